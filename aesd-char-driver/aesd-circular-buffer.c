@@ -30,65 +30,75 @@
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn )
 {
-    /**
-    * TODO: implement per description
-    */
-    // Starting at the in offset, loop through the buffer and find the entry that contains the char_offset
-    struct aesd_buffer_entry *entry = NULL;
-    int i = 0;
+    // Walk the entries oldest first until the one holding char_offset
+    struct aesd_buffer_entry *entry;
+    uint32_t i;
     size_t char_offset_bytes = 0;
-    int index = 0;
 
-    for ( i=0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
-        index = (buffer->out_offs + i) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-        if ( buffer->entry[index].buffptr != NULL ) {
-            if ( char_offset_bytes + buffer->entry[index].size > char_offset ) {
-                // We have found the entry that contains the char_offset
-                *entry_offset_byte_rtn = char_offset - char_offset_bytes;
-                entry = &buffer->entry[index];
-                break;
-            }
-            char_offset_bytes += buffer->entry[index].size;
+    for ( i=0; i < aesd_entry_ring_count(&buffer->ring); i++) {
+        entry = aesd_entry_ring_at(&buffer->ring, i);
+        if ( char_offset_bytes + entry->size > char_offset ) {
+            // We have found the entry that contains the char_offset
+            *entry_offset_byte_rtn = char_offset - char_offset_bytes;
+            return entry;
         }
+        char_offset_bytes += entry->size;
     }
-    return entry;
+    return NULL;
 }
 
 /**
-* Adds entry @param add_entry to @param buffer in the location specified in buffer->in_offs.
-* If the buffer was already full, overwrites the oldest entry and advances buffer->out_offs to the
-* new start location.
+ * @param buffer the buffer to search, with timestamps that never decrease from the oldest entry to the newest.
+ *      Any necessary locking must be performed by caller.
+ * @param time_ns the time to search for, in the unit of the entry timestamps
+ * @param char_offset_rtn is set to the zero referenced character index of the returned entry if all buffer
+ *      strings were concatenated end to end, or to the total size of the entries when none is returned
+ * @param index_rtn is set to the zero referenced index of the returned entry, oldest first, or to the number
+ *      of entries when none is returned
+ * @return the oldest entry with a timestamp at or after time_ns, or NULL if every entry is older.
+ */
+struct aesd_buffer_entry *aesd_circular_buffer_find_entry_for_time(struct aesd_circular_buffer *buffer,
+            uint64_t time_ns, size_t *char_offset_rtn, uint32_t *index_rtn)
+{
+    uint32_t count = aesd_entry_ring_count(&buffer->ring);
+    uint32_t low = 0, high = count, mid, i;
+    size_t char_offset_bytes = 0;
+
+    // Binary search for the first entry which is not older than time_ns
+    while ( low < high ) {
+        mid = low + (high - low) / 2;
+        if ( aesd_entry_ring_at(&buffer->ring, mid)->timestamp_ns < time_ns ) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    for ( i=0; i < low; i++) {
+        char_offset_bytes += aesd_entry_ring_at(&buffer->ring, i)->size;
+    }
+    *char_offset_rtn = char_offset_bytes;
+    *index_rtn = low;
+    return low < count ? aesd_entry_ring_at(&buffer->ring, low) : NULL;
+}
+
+/**
+* Adds entry @param add_entry to @param buffer after the newest entry.
+* If the buffer was already full, overwrites the oldest entry, the next one becomes the oldest.
 * Any necessary locking must be handled by the caller
 * Any memory referenced in @param add_entry must be allocated by and/or must have a lifetime managed by the caller.
-* @return NULL or, if an existing entry at out_offs was replaced then return
+* @return NULL or, if the oldest entry was replaced then return
 * the value of buffptr for the entry which was replaced (for use with dynamic memory allocation/free)
 */
 const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
 {
-    const char *ret_buffptr = NULL;
+    struct aesd_buffer_entry replaced;
 
-    if ( buffer->entry[buffer->in_offs].buffptr == NULL ) {
-        // We have an entry available assign it and move pointers
-        // Update the buffptr value with the value from add_entry
-        buffer->entry[buffer->in_offs].buffptr = add_entry->buffptr;
-        buffer->entry[buffer->in_offs].size = add_entry->size;
-        buffer->in_offs = (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-        if ( buffer->in_offs == buffer->out_offs ) {
-            buffer->full = 1;
-            //buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-        } else {
-            buffer->full = 0;
-        }
-    } else {
-        // We are overwriting an entry, move the out offset
-        ret_buffptr = buffer->entry[buffer->out_offs].buffptr;
-        buffer->entry[buffer->in_offs].buffptr = add_entry->buffptr;
-        buffer->entry[buffer->in_offs].size = add_entry->size;
-        buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-        buffer->in_offs = (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    // A full ring drops its oldest entry, hand its memory back to the caller
+    if ( aesd_entry_ring_push(&buffer->ring, add_entry, &replaced) ) {
+        return replaced.buffptr;
     }
-
-    return ret_buffptr;
+    return NULL;
 }
 
 /**
@@ -97,4 +107,5 @@ const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 {
     memset(buffer,0,sizeof(struct aesd_circular_buffer));
+    aesd_entry_ring_init(&buffer->ring);
 }
@@ -15,8 +15,15 @@
 #include <stdint.h> // uintx_t
 #include <stdbool.h>
 #endif
+#include "aesd-ring.h"
 
+/**
+ * May be overridden at build time (up to 255, callers iterate with a uint8_t),
+ * the benchmarks build the buffer with several depths.
+ */
+#ifndef AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+#endif
 
 struct aesd_buffer_entry
 {
@@ -28,27 +35,27 @@ struct aesd_buffer_entry
      * Number of bytes stored in buffptr
      */
     size_t size;
+    /**
+     * When the write was committed, in nanoseconds since the epoch.  Must not
+     * decrease from one entry added to the next for searches by time.
+     */
+    uint64_t timestamp_ns;
 };
 
+/**
+ * The most recent write operations, in an array rounded up to a power of two
+ * entries so indexing is a mask, see aesd-ring.h
+ */
+AESD_RING_DEFINE(aesd_entry_ring, struct aesd_buffer_entry,
+                 AESD_RING_SLOTS(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED),
+                 AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+
 struct aesd_circular_buffer
 {
     /**
-     * An array of pointers to memory allocated for the most recent write operations
+     * The entries, oldest first from aesd_entry_ring_at(&ring, 0)
      */
-    struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
-    /**
-     * The current location in the entry structure where the next write should
-     * be stored.
-     */
-    uint8_t in_offs;
-    /**
-     * The first location in the entry structure to read from
-     */
-    uint8_t out_offs;
-    /**
-     * set to true when the buffer entry structure is full
-     */
-    bool full;
+    struct aesd_entry_ring ring;
 };
 
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
@@ -56,10 +63,13 @@ extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos
 
 extern const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
 
+extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_for_time(struct aesd_circular_buffer *buffer,
+            uint64_t time_ns, size_t *char_offset_rtn, uint32_t *index_rtn);
+
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
 /**
- * Create a for loop to iterate over each member of the circular buffer.
+ * Create a for loop to iterate over each entry of the circular buffer, oldest first.
  * Useful when you've allocated memory for circular buffer entries and need to free it
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
@@ -73,9 +83,7 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
  * }
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index) \
-    for(index=0, entryptr=&((buffer)->entry[index]); \
-            index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
-            index++, entryptr=&((buffer)->entry[index]))
+    AESD_RING_FOREACH(aesd_entry_ring, entryptr, &(buffer)->ring, index)
 
 
 
@@ -0,0 +1,110 @@
+/*
+ * aesd-ring.h
+ *
+ * Fixed capacity ring of any element type, for the driver and for userspace.
+ *
+ * AESD_RING_DEFINE(name, type, slots, capacity) defines struct name, holding
+ * up to capacity elements of type in an array of slots, and static inline
+ * functions name_init(), name_count(), name_full(), name_at(), name_push()
+ * and name_pop() for it.  slots must be a power of two no smaller than
+ * capacity, AESD_RING_SLOTS() rounds a capacity up to one.
+ *
+ * head and tail are free running counters: an element is at slot
+ * counter & (slots - 1), so no index step needs a division, and the number of
+ * elements is head - tail, which stays right when the counters wrap around
+ * since slots divides 2^32.  No full flag is needed either.
+ *
+ * None of the functions lock, callers serialize them.
+ */
+
+#ifndef AESD_RING_H
+#define AESD_RING_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdbool.h>
+#include <stdint.h>
+#endif
+
+/**
+ * Set every bit of @param v below its highest set bit, for 16 bit values.
+ */
+#define AESD_RING_SMEAR(v)  ((v) | (v) >> 1 | (v) >> 2 | (v) >> 3 | (v) >> 4 | (v) >> 5 | (v) >> 6 | \
+                             (v) >> 7 | (v) >> 8 | (v) >> 9 | (v) >> 10 | (v) >> 11 | (v) >> 12 | \
+                             (v) >> 13 | (v) >> 14 | (v) >> 15)
+/**
+ * Round @param n, from 1 to 2^16, up to a power of two.  A constant
+ * expression, so it can size an array.
+ */
+#define AESD_RING_SLOTS(n)  (AESD_RING_SMEAR((uint32_t)(n) - 1) + 1)
+
+/**
+ * Define struct @param name and its functions, see above.
+ */
+#define AESD_RING_DEFINE(name, type, slots, capacity) \
+    _Static_assert(((slots) & ((slots) - 1)) == 0, #name " slots must be a power of two"); \
+    _Static_assert((capacity) >= 1 && (capacity) <= (slots), #name " capacity must fit in its slots"); \
+    \
+    struct name { \
+        type slot[slots]; \
+        uint32_t head;      /* counter of the next element pushed */ \
+        uint32_t tail;      /* counter of the oldest element */ \
+    }; \
+    \
+    static inline void name##_init(struct name *ring) \
+    { \
+        ring->head = ring->tail = 0; \
+    } \
+    \
+    static inline uint32_t name##_count(const struct name *ring) \
+    { \
+        return ring->head - ring->tail; \
+    } \
+    \
+    static inline bool name##_full(const struct name *ring) \
+    { \
+        return ring->head - ring->tail == (capacity); \
+    } \
+    \
+    /* The @param i th oldest element, i below name_count() */ \
+    static inline type *name##_at(struct name *ring, uint32_t i) \
+    { \
+        return &ring->slot[(ring->tail + i) & ((slots) - 1)]; \
+    } \
+    \
+    /* Append *@param elem, when full the oldest element is dropped and  \
+     * copied to *@param evicted first.  Returns true if one was dropped. */ \
+    static inline bool name##_push(struct name *ring, const type *elem, type *evicted) \
+    { \
+        bool full = name##_full(ring); \
+        \
+        if (full) { \
+            *evicted = ring->slot[ring->tail++ & ((slots) - 1)]; \
+        } \
+        ring->slot[ring->head++ & ((slots) - 1)] = *elem; \
+        return full; \
+    } \
+    \
+    /* Remove the oldest element into *@param elem.  Returns false when empty. */ \
+    static inline bool name##_pop(struct name *ring, type *elem) \
+    { \
+        if (ring->head == ring->tail) { \
+            return false; \
+        } \
+        *elem = ring->slot[ring->tail++ & ((slots) - 1)]; \
+        return true; \
+    }
+
+/**
+ * Iterate over the elements of a ring defined as @param name, oldest first.
+ * @param elemptr is set to each element in turn
+ * @param ring is the struct name * to iterate over
+ * @param index is a stack allocated counter used by this macro
+ */
+#define AESD_RING_FOREACH(name, elemptr, ring, index) \
+    for ((index) = 0; \
+         (index) < name##_count(ring) && ((elemptr) = name##_at((ring), (index)), 1); \
+         (index)++)
+
+#endif /* AESD_RING_H */
@@ -33,14 +33,41 @@ struct aesd_seekto {
     uint32_t write_cmd_offset;
 };
 
+/**
+ * Passed with AESDCHAR_IOCSEEKTIME, seeks to the oldest write command committed
+ * at or after a time
+ */
+struct aesd_seektime {
+    /**
+     * The time to seek to, in nanoseconds since the epoch (CLOCK_REALTIME)
+     */
+    uint64_t time_ns;
+    /**
+     * Set by the driver to the zero referenced write command the file position
+     * now points at, the number of write commands held when all are older
+     */
+    uint32_t write_cmd;
+    uint32_t reserved;
+};
+
 // Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x16
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+/**
+ * Discard the bytes written so far without a terminating newline, so a writer
+ * which fails in the middle of a command leaves nothing behind
+ */
+#define AESDCHAR_IOCDISCARD _IO(AESD_IOC_MAGIC, 2)
+/**
+ * Seek to the oldest write command at or after a time, or to the end when every
+ * write command is older, found with a binary search over their timestamps
+ */
+#define AESDCHAR_IOCSEEKTIME _IOWR(AESD_IOC_MAGIC, 3, struct aesd_seektime)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 3
 
 #endif /* AESD_IOCTL_H */
@@ -29,6 +29,7 @@ struct aesd_dev
 {
     struct aesd_circular_buffer circular_buffer;
     char * working_entry;
+    size_t working_size;  /* bytes of a write without its newline yet */
     // Below is a locking primative
     struct mutex lock;
     struct cdev cdev;     /* Char device structure      */
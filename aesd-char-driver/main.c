@@ -18,6 +18,7 @@
 #include <linux/types.h>
 #include <linux/cdev.h>
 #include <linux/fs.h> // file_operations
+#include <linux/timekeeping.h> // ktime_get_real_ns()
 #include "aesdchar.h"
 #include "aesd_ioctl.h"
 int aesd_major =   0; // use dynamic major
@@ -86,16 +87,36 @@ ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
     return retval;
 }
 
+/*
+ * The timestamp of an entry committed now.  The wall clock may be stepped back,
+ * then the newest timestamp is reused so the entries stay sorted by time.
+ */
+static u64 aesd_entry_timestamp(struct aesd_dev *dev)
+{
+    u64 now = ktime_get_real_ns();
+    uint32_t count = aesd_entry_ring_count(&dev->circular_buffer.ring);
+    u64 newest;
+
+    if (count > 0) {
+        newest = aesd_entry_ring_at(&dev->circular_buffer.ring, count - 1)->timestamp_ns;
+        if (newest > now) {
+            return newest;
+        }
+    }
+    return now;
+}
+
 ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
                 loff_t *f_pos)
 {
     ssize_t retval = -ENOMEM;
-    static size_t previous_count = 0;
+    size_t previous_count;
     const char* ret_buffptr = NULL;
     PDEBUG("write %zu bytes with offset %lld",count,*f_pos);
 
     if (mutex_lock_interruptible(&aesd_device.lock))
         return -ERESTARTSYS;
+    previous_count = aesd_device.working_size;
 
     // check if aesd_dev.working_entry is NULL and allocate memory if it is
     if (aesd_device.working_entry == NULL) {
@@ -132,17 +153,18 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
         // Add the entry to the circular buffer and free the working entry regarless of return value
         ret_buffptr = aesd_circular_buffer_add_entry(&aesd_device.circular_buffer, &(struct aesd_buffer_entry) {
             .buffptr = aesd_device.working_entry,
-            .size = count + previous_count
+            .size = count + previous_count,
+            .timestamp_ns = aesd_entry_timestamp(&aesd_device)
         });
         if (ret_buffptr != NULL) {
             kfree(ret_buffptr);
             ret_buffptr = NULL;
         }
         aesd_device.working_entry = NULL;
-        previous_count = 0;
+        aesd_device.working_size = 0;
     } else {
         // If the last character is not a newline then we need to keep track of the count
-        previous_count += count;
+        aesd_device.working_size += count;
     }
 
     // If we get here then we have successfully written to the buffer so return count
@@ -153,6 +175,7 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
     exit_cleanup_working_entry:
     kfree(aesd_device.working_entry);
     aesd_device.working_entry = NULL;
+    aesd_device.working_size = 0;
 
     exit_return:
     mutex_unlock(&aesd_device.lock);
@@ -204,8 +227,9 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
     int retval = 0;
     struct aesd_dev *dev = filp->private_data;
     struct aesd_seekto seekto;
+    struct aesd_seektime seektime;
+    size_t char_offset;
     int i = 0;
-    int index = 0;
     int write_cmd_size = 0;
 
     switch (cmd) {
@@ -214,36 +238,64 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
                 return -EFAULT;
             }
 
-            // Make sure the write_cmd is within bounds
-            if (seekto.write_cmd >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
-                return -EINVAL;
+            // A concurrent write may evict entries, hold the lock while reading them
+            if (mutex_lock_interruptible(&dev->lock)) {
+                return -ERESTARTSYS;
             }
 
-            // Get the number of bytes in all the entries up to the write_cmd entry and make sure all those previous entries are not null or else return -EINVAL
-            for ( i=0; i < seekto.write_cmd; i++) {
-                index = (dev->circular_buffer.out_offs + i) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-                if ( dev->circular_buffer.entry[index].buffptr == NULL ) {
-                    return -EINVAL;
-                }
-                write_cmd_size += dev->circular_buffer.entry[index].size;
+            // Make sure the write_cmd is one of the entries held
+            if (seekto.write_cmd >= aesd_entry_ring_count(&dev->circular_buffer.ring)) {
+                mutex_unlock(&dev->lock);
+                return -EINVAL;
             }
 
-            // Check that the write_cmd entry offset from the out_offs is not null
-            index = (dev->circular_buffer.out_offs + seekto.write_cmd) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-            if ( dev->circular_buffer.entry[index].buffptr == NULL ) {
-                return -EINVAL;
+            // Get the number of bytes in all the entries up to the write_cmd entry
+            for ( i=0; i < seekto.write_cmd; i++) {
+                write_cmd_size += aesd_entry_ring_at(&dev->circular_buffer.ring, i)->size;
             }
 
-            // Check that the write_cmd entry offset form the out_offs is less than or equial to write_cmd_offset in size else return -EINVAL
-            if (seekto.write_cmd_offset > dev->circular_buffer.entry[index].size) {
+            // Check that the write_cmd_offset is within the write_cmd entry else return -EINVAL
+            if (seekto.write_cmd_offset > aesd_entry_ring_at(&dev->circular_buffer.ring, seekto.write_cmd)->size) {
+                mutex_unlock(&dev->lock);
                 return -EINVAL;
             }
+            mutex_unlock(&dev->lock);
 
             write_cmd_size += seekto.write_cmd_offset;
 
             filp->f_pos = write_cmd_size;
             break;
 
+        case AESDCHAR_IOCDISCARD:
+            // Drop the partial write, nothing of it was ever readable
+            if (mutex_lock_interruptible(&dev->lock)) {
+                return -ERESTARTSYS;
+            }
+            kfree(dev->working_entry);
+            dev->working_entry = NULL;
+            dev->working_size = 0;
+            mutex_unlock(&dev->lock);
+            break;
+
+        case AESDCHAR_IOCSEEKTIME:
+            if (copy_from_user(&seektime, (struct aesd_seektime *)arg, sizeof(struct aesd_seektime))) {
+                return -EFAULT;
+            }
+
+            // Entries are added in time order, find the first one not older than time_ns
+            if (mutex_lock_interruptible(&dev->lock)) {
+                return -ERESTARTSYS;
+            }
+            (void)aesd_circular_buffer_find_entry_for_time(&dev->circular_buffer, seektime.time_ns,
+                                                           &char_offset, &seektime.write_cmd);
+            mutex_unlock(&dev->lock);
+
+            filp->f_pos = char_offset;
+            if (copy_to_user((struct aesd_seektime *)arg, &seektime, sizeof(struct aesd_seektime))) {
+                return -EFAULT;
+            }
+            break;
+
         default:
             return -ENOTTY;
     }
@@ -0,0 +1,321 @@
+/**
+ * @file circular-buffer-bench.c
+ * @brief Microbenchmarks for the aesd circular buffer
+ *
+ * Measures aesd_circular_buffer_add_entry() and
+ * aesd_circular_buffer_find_entry_offset_for_fpos() on a full buffer for a
+ * range of entry sizes and access patterns, against the legacy implementation
+ * the buffer had before it moved onto the ring of aesd-ring.h.  The buffer depth is fixed at
+ * compile time through AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, so the CMake
+ * build produces one executable per depth.
+ *
+ * Results are written to stdout as CSV, one row per (operation, pattern,
+ * entry size) so runs before and after a change to the ring can be diffed or
+ * loaded into a spreadsheet.  Latency percentiles are computed over batches of
+ * BATCH_OPS operations since a single call is below the clock resolution.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "../aesd-char-driver/aesd-circular-buffer.h"
+
+#define DEFAULT_OPS     2000000
+#define BATCH_OPS       64
+#define MAX_ENTRY_SIZE  4096
+
+static const size_t EntrySizes[] = { 8, 64, 512, MAX_ENTRY_SIZE };
+
+enum pattern {
+    PATTERN_APPEND,     // add_entry on a full buffer, every add evicts
+    PATTERN_SEQUENTIAL, // find_entry walking fpos the way aesd_read() does
+    PATTERN_RANDOM,     // find_entry at uniformly random fpos
+    PATTERN_MISS,       // find_entry past the end of the data (full scan)
+};
+
+static const char *PatternNames[] = { "append", "sequential", "random", "miss" };
+
+static char EntryData[MAX_ENTRY_SIZE];
+static volatile size_t Sink;
+
+/*
+ * The buffer before aesd-ring.h: a modulo on every index step, uint8_t offsets
+ * and a full flag.  Not inlined, like the functions of the real buffer which
+ * live in their own translation unit.
+ */
+struct legacy_circular_buffer
+{
+    struct aesd_buffer_entry entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    uint8_t in_offs;
+    uint8_t out_offs;
+    bool full;
+};
+
+static __attribute__((noinline)) struct aesd_buffer_entry *legacy_find_entry_offset_for_fpos(
+        struct legacy_circular_buffer *buffer, size_t char_offset, size_t *entry_offset_byte_rtn)
+{
+    struct aesd_buffer_entry *entry = NULL;
+    int i = 0;
+    size_t char_offset_bytes = 0;
+    int index = 0;
+
+    for ( i=0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
+        index = (buffer->out_offs + i) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        if ( buffer->entry[index].buffptr != NULL ) {
+            if ( char_offset_bytes + buffer->entry[index].size > char_offset ) {
+                *entry_offset_byte_rtn = char_offset - char_offset_bytes;
+                entry = &buffer->entry[index];
+                break;
+            }
+            char_offset_bytes += buffer->entry[index].size;
+        }
+    }
+    return entry;
+}
+
+static __attribute__((noinline)) const char *legacy_add_entry(struct legacy_circular_buffer *buffer,
+        const struct aesd_buffer_entry *add_entry)
+{
+    const char *ret_buffptr = NULL;
+
+    if ( buffer->entry[buffer->in_offs].buffptr == NULL ) {
+        buffer->entry[buffer->in_offs].buffptr = add_entry->buffptr;
+        buffer->entry[buffer->in_offs].size = add_entry->size;
+        buffer->in_offs = (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        buffer->full = buffer->in_offs == buffer->out_offs;
+    } else {
+        ret_buffptr = buffer->entry[buffer->out_offs].buffptr;
+        buffer->entry[buffer->in_offs].buffptr = add_entry->buffptr;
+        buffer->entry[buffer->in_offs].size = add_entry->size;
+        buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        buffer->in_offs = (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    }
+    return ret_buffptr;
+}
+
+// Storage for either implementation
+union bench_buffer {
+    struct aesd_circular_buffer ring;
+    struct legacy_circular_buffer legacy;
+};
+
+// One implementation under test, called the same way for both
+struct bench_impl {
+    const char *name;
+    void (*init)(union bench_buffer *buffer);
+    const char *(*add_entry)(union bench_buffer *buffer, const struct aesd_buffer_entry *entry);
+    struct aesd_buffer_entry *(*find_entry)(union bench_buffer *buffer, size_t char_offset, size_t *offset);
+};
+
+static void ring_init(union bench_buffer *buffer)
+{
+    aesd_circular_buffer_init(&buffer->ring);
+}
+
+static const char *ring_add_entry(union bench_buffer *buffer, const struct aesd_buffer_entry *entry)
+{
+    return aesd_circular_buffer_add_entry(&buffer->ring, entry);
+}
+
+static struct aesd_buffer_entry *ring_find_entry(union bench_buffer *buffer, size_t char_offset, size_t *offset)
+{
+    return aesd_circular_buffer_find_entry_offset_for_fpos(&buffer->ring, char_offset, offset);
+}
+
+static void legacy_init(union bench_buffer *buffer)
+{
+    memset(&buffer->legacy, 0, sizeof(buffer->legacy));
+}
+
+static const char *legacy_add(union bench_buffer *buffer, const struct aesd_buffer_entry *entry)
+{
+    return legacy_add_entry(&buffer->legacy, entry);
+}
+
+static struct aesd_buffer_entry *legacy_find_entry(union bench_buffer *buffer, size_t char_offset, size_t *offset)
+{
+    return legacy_find_entry_offset_for_fpos(&buffer->legacy, char_offset, offset);
+}
+
+static const struct bench_impl Impls[] = {
+    { "aesd_circular_buffer", ring_init, ring_add_entry, ring_find_entry },
+    { "legacy_circular_buffer", legacy_init, legacy_add, legacy_find_entry },
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t rng_next(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Fill @param buffer with AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries of @param entry_size bytes
+ * @return the total number of bytes stored in the buffer
+ */
+static size_t fill_buffer(const struct bench_impl *impl, union bench_buffer *buffer, size_t entry_size)
+{
+    struct aesd_buffer_entry entry = { .buffptr = EntryData, .size = entry_size };
+    int i;
+
+    impl->init(buffer);
+    for (i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
+        impl->add_entry(buffer, &entry);
+    }
+    return entry_size * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+}
+
+/**
+ * Run one batch of BATCH_OPS operations of @param pattern
+ * @param fpos carries the sequential read position across batches
+ */
+static void run_batch(const struct bench_impl *impl, enum pattern pattern, union bench_buffer *buffer,
+        size_t entry_size, size_t total_size, size_t *fpos, uint64_t *rng)
+{
+    struct aesd_buffer_entry add = { .buffptr = EntryData, .size = entry_size };
+    struct aesd_buffer_entry *entry;
+    size_t offset = 0;
+    int i;
+
+    for (i = 0; i < BATCH_OPS; i++) {
+        switch (pattern) {
+            case PATTERN_APPEND:
+                Sink += (size_t)impl->add_entry(buffer, &add);
+                break;
+            case PATTERN_SEQUENTIAL:
+                entry = impl->find_entry(buffer, *fpos, &offset);
+                if (entry == NULL) {
+                    *fpos = 0;
+                } else {
+                    *fpos += entry->size - offset;
+                    Sink += offset;
+                }
+                break;
+            case PATTERN_RANDOM:
+                entry = impl->find_entry(buffer, rng_next(rng) % total_size, &offset);
+                Sink += (size_t)entry + offset;
+                break;
+            case PATTERN_MISS:
+                entry = impl->find_entry(buffer, total_size, &offset);
+                Sink += (size_t)entry;
+                break;
+        }
+    }
+}
+
+static void run_case(const struct bench_impl *impl, enum pattern pattern, size_t entry_size, long ops)
+{
+    union bench_buffer buffer;
+    long batches = (ops + BATCH_OPS - 1) / BATCH_OPS, b;
+    uint64_t *batch_ns = malloc(batches * sizeof(uint64_t));
+    uint64_t rng = 0x9E3779B97F4A7C15ULL, start, end, total_ns = 0;
+    size_t total_size, fpos = 0;
+
+    if (batch_ns == NULL) {
+        fprintf(stderr, "Failed to allocate %ld batch samples\n", batches);
+        exit(1);
+    }
+
+    total_size = fill_buffer(impl, &buffer, entry_size);
+
+    // Warm up caches and branch predictors before measuring
+    for (b = 0; b < batches / 10 + 1; b++) {
+        run_batch(impl, pattern, &buffer, entry_size, total_size, &fpos, &rng);
+    }
+
+    for (b = 0; b < batches; b++) {
+        start = now_ns();
+        run_batch(impl, pattern, &buffer, entry_size, total_size, &fpos, &rng);
+        end = now_ns();
+        batch_ns[b] = end - start;
+        total_ns += batch_ns[b];
+    }
+
+    qsort(batch_ns, batches, sizeof(uint64_t), compare_u64);
+
+    printf("%s,%s,%s,%d,%zu,%ld,%llu,%.2f,%.2f,%.2f,%.2f\n",
+        impl->name, pattern == PATTERN_APPEND ? "add_entry" : "find_entry_offset_for_fpos",
+        PatternNames[pattern], AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, entry_size,
+        batches * BATCH_OPS, (unsigned long long)total_ns,
+        (double)total_ns / (batches * BATCH_OPS),
+        (batches * BATCH_OPS) * 1e3 / (double)total_ns,
+        (double)batch_ns[batches / 2] / BATCH_OPS,
+        (double)batch_ns[(batches * 99) / 100] / BATCH_OPS);
+
+    free(batch_ns);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+        "Usage: %s [-n ops] [-H]\n"
+        "  -n ops  operations per case (default %d)\n"
+        "  -H      omit the CSV header, for concatenating runs of several depths\n",
+        prog, DEFAULT_OPS);
+}
+
+int main(int argc, char *argv[])
+{
+    long ops = DEFAULT_OPS;
+    bool header = true;
+    size_t i, m;
+    int opt, p;
+
+    while ((opt = getopt(argc, argv, "n:Hh")) != -1) {
+        switch (opt) {
+            case 'n':
+                ops = atol(optarg);
+                break;
+            case 'H':
+                header = false;
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (ops <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    memset(EntryData, 'a', sizeof(EntryData));
+
+    if (header) {
+        printf("impl,op,pattern,depth,entry_size,ops,total_ns,ns_per_op,mops_per_sec,p50_ns_per_op,p99_ns_per_op\n");
+    }
+
+    for (m = 0; m < sizeof(Impls) / sizeof(Impls[0]); m++) {
+        for (p = PATTERN_APPEND; p <= PATTERN_MISS; p++) {
+            for (i = 0; i < sizeof(EntrySizes) / sizeof(EntrySizes[0]); i++) {
+                run_case(&Impls[m], (enum pattern)p, EntrySizes[i], ops);
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,246 @@
+/**
+ * @file lf-ring-bench.c
+ * @brief Lock-free ring against a mutex protected queue
+ *
+ * Producer threads hand items to one consumer thread through a bounded queue
+ * of QUEUE_SIZE pointers, two ways:
+ *
+ *  - mutex_queue: an array ring under a pthread mutex, with condition
+ *    variables for full and empty, the usual way of aesdsocket before
+ *    examples/threading/lf-ring
+ *  - lf_ring: examples/threading/lf-ring, single producer with one producer
+ *    thread and LF_RING_MP otherwise
+ *
+ * Both block when the queue is full or empty instead of spinning.  Items are
+ * enqueued and dequeued batch at a time, for batches of 1 and BATCH_MAX.
+ * Results are written to stdout as CSV.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "../examples/threading/lf-ring.h"
+
+#define DEFAULT_ITEMS   2000000
+#define QUEUE_SIZE      1024
+#define BATCH_MAX       32
+
+static const int Producers[] = { 1, 4 };
+static const int Batches[] = { 1, BATCH_MAX };
+
+struct mutex_queue {
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    void *slot[QUEUE_SIZE];
+    unsigned head;
+    unsigned tail;
+};
+
+struct bench_case {
+    bool lockfree;
+    struct mutex_queue mq;
+    struct lf_ring *ring;
+    long items_per_producer;
+    int batch;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void mq_enqueue(struct mutex_queue *q, void **elems, int n)
+{
+    int i;
+
+    pthread_mutex_lock(&q->mutex);
+    for (i = 0; i < n; i++) {
+        while (q->head - q->tail == QUEUE_SIZE) {
+            pthread_cond_wait(&q->not_full, &q->mutex);
+        }
+        q->slot[q->head++ % QUEUE_SIZE] = elems[i];
+    }
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+static int mq_dequeue(struct mutex_queue *q, void **elems, int n)
+{
+    int i;
+
+    pthread_mutex_lock(&q->mutex);
+    while (q->head == q->tail) {
+        pthread_cond_wait(&q->not_empty, &q->mutex);
+    }
+    for (i = 0; i < n && q->head != q->tail; i++) {
+        elems[i] = q->slot[q->tail++ % QUEUE_SIZE];
+    }
+    pthread_cond_broadcast(&q->not_full);
+    pthread_mutex_unlock(&q->mutex);
+    return i;
+}
+
+static void ring_enqueue(struct lf_ring *ring, void **elems, int n)
+{
+    unsigned done = 0;
+
+    while ((done += lf_ring_enqueue(ring, elems + done, n - done)) < (unsigned)n) {
+        (void)lf_ring_wait_room(ring, 1, -1);
+    }
+}
+
+static int ring_dequeue(struct lf_ring *ring, void **elems, int n)
+{
+    unsigned got;
+
+    while ((got = lf_ring_dequeue(ring, elems, n)) == 0) {
+        (void)lf_ring_wait(ring, -1);
+    }
+    return (int)got;
+}
+
+static void *producer(void *arg)
+{
+    struct bench_case *bc = arg;
+    void *elems[BATCH_MAX];
+    long sent = 0;
+    int n, i;
+
+    while (sent < bc->items_per_producer) {
+        n = bc->items_per_producer - sent < bc->batch ? (int)(bc->items_per_producer - sent) : bc->batch;
+        for (i = 0; i < n; i++) {
+            elems[i] = (void *)(uintptr_t)(sent + i + 1);
+        }
+        if (bc->lockfree) {
+            ring_enqueue(bc->ring, elems, n);
+        } else {
+            mq_enqueue(&bc->mq, elems, n);
+        }
+        sent += n;
+    }
+    return NULL;
+}
+
+static uint64_t run_case(bool lockfree, int producers, int batch, long items)
+{
+    struct bench_case bc = { .lockfree = lockfree, .batch = batch };
+    pthread_t threads[8];
+    void *elems[BATCH_MAX];
+    long received = 0, total;
+    uint64_t sum = 0, expected, start, elapsed;
+    int n, i;
+
+    bc.items_per_producer = items / producers;
+    total = bc.items_per_producer * producers;
+    expected = (uint64_t)producers * bc.items_per_producer * (bc.items_per_producer + 1) / 2;
+    if (lockfree) {
+        bc.ring = lf_ring_create(QUEUE_SIZE, producers > 1 ? LF_RING_MP : 0);
+        if (bc.ring == NULL) {
+            perror("lf_ring_create");
+            exit(1);
+        }
+    } else {
+        pthread_mutex_init(&bc.mq.mutex, NULL);
+        pthread_cond_init(&bc.mq.not_empty, NULL);
+        pthread_cond_init(&bc.mq.not_full, NULL);
+    }
+
+    start = now_ns();
+    for (i = 0; i < producers; i++) {
+        pthread_create(&threads[i], NULL, producer, &bc);
+    }
+    while (received < total) {
+        n = lockfree ? ring_dequeue(bc.ring, elems, batch) : mq_dequeue(&bc.mq, elems, batch);
+        for (i = 0; i < n; i++) {
+            sum += (uintptr_t)elems[i];
+        }
+        received += n;
+    }
+    for (i = 0; i < producers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    elapsed = now_ns() - start;
+
+    if (sum != expected) {
+        fprintf(stderr, "%s: items lost or duplicated\n", lockfree ? "lf_ring" : "mutex_queue");
+        exit(1);
+    }
+    if (lockfree) {
+        lf_ring_destroy(bc.ring);
+    } else {
+        pthread_cond_destroy(&bc.mq.not_full);
+        pthread_cond_destroy(&bc.mq.not_empty);
+        pthread_mutex_destroy(&bc.mq.mutex);
+    }
+    return elapsed;
+}
+
+static void report(const char *impl, int producers, int batch, long items, uint64_t total_ns)
+{
+    printf("%s,%d,%d,%ld,%llu,%.1f,%.0f\n", impl, producers, batch, items,
+        (unsigned long long)total_ns, (double)total_ns / items, items * 1e9 / (double)total_ns);
+    fflush(stdout);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+        "Usage: %s [-n items] [-H]\n"
+        "  -n items    items handed over per case (default %d)\n"
+        "  -H          omit the CSV header\n",
+        prog, DEFAULT_ITEMS);
+}
+
+int main(int argc, char *argv[])
+{
+    long items = DEFAULT_ITEMS;
+    bool header = true;
+    long per_case;
+    size_t p, b;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:Hh")) != -1) {
+        switch (opt) {
+            case 'n':
+                items = atol(optarg);
+                break;
+            case 'H':
+                header = false;
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (items <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (header) {
+        printf("impl,producers,batch,items,total_ns,ns_per_item,items_per_sec\n");
+    }
+
+    for (p = 0; p < sizeof(Producers) / sizeof(Producers[0]); p++) {
+        // Every producer sends the same number of items
+        per_case = items / Producers[p] * Producers[p];
+        for (b = 0; b < sizeof(Batches) / sizeof(Batches[0]); b++) {
+            report("mutex_queue", Producers[p], Batches[b], per_case,
+                run_case(false, Producers[p], Batches[b], per_case));
+            report("lf_ring", Producers[p], Batches[b], per_case,
+                run_case(true, Producers[p], Batches[b], per_case));
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,151 @@
+/**
+ * @file spawn-bench.c
+ * @brief Process launch latency against the size of the parent
+ *
+ * Launches a trivial program repeatedly two ways:
+ *
+ *  - fork_exec: fork(), execv() and waitpid(), what do_exec() used to do
+ *  - posix_spawn: spawn_command() and wait_command() from systemcalls.c
+ *
+ * The parent first grows its resident set by touching an allocation of
+ * rss_mb megabytes, since fork() has to copy the page tables of every mapped
+ * page while posix_spawn() runs the child in the parent's memory until it
+ * execs.  Results are written to stdout as CSV.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include "../examples/systemcalls/systemcalls.h"
+
+#define DEFAULT_LAUNCHES    200
+#define DEFAULT_PROGRAM     "/bin/true"
+
+static const size_t RssMb[] = { 0, 64, 256, 1024 };
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static bool launch_fork_exec(char *const command[])
+{
+    int wstatus;
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        return false;
+    }
+    if (pid == 0) {
+        execv(command[0], command);
+        _exit(127);
+    }
+    if (waitpid(pid, &wstatus, 0) == -1) {
+        return false;
+    }
+    return WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0;
+}
+
+static bool launch_spawn(char *const command[])
+{
+    pid_t pid = spawn_command(command, NULL);
+
+    return pid != -1 && wait_command(pid);
+}
+
+static void run(const char *impl, bool (*launch)(char *const command[]),
+                char *const command[], size_t rss_mb, long launches)
+{
+    uint64_t start = now_ns(), total;
+    long i;
+
+    for (i = 0; i < launches; i++) {
+        if (!launch(command)) {
+            fprintf(stderr, "%s: failed to run %s\n", impl, command[0]);
+            exit(1);
+        }
+    }
+    total = now_ns() - start;
+    printf("%s,%zu,%ld,%llu,%.1f\n", impl, rss_mb, launches,
+        (unsigned long long)total, total / 1000.0 / launches);
+    fflush(stdout);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+        "Usage: %s [-n launches] [-p program] [-m max_rss_mb] [-H]\n"
+        "  -n launches   launches per case (default %d)\n"
+        "  -p program    full path of the program to launch (default %s)\n"
+        "  -m max_rss_mb skip parent sizes above this many megabytes\n"
+        "  -H            omit the CSV header\n",
+        prog, DEFAULT_LAUNCHES, DEFAULT_PROGRAM);
+}
+
+int main(int argc, char *argv[])
+{
+    char *command[2] = { DEFAULT_PROGRAM, NULL };
+    long launches = DEFAULT_LAUNCHES;
+    size_t max_rss_mb = SIZE_MAX;
+    bool header = true;
+    char *ballast = NULL;
+    size_t i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:p:m:Hh")) != -1) {
+        switch (opt) {
+            case 'n':
+                launches = atol(optarg);
+                break;
+            case 'p':
+                command[0] = optarg;
+                break;
+            case 'm':
+                max_rss_mb = strtoul(optarg, NULL, 10);
+                break;
+            case 'H':
+                header = false;
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (launches <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // spawn_command() and wait_command() report errors on stdout
+    if (header) {
+        printf("impl,rss_mb,launches,total_ns,us_per_launch\n");
+    }
+
+    for (i = 0; i < sizeof(RssMb) / sizeof(RssMb[0]) && RssMb[i] <= max_rss_mb; i++) {
+        free(ballast);
+        ballast = NULL;
+        if (RssMb[i] > 0) {
+            if ((ballast = malloc(RssMb[i] << 20)) == NULL) {
+                fprintf(stderr, "Failed to allocate %zu MB\n", RssMb[i]);
+                break;
+            }
+            // Touch every page so it is resident and mapped in the page tables
+            memset(ballast, 1, RssMb[i] << 20);
+        }
+
+        run("fork_exec", launch_fork_exec, command, RssMb[i], launches);
+        run("posix_spawn", launch_spawn, command, RssMb[i], launches);
+    }
+
+    free(ballast);
+    return 0;
+}
@@ -0,0 +1,278 @@
+/**
+ * @file ws-scheduler-bench.c
+ * @brief Work-stealing scheduler against thread-per-task spawning
+ *
+ * Runs the same batch of short tasks four ways:
+ *
+ *  - thread_per_task: pthread_create()/pthread_join() for every task, the
+ *    model of examples/threading, with at most THREAD_WINDOW threads alive
+ *  - ws_spawn: fire and forget tasks with a completion callback
+ *  - ws_submit: one future per task, all waited on by the submitting thread
+ *  - ws_forkjoin: a binary tree of tasks, each waiting on the two children it
+ *    submits from its worker, which exercises the deques and stealing
+ *
+ * Each task spins for work_iters iterations, so the cost of scheduling can be
+ * seen against tasks of growing size.  Results are written to stdout as CSV.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "../examples/threading/ws-scheduler.h"
+
+#define DEFAULT_TASKS   200000
+#define THREAD_WINDOW   64      // threads alive at once for thread_per_task
+
+static const long WorkIters[] = { 0, 1000, 10000 };
+
+struct spawn_wait {
+    atomic_long left;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+struct tree_arg {
+    struct ws_scheduler *sched;
+    long tasks;                 // tasks in this subtree, this one included
+    long work_iters;
+};
+
+static long WorkIterations;
+static atomic_long Executed;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void spin(long iters)
+{
+    volatile long x = 0;
+    long i;
+
+    for (i = 0; i < iters; i++) {
+        x += i;
+    }
+}
+
+static void *task_fn(void *arg)
+{
+    spin(WorkIterations);
+    atomic_fetch_add_explicit(&Executed, 1, memory_order_relaxed);
+    return arg;
+}
+
+static void spawn_done(void *result, void *ctx)
+{
+    struct spawn_wait *wait = ctx;
+
+    (void)result;
+    if (atomic_fetch_sub_explicit(&wait->left, 1, memory_order_acq_rel) == 1) {
+        pthread_mutex_lock(&wait->mutex);
+        pthread_cond_signal(&wait->cond);
+        pthread_mutex_unlock(&wait->mutex);
+    }
+}
+
+static void *tree_fn(void *param)
+{
+    struct tree_arg *arg = param;
+    struct tree_arg left, right;
+    struct ws_future *fl = NULL, *fr = NULL;
+    long children = arg->tasks - 1;
+
+    spin(arg->work_iters);
+    atomic_fetch_add_explicit(&Executed, 1, memory_order_relaxed);
+
+    left = *arg;
+    left.tasks = children / 2;
+    right = *arg;
+    right.tasks = children - left.tasks;
+
+    if (left.tasks > 0) {
+        fl = ws_submit(arg->sched, tree_fn, &left);
+    }
+    if (right.tasks > 0) {
+        fr = ws_submit(arg->sched, tree_fn, &right);
+    }
+    if (fl != NULL) {
+        ws_future_wait(fl);
+        ws_future_release(fl);
+    }
+    if (fr != NULL) {
+        ws_future_wait(fr);
+        ws_future_release(fr);
+    }
+    return NULL;
+}
+
+static void run_thread_per_task(long tasks)
+{
+    pthread_t threads[THREAD_WINDOW];
+    long done = 0;
+    int n, i;
+
+    while (done < tasks) {
+        for (n = 0; n < THREAD_WINDOW && done + n < tasks; n++) {
+            if (pthread_create(&threads[n], NULL, task_fn, NULL) != 0) {
+                fprintf(stderr, "Failed to start thread\n");
+                exit(1);
+            }
+        }
+        for (i = 0; i < n; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        done += n;
+    }
+}
+
+static void run_ws_spawn(struct ws_scheduler *sched, long tasks)
+{
+    struct spawn_wait wait;
+    long i;
+
+    atomic_init(&wait.left, tasks);
+    pthread_mutex_init(&wait.mutex, NULL);
+    pthread_cond_init(&wait.cond, NULL);
+
+    for (i = 0; i < tasks; i++) {
+        if (!ws_spawn(sched, task_fn, NULL, spawn_done, &wait)) {
+            exit(1);
+        }
+    }
+
+    pthread_mutex_lock(&wait.mutex);
+    while (atomic_load(&wait.left) > 0) {
+        pthread_cond_wait(&wait.cond, &wait.mutex);
+    }
+    pthread_mutex_unlock(&wait.mutex);
+    pthread_mutex_destroy(&wait.mutex);
+    pthread_cond_destroy(&wait.cond);
+}
+
+static void run_ws_submit(struct ws_scheduler *sched, long tasks)
+{
+    struct ws_future **futures = malloc(tasks * sizeof(struct ws_future *));
+    long i;
+
+    if (futures == NULL) {
+        exit(1);
+    }
+    for (i = 0; i < tasks; i++) {
+        if ((futures[i] = ws_submit(sched, task_fn, NULL)) == NULL) {
+            exit(1);
+        }
+    }
+    for (i = 0; i < tasks; i++) {
+        ws_future_wait(futures[i]);
+        ws_future_release(futures[i]);
+    }
+    free(futures);
+}
+
+static void run_ws_forkjoin(struct ws_scheduler *sched, long tasks, long work_iters)
+{
+    struct tree_arg root = { .sched = sched, .tasks = tasks, .work_iters = work_iters };
+    struct ws_future *f = ws_submit(sched, tree_fn, &root);
+
+    ws_future_wait(f);
+    ws_future_release(f);
+}
+
+static void report(const char *impl, int workers, long tasks, uint64_t total_ns)
+{
+    long executed = atomic_exchange(&Executed, 0);
+
+    if (executed != tasks) {
+        fprintf(stderr, "%s: ran %ld of %ld tasks\n", impl, executed, tasks);
+        exit(1);
+    }
+    printf("%s,%d,%ld,%ld,%llu,%.1f,%.0f\n", impl, workers, tasks, WorkIterations,
+        (unsigned long long)total_ns, (double)total_ns / tasks, tasks * 1e9 / (double)total_ns);
+    fflush(stdout);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+        "Usage: %s [-n tasks] [-w workers] [-H]\n"
+        "  -n tasks    tasks per case (default %d)\n"
+        "  -w workers  scheduler worker threads (default one per online cpu)\n"
+        "  -H          omit the CSV header\n",
+        prog, DEFAULT_TASKS);
+}
+
+int main(int argc, char *argv[])
+{
+    struct ws_scheduler *sched;
+    long tasks = DEFAULT_TASKS;
+    bool header = true;
+    int workers = 0, opt;
+    uint64_t start;
+    size_t i;
+
+    while ((opt = getopt(argc, argv, "n:w:Hh")) != -1) {
+        switch (opt) {
+            case 'n':
+                tasks = atol(optarg);
+                break;
+            case 'w':
+                workers = atoi(optarg);
+                break;
+            case 'H':
+                header = false;
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (tasks <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    sched = ws_scheduler_create(workers);
+    if (sched == NULL) {
+        fprintf(stderr, "Failed to create the scheduler\n");
+        return 1;
+    }
+    workers = ws_scheduler_workers(sched);
+
+    if (header) {
+        printf("impl,workers,tasks,work_iters,total_ns,ns_per_task,tasks_per_sec\n");
+    }
+
+    for (i = 0; i < sizeof(WorkIters) / sizeof(WorkIters[0]); i++) {
+        WorkIterations = WorkIters[i];
+
+        start = now_ns();
+        run_thread_per_task(tasks);
+        report("thread_per_task", THREAD_WINDOW, tasks, now_ns() - start);
+
+        start = now_ns();
+        run_ws_spawn(sched, tasks);
+        report("ws_spawn", workers, tasks, now_ns() - start);
+
+        start = now_ns();
+        run_ws_submit(sched, tasks);
+        report("ws_submit", workers, tasks, now_ns() - start);
+
+        start = now_ns();
+        run_ws_forkjoin(sched, tasks, WorkIterations);
+        report("ws_forkjoin", workers, tasks, now_ns() - start);
+    }
+
+    ws_scheduler_destroy(sched);
+    return 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "systemcalls.h"
 #include <stdlib.h>
 #include <sys/wait.h>
@@ -5,6 +6,18 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <spawn.h>
+#include <signal.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/syscall.h>
+
+#define CAPTURE_INITIAL_SIZE    4096
+#define CAPTURE_CHUNK_SIZE      16384
+
+extern char **environ;
 
 /**
  * @param cmd the command to execute with system()
@@ -53,13 +66,14 @@ bool do_exec(int count, ...)
     va_start(args, count);
     char * command[count+1];
     int i;
-    int childPID, wstatus, exeReturn;
+    pid_t childPID;
 
     for(i=0; i<count; i++)
     {
         command[i] = va_arg(args, char *);
     }
     command[count] = NULL;
+    va_end(args);
 
 /*
  * TODO:
@@ -70,51 +84,10 @@ bool do_exec(int count, ...)
  *   as second argument to the execv() command.
  *
 */
-    fflush(stdout);
-
-    printf("Forking\n");
-    if ((childPID = fork()) == -1) {
-        //failed to fork
-        printf("Fork failed\n");
+    if ((childPID = spawn_command(command, NULL)) == -1) {
         return false;
     }
-    else if (childPID == 0) {
-        // Child Process
-        printf("Child process about to run command\n");
-        if ((exeReturn = execv(command[0], command)) == -1) {
-            // Failed to run execv syscall
-            printf("execv command failed to run\n");
-            _exit(1);
-        }
-    }
-    else {
-        // Parent Process
-        printf("Parent process waiting\n");
-        if (wait(&wstatus) == -1) {
-            // Wait failed
-            printf("Wait failed\n");
-            return false;
-        }
-        else {
-            if (WIFEXITED(wstatus) != 0) {
-                // Child process ended correctly
-                // Check the status to see if it failed to execute the command
-                if (WEXITSTATUS(wstatus) != 0) {
-                    printf("Child process existed but did not run command\n");
-                    return false;
-                }
-            }
-            else {
-                // Child process did not end correctly
-                return false;
-            }
-        }
-    }
-
-    va_end(args);
-
-    printf("Hit final return\n");
-    return true;
+    return wait_command(childPID);
 }
 
 /**
@@ -127,12 +100,15 @@ bool do_exec_redirect(const char *outputfile, int count, ...)
     va_list args;
     va_start(args, count);
     char * command[count+1];
-    int i, childPID, wstatus;
+    int i;
+    pid_t childPID;
+
     for(i=0; i<count; i++)
     {
         command[i] = va_arg(args, char *);
     }
     command[count] = NULL;
+    va_end(args);
 
 
 /*
@@ -142,62 +118,390 @@ bool do_exec_redirect(const char *outputfile, int count, ...)
  *   The rest of the behaviour is same as do_exec()
  *
 */
-    int fd = open(outputfile, O_WRONLY|O_TRUNC|O_CREAT, 0644);
-    if (fd < 0) {
-        printf("Failed to open redirect file.\n");
+    if (outputfile == NULL) {
         return false;
     }
+    if ((childPID = spawn_command(command, outputfile)) == -1) {
+        return false;
+    }
+    return wait_command(childPID);
+}
+
+/**
+* posix_spawn() @param command with the file actions @param actions.
+* @return the pid of the child, or -1 on failure.
+*/
+static pid_t spawn_with_actions(char *const command[], const posix_spawn_file_actions_t *actions)
+{
+    posix_spawnattr_t attr;
+    sigset_t mask;
+    pid_t childPID;
+    int rc;
+
+    posix_spawnattr_init(&attr);
 
+    // Callers may block signals in their thread, the command starts without a mask
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+    // Flush so output already printed comes before the output of the command
     fflush(stdout);
 
-    printf("Forking\n");
-    if ((childPID = fork()) == -1) {
-        //failed to fork
-        printf("Fork failed\n");
+    // glibc reports exec failures here, the child never runs with a bad path
+    if ((rc = posix_spawn(&childPID, command[0], actions, &attr, command, environ)) != 0) {
+        printf("Failed to spawn %s: %s\n", command[0], strerror(rc));
+        childPID = -1;
+    }
+
+    posix_spawnattr_destroy(&attr);
+    return childPID;
+}
+
+/**
+* waitpid() @param pid into @param wstatus, retrying when interrupted.
+*/
+static bool wait_status(pid_t pid, int *wstatus)
+{
+    while (waitpid(pid, wstatus, 0) == -1) {
+        if (errno != EINTR) {
+            printf("Wait failed: %s\n", strerror(errno));
+            return false;
+        }
+    }
+    return true;
+}
+
+pid_t spawn_command(char *const command[], const char *outputfile)
+{
+    posix_spawn_file_actions_t actions;
+    pid_t childPID = -1;
+
+    if (command == NULL || command[0] == NULL) {
+        return -1;
+    }
+
+    posix_spawn_file_actions_init(&actions);
+
+    // The open happens in the child, so the parent never holds the descriptor
+    if (outputfile != NULL &&
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, outputfile,
+                                         O_WRONLY|O_TRUNC|O_CREAT, 0644) != 0) {
+        printf("Failed to add the redirect of %s\n", outputfile);
+    } else {
+        childPID = spawn_with_actions(command, &actions);
+    }
+
+    posix_spawn_file_actions_destroy(&actions);
+    return childPID;
+}
+
+bool wait_command(pid_t pid)
+{
+    int wstatus;
+
+    if (!wait_status(pid, &wstatus)) {
+        return false;
+    }
+
+    if (WIFEXITED(wstatus) == 0) {
+        // Child process did not end correctly
         return false;
     }
-    else if (childPID == 0) {
-        // Child Process
-        printf("Child process about to run command\n");
+    // Check the status to see if it failed to execute the command
+    return WEXITSTATUS(wstatus) == 0;
+}
+
+/**
+* Keep @param len bytes of @param data in @param buf, up to @param max bytes in total.
+* @return false if they did not all fit.
+*/
+static bool capture_keep(struct capture_buffer *buf, const char *data, size_t len, size_t max)
+{
+    size_t keep = len, size;
+    char *grown;
 
-        if (dup2(fd, 1) < 0) {
-            printf("Failed to duplicate file descriptor\n");
-            _exit(1);
+    if (buf->len + keep > max) {
+        keep = max - buf->len;
+    }
+    if (buf->len + keep + 1 > buf->size) {
+        // Grow geometrically, the NUL terminator included
+        size = buf->size ? buf->size : CAPTURE_INITIAL_SIZE;
+        while (size < buf->len + keep + 1) {
+            size *= 2;
         }
-        close(fd);
-        if (execv(command[0], command) == -1) {
-            // Failed to run execv syscall
-            printf("execv command failed to run\n");
-            _exit(1);
+        if (size > max + 1) {
+            size = max + 1;
         }
-    }
-    else {
-        // Parent Process
-        printf("Parent process waiting\n");
-        close(fd);
-        if (wait(&wstatus) == -1) {
-            // Wait failed
-            printf("Wait failed\n");
+        if ((grown = realloc(buf->data, size)) == NULL) {
             return false;
         }
-        else {
-            if (WIFEXITED(wstatus) != 0) {
-                // Child process ended correctly
-                // Check the status to see if it failed to execute the command
-                if (WEXITSTATUS(wstatus) != 0) {
-                    printf("Child process existed but did not run command\n");
-                    return false;
-                }
+        buf->data = grown;
+        buf->size = size;
+    }
+    memcpy(buf->data + buf->len, data, keep);
+    buf->len += keep;
+    buf->data[buf->len] = '\0';
+    return keep == len;
+}
+
+bool capture_command(char *const command[], const struct capture_options *options,
+                     struct exec_capture *capture)
+{
+    static const struct capture_options defaults = { .max_bytes = CAPTURE_DEFAULT_MAX };
+    posix_spawn_file_actions_t actions;
+    struct capture_buffer *bufs[2] = { &capture->out, &capture->err };
+    struct pollfd fds[2];
+    char chunk[CAPTURE_CHUNK_SIZE];
+    int out_pipe[2] = { -1, -1 }, err_pipe[2] = { -1, -1 };
+    int open_fds = 2, i, wstatus;
+    bool killed = false;
+    ssize_t n;
+    pid_t childPID = -1;
+
+    memset(capture, 0, sizeof(struct exec_capture));
+    capture->exit_status = -1;
+    if (command == NULL || command[0] == NULL) {
+        return false;
+    }
+    if (options == NULL) {
+        options = &defaults;
+    }
+
+    // Close on exec so only the dup2()ed write ends survive in the child
+    if (pipe2(out_pipe, O_CLOEXEC) != 0 || pipe2(err_pipe, O_CLOEXEC) != 0) {
+        printf("Failed to create capture pipes: %s\n", strerror(errno));
+        goto cleanup;
+    }
+
+    posix_spawn_file_actions_init(&actions);
+    if (posix_spawn_file_actions_adddup2(&actions, out_pipe[1], STDOUT_FILENO) != 0 ||
+        posix_spawn_file_actions_adddup2(&actions, err_pipe[1], STDERR_FILENO) != 0) {
+        printf("Failed to add the capture redirects\n");
+    } else {
+        childPID = spawn_with_actions(command, &actions);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+
+    // Only the child may hold the write ends, or the reads below never see EOF
+    close(out_pipe[1]);
+    close(err_pipe[1]);
+    out_pipe[1] = err_pipe[1] = -1;
+    if (childPID == -1) {
+        goto cleanup;
+    }
+
+    fds[0].fd = out_pipe[0];
+    fds[1].fd = err_pipe[0];
+    fds[0].events = fds[1].events = POLLIN;
+
+    // Drain both pipes until the child closes them, past the cap too so it never blocks
+    while (open_fds > 0) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            printf("Failed to poll capture pipes: %s\n", strerror(errno));
+            break;
+        }
+        for (i = 0; i < 2; i++) {
+            if (fds[i].fd == -1 || fds[i].revents == 0) {
+                continue;
+            }
+            n = read(fds[i].fd, chunk, sizeof(chunk));
+            if (n == -1 && (errno == EINTR || errno == EAGAIN)) {
+                continue;
             }
-            else {
-                // Child process did not end correctly
-                return false;
+            if (n <= 0) {
+                // poll() ignores negative descriptors
+                fds[i].fd = -1;
+                open_fds--;
+                continue;
             }
+            if (options->on_output != NULL && !killed &&
+                !options->on_output(i == 0 ? STDOUT_FILENO : STDERR_FILENO, chunk, n, options->ctx)) {
+                kill(childPID, SIGKILL);
+                killed = true;
+            }
+            // With max_bytes 0 the output is only streamed, nothing is dropped from a capture
+            if (options->max_bytes != 0 && !capture_keep(bufs[i], chunk, n, options->max_bytes)) {
+                capture->truncated = true;
+            }
+        }
+    }
+
+    if (wait_status(childPID, &wstatus) && WIFEXITED(wstatus)) {
+        capture->exit_status = WEXITSTATUS(wstatus);
+    }
+
+cleanup:
+    for (i = 0; i < 2; i++) {
+        if (out_pipe[i] != -1) {
+            close(out_pipe[i]);
+        }
+        if (err_pipe[i] != -1) {
+            close(err_pipe[i]);
+        }
+    }
+    // Callers can always use the buffers as strings
+    for (i = 0; i < 2; i++) {
+        if (bufs[i]->data == NULL && (bufs[i]->data = calloc(1, 1)) != NULL) {
+            bufs[i]->size = 1;
         }
     }
+    return !killed && capture->exit_status == 0;
+}
+
+bool do_exec_capture(struct exec_capture *capture, const struct capture_options *options, int count, ...)
+{
+    va_list args;
+    va_start(args, count);
+    char * command[count+1];
+    int i;
 
+    for(i=0; i<count; i++)
+    {
+        command[i] = va_arg(args, char *);
+    }
+    command[count] = NULL;
     va_end(args);
 
-    printf("Hit final return\n");
-    return true;
+    return capture_command(command, options, capture);
+}
+
+void exec_capture_free(struct exec_capture *capture)
+{
+    free(capture->out.data);
+    free(capture->err.data);
+    memset(capture, 0, sizeof(struct exec_capture));
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+* @return a descriptor which polls readable once @param pid exits, or -1 when
+* the kernel has no pidfd_open() (before 5.3).
+*/
+static int open_pidfd(pid_t pid)
+{
+#if defined(SYS_pidfd_open)
+    return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+bool run_batch(char *const *const commands[], size_t count, int max_parallel,
+               struct batch_result results[])
+{
+    struct pollfd *fds;
+    size_t *running_cmd;
+    pid_t *running_pid;
+    size_t next = 0, cmd;
+    int running = 0, i, wstatus;
+    bool use_pidfd = true, all_ok = true;
+    uint64_t batch_start = now_ns();
+    pid_t pid;
+
+    if (max_parallel <= 0) {
+        max_parallel = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (max_parallel <= 0) {
+            max_parallel = 1;
+        }
+    }
+    if ((size_t)max_parallel > count) {
+        max_parallel = count > 0 ? (int)count : 1;
+    }
+
+    fds = calloc(max_parallel, sizeof(struct pollfd));
+    running_cmd = calloc(max_parallel, sizeof(size_t));
+    running_pid = calloc(max_parallel, sizeof(pid_t));
+    if (fds == NULL || running_cmd == NULL || running_pid == NULL) {
+        printf("Failed to allocate the batch of %zu commands\n", count);
+        free(fds);
+        free(running_cmd);
+        free(running_pid);
+        return false;
+    }
+
+    while (next < count || running > 0) {
+        // Fill every free slot
+        while (running < max_parallel && next < count) {
+            cmd = next++;
+            memset(&results[cmd], 0, sizeof(struct batch_result));
+            results[cmd].exit_status = -1;
+            results[cmd].start_ns = now_ns() - batch_start;
+            if ((pid = spawn_command(commands[cmd], NULL)) == -1) {
+                all_ok = false;
+                continue;
+            }
+            results[cmd].started = true;
+
+            fds[running].fd = -1;
+            if (use_pidfd && (fds[running].fd = open_pidfd(pid)) == -1) {
+                // Reap in start order instead, slots then free up late but correctly
+                use_pidfd = false;
+            }
+            fds[running].events = POLLIN;
+            running_cmd[running] = cmd;
+            running_pid[running] = pid;
+            running++;
+        }
+        if (running == 0) {
+            break;
+        }
+
+        if (use_pidfd) {
+            if (poll(fds, running, -1) == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                printf("Failed to poll the batch: %s\n", strerror(errno));
+                use_pidfd = false;
+                continue;
+            }
+        } else {
+            // The oldest command, waited for below
+            fds[0].revents = POLLIN;
+            for (i = 1; i < running; i++) {
+                fds[i].revents = 0;
+            }
+        }
+
+        for (i = running - 1; i >= 0; i--) {
+            if (fds[i].revents == 0) {
+                continue;
+            }
+            cmd = running_cmd[i];
+            if (wait_status(running_pid[i], &wstatus) && WIFEXITED(wstatus)) {
+                results[cmd].exit_status = WEXITSTATUS(wstatus);
+            }
+            results[cmd].duration_ns = now_ns() - batch_start - results[cmd].start_ns;
+            if (results[cmd].exit_status != 0) {
+                all_ok = false;
+            }
+            if (fds[i].fd != -1) {
+                close(fds[i].fd);
+            }
+
+            // Keep the running slots packed, in start order
+            running--;
+            memmove(&fds[i], &fds[i + 1], (running - i) * sizeof(struct pollfd));
+            memmove(&running_cmd[i], &running_cmd[i + 1], (running - i) * sizeof(size_t));
+            memmove(&running_pid[i], &running_pid[i + 1], (running - i) * sizeof(pid_t));
+        }
+    }
+
+    free(fds);
+    free(running_cmd);
+    free(running_pid);
+    return all_ok;
 }
@@ -1,9 +1,97 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <sys/types.h>
 
 bool do_system(const char *command);
 
 bool do_exec(int count, ...);
 
 bool do_exec_redirect(const char *outputfile, int count, ...);
+
+/**
+* Start @param command, a NULL terminated argument vector whose first entry is the
+* full path of the program, with posix_spawn().  The child shares the parent's
+* memory until it execs instead of copying its page tables like fork().
+* @param outputfile - when not NULL, the child's stdout is redirected to this file,
+*   created or truncated.
+* @return the pid of the child, or -1 if it could not be started.
+*/
+pid_t spawn_command(char *const command[], const char *outputfile);
+
+/**
+* Wait for the child @param pid started by spawn_command().  Only this child is
+* reaped, other children of the caller are left alone.
+* @return true if the child exited with status 0.
+*/
+bool wait_command(pid_t pid);
+
+#define CAPTURE_DEFAULT_MAX (1024 * 1024)   // bytes kept per stream without options
+
+struct capture_buffer {
+    char *data;                 // NUL terminated
+    size_t len;
+    size_t size;
+};
+
+struct exec_capture {
+    struct capture_buffer out;  // the command's stdout
+    struct capture_buffer err;  // the command's stderr
+    bool truncated;             // output past max_bytes was dropped, never with max_bytes 0
+    int exit_status;            // -1 if the command did not exit normally
+};
+
+/**
+* Called with every chunk of @param len bytes read from the command's
+* @param fd, STDOUT_FILENO or STDERR_FILENO, as it arrives.
+* @return false to kill the command.
+*/
+typedef bool (*capture_fn)(int fd, const char *data, size_t len, void *ctx);
+
+struct capture_options {
+    size_t max_bytes;           // bytes kept per stream, 0 to only stream to on_output
+    capture_fn on_output;       // NULL for none
+    void *ctx;                  // passed to on_output
+};
+
+/**
+* Run @param command like spawn_command() with its stdout and stderr read from
+* pipes into @param capture instead of going to a file.  Output past
+* @param options max_bytes is still drained and passed to on_output, but not
+* kept.  @param options may be NULL for CAPTURE_DEFAULT_MAX and no callback.
+* The buffers of @param capture must be freed with exec_capture_free(), also
+* on failure.
+* @return true if the command exited with status 0 and was not killed.
+*/
+bool capture_command(char *const command[], const struct capture_options *options,
+                     struct exec_capture *capture);
+
+/**
+* capture_command() with the command given like do_exec().
+*/
+bool do_exec_capture(struct exec_capture *capture, const struct capture_options *options, int count, ...);
+
+/**
+* Free the buffers of @param capture.
+*/
+void exec_capture_free(struct exec_capture *capture);
+
+struct batch_result {
+    bool started;               // false if the command could not be spawned
+    int exit_status;            // -1 if the command did not exit normally
+    uint64_t start_ns;          // when it was spawned, from the start of the batch
+    uint64_t duration_ns;       // from spawn to exit
+};
+
+/**
+* Run the @param count commands of @param commands, each a NULL terminated
+* argument vector as for spawn_command(), with at most @param max_parallel of
+* them running at once, 0 for one per online cpu.  Commands are started in
+* order as earlier ones exit.  Exits are waited for through a pidfd per
+* command, without polling, so a slot is refilled as soon as its command ends.
+* @param results - the status and timing of commands[i] are stored in results[i].
+* @return true if every command exited with status 0.
+*/
+bool run_batch(char *const *const commands[], size_t count, int max_parallel,
+               struct batch_result results[]);
@@ -0,0 +1,219 @@
+#define _GNU_SOURCE
+#include "lf-ring.h"
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#define LF_RING_MAX_SLOTS   (1u << 31)
+#define PUBLISH_SPINS       64      // spins waiting for earlier producers before yielding
+
+/********************************************************************
+Helpers
+*********************************************************************/
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __asm__ __volatile__("pause");
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+static void futex_wait(atomic_uint *addr, unsigned val, int timeout_ms) {
+    struct timespec ts;
+
+    if (timeout_ms < 0) {
+        (void)syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+        return;
+    }
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    (void)syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, &ts, NULL, 0);
+}
+
+static void futex_wake_all(atomic_uint *addr) {
+    (void)syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+static inline unsigned room(struct lf_ring *ring, unsigned head) {
+    return ring->mask + 1 - (head - atomic_load(&ring->cons_tail));
+}
+
+/********************************************************************
+Setup
+*********************************************************************/
+struct lf_ring *lf_ring_create(unsigned capacity, unsigned flags) {
+    struct lf_ring *ring;
+    unsigned slots = 1;
+    size_t size;
+
+    if (capacity == 0 || capacity > LF_RING_MAX_SLOTS) {
+        errno = EINVAL;
+        return NULL;
+    }
+    while (slots < capacity) {
+        slots <<= 1;
+    }
+
+    // aligned_alloc() wants a multiple of the alignment
+    size = sizeof(struct lf_ring) + (size_t)slots * sizeof(void *);
+    size = (size + LF_RING_CACHE_LINE - 1) & ~(size_t)(LF_RING_CACHE_LINE - 1);
+    if ((ring = aligned_alloc(LF_RING_CACHE_LINE, size)) == NULL) {
+        return NULL;
+    }
+    ring->mask = slots - 1;
+    ring->flags = flags;
+    // Spinning only helps when the earlier producer can run on another cpu meanwhile
+    ring->publish_spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? PUBLISH_SPINS : 0;
+    atomic_init(&ring->prod_head, 0);
+    atomic_init(&ring->prod_tail, 0);
+    atomic_init(&ring->room_waiting, 0);
+    atomic_init(&ring->room_seq, 0);
+    atomic_init(&ring->cons_tail, 0);
+    atomic_init(&ring->data_waiting, 0);
+    atomic_init(&ring->data_seq, 0);
+    atomic_init(&ring->closed, false);
+    return ring;
+}
+
+void lf_ring_destroy(struct lf_ring *ring) {
+    free(ring);
+}
+
+/********************************************************************
+Producers
+*********************************************************************/
+unsigned lf_ring_enqueue(struct lf_ring *ring, void *const *elems, unsigned n) {
+    unsigned head, free_slots, i;
+    int spins;
+
+    if (lf_ring_closed(ring)) {
+        return 0;
+    }
+
+    if (ring->flags & LF_RING_MP) {
+        head = atomic_load_explicit(&ring->prod_head, memory_order_relaxed);
+        do {
+            free_slots = room(ring, head);
+            if (n > free_slots) {
+                n = free_slots;
+            }
+            if (n == 0) {
+                return 0;
+            }
+        } while (!atomic_compare_exchange_weak_explicit(&ring->prod_head, &head, head + n,
+                                                        memory_order_relaxed, memory_order_relaxed));
+    } else {
+        head = atomic_load_explicit(&ring->prod_head, memory_order_relaxed);
+        free_slots = room(ring, head);
+        if (n > free_slots) {
+            n = free_slots;
+        }
+        if (n == 0) {
+            return 0;
+        }
+        atomic_store_explicit(&ring->prod_head, head + n, memory_order_relaxed);
+    }
+
+    for (i = 0; i < n; i++) {
+        ring->slot[(head + i) & ring->mask] = elems[i];
+    }
+
+    // Publish in reservation order, after the producers which reserved earlier
+    if (ring->flags & LF_RING_MP) {
+        for (spins = 0; atomic_load_explicit(&ring->prod_tail, memory_order_acquire) != head; spins++) {
+            if (spins < ring->publish_spins) {
+                cpu_relax();
+            } else {
+                // It may have been preempted, let it run
+                sched_yield();
+            }
+        }
+    }
+
+    // Pairs with lf_ring_wait(): either it sees the data or we see it parked.
+    // Only the first producer to see it parked wakes it.
+    atomic_store(&ring->prod_tail, head + n);
+    if (atomic_load(&ring->data_waiting) &&
+        atomic_exchange(&ring->data_waiting, 0)) {
+        atomic_fetch_add(&ring->data_seq, 1);
+        futex_wake_all(&ring->data_seq);
+    }
+    return n;
+}
+
+bool lf_ring_wait_room(struct lf_ring *ring, unsigned n, int timeout_ms) {
+    unsigned seq;
+
+    if (room(ring, atomic_load(&ring->prod_head)) >= n) {
+        return true;
+    }
+
+    seq = atomic_load(&ring->room_seq);
+    atomic_store(&ring->room_waiting, 1);
+    if (room(ring, atomic_load(&ring->prod_head)) < n && !lf_ring_closed(ring)) {
+        futex_wait(&ring->room_seq, seq, timeout_ms);
+    }
+
+    return room(ring, atomic_load(&ring->prod_head)) >= n;
+}
+
+/********************************************************************
+Consumer
+*********************************************************************/
+unsigned lf_ring_dequeue(struct lf_ring *ring, void **elems, unsigned n) {
+    unsigned tail = atomic_load_explicit(&ring->cons_tail, memory_order_relaxed);
+    unsigned avail = atomic_load_explicit(&ring->prod_tail, memory_order_acquire) - tail;
+    unsigned i;
+
+    if (n > avail) {
+        n = avail;
+    }
+    if (n == 0) {
+        return 0;
+    }
+    for (i = 0; i < n; i++) {
+        elems[i] = ring->slot[(tail + i) & ring->mask];
+    }
+
+    // Pairs with lf_ring_wait_room(), as above, but wakes every parked producer
+    atomic_store(&ring->cons_tail, tail + n);
+    if (atomic_load(&ring->room_waiting) &&
+        atomic_exchange(&ring->room_waiting, 0)) {
+        atomic_fetch_add(&ring->room_seq, 1);
+        futex_wake_all(&ring->room_seq);
+    }
+    return n;
+}
+
+unsigned lf_ring_count(struct lf_ring *ring) {
+    return atomic_load(&ring->prod_tail) - atomic_load(&ring->cons_tail);
+}
+
+unsigned lf_ring_wait(struct lf_ring *ring, int timeout_ms) {
+    unsigned seq, avail;
+
+    if ((avail = lf_ring_count(ring)) > 0) {
+        return avail;
+    }
+
+    seq = atomic_load(&ring->data_seq);
+    atomic_store(&ring->data_waiting, 1);
+    if (lf_ring_count(ring) == 0 && !lf_ring_closed(ring)) {
+        futex_wait(&ring->data_seq, seq, timeout_ms);
+    }
+
+    return lf_ring_count(ring);
+}
+
+void lf_ring_close(struct lf_ring *ring) {
+    atomic_store(&ring->closed, true);
+    atomic_fetch_add(&ring->data_seq, 1);
+    futex_wake_all(&ring->data_seq);
+    atomic_fetch_add(&ring->room_seq, 1);
+    futex_wake_all(&ring->room_seq);
+}
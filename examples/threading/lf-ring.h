@@ -0,0 +1,108 @@
+#ifndef LF_RING_H
+#define LF_RING_H
+
+#include <stdbool.h>
+#include <stdatomic.h>
+
+/**
+ * Lock-free ring of pointers.
+ *
+ * The userspace companion of aesd-ring.h for handing work between threads
+ * without a mutex.  One consumer; one producer, or any number of them with
+ * LF_RING_MP.  Counters are free running and masked into a power-of-two
+ * array of slots, like aesd-ring.h.  The producer and the consumer counters
+ * live on cache lines of their own, so the two sides only share a line when
+ * one of them actually reads what the other published.
+ *
+ * Multiple producers reserve slots by compare-and-swap on the producer head,
+ * fill them, then publish in reservation order through the producer tail.
+ * The consumer only ever reads up to the producer tail.
+ *
+ * Blocking is optional: lf_ring_wait() and lf_ring_wait_room() park on a futex
+ * and the other side only makes the wake up call when it finds someone parked,
+ * once until they park again, so a ring nobody waits on costs no system call.
+ */
+
+#define LF_RING_MP          0x1     // more than one thread enqueues
+#define LF_RING_CACHE_LINE  64
+
+struct lf_ring {
+    // Read only after lf_ring_create()
+    unsigned mask;
+    unsigned flags;
+    int publish_spins;              // spins before yielding to an earlier producer
+
+    // Written by producers
+    _Alignas(LF_RING_CACHE_LINE) atomic_uint prod_head;     // next counter to reserve
+    atomic_uint prod_tail;          // counters below are readable by the consumer
+    atomic_uint room_waiting;       // producers are parked in lf_ring_wait_room()
+    atomic_uint room_seq;           // futex word producers park on
+
+    // Written by the consumer
+    _Alignas(LF_RING_CACHE_LINE) atomic_uint cons_tail;     // counters below are free again
+    atomic_uint data_waiting;       // the consumer is parked in lf_ring_wait()
+    atomic_uint data_seq;           // futex word the consumer parks on
+    atomic_bool closed;
+
+    _Alignas(LF_RING_CACHE_LINE) void *slot[];
+};
+
+/**
+* Create a ring of at least @param capacity slots, rounded up to a power of
+* two, with @param flags (LF_RING_MP).
+* @return the ring, or NULL with errno set.
+*/
+struct lf_ring *lf_ring_create(unsigned capacity, unsigned flags);
+
+/**
+* Free @param ring, NULL is ignored.  Nobody may use it any more.
+*/
+void lf_ring_destroy(struct lf_ring *ring);
+
+/**
+* Enqueue up to @param n pointers from @param elems, as many as there is room
+* for, in order.  Wakes the consumer if it is parked.
+* @return the number enqueued, 0 when the ring is full or closed.
+*/
+unsigned lf_ring_enqueue(struct lf_ring *ring, void *const *elems, unsigned n);
+
+/**
+* Dequeue up to @param n pointers into @param elems, oldest first.  Consumer
+* only.  Wakes parked producers.
+* @return the number dequeued, 0 when the ring is empty.
+*/
+unsigned lf_ring_dequeue(struct lf_ring *ring, void **elems, unsigned n);
+
+/**
+* Number of pointers queued, a snapshot.
+*/
+unsigned lf_ring_count(struct lf_ring *ring);
+
+/**
+* Consumer: park until something is queued, @param timeout_ms passed (-1 for
+* no limit) or the ring was closed.  May return early.
+* @return the number of pointers queued when it returned.
+*/
+unsigned lf_ring_wait(struct lf_ring *ring, int timeout_ms);
+
+/**
+* Producer: park until there is room for @param n pointers, @param timeout_ms
+* passed (-1 for no limit) or the ring was closed.  May return early.
+* @return true if there was room when it returned.
+*/
+bool lf_ring_wait_room(struct lf_ring *ring, unsigned n, int timeout_ms);
+
+/**
+* Close @param ring: further enqueues fail and every parked thread is woken.
+* What is queued stays there to be dequeued.
+*/
+void lf_ring_close(struct lf_ring *ring);
+
+/**
+* @return true once lf_ring_close() was called on @param ring.
+*/
+static inline bool lf_ring_closed(struct lf_ring *ring) {
+    return atomic_load_explicit(&ring->closed, memory_order_acquire);
+}
+
+#endif /* LF_RING_H */
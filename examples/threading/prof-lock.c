@@ -0,0 +1,363 @@
+#define _GNU_SOURCE
+#include "prof-lock.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#define PROF_LOCK_NAME_MAX  32
+#define PROF_LOCK_MAX_SPIN  1000    // trylock rounds before parking, at most
+#define REPORT_LINE_MAX     1024
+
+struct prof_lock_stats {
+    char name[PROF_LOCK_NAME_MAX];
+    int refs;                       // locks of this name, under RegistryMutex
+    struct prof_lock_stats *next;
+    atomic_ulong acquisitions;
+    atomic_ulong contended;         // acquisitions which did not get the lock at once
+    atomic_ulong wait_ns;
+    atomic_ulong hold_ns;
+    atomic_ulong max_wait_ns;
+    atomic_ulong max_hold_ns;
+    atomic_ulong wait_hist[PROF_LOCK_BUCKETS];
+    atomic_ulong hold_hist[PROF_LOCK_BUCKETS];
+};
+
+static atomic_bool Profiling;
+static pthread_mutex_t RegistryMutex = PTHREAD_MUTEX_INITIALIZER;
+static struct prof_lock_stats *Registry;
+static pthread_once_t CpuOnce = PTHREAD_ONCE_INIT;
+static bool SingleCpu;
+
+/********************************************************************
+Helpers
+*********************************************************************/
+static void check_cpus(void) {
+    // Spinning only helps when the owner can run on another cpu meanwhile
+    SingleCpu = sysconf(_SC_NPROCESSORS_ONLN) <= 1;
+}
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __asm__ __volatile__("pause");
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int spin_limit(struct prof_lock *lock) {
+    int limit;
+
+    pthread_once(&CpuOnce, check_cpus);
+    if (SingleCpu) {
+        return 0;
+    }
+    limit = atomic_load_explicit(&lock->spin_estimate, memory_order_relaxed) * 2 + 10;
+    return limit < PROF_LOCK_MAX_SPIN ? limit : PROF_LOCK_MAX_SPIN;
+}
+
+/**
+* Move the spin estimate an eighth of the way towards @param spins, the
+* number of rounds the last contended acquisition spun.
+*/
+static void spin_adapt(struct prof_lock *lock, int spins) {
+    int estimate = atomic_load_explicit(&lock->spin_estimate, memory_order_relaxed);
+
+    atomic_store_explicit(&lock->spin_estimate, estimate + (spins - estimate) / 8,
+                          memory_order_relaxed);
+}
+
+static void futex_wait(atomic_uint *addr, unsigned val) {
+    (void)syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake_all(atomic_uint *addr) {
+    (void)syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+static inline int bucket(uint64_t ns) {
+    int b = 63 - __builtin_clzll(ns | 1);
+
+    return b < PROF_LOCK_BUCKETS ? b : PROF_LOCK_BUCKETS - 1;
+}
+
+static void update_max(atomic_ulong *max, unsigned long val) {
+    unsigned long cur = atomic_load_explicit(max, memory_order_relaxed);
+
+    while (val > cur &&
+           !atomic_compare_exchange_weak_explicit(max, &cur, val,
+                memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+static void record_wait(struct prof_lock_stats *stats, uint64_t ns, bool contended) {
+    atomic_fetch_add_explicit(&stats->acquisitions, 1, memory_order_relaxed);
+    if (contended) {
+        atomic_fetch_add_explicit(&stats->contended, 1, memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&stats->wait_ns, ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->wait_hist[bucket(ns)], 1, memory_order_relaxed);
+    update_max(&stats->max_wait_ns, ns);
+}
+
+static void record_hold(struct prof_lock_stats *stats, uint64_t ns) {
+    atomic_fetch_add_explicit(&stats->hold_ns, ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->hold_hist[bucket(ns)], 1, memory_order_relaxed);
+    update_max(&stats->max_hold_ns, ns);
+}
+
+/********************************************************************
+Acquisition
+*********************************************************************/
+static int mutex_acquire(struct prof_lock *lock, bool *contended) {
+    int rc = pthread_mutex_trylock(&lock->mutex);
+    int limit, spins;
+
+    *contended = rc == EBUSY;
+    if (rc != EBUSY) {
+        return rc;
+    }
+
+    limit = spin_limit(lock);
+    for (spins = 1; spins <= limit; spins++) {
+        cpu_relax();
+        if ((rc = pthread_mutex_trylock(&lock->mutex)) != EBUSY) {
+            spin_adapt(lock, spins);
+            return rc;
+        }
+    }
+    spin_adapt(lock, limit);
+    return pthread_mutex_lock(&lock->mutex);
+}
+
+static void ticket_acquire(struct prof_lock *lock, bool *contended) {
+    unsigned ticket = atomic_fetch_add_explicit(&lock->next_ticket, 1, memory_order_relaxed);
+    unsigned serving;
+    int limit, spins;
+
+    *contended = atomic_load_explicit(&lock->now_serving, memory_order_acquire) != ticket;
+    if (!*contended) {
+        return;
+    }
+
+    limit = spin_limit(lock);
+    for (spins = 1; spins <= limit; spins++) {
+        cpu_relax();
+        if (atomic_load_explicit(&lock->now_serving, memory_order_acquire) == ticket) {
+            spin_adapt(lock, spins);
+            return;
+        }
+    }
+    spin_adapt(lock, limit);
+
+    // Pairs with ticket_release(): either it sees us parked or we see our turn
+    atomic_fetch_add(&lock->parked, 1);
+    while ((serving = atomic_load(&lock->now_serving)) != ticket) {
+        futex_wait(&lock->now_serving, serving);
+    }
+    atomic_fetch_sub_explicit(&lock->parked, 1, memory_order_relaxed);
+}
+
+static void ticket_release(struct prof_lock *lock) {
+    atomic_fetch_add(&lock->now_serving, 1);
+    if (atomic_load(&lock->parked) > 0) {
+        // Only the holder of the next ticket can proceed, but any of them may hold it
+        futex_wake_all(&lock->now_serving);
+    }
+}
+
+int prof_lock_acquire(struct prof_lock *lock) {
+    bool profiling = atomic_load_explicit(&Profiling, memory_order_relaxed);
+    uint64_t start = 0, now;
+    bool contended;
+    int rc = 0;
+
+    if (profiling) {
+        start = now_ns();
+    }
+
+    if (lock->flags & PROF_LOCK_FAIR) {
+        ticket_acquire(lock, &contended);
+    } else if ((rc = mutex_acquire(lock, &contended)) != 0) {
+        return rc;
+    }
+
+    if (profiling) {
+        now = now_ns();
+        record_wait(lock->stats, now - start, contended);
+        lock->acquired_ns = now;
+    } else {
+        lock->acquired_ns = 0;
+    }
+    return 0;
+}
+
+int prof_lock_release(struct prof_lock *lock) {
+    uint64_t acquired = lock->acquired_ns;
+    uint64_t held = 0;
+    int rc = 0;
+
+    if (acquired != 0) {
+        held = now_ns() - acquired;
+    }
+
+    if (lock->flags & PROF_LOCK_FAIR) {
+        ticket_release(lock);
+    } else {
+        rc = pthread_mutex_unlock(&lock->mutex);
+    }
+
+    if (acquired != 0 && rc == 0) {
+        record_hold(lock->stats, held);
+    }
+    return rc;
+}
+
+/********************************************************************
+Setup and reporting
+*********************************************************************/
+int prof_lock_init(struct prof_lock *lock, const char *name, unsigned flags) {
+    struct prof_lock_stats *stats;
+    int rc;
+
+    memset(lock, 0, sizeof(struct prof_lock));
+    lock->flags = flags;
+    if ((rc = pthread_mutex_init(&lock->mutex, NULL)) != 0) {
+        return rc;
+    }
+
+    pthread_mutex_lock(&RegistryMutex);
+    for (stats = Registry; stats != NULL; stats = stats->next) {
+        if (strncmp(stats->name, name, PROF_LOCK_NAME_MAX - 1) == 0) {
+            break;
+        }
+    }
+    if (stats == NULL) {
+        if ((stats = calloc(1, sizeof(struct prof_lock_stats))) == NULL) {
+            pthread_mutex_unlock(&RegistryMutex);
+            pthread_mutex_destroy(&lock->mutex);
+            return ENOMEM;
+        }
+        strncpy(stats->name, name, PROF_LOCK_NAME_MAX - 1);
+        stats->next = Registry;
+        Registry = stats;
+    }
+    stats->refs++;
+    lock->stats = stats;
+    pthread_mutex_unlock(&RegistryMutex);
+
+    return 0;
+}
+
+void prof_lock_destroy(struct prof_lock *lock) {
+    struct prof_lock_stats **pp;
+
+    pthread_mutex_lock(&RegistryMutex);
+    if (--lock->stats->refs == 0) {
+        for (pp = &Registry; *pp != lock->stats; pp = &(*pp)->next) {
+        }
+        *pp = lock->stats->next;
+        free(lock->stats);
+    }
+    pthread_mutex_unlock(&RegistryMutex);
+    lock->stats = NULL;
+    pthread_mutex_destroy(&lock->mutex);
+}
+
+void prof_lock_profiling(bool enable) {
+    atomic_store(&Profiling, enable);
+}
+
+static const char *format_ns(char *buf, size_t len, unsigned long ns) {
+    if (ns >= 1000000000UL) {
+        snprintf(buf, len, "%lus", ns / 1000000000UL);
+    } else if (ns >= 1000000UL) {
+        snprintf(buf, len, "%lums", ns / 1000000UL);
+    } else if (ns >= 1000UL) {
+        snprintf(buf, len, "%luus", ns / 1000UL);
+    } else {
+        snprintf(buf, len, "%luns", ns);
+    }
+    return buf;
+}
+
+static void report_histogram(const struct prof_lock_stats *stats, const char *kind,
+                             atomic_ulong *hist,
+                             void (*print)(const char *line, void *ctx), void *ctx) {
+    char line[REPORT_LINE_MAX];
+    char bound[16];
+    size_t used;
+    unsigned long count;
+    int i;
+
+    used = snprintf(line, sizeof(line), "lock %s %s:", stats->name, kind);
+    for (i = 0; i < PROF_LOCK_BUCKETS; i++) {
+        count = atomic_load_explicit(&hist[i], memory_order_relaxed);
+        if (count != 0 && used < sizeof(line)) {
+            used += snprintf(line + used, sizeof(line) - used, " >=%s:%lu",
+                             format_ns(bound, sizeof(bound), 1UL << i), count);
+        }
+    }
+    print(line, ctx);
+}
+
+void prof_lock_report(void (*print)(const char *line, void *ctx), void *ctx) {
+    struct prof_lock_stats *stats;
+    char line[REPORT_LINE_MAX];
+    unsigned long acquisitions, contended;
+
+    pthread_mutex_lock(&RegistryMutex);
+    for (stats = Registry; stats != NULL; stats = stats->next) {
+        acquisitions = atomic_load_explicit(&stats->acquisitions, memory_order_relaxed);
+        contended = atomic_load_explicit(&stats->contended, memory_order_relaxed);
+        if (acquisitions == 0) {
+            snprintf(line, sizeof(line), "lock %s: no profiled acquisitions", stats->name);
+            print(line, ctx);
+            continue;
+        }
+        snprintf(line, sizeof(line),
+                 "lock %s: %lu acquisitions, %lu contended (%.1f%%), "
+                 "wait avg %lu ns max %lu ns, hold avg %lu ns max %lu ns",
+                 stats->name, acquisitions, contended, 100.0 * contended / acquisitions,
+                 atomic_load_explicit(&stats->wait_ns, memory_order_relaxed) / acquisitions,
+                 atomic_load_explicit(&stats->max_wait_ns, memory_order_relaxed),
+                 atomic_load_explicit(&stats->hold_ns, memory_order_relaxed) / acquisitions,
+                 atomic_load_explicit(&stats->max_hold_ns, memory_order_relaxed));
+        print(line, ctx);
+        report_histogram(stats, "wait", stats->wait_hist, print, ctx);
+        report_histogram(stats, "hold", stats->hold_hist, print, ctx);
+    }
+    pthread_mutex_unlock(&RegistryMutex);
+}
+
+void prof_lock_reset(void) {
+    struct prof_lock_stats *stats;
+    int i;
+
+    pthread_mutex_lock(&RegistryMutex);
+    for (stats = Registry; stats != NULL; stats = stats->next) {
+        atomic_store(&stats->acquisitions, 0);
+        atomic_store(&stats->contended, 0);
+        atomic_store(&stats->wait_ns, 0);
+        atomic_store(&stats->hold_ns, 0);
+        atomic_store(&stats->max_wait_ns, 0);
+        atomic_store(&stats->max_hold_ns, 0);
+        for (i = 0; i < PROF_LOCK_BUCKETS; i++) {
+            atomic_store(&stats->wait_hist[i], 0);
+            atomic_store(&stats->hold_hist[i], 0);
+        }
+    }
+    pthread_mutex_unlock(&RegistryMutex);
+}
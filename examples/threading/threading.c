@@ -9,6 +9,22 @@
 #define DEBUG_LOG(msg,...) printf("threading: " msg "\n" , ##__VA_ARGS__)
 #define ERROR_LOG(msg,...) printf("threading ERROR: " msg "\n" , ##__VA_ARGS__)
 
+static int obtain(struct thread_data *data)
+{
+    if (data->lock != NULL) {
+        return prof_lock_acquire(data->lock);
+    }
+    return pthread_mutex_lock(data->mutex);
+}
+
+static int release(struct thread_data *data)
+{
+    if (data->lock != NULL) {
+        return prof_lock_release(data->lock);
+    }
+    return pthread_mutex_unlock(data->mutex);
+}
+
 void* threadfunc(void* thread_param)
 {
 
@@ -16,7 +32,6 @@ void* threadfunc(void* thread_param)
     // hint: use a cast like the one below to obtain thread arguments from your parameter
     struct thread_data* thread_func_args = (struct thread_data *) thread_param;
     int mutex_rc;
-    pthread_mutex_t *mutex = thread_func_args->mutex;
 
     DEBUG_LOG("Data in thread: mutex: %p, obtain_wait: %i, obtain_release: %i", thread_func_args->mutex, thread_func_args->wait_to_obtain_ms, thread_func_args->wait_to_release_ms);
 
@@ -27,7 +42,7 @@ void* threadfunc(void* thread_param)
         thread_func_args->thread_complete_success = false;
     } else {
         // Attempt to lock passed in mutex
-        mutex_rc = pthread_mutex_lock(mutex);
+        mutex_rc = obtain(thread_func_args);
 
         if (mutex_rc != 0) {
             ERROR_LOG("Failed to lock mutex");
@@ -37,10 +52,10 @@ void* threadfunc(void* thread_param)
 
             if (sleep_return != 0) {
                 ERROR_LOG("Failed to do second sleep");
-                (void) pthread_mutex_unlock(mutex);
+                (void) release(thread_func_args);
                 thread_func_args->thread_complete_success = false;
             } else {
-                mutex_rc = pthread_mutex_unlock(mutex);
+                mutex_rc = release(thread_func_args);
                 if (mutex_rc != 0) {
                     ERROR_LOG("Failed to unlock mutex");
                     thread_func_args->thread_complete_success = false;
@@ -56,7 +71,7 @@ void* threadfunc(void* thread_param)
 }
 
 
-bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex, int wait_to_obtain_ms, int wait_to_release_ms)
+static bool start_thread(pthread_t *thread, pthread_mutex_t *mutex, struct prof_lock *lock, int wait_to_obtain_ms, int wait_to_release_ms)
 {
     /**
      * TODO: allocate memory for thread_data, setup mutex and wait arguments, pass thread_data to created thread
@@ -69,6 +84,7 @@ bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex, int
     DEBUG_LOG("Data to start thread mutex: %p, obtain_wait: %i, obtain_release: %i", mutex, wait_to_obtain_ms, wait_to_release_ms);
     struct thread_data* data = malloc(sizeof(struct thread_data));
     data->mutex = mutex;
+    data->lock = lock;
     data->wait_to_obtain_ms = wait_to_obtain_ms;
     data->wait_to_release_ms = wait_to_release_ms;
     data->thread_complete_success = false;
@@ -86,3 +102,12 @@ bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex, int
     return true;
 }
 
+bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex, int wait_to_obtain_ms, int wait_to_release_ms)
+{
+    return start_thread(thread, mutex, NULL, wait_to_obtain_ms, wait_to_release_ms);
+}
+
+bool start_thread_obtaining_prof_lock(pthread_t *thread, struct prof_lock *lock, int wait_to_obtain_ms, int wait_to_release_ms)
+{
+    return start_thread(thread, NULL, lock, wait_to_obtain_ms, wait_to_release_ms);
+}
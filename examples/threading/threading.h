@@ -1,5 +1,6 @@
 #include <stdbool.h>
 #include <pthread.h>
+#include "prof-lock.h"
 
 /**
  * This structure should be dynamically allocated and passed as
@@ -20,6 +21,7 @@ struct thread_data{
      * if an error occurred.
      */
     pthread_mutex_t *mutex;
+    struct prof_lock *lock;     // used instead of mutex when not NULL
     int wait_to_obtain_ms;
     int wait_to_release_ms;
     bool thread_complete_success;
@@ -41,3 +43,9 @@ struct thread_data{
 * @return true if the thread could be started, false if a failure occurred.
 */
 bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex,int wait_to_obtain_ms, int wait_to_release_ms);
+
+/**
+* Same as start_thread_obtaining_mutex() with the profiling lock @param lock, so the
+* time the thread waits for and holds it shows in the report of prof_lock_report().
+*/
+bool start_thread_obtaining_prof_lock(pthread_t *thread, struct prof_lock *lock, int wait_to_obtain_ms, int wait_to_release_ms);
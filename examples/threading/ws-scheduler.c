@@ -0,0 +1,539 @@
+#define _GNU_SOURCE
+#include "ws-scheduler.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+// Optional: use these functions to add debug or error prints to your application
+#define DEBUG_LOG(msg,...)
+//#define DEBUG_LOG(msg,...) printf("ws-scheduler: " msg "\n" , ##__VA_ARGS__)
+#define ERROR_LOG(msg,...) printf("ws-scheduler ERROR: " msg "\n" , ##__VA_ARGS__)
+
+#define DEQUE_INITIAL_SIZE  256     // slots, always a power of two
+#define SPIN_ROUNDS         64      // failed steal rounds before a worker parks
+#define CACHE_LINE          64
+
+struct ws_future {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    atomic_bool ready;
+    atomic_int refs;            // the task and the submitter
+    void *result;
+};
+
+struct ws_task {
+    ws_task_fn fn;
+    void *arg;
+    ws_done_fn done;
+    void *ctx;
+    struct ws_future *future;
+    struct ws_task *next;       // injection queue link
+};
+
+/*
+ * Chase-Lev deque, following "Correct and Efficient Work-Stealing for Weak
+ * Memory Models" (Le, Pop, Cohen, Zappa Nardelli, PPoPP 2013).  The owner
+ * pushes and takes at bottom, thieves steal at top.  Arrays replaced on growth
+ * may still be read by a thief, they are only freed with the scheduler.
+ */
+struct ws_array {
+    int64_t size;
+    struct ws_array *retired;   // previous array, kept until destroy
+    _Atomic(struct ws_task *) slots[];
+};
+
+struct ws_deque {
+    _Alignas(CACHE_LINE) atomic_int_least64_t top;
+    _Alignas(CACHE_LINE) atomic_int_least64_t bottom;
+    _Atomic(struct ws_array *) array;
+};
+
+struct ws_worker {
+    struct ws_deque deque;
+    struct ws_scheduler *sched;
+    pthread_t thread;
+    uint64_t rng;
+    int index;
+};
+
+struct ws_scheduler {
+    struct ws_worker *workers;
+    int num_workers;
+
+    // Tasks submitted from outside the workers
+    pthread_mutex_t inject_mutex;
+    struct ws_task *inject_head;
+    struct ws_task *inject_tail;
+    atomic_int inject_count;
+
+    // Parking of idle workers
+    pthread_mutex_t park_mutex;
+    pthread_cond_t park_cond;
+    atomic_int sleeping;
+    atomic_bool shutdown;
+};
+
+static __thread struct ws_worker *CurrentWorker;
+
+/********************************************************************
+Deque
+*********************************************************************/
+static struct ws_array *array_create(int64_t size) {
+    struct ws_array *a = malloc(sizeof(struct ws_array) + size * sizeof(a->slots[0]));
+
+    if (a != NULL) {
+        a->size = size;
+        a->retired = NULL;
+    }
+    return a;
+}
+
+static bool deque_init(struct ws_deque *d) {
+    struct ws_array *a = array_create(DEQUE_INITIAL_SIZE);
+
+    if (a == NULL) {
+        return false;
+    }
+    atomic_init(&d->top, 0);
+    atomic_init(&d->bottom, 0);
+    atomic_init(&d->array, a);
+    return true;
+}
+
+static void deque_destroy(struct ws_deque *d) {
+    struct ws_array *a = atomic_load_explicit(&d->array, memory_order_relaxed);
+    struct ws_array *next;
+
+    while (a != NULL) {
+        next = a->retired;
+        free(a);
+        a = next;
+    }
+}
+
+static bool deque_push(struct ws_deque *d, struct ws_task *task) {
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+    struct ws_array *a = atomic_load_explicit(&d->array, memory_order_relaxed);
+    struct ws_array *bigger;
+    int64_t i;
+
+    if (b - t > a->size - 1) {
+        // Full, copy the live slots to an array twice the size
+        if ((bigger = array_create(a->size * 2)) == NULL) {
+            return false;
+        }
+        for (i = t; i < b; i++) {
+            atomic_store_explicit(&bigger->slots[i & (bigger->size - 1)],
+                atomic_load_explicit(&a->slots[i & (a->size - 1)], memory_order_relaxed),
+                memory_order_relaxed);
+        }
+        bigger->retired = a;
+        atomic_store_explicit(&d->array, bigger, memory_order_release);
+        a = bigger;
+    }
+    atomic_store_explicit(&a->slots[b & (a->size - 1)], task, memory_order_relaxed);
+    // Publishes the task to thieves, which load bottom with acquire
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_release);
+    return true;
+}
+
+static struct ws_task *deque_take(struct ws_deque *d) {
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    struct ws_array *a = atomic_load_explicit(&d->array, memory_order_relaxed);
+    struct ws_task *task = NULL;
+    int64_t t;
+
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    t = atomic_load_explicit(&d->top, memory_order_relaxed);
+
+    if (t <= b) {
+        task = atomic_load_explicit(&a->slots[b & (a->size - 1)], memory_order_relaxed);
+        if (t == b) {
+            // Last task, race the thieves for it
+            if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                    memory_order_seq_cst, memory_order_relaxed)) {
+                task = NULL;
+            }
+            atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        }
+    } else {
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    }
+    return task;
+}
+
+static struct ws_task *deque_steal(struct ws_deque *d) {
+    int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+    int64_t b;
+    struct ws_array *a;
+    struct ws_task *task;
+
+    atomic_thread_fence(memory_order_seq_cst);
+    b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if (t >= b) {
+        return NULL;
+    }
+
+    a = atomic_load_explicit(&d->array, memory_order_acquire);
+    task = atomic_load_explicit(&a->slots[t & (a->size - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+            memory_order_seq_cst, memory_order_relaxed)) {
+        return NULL;    // lost the race to another thief or the owner
+    }
+    return task;
+}
+
+static bool deque_empty(struct ws_deque *d) {
+    return atomic_load_explicit(&d->top, memory_order_acquire) >=
+           atomic_load_explicit(&d->bottom, memory_order_acquire);
+}
+
+/********************************************************************
+Scheduling
+*********************************************************************/
+static void wake_one(struct ws_scheduler *sched) {
+    // Pairs with the fence in park(): either we see the sleeper or it sees the task
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&sched->sleeping, memory_order_relaxed) > 0) {
+        pthread_mutex_lock(&sched->park_mutex);
+        pthread_cond_signal(&sched->park_cond);
+        pthread_mutex_unlock(&sched->park_mutex);
+    }
+}
+
+static struct ws_task *inject_pop(struct ws_scheduler *sched) {
+    struct ws_task *task;
+
+    if (atomic_load_explicit(&sched->inject_count, memory_order_acquire) == 0) {
+        return NULL;
+    }
+    pthread_mutex_lock(&sched->inject_mutex);
+    task = sched->inject_head;
+    if (task != NULL) {
+        sched->inject_head = task->next;
+        if (sched->inject_head == NULL) {
+            sched->inject_tail = NULL;
+        }
+        atomic_fetch_sub_explicit(&sched->inject_count, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&sched->inject_mutex);
+    return task;
+}
+
+static bool work_available(struct ws_scheduler *sched) {
+    int i;
+
+    if (atomic_load_explicit(&sched->inject_count, memory_order_relaxed) > 0) {
+        return true;
+    }
+    for (i = 0; i < sched->num_workers; i++) {
+        if (!deque_empty(&sched->workers[i].deque)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+* Find a task for worker @param self: its own deque first, then the injection
+* queue, then one steal attempt from every other worker starting at a random one.
+*/
+static struct ws_task *find_task(struct ws_worker *self) {
+    struct ws_scheduler *sched = self->sched;
+    struct ws_task *task;
+    uint64_t x;
+    int i, victim;
+
+    if ((task = deque_take(&self->deque)) != NULL) {
+        return task;
+    }
+    if ((task = inject_pop(sched)) != NULL) {
+        return task;
+    }
+
+    // xorshift64
+    x = self->rng;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    self->rng = x;
+
+    victim = (int)(x % sched->num_workers);
+    for (i = 0; i < sched->num_workers; i++, victim = (victim + 1) % sched->num_workers) {
+        if (victim != self->index && (task = deque_steal(&sched->workers[victim].deque)) != NULL) {
+            return task;
+        }
+    }
+    return NULL;
+}
+
+static void future_complete(struct ws_future *future, void *result) {
+    pthread_mutex_lock(&future->mutex);
+    future->result = result;
+    atomic_store_explicit(&future->ready, true, memory_order_release);
+    pthread_cond_broadcast(&future->cond);
+    pthread_mutex_unlock(&future->mutex);
+    ws_future_release(future);
+}
+
+static void run_task(struct ws_task *task) {
+    void *result = task->fn(task->arg);
+
+    if (task->done != NULL) {
+        task->done(result, task->ctx);
+    }
+    if (task->future != NULL) {
+        future_complete(task->future, result);
+    }
+    free(task);
+}
+
+/**
+* Sleep until a task is submitted or the scheduler shuts down.
+*/
+static void park(struct ws_scheduler *sched) {
+    pthread_mutex_lock(&sched->park_mutex);
+    atomic_fetch_add_explicit(&sched->sleeping, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!work_available(sched) && !atomic_load_explicit(&sched->shutdown, memory_order_relaxed)) {
+        pthread_cond_wait(&sched->park_cond, &sched->park_mutex);
+    }
+    atomic_fetch_sub_explicit(&sched->sleeping, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&sched->park_mutex);
+}
+
+static void* worker_thread(void* thread_param) {
+    struct ws_worker *self = (struct ws_worker *) thread_param;
+    struct ws_scheduler *sched = self->sched;
+    struct ws_task *task;
+    int idle = 0;
+
+    CurrentWorker = self;
+    DEBUG_LOG("Worker %i started", self->index);
+
+    while (1) {
+        if ((task = find_task(self)) != NULL) {
+            idle = 0;
+            run_task(task);
+            continue;
+        }
+        if (atomic_load_explicit(&sched->shutdown, memory_order_acquire) && !work_available(sched)) {
+            break;
+        }
+        if (++idle < SPIN_ROUNDS) {
+            sched_yield();
+            continue;
+        }
+        idle = 0;
+        park(sched);
+    }
+
+    DEBUG_LOG("Worker %i stopped", self->index);
+    return NULL;
+}
+
+static bool submit(struct ws_scheduler *sched, struct ws_task *task) {
+    struct ws_worker *self = CurrentWorker;
+
+    if (self != NULL && self->sched == sched && deque_push(&self->deque, task)) {
+        wake_one(sched);
+        return true;
+    }
+
+    task->next = NULL;
+    pthread_mutex_lock(&sched->inject_mutex);
+    if (sched->inject_tail != NULL) {
+        sched->inject_tail->next = task;
+    } else {
+        sched->inject_head = task;
+    }
+    sched->inject_tail = task;
+    atomic_fetch_add_explicit(&sched->inject_count, 1, memory_order_release);
+    pthread_mutex_unlock(&sched->inject_mutex);
+
+    wake_one(sched);
+    return true;
+}
+
+/********************************************************************
+Public API, see ws-scheduler.h
+*********************************************************************/
+struct ws_scheduler *ws_scheduler_create(int num_workers) {
+    struct ws_scheduler *sched;
+    int i, rc;
+
+    if (num_workers <= 0) {
+        num_workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (num_workers <= 0) {
+            num_workers = 1;
+        }
+    }
+
+    sched = calloc(1, sizeof(struct ws_scheduler));
+    if (sched == NULL) {
+        return NULL;
+    }
+    sched->workers = aligned_alloc(CACHE_LINE,
+        (num_workers * sizeof(struct ws_worker) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE);
+    if (sched->workers == NULL) {
+        free(sched);
+        return NULL;
+    }
+    memset(sched->workers, 0, num_workers * sizeof(struct ws_worker));
+    pthread_mutex_init(&sched->inject_mutex, NULL);
+    pthread_mutex_init(&sched->park_mutex, NULL);
+    pthread_cond_init(&sched->park_cond, NULL);
+
+    for (i = 0; i < num_workers; i++) {
+        sched->workers[i].sched = sched;
+        sched->workers[i].index = i;
+        sched->workers[i].rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+        if (!deque_init(&sched->workers[i].deque)) {
+            ERROR_LOG("Failed to allocate deque.");
+            sched->num_workers = i;
+            ws_scheduler_destroy(sched);
+            return NULL;
+        }
+    }
+    // Every deque exists before a worker may try to steal from it
+    sched->num_workers = num_workers;
+
+    for (i = 0; i < num_workers; i++) {
+        rc = pthread_create(&sched->workers[i].thread, NULL, worker_thread, &sched->workers[i]);
+        if (rc != 0) {
+            ERROR_LOG("Failed to start worker %i: %s", i, strerror(rc));
+            // Stop the workers already started, the others are never joined
+            atomic_store(&sched->shutdown, true);
+            pthread_mutex_lock(&sched->park_mutex);
+            pthread_cond_broadcast(&sched->park_cond);
+            pthread_mutex_unlock(&sched->park_mutex);
+            while (--i >= 0) {
+                pthread_join(sched->workers[i].thread, NULL);
+            }
+            for (i = 0; i < num_workers; i++) {
+                deque_destroy(&sched->workers[i].deque);
+            }
+            free(sched->workers);
+            free(sched);
+            return NULL;
+        }
+    }
+
+    return sched;
+}
+
+void ws_scheduler_destroy(struct ws_scheduler *sched) {
+    int i;
+
+    if (sched == NULL) {
+        return;
+    }
+
+    atomic_store(&sched->shutdown, true);
+    pthread_mutex_lock(&sched->park_mutex);
+    pthread_cond_broadcast(&sched->park_cond);
+    pthread_mutex_unlock(&sched->park_mutex);
+
+    for (i = 0; i < sched->num_workers; i++) {
+        if (sched->workers[i].thread != 0) {
+            pthread_join(sched->workers[i].thread, NULL);
+        }
+    }
+    for (i = 0; i < sched->num_workers; i++) {
+        deque_destroy(&sched->workers[i].deque);
+    }
+
+    pthread_mutex_destroy(&sched->inject_mutex);
+    pthread_mutex_destroy(&sched->park_mutex);
+    pthread_cond_destroy(&sched->park_cond);
+    free(sched->workers);
+    free(sched);
+}
+
+int ws_scheduler_workers(const struct ws_scheduler *sched) {
+    return sched->num_workers;
+}
+
+bool ws_spawn(struct ws_scheduler *sched, ws_task_fn fn, void *arg, ws_done_fn done, void *ctx) {
+    struct ws_task *task = malloc(sizeof(struct ws_task));
+
+    if (task == NULL) {
+        ERROR_LOG("Failed to allocate task.");
+        return false;
+    }
+    task->fn = fn;
+    task->arg = arg;
+    task->done = done;
+    task->ctx = ctx;
+    task->future = NULL;
+    return submit(sched, task);
+}
+
+struct ws_future *ws_submit(struct ws_scheduler *sched, ws_task_fn fn, void *arg) {
+    struct ws_future *future = malloc(sizeof(struct ws_future));
+    struct ws_task *task = malloc(sizeof(struct ws_task));
+
+    if (future == NULL || task == NULL) {
+        ERROR_LOG("Failed to allocate task.");
+        free(future);
+        free(task);
+        return NULL;
+    }
+    pthread_mutex_init(&future->mutex, NULL);
+    pthread_cond_init(&future->cond, NULL);
+    atomic_init(&future->ready, false);
+    atomic_init(&future->refs, 2);
+    future->result = NULL;
+
+    task->fn = fn;
+    task->arg = arg;
+    task->done = NULL;
+    task->ctx = NULL;
+    task->future = future;
+    submit(sched, task);
+    return future;
+}
+
+bool ws_future_ready(struct ws_future *future) {
+    return atomic_load_explicit(&future->ready, memory_order_acquire);
+}
+
+void *ws_future_wait(struct ws_future *future) {
+    struct ws_worker *self = CurrentWorker;
+    struct ws_task *task;
+
+    if (self != NULL) {
+        // Keep the worker busy with other tasks, the awaited one may be among them
+        while (!ws_future_ready(future)) {
+            if ((task = find_task(self)) != NULL) {
+                run_task(task);
+            } else {
+                sched_yield();
+            }
+        }
+        return future->result;
+    }
+
+    pthread_mutex_lock(&future->mutex);
+    while (!atomic_load_explicit(&future->ready, memory_order_relaxed)) {
+        pthread_cond_wait(&future->cond, &future->mutex);
+    }
+    pthread_mutex_unlock(&future->mutex);
+    return future->result;
+}
+
+void ws_future_release(struct ws_future *future) {
+    if (future != NULL && atomic_fetch_sub_explicit(&future->refs, 1, memory_order_acq_rel) == 1) {
+        pthread_mutex_destroy(&future->mutex);
+        pthread_cond_destroy(&future->cond);
+        free(future);
+    }
+}
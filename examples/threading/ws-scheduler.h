@@ -0,0 +1,78 @@
+#ifndef WS_SCHEDULER_H
+#define WS_SCHEDULER_H
+
+#include <stdbool.h>
+
+/**
+ * Work-stealing task scheduler.
+ *
+ * A fixed set of worker threads each own a Chase-Lev deque.  Tasks submitted
+ * from a worker are pushed on its own deque and popped LIFO, tasks submitted
+ * from any other thread go through a shared injection queue, and idle workers
+ * steal FIFO from the other deques before parking.  Running a short task then
+ * costs a malloc and a few atomics instead of a pthread_create()/join pair.
+ *
+ * Tasks should not block for long: a blocked task holds its worker.
+ */
+
+struct ws_scheduler;
+struct ws_future;
+
+typedef void *(*ws_task_fn)(void *arg);
+
+/**
+ * Called on the worker thread with the value returned by the task and the
+ * @param ctx given at submission.
+ */
+typedef void (*ws_done_fn)(void *result, void *ctx);
+
+/**
+* Start a scheduler with @param num_workers worker threads, 0 for one per
+* online cpu.
+* @return the scheduler, or NULL on failure.
+*/
+struct ws_scheduler *ws_scheduler_create(int num_workers);
+
+/**
+* Run every task already submitted, then stop and join the workers and free
+* @param sched.  Must not be called from one of its workers.
+*/
+void ws_scheduler_destroy(struct ws_scheduler *sched);
+
+/**
+* @return the number of worker threads of @param sched.
+*/
+int ws_scheduler_workers(const struct ws_scheduler *sched);
+
+/**
+* Run @param fn with @param arg on the scheduler, then call @param done (when
+* not NULL) with its result and @param ctx.
+* @return true if the task was queued, false if out of memory.
+*/
+bool ws_spawn(struct ws_scheduler *sched, ws_task_fn fn, void *arg, ws_done_fn done, void *ctx);
+
+/**
+* Run @param fn with @param arg on the scheduler.
+* @return a future for its result, which must be released with
+* ws_future_release(), or NULL if out of memory.
+*/
+struct ws_future *ws_submit(struct ws_scheduler *sched, ws_task_fn fn, void *arg);
+
+/**
+* @return true once the task of @param future has completed.
+*/
+bool ws_future_ready(struct ws_future *future);
+
+/**
+* Wait for the task of @param future and return its result.  On a worker
+* thread other tasks are run while waiting, so tasks can wait on the tasks
+* they submit (fork-join) without deadlocking the scheduler.
+*/
+void *ws_future_wait(struct ws_future *future);
+
+/**
+* Release @param future.  The task keeps running if it has not completed.
+*/
+void ws_future_release(struct ws_future *future);
+
+#endif /* WS_SCHEDULER_H */
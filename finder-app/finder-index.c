@@ -0,0 +1,235 @@
+/*
+ * finder-index.c
+ *
+ * Index file naming and lookups shared by finder and finder-indexd.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "finder-index.h"
+
+// Defines
+#define SYNC_TIMEOUT_NS     (100 * 1000000ULL)  // then the tree is scanned
+#define SYNC_POLL_NS        50000
+
+/**************************************************************
+ * ************************************************************/
+int finder_index_path(const char *root, char *buf, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325ULL;  // FNV-1a
+    const unsigned char *p;
+    int n;
+
+    for (p = (const unsigned char *)root; *p != '\0'; p++) {
+        hash = (hash ^ *p) * 0x100000001b3ULL;
+    }
+    n = snprintf(buf, len, "%s/%016llx.idx", FINDER_INDEX_DIR, (unsigned long long)hash);
+    return (n < 0 || (size_t)n >= len) ? -1 : 0;
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int compare_count(const void *a, const void *b) {
+    const struct finder_index_trigram *x = *(const struct finder_index_trigram * const *)a;
+    const struct finder_index_trigram *y = *(const struct finder_index_trigram * const *)b;
+
+    return x->count < y->count ? -1 : x->count > y->count;
+}
+
+/**
+* @return true if the daemon of @param header is running and saw no change
+* since the index was written.
+*/
+static bool index_current(const struct finder_index_header *header) {
+    if (__atomic_load_n(&header->dirty, __ATOMIC_ACQUIRE) != 0) {
+        return false;
+    }
+    return kill(header->pid, 0) == 0 || errno == EPERM;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+* Wait for the daemon to read the events of every change made so far.
+* @return true if the index then still is current.
+*/
+static bool index_synced(const struct finder_index_header *header, const char *sync_path) {
+    const struct timespec pause = { 0, SYNC_POLL_NS };
+    uint64_t start = now_ns();
+    int fd;
+
+    if (!index_current(header)) {
+        return false;
+    }
+    if ((fd = open(sync_path, O_RDONLY | O_CLOEXEC)) == -1) {
+        return false;
+    }
+    close(fd);
+    while (__atomic_load_n(&header->synced_ns, __ATOMIC_ACQUIRE) < start) {
+        if (now_ns() - start > SYNC_TIMEOUT_NS) {
+            return false;
+        }
+        nanosleep(&pause, NULL);
+    }
+    return index_current(header);
+}
+
+static const struct finder_index_trigram *find_trigram(const struct finder_index_trigram *table,
+                                                       uint32_t count, uint32_t trigram) {
+    uint32_t lo = 0, hi = count, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (table[mid].trigram < trigram) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return (lo < count && table[lo].trigram == trigram) ? &table[lo] : NULL;
+}
+
+/**
+* Keep the @param n ids of @param ids which are also in @param postings.
+* Both are sorted.
+* @return the number of ids kept.
+*/
+static size_t intersect(uint32_t *ids, size_t n, const uint32_t *postings, size_t count) {
+    size_t i = 0, j = 0, kept = 0;
+
+    while (i < n && j < count) {
+        if (ids[i] < postings[j]) {
+            i++;
+        } else if (ids[i] > postings[j]) {
+            j++;
+        } else {
+            ids[kept++] = ids[i];
+            i++;
+            j++;
+        }
+    }
+    return kept;
+}
+
+/**************************************************************
+ * ************************************************************/
+long finder_index_query(const char *dir, const char *needle,
+                        void (*fn)(const char *rel_path, size_t len, void *ctx), void *ctx) {
+    const struct finder_index_header *header;
+    const struct finder_index_trigram *table, **found = NULL;
+    const struct finder_index_file *files;
+    const uint32_t *postings;
+    const unsigned char *n = (const unsigned char *)needle;
+    char root[PATH_MAX], path[PATH_MAX], sync_path[PATH_MAX + sizeof(FINDER_INDEX_SYNC_SUFFIX)];
+    uint32_t *trigrams = NULL, *ids = NULL;
+    size_t needle_len = strlen(needle), num = 0, i, candidates = 0;
+    struct stat st;
+    void *map = MAP_FAILED;
+    long rc = -1;
+    int fd;
+
+    // Shorter strings have no trigram to look up
+    if (needle_len < 3 || realpath(dir, root) == NULL ||
+        finder_index_path(root, path, sizeof(path)) != 0) {
+        return -1;
+    }
+    snprintf(sync_path, sizeof(sync_path), "%s%s", path, FINDER_INDEX_SYNC_SUFFIX);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+        return -1;
+    }
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct finder_index_header)) {
+        // Shared, so the dirty flag set by the daemon is seen
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    header = map;
+    if (header->magic != FINDER_INDEX_MAGIC || header->version != FINDER_INDEX_VERSION ||
+        strncmp(header->root, root, sizeof(header->root)) != 0 || !index_synced(header, sync_path) ||
+        header->trigrams_off + (uint64_t)header->num_trigrams * sizeof(*table) > (uint64_t)st.st_size ||
+        header->postings_off + header->num_postings * sizeof(*postings) > (uint64_t)st.st_size ||
+        header->files_off + (uint64_t)header->num_files * sizeof(*files) > (uint64_t)st.st_size ||
+        header->paths_off > (uint64_t)st.st_size) {
+        goto cleanup;
+    }
+    table = (const void *)((const char *)map + header->trigrams_off);
+    postings = (const void *)((const char *)map + header->postings_off);
+    files = (const void *)((const char *)map + header->files_off);
+
+    // Distinct trigrams of the needle, each must be in every candidate
+    trigrams = malloc((needle_len - 2) * sizeof(uint32_t));
+    found = malloc((needle_len - 2) * sizeof(*found));
+    if (trigrams == NULL || found == NULL) {
+        goto cleanup;
+    }
+    for (i = 0; i + 2 < needle_len; i++) {
+        trigrams[i] = (uint32_t)n[i] << 16 | (uint32_t)n[i + 1] << 8 | n[i + 2];
+    }
+    qsort(trigrams, needle_len - 2, sizeof(uint32_t), compare_u32);
+    for (i = 0; i < needle_len - 2; i++) {
+        if (i > 0 && trigrams[i] == trigrams[i - 1]) {
+            continue;
+        }
+        if ((found[num] = find_trigram(table, header->num_trigrams, trigrams[i])) == NULL ||
+            found[num]->postings + found[num]->count > header->num_postings) {
+            num = 0;    // no file has all of them
+            break;
+        }
+        num++;
+    }
+
+    if (num > 0) {
+        // Start from the rarest trigram so the candidate set only shrinks
+        qsort(found, num, sizeof(*found), compare_count);
+        candidates = found[0]->count;
+        if ((ids = malloc((candidates ? candidates : 1) * sizeof(uint32_t))) == NULL) {
+            goto cleanup;
+        }
+        memcpy(ids, postings + found[0]->postings, candidates * sizeof(uint32_t));
+        for (i = 1; i < num && candidates > 0; i++) {
+            candidates = intersect(ids, candidates, postings + found[i]->postings, found[i]->count);
+        }
+    }
+
+    // The tree may have changed while the lists were read
+    if (!index_current(header)) {
+        goto cleanup;
+    }
+    rc = 0;
+    for (i = 0; i < candidates; i++) {
+        if (ids[i] >= header->num_files ||
+            header->paths_off + files[ids[i]].path_off + files[ids[i]].path_len > (uint64_t)st.st_size) {
+            continue;
+        }
+        fn((const char *)map + header->paths_off + files[ids[i]].path_off, files[ids[i]].path_len, ctx);
+        rc++;
+    }
+
+cleanup:
+    free(ids);
+    free(found);
+    free(trigrams);
+    munmap(map, st.st_size);
+    return rc;
+}
@@ -0,0 +1,91 @@
+/*
+ * finder-index.h
+ *
+ * Trigram index of a directory tree, kept current by finder-indexd and
+ * queried by finder.
+ *
+ * The index file lives outside the tree, in FINDER_INDEX_DIR, named after a
+ * hash of the real path of the tree's root.  It is written whole to a
+ * temporary file and renamed over the previous one, so readers always map a
+ * complete index.  Between two writes the daemon sets the dirty flag in the
+ * header of the current file, which readers treat as "not current", as they
+ * do an index whose daemon is gone.
+ *
+ * A change is only seen once the daemon has read its inotify event, so
+ * readers first open the sync file next to the index.  That queues an event
+ * behind those of every change made before, and the daemon stores in synced_ns
+ * the time up to which it has read its events.
+ *
+ * Layout, native byte order:
+ *   struct finder_index_header
+ *   struct finder_index_trigram[num_trigrams]  sorted by trigram
+ *   uint32_t postings[num_postings]            file ids, sorted per trigram
+ *   struct finder_index_file[num_files]
+ *   char paths[]                               relative to the root, NUL terminated
+ */
+
+#ifndef FINDER_INDEX_H
+#define FINDER_INDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifndef FINDER_INDEX_DIR
+#define FINDER_INDEX_DIR    "/tmp/finder-index"
+#endif
+
+#define FINDER_INDEX_MAGIC      0x58444946u     // "FIDX"
+#define FINDER_INDEX_VERSION    1
+#define FINDER_INDEX_ROOT_MAX   4096
+#define FINDER_INDEX_SYNC_SUFFIX ".sync"   // appended to the index path
+
+struct finder_index_header {
+    uint32_t magic;
+    uint32_t version;
+    int32_t pid;                    // daemon keeping the index current
+    volatile uint32_t dirty;        // set by the daemon once the tree changed
+    volatile uint64_t synced_ns;    // CLOCK_MONOTONIC, every event queued before was read
+    uint32_t num_trigrams;
+    uint32_t num_files;
+    uint64_t num_postings;
+    uint64_t trigrams_off;
+    uint64_t postings_off;
+    uint64_t files_off;
+    uint64_t paths_off;
+    char root[FINDER_INDEX_ROOT_MAX];   // real path of the indexed tree
+};
+
+struct finder_index_trigram {
+    uint32_t trigram;               // three bytes, the first one highest
+    uint32_t count;
+    uint64_t postings;              // index of the first posting
+};
+
+struct finder_index_file {
+    uint64_t path_off;              // from paths_off
+    uint32_t path_len;
+    uint32_t reserved;
+};
+
+/**
+* Store in @param buf of @param len bytes the path of the index file of the
+* tree whose real path is @param root.  Its sync file has the same path with
+* FINDER_INDEX_SYNC_SUFFIX appended.
+* @return 0 on success, -1 if it does not fit.
+*/
+int finder_index_path(const char *root, char *buf, size_t len);
+
+/**
+* Look up the files of the tree @param dir which may contain @param needle,
+* from a current index of it.  @param fn is called with the path of every
+* candidate relative to @param dir.
+* @return the number of candidates, or -1 if there is no current index for
+* @param dir or @param needle is too short to be looked up, in which case the
+* tree has to be scanned.
+*/
+long finder_index_query(const char *dir, const char *needle,
+                        void (*fn)(const char *rel_path, size_t len, void *ctx), void *ctx);
+
+#endif /* FINDER_INDEX_H */
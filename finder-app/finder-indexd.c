@@ -0,0 +1,886 @@
+/*
+ * finder-indexd.c
+ *
+ * Keeps a trigram index of a directory tree current for finder, see
+ * finder-index.h.
+ *
+ * The tree is walked once, with an inotify watch on every directory.  Every
+ * regular file is read and its distinct trigrams are kept in memory.  Events
+ * mark the files they name for a new read and set the dirty flag of the
+ * current index, which then is rewritten once the tree has been quiet for
+ * QUIET_MS, or at the latest MAX_DELAY_MS after the first change.  Only the
+ * files named by events are read again.
+ *
+ * Every read of the events which drains the queue stores the time it started
+ * in synced_ns, which readers wait for after opening the sync file.
+ *
+ * Changes inotify does not report, such as writes through a mapping or
+ * through another hard link outside the watched directory, are not seen.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <syslog.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "finder-index.h"
+
+// Defines
+#define QUIET_MS        50
+#define MAX_DELAY_MS    1000
+#define READ_SIZE       (256 * 1024)
+#define EVENT_SIZE      (64 * 1024)
+#define TRIGRAM_BITS    (1u << 24)
+#define TOMBSTONE       UINT32_MAX
+
+#define WATCH_MASK      (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | \
+                         IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | \
+                         IN_ONLYDIR | IN_DONT_FOLLOW)
+
+// Types
+struct file_entry {
+    char *path;                 // relative to the root, NULL for a free slot
+    size_t path_len;
+    uint32_t *trigrams;         // distinct, sorted
+    uint32_t num_trigrams;
+    bool pending;               // to be read before the next write
+};
+
+struct indexd {
+    char root[PATH_MAX];
+    char index_path[PATH_MAX];
+    char sync_path[PATH_MAX + sizeof(FINDER_INDEX_SYNC_SUFFIX)];
+    int inotify_fd;
+    int root_wd;
+    int sync_wd;
+
+    char **dirs;                // relative path of every watched directory, by wd
+    size_t dirs_cap;
+
+    struct file_entry *files;
+    size_t num_files, files_cap;
+    uint32_t *free_slots;
+    size_t num_free, free_cap;
+    uint32_t *table;            // open addressing from path to slot + 1
+    size_t table_size, table_used;
+    uint32_t *pending;
+    size_t num_pending, pending_cap;
+
+    uint64_t *bits;             // one bit per trigram
+    uint32_t *rank;             // set bits before every word of bits
+    char *buffer;
+
+    struct finder_index_header *map;    // the current index, to set dirty
+    size_t map_len;
+};
+
+// File Private Vars
+static volatile sig_atomic_t ExitNow = 0;
+
+static void signal_handler(int signal_number) {
+    if (signal_number == SIGINT || signal_number == SIGTERM) {
+        ExitNow = 1;
+    }
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t now_ms(void) {
+    return now_ns() / 1000000;
+}
+
+/**
+* Make room for @param need elements of @param size bytes in @param array.
+*/
+static bool grow(void *array, size_t *cap, size_t need, size_t size) {
+    size_t new_cap = *cap ? *cap : 16;
+    void *p;
+
+    if (need <= *cap) {
+        return true;
+    }
+    while (new_cap < need) {
+        new_cap *= 2;
+    }
+    if ((p = realloc(*(void **)array, new_cap * size)) == NULL) {
+        syslog(LOG_ERR, "Out of memory");
+        return false;
+    }
+    *(void **)array = p;
+    *cap = new_cap;
+    return true;
+}
+
+static char *join(const char *dir, const char *name) {
+    char *path;
+
+    if (dir[0] == '\0') {
+        return strdup(name);
+    }
+    return asprintf(&path, "%s/%s", dir, name) == -1 ? NULL : path;
+}
+
+/**************************************************************
+ * Files
+ * ************************************************************/
+static uint64_t hash_path(const char *path, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)path[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/**
+* Look up @param path in the table.
+* @return the table position holding it, or the one to insert it at if absent.
+*/
+static size_t table_find(const struct indexd *indexd, const char *path, size_t len, bool *found) {
+    size_t mask = indexd->table_size - 1, pos = hash_path(path, len) & mask, insert = SIZE_MAX;
+    const struct file_entry *file;
+    uint32_t entry;
+
+    while ((entry = indexd->table[pos]) != 0) {
+        if (entry == TOMBSTONE) {
+            if (insert == SIZE_MAX) {
+                insert = pos;
+            }
+        } else {
+            file = &indexd->files[entry - 1];
+            if (file->path_len == len && memcmp(file->path, path, len) == 0) {
+                *found = true;
+                return pos;
+            }
+        }
+        pos = (pos + 1) & mask;
+    }
+    *found = false;
+    return insert != SIZE_MAX ? insert : pos;
+}
+
+static bool table_resize(struct indexd *indexd, size_t size) {
+    uint32_t *old = indexd->table;
+    size_t old_size = indexd->table_size, i, pos;
+    bool found;
+
+    if ((indexd->table = calloc(size, sizeof(uint32_t))) == NULL) {
+        indexd->table = old;
+        syslog(LOG_ERR, "Out of memory");
+        return false;
+    }
+    indexd->table_size = size;
+    indexd->table_used = 0;
+    for (i = 0; i < old_size; i++) {
+        if (old[i] != 0 && old[i] != TOMBSTONE) {
+            pos = table_find(indexd, indexd->files[old[i] - 1].path,
+                             indexd->files[old[i] - 1].path_len, &found);
+            indexd->table[pos] = old[i];
+            indexd->table_used++;
+        }
+    }
+    free(old);
+    return true;
+}
+
+static void free_file(struct indexd *indexd, uint32_t slot) {
+    struct file_entry *file = &indexd->files[slot];
+
+    free(file->path);
+    free(file->trigrams);
+    memset(file, 0, sizeof(*file));
+    // Cannot fail, there is a free slot entry for every slot
+    indexd->free_slots[indexd->num_free++] = slot;
+}
+
+/**
+* Mark the file at @param path to be read before the next write, adding it if
+* it is new.
+*/
+static bool touch_file(struct indexd *indexd, const char *path) {
+    size_t len = strlen(path), pos, size;
+    struct file_entry *file;
+    uint32_t slot;
+    bool found;
+
+    // Keep the table at most half full, tombstones included, which a rehash drops
+    if ((indexd->table_used + 1) * 2 > indexd->table_size) {
+        size = indexd->table_size ? indexd->table_size : 1024;
+        while ((indexd->num_files - indexd->num_free + 1) * 4 > size) {
+            size *= 2;
+        }
+        if (!table_resize(indexd, size)) {
+            return false;
+        }
+    }
+    pos = table_find(indexd, path, len, &found);
+    if (found) {
+        slot = indexd->table[pos] - 1;
+    } else {
+        if (indexd->num_free > 0) {
+            slot = indexd->free_slots[--indexd->num_free];
+        } else {
+            if (!grow(&indexd->files, &indexd->files_cap, indexd->num_files + 1, sizeof(struct file_entry)) ||
+                !grow(&indexd->free_slots, &indexd->free_cap, indexd->num_files + 1, sizeof(uint32_t))) {
+                return false;
+            }
+            slot = indexd->num_files++;
+        }
+        file = &indexd->files[slot];
+        memset(file, 0, sizeof(*file));
+        if ((file->path = strdup(path)) == NULL) {
+            indexd->free_slots[indexd->num_free++] = slot;
+            return false;
+        }
+        file->path_len = len;
+        if (indexd->table[pos] == 0) {
+            indexd->table_used++;
+        }
+        indexd->table[pos] = slot + 1;
+    }
+
+    file = &indexd->files[slot];
+    if (!file->pending) {
+        if (!grow(&indexd->pending, &indexd->pending_cap, indexd->num_pending + 1, sizeof(uint32_t))) {
+            return false;
+        }
+        indexd->pending[indexd->num_pending++] = slot;
+        file->pending = true;
+    }
+    return true;
+}
+
+static void drop_slot(struct indexd *indexd, uint32_t slot) {
+    size_t pos;
+    bool found;
+
+    pos = table_find(indexd, indexd->files[slot].path, indexd->files[slot].path_len, &found);
+    if (found) {
+        indexd->table[pos] = TOMBSTONE;
+    }
+    free_file(indexd, slot);
+}
+
+static void drop_file(struct indexd *indexd, const char *path) {
+    size_t pos;
+    bool found;
+
+    if (indexd->table_size == 0) {
+        return;
+    }
+    pos = table_find(indexd, path, strlen(path), &found);
+    if (found) {
+        drop_slot(indexd, indexd->table[pos] - 1);
+    }
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/**
+* Read the file in @param slot again, or drop it if it no longer is a readable
+* regular file.
+*/
+static bool read_file(struct indexd *indexd, uint32_t slot) {
+    struct file_entry *file = &indexd->files[slot];
+    uint32_t *trigrams = NULL, trigram = 0, bit;
+    size_t num = 0, cap = 0, seen = 0, i;
+    char path[PATH_MAX];
+    struct stat st;
+    bool oom = false;
+    ssize_t n;
+    int fd;
+
+    if (snprintf(path, sizeof(path), "%s/%s", indexd->root, file->path) >= (int)sizeof(path) ||
+        (fd = open(path, O_RDONLY | O_CLOEXEC | O_NOCTTY | O_NOFOLLOW | O_NONBLOCK)) == -1) {
+        drop_slot(indexd, slot);
+        return true;
+    }
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        drop_slot(indexd, slot);
+        return true;
+    }
+
+    while (!oom && (n = read(fd, indexd->buffer, READ_SIZE)) != 0) {
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (i = 0; i < (size_t)n; i++) {
+            trigram = (trigram << 8 | (unsigned char)indexd->buffer[i]) & (TRIGRAM_BITS - 1);
+            if (++seen < 3) {
+                continue;
+            }
+            bit = trigram & 63;
+            if (indexd->bits[trigram >> 6] & (1ULL << bit)) {
+                continue;
+            }
+            indexd->bits[trigram >> 6] |= 1ULL << bit;
+            if (num == cap && !grow(&trigrams, &cap, num + 1, sizeof(uint32_t))) {
+                oom = true;
+                break;
+            }
+            trigrams[num++] = trigram;
+        }
+    }
+    close(fd);
+
+    for (i = 0; i < num; i++) {
+        indexd->bits[trigrams[i] >> 6] = 0;
+    }
+    if (oom || n != 0) {
+        // Unreadable, left out like the files finder cannot read
+        free(trigrams);
+        drop_slot(indexd, slot);
+        return !oom;
+    }
+
+    qsort(trigrams, num, sizeof(uint32_t), compare_u32);
+    free(file->trigrams);
+    file->trigrams = trigrams;
+    file->num_trigrams = num;
+    return true;
+}
+
+/**************************************************************
+ * Directories
+ * ************************************************************/
+static void drop_watch(struct indexd *indexd, int wd) {
+    inotify_rm_watch(indexd->inotify_fd, wd);
+    free(indexd->dirs[wd]);
+    indexd->dirs[wd] = NULL;
+}
+
+/**
+* Forget the directory @param path and everything below it.
+*/
+static void drop_dir(struct indexd *indexd, const char *path) {
+    size_t len = strlen(path), i;
+
+    for (i = 0; i < indexd->num_files; i++) {
+        if (indexd->files[i].path != NULL && indexd->files[i].path_len > len &&
+            indexd->files[i].path[len] == '/' && memcmp(indexd->files[i].path, path, len) == 0) {
+            drop_slot(indexd, i);
+        }
+    }
+    for (i = 0; i < indexd->dirs_cap; i++) {
+        if (indexd->dirs[i] != NULL && (int)i != indexd->root_wd &&
+            strncmp(indexd->dirs[i], path, len) == 0 &&
+            (indexd->dirs[i][len] == '\0' || indexd->dirs[i][len] == '/')) {
+            drop_watch(indexd, i);
+        }
+    }
+}
+
+/**
+* Watch the directory @param path and add the files below it.
+* @return false if it could not be watched, the index then cannot be kept current.
+*/
+static bool scan_dir(struct indexd *indexd, const char *path) {
+    struct dirent *entry;
+    char full[PATH_MAX], *child;
+    struct stat st;
+    size_t old_cap;
+    bool ok = true;
+    DIR *dir;
+    int wd;
+
+    if (snprintf(full, sizeof(full), "%s%s%s", indexd->root, path[0] ? "/" : "", path) >= (int)sizeof(full)) {
+        syslog(LOG_ERR, "Path too long below %s", indexd->root);
+        return false;
+    }
+    if (strcmp(full, FINDER_INDEX_DIR) == 0) {
+        return true;
+    }
+    // Watch before listing, so files created meanwhile are either listed or reported
+    if ((wd = inotify_add_watch(indexd->inotify_fd, full, WATCH_MASK)) == -1) {
+        if (errno == ENOENT || errno == ENOTDIR) {
+            return true;    // gone again, its removal is reported too
+        }
+        syslog(LOG_ERR, "Failed to watch %s: %s", full, strerror(errno));
+        return false;
+    }
+    old_cap = indexd->dirs_cap;
+    if (!grow(&indexd->dirs, &indexd->dirs_cap, wd + 1, sizeof(char *))) {
+        return false;
+    }
+    memset(indexd->dirs + old_cap, 0, (indexd->dirs_cap - old_cap) * sizeof(char *));
+    free(indexd->dirs[wd]);
+    if ((indexd->dirs[wd] = strdup(path)) == NULL) {
+        return false;
+    }
+    if (path[0] == '\0') {
+        indexd->root_wd = wd;
+    }
+
+    if ((dir = opendir(full)) == NULL) {
+        return true;
+    }
+    while (ok && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        if (entry->d_type == DT_UNKNOWN) {
+            if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+                continue;
+            }
+            entry->d_type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_LNK;
+        }
+        if (entry->d_type != DT_DIR && entry->d_type != DT_REG) {
+            continue;   // not followed or searched by finder either
+        }
+        if ((child = join(path, entry->d_name)) == NULL) {
+            ok = false;
+            break;
+        }
+        ok = entry->d_type == DT_DIR ? scan_dir(indexd, child) : touch_file(indexd, child);
+        free(child);
+    }
+    closedir(dir);
+    return ok;
+}
+
+static void drop_all(struct indexd *indexd) {
+    size_t i;
+
+    for (i = 0; i < indexd->dirs_cap; i++) {
+        if (indexd->dirs[i] != NULL) {
+            drop_watch(indexd, i);
+        }
+    }
+    for (i = 0; i < indexd->num_files; i++) {
+        if (indexd->files[i].path != NULL) {
+            drop_slot(indexd, i);
+        }
+    }
+    memset(indexd->table, 0, indexd->table_size * sizeof(uint32_t));
+    indexd->table_used = 0;
+    indexd->num_pending = 0;
+}
+
+static bool scan_root(struct indexd *indexd) {
+    indexd->root_wd = -1;
+    return scan_dir(indexd, "") && indexd->root_wd != -1;
+}
+
+/**************************************************************
+ * Index file
+ * ************************************************************/
+static void set_dirty(struct indexd *indexd) {
+    if (indexd->map != NULL && indexd->map->dirty == 0) {
+        __atomic_store_n(&indexd->map->dirty, 1, __ATOMIC_RELEASE);
+    }
+}
+
+static inline uint32_t trigram_rank(const struct indexd *indexd, uint32_t trigram) {
+    return indexd->rank[trigram >> 6] +
+           __builtin_popcountll(indexd->bits[trigram >> 6] & ((1ULL << (trigram & 63)) - 1));
+}
+
+/**
+* Read the pending files and write the index of every file to a new index
+* file, which then replaces the current one.
+*/
+static bool write_index(struct indexd *indexd) {
+    struct finder_index_header *header;
+    struct finder_index_trigram *table;
+    struct finder_index_file *files;
+    uint32_t *postings, *fill = NULL, id, t, num_trigrams = 0, num_files = 0;
+    uint64_t num_postings = 0, paths_len = 0, w, bits, off;
+    size_t i, j, len;
+    char tmp[PATH_MAX + 8], *paths;
+    void *map = MAP_FAILED;
+    bool ok = false;
+    int fd;
+
+    for (i = 0; i < indexd->num_pending; i++) {
+        if (indexd->files[indexd->pending[i]].pending) {
+            indexd->files[indexd->pending[i]].pending = false;
+            if (!read_file(indexd, indexd->pending[i])) {
+                return false;
+            }
+        }
+    }
+    indexd->num_pending = 0;
+
+    // Number the trigrams of all files in order, through a bit per trigram
+    for (i = 0; i < indexd->num_files; i++) {
+        if (indexd->files[i].path == NULL) {
+            continue;
+        }
+        num_files++;
+        paths_len += indexd->files[i].path_len + 1;
+        num_postings += indexd->files[i].num_trigrams;
+        for (j = 0; j < indexd->files[i].num_trigrams; j++) {
+            t = indexd->files[i].trigrams[j];
+            indexd->bits[t >> 6] |= 1ULL << (t & 63);
+        }
+    }
+    for (w = 0; w < TRIGRAM_BITS / 64; w++) {
+        indexd->rank[w] = num_trigrams;
+        num_trigrams += __builtin_popcountll(indexd->bits[w]);
+    }
+
+    header = NULL;
+    len = sizeof(*header) + num_trigrams * sizeof(*table);
+    off = len + num_postings * sizeof(uint32_t);
+    off = (off + 7) & ~7ULL;
+    len = off + num_files * sizeof(*files) + paths_len;
+
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", indexd->index_path);
+    if ((fd = mkostemp(tmp, O_CLOEXEC)) == -1) {
+        syslog(LOG_ERR, "Failed to create %s: %s", tmp, strerror(errno));
+        goto cleanup;
+    }
+    if (fchmod(fd, 0644) == -1 || ftruncate(fd, len) == -1 ||
+        (map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED ||
+        (fill = calloc(num_trigrams ? num_trigrams : 1, sizeof(uint32_t))) == NULL) {
+        syslog(LOG_ERR, "Failed to write %s: %s", tmp, strerror(errno));
+        close(fd);
+        unlink(tmp);
+        goto cleanup;
+    }
+    close(fd);
+
+    header = map;
+    header->magic = FINDER_INDEX_MAGIC;
+    header->version = FINDER_INDEX_VERSION;
+    header->pid = getpid();
+    header->dirty = 0;
+    header->num_trigrams = num_trigrams;
+    header->num_files = num_files;
+    header->num_postings = num_postings;
+    header->trigrams_off = sizeof(*header);
+    header->postings_off = header->trigrams_off + num_trigrams * sizeof(*table);
+    header->files_off = off;
+    header->paths_off = off + num_files * sizeof(*files);
+    memcpy(header->root, indexd->root, strlen(indexd->root) + 1);
+
+    table = (void *)((char *)map + header->trigrams_off);
+    postings = (void *)((char *)map + header->postings_off);
+    files = (void *)((char *)map + header->files_off);
+    paths = (char *)map + header->paths_off;
+
+    // Count the files of every trigram, then place the postings in file order
+    for (w = 0, t = 0; w < TRIGRAM_BITS / 64; w++) {
+        for (bits = indexd->bits[w]; bits != 0; bits &= bits - 1) {
+            table[t].trigram = w * 64 + __builtin_ctzll(bits);
+            table[t++].count = 0;
+        }
+    }
+    for (i = 0; i < indexd->num_files; i++) {
+        for (j = 0; j < indexd->files[i].num_trigrams; j++) {
+            table[trigram_rank(indexd, indexd->files[i].trigrams[j])].count++;
+        }
+    }
+    for (t = 0, off = 0; t < num_trigrams; t++) {
+        table[t].postings = off;
+        off += table[t].count;
+    }
+    for (i = 0, id = 0, off = 0; i < indexd->num_files; i++) {
+        if (indexd->files[i].path == NULL) {
+            continue;
+        }
+        for (j = 0; j < indexd->files[i].num_trigrams; j++) {
+            t = trigram_rank(indexd, indexd->files[i].trigrams[j]);
+            postings[table[t].postings + fill[t]++] = id;
+        }
+        files[id].path_off = off;
+        files[id].path_len = indexd->files[i].path_len;
+        files[id].reserved = 0;
+        memcpy(paths + off, indexd->files[i].path, indexd->files[i].path_len + 1);
+        off += indexd->files[i].path_len + 1;
+        id++;
+    }
+
+    if (rename(tmp, indexd->index_path) == -1) {
+        syslog(LOG_ERR, "Failed to rename %s: %s", tmp, strerror(errno));
+        unlink(tmp);
+        goto cleanup;
+    }
+    if (indexd->map != NULL) {
+        munmap(indexd->map, indexd->map_len);
+    }
+    indexd->map = map;
+    indexd->map_len = len;
+    map = MAP_FAILED;
+    ok = true;
+    syslog(LOG_DEBUG, "Indexed %u files, %u trigrams, %llu postings", num_files, num_trigrams,
+           (unsigned long long)num_postings);
+
+cleanup:
+    memset(indexd->bits, 0, TRIGRAM_BITS / 8);
+    if (map != MAP_FAILED) {
+        munmap(map, len);
+    }
+    free(fill);
+    return ok;
+}
+
+/**************************************************************
+ * Events
+ * ************************************************************/
+/**
+* Apply the events available on the inotify descriptor.
+* @return false if the index can no longer be kept current.
+*/
+static bool read_events(struct indexd *indexd, bool *changed) {
+    char buffer[EVENT_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *event;
+    uint64_t start;
+    char *path;
+    bool ok = true;
+    ssize_t n;
+    char *p;
+
+    for (;;) {
+        start = now_ns();
+        if ((n = read(indexd->inotify_fd, buffer, sizeof(buffer))) <= 0) {
+            break;
+        }
+        for (p = buffer; p < buffer + n; p += sizeof(struct inotify_event) + event->len) {
+            event = (const struct inotify_event *)p;
+            if (event->wd == indexd->sync_wd) {
+                continue;   // a reader waking us up
+            }
+            *changed = true;
+            set_dirty(indexd);
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                // Events were lost, start over
+                syslog(LOG_NOTICE, "Event queue overflow, rescanning %s", indexd->root);
+                drop_all(indexd);
+                if (!scan_root(indexd)) {
+                    return false;
+                }
+                continue;
+            }
+            if (event->wd < 0 || (size_t)event->wd >= indexd->dirs_cap ||
+                indexd->dirs[event->wd] == NULL) {
+                continue;   // a watch already dropped
+            }
+            if (event->mask & IN_IGNORED) {
+                free(indexd->dirs[event->wd]);
+                indexd->dirs[event->wd] = NULL;
+                if (event->wd == indexd->root_wd) {
+                    syslog(LOG_ERR, "%s is gone", indexd->root);
+                    return false;
+                }
+                continue;
+            }
+            if (event->wd == indexd->root_wd && (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF))) {
+                syslog(LOG_ERR, "%s was removed or moved", indexd->root);
+                return false;
+            }
+            if (event->len == 0) {
+                continue;
+            }
+
+            if ((path = join(indexd->dirs[event->wd], event->name)) == NULL) {
+                return false;
+            }
+            if (event->mask & IN_ISDIR) {
+                if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                    drop_dir(indexd, path);
+                } else if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                    ok = scan_dir(indexd, path);
+                }
+            } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                drop_file(indexd, path);
+            } else {
+                ok = touch_file(indexd, path);
+            }
+            free(path);
+            if (!ok) {
+                return false;
+            }
+        }
+    }
+    if (n == -1 && errno == EAGAIN) {
+        // Every event queued before start has been read
+        if (indexd->map != NULL) {
+            __atomic_store_n(&indexd->map->synced_ns, start, __ATOMIC_RELEASE);
+        }
+        return true;
+    }
+    return n != -1 || errno == EINTR;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [-d] <dir>\n"
+        "  -d  run as a daemon\n"
+        "Keeps an index of <dir> in %s which finder answers from.\n",
+        prog, FINDER_INDEX_DIR);
+}
+
+/**************************************************************
+ * ************************************************************/
+int main( int argc, char *argv[] ) {
+    struct indexd indexd;
+    struct sigaction new_action;
+    struct pollfd pfd;
+    size_t i;
+    uint64_t first_change = 0, last_change = 0, now;
+    bool run_as_daemon = false, changed = false;
+    int opt, fd, timeout, rc = 1;
+
+    while ((opt = getopt(argc, argv, "dh")) != -1) {
+        switch (opt) {
+            case 'd':
+                run_as_daemon = true;
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind + 1 != argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    openlog("finder-indexd", LOG_CONS | (run_as_daemon ? 0 : LOG_PERROR), LOG_USER);
+
+    memset(&indexd, 0, sizeof(indexd));
+    indexd.inotify_fd = -1;
+    indexd.sync_wd = -1;
+    if (realpath(argv[optind], indexd.root) == NULL || strlen(indexd.root) >= FINDER_INDEX_ROOT_MAX) {
+        syslog(LOG_ERR, "No valid directory specified");
+        return 1;
+    }
+    if ((mkdir(FINDER_INDEX_DIR, 0755) == -1 && errno != EEXIST) ||
+        finder_index_path(indexd.root, indexd.index_path, sizeof(indexd.index_path)) != 0) {
+        syslog(LOG_ERR, "Failed to create %s: %s", FINDER_INDEX_DIR, strerror(errno));
+        return 1;
+    }
+
+    memset(&new_action, 0, sizeof(struct sigaction));
+    new_action.sa_handler = signal_handler;
+    if (sigaction(SIGTERM, &new_action, NULL) != 0 || sigaction(SIGINT, &new_action, NULL) != 0) {
+        syslog(LOG_ERR, "Error (%s) registering signal handlers", strerror(errno));
+        return 1;
+    }
+
+    indexd.bits = calloc(TRIGRAM_BITS / 64, sizeof(uint64_t));
+    indexd.rank = calloc(TRIGRAM_BITS / 64, sizeof(uint32_t));
+    indexd.buffer = malloc(READ_SIZE);
+    if (indexd.bits == NULL || indexd.rank == NULL || indexd.buffer == NULL) {
+        syslog(LOG_ERR, "Out of memory");
+        goto cleanup;
+    }
+    if ((indexd.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+        syslog(LOG_ERR, "Failed to initialize inotify: %s", strerror(errno));
+        goto cleanup;
+    }
+    snprintf(indexd.sync_path, sizeof(indexd.sync_path), "%s%s", indexd.index_path,
+             FINDER_INDEX_SYNC_SUFFIX);
+    if ((fd = open(indexd.sync_path, O_RDONLY | O_CREAT | O_CLOEXEC, 0644)) == -1 ||
+        close(fd) == -1 ||
+        (indexd.sync_wd = inotify_add_watch(indexd.inotify_fd, indexd.sync_path, IN_OPEN)) == -1) {
+        syslog(LOG_ERR, "Failed to watch %s: %s", indexd.sync_path, strerror(errno));
+        goto cleanup;
+    }
+    // Walk the tree before forking so a tree too large to watch is reported
+    if (!scan_root(&indexd)) {
+        goto cleanup;
+    }
+
+    if (run_as_daemon) {
+        if (fork()) {
+            return 0;
+        }
+    }
+
+    // The index records the pid of the process keeping it current
+    changed = true;
+    rc = 0;
+    while (!ExitNow) {
+        if (changed) {
+            now = now_ms();
+            if (first_change == 0) {
+                first_change = now;
+            }
+            last_change = now;
+            changed = false;
+        }
+        timeout = -1;
+        if (first_change != 0) {
+            now = now_ms();
+            if (now >= last_change + QUIET_MS || now >= first_change + MAX_DELAY_MS) {
+                if (!write_index(&indexd)) {
+                    rc = 1;
+                    break;
+                }
+                first_change = 0;
+                continue;
+            }
+            timeout = (int)(last_change + QUIET_MS < first_change + MAX_DELAY_MS ?
+                            last_change + QUIET_MS - now : first_change + MAX_DELAY_MS - now);
+        }
+
+        pfd.fd = indexd.inotify_fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, timeout) == -1 && errno != EINTR) {
+            syslog(LOG_ERR, "poll failed: %s", strerror(errno));
+            rc = 1;
+            break;
+        }
+        if (!read_events(&indexd, &changed)) {
+            rc = 1;
+            break;
+        }
+    }
+
+    // Without this process the index would go stale
+    unlink(indexd.index_path);
+    unlink(indexd.sync_path);
+
+cleanup:
+    if (indexd.map != NULL) {
+        munmap(indexd.map, indexd.map_len);
+    }
+    if (indexd.inotify_fd != -1) {
+        close(indexd.inotify_fd);
+    }
+    for (i = 0; i < indexd.num_files; i++) {
+        free(indexd.files[i].path);
+        free(indexd.files[i].trigrams);
+    }
+    for (i = 0; i < indexd.dirs_cap; i++) {
+        free(indexd.dirs[i]);
+    }
+    free(indexd.files);
+    free(indexd.free_slots);
+    free(indexd.table);
+    free(indexd.pending);
+    free(indexd.dirs);
+    free(indexd.bits);
+    free(indexd.rank);
+    free(indexd.buffer);
+    closelog();
+    return rc;
+}
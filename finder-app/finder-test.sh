@@ -43,10 +43,12 @@ else
 	exit 1
 fi
 
+# All files are written by a single writer from a manifest of NUL separated
+# path and content pairs, instead of one writer process per file.
 for i in $( seq 1 $NUMFILES)
 do
-	writer "$WRITEDIR/${username}$i.txt" "$WRITESTR"
-done
+	printf '%s\0%s\0' "$WRITEDIR/${username}$i.txt" "$WRITESTR"
+done | writer -0 -m -
 
 OUTPUTSTRING=$(finder.sh "$WRITEDIR" "$WRITESTR")
 
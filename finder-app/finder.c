@@ -0,0 +1,451 @@
+/*
+ * finder.c
+ *
+ * Native replacement for the two grep -r passes of finder.sh.  Counts, in a
+ * single walk of a directory tree, the files containing a fixed string and
+ * the lines they contain it on, and prints them in the format of finder.sh:
+ *
+ *   The number of files are <files> and the number of matching lines are <lines>
+ *
+ * Directories and files are handed out to worker threads through a shared
+ * work queue.  Small files are read into a per thread buffer, large ones are
+ * mapped.  Matches are located with an SSE2 scan for the first and last byte
+ * of the string where available and memmem() otherwise.
+ *
+ * When finder-indexd keeps a current index of the tree, only the files the
+ * index names as candidates are searched, see finder-index.h.
+ *
+ * The counts follow GNU grep -r: symbolic links met during the walk are not
+ * followed, and a file with a NUL byte is binary.  A matching binary file
+ * counts as a matching file without matching lines, as grep 3.5 and later
+ * only report it on stderr.
+ */
+
+#define _GNU_SOURCE    // memmem
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "finder-index.h"
+
+// Defines
+#define READ_BUFFER_SIZE    (256 * 1024)    // larger files are mapped instead of read
+#define MAX_THREADS         64
+
+// Types
+enum work_type {
+    WORK_DIR,
+    WORK_FILE,
+};
+
+struct work {
+    enum work_type type;
+    struct work *next;
+    char path[];
+};
+
+struct finder {
+    const char *dir;
+    const char *needle;
+    size_t needle_len;
+    bool queue_failed;          // a candidate of the index could not be queued
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct work *queue;         // LIFO, so the walk stays depth first
+    int busy;                   // workers holding an item, which may queue more
+
+    uint64_t files;             // totals, under mutex
+    uint64_t lines;
+};
+
+struct worker {
+    pthread_t thread;
+    struct finder *finder;
+    char *buffer;
+    uint64_t files;
+    uint64_t lines;
+};
+
+/**************************************************************
+ * Search
+ * ************************************************************/
+#if defined(__SSE2__)
+/**
+* Find @param needle of @param m bytes in @param hay of @param n bytes.
+* Compares the first and last byte of the needle against 16 positions at once
+* and only checks the bytes in between for positions where both match.
+*/
+static const char *find(const char *hay, size_t n, const char *needle, size_t m) {
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[m - 1]);
+    const char *found;
+    __m128i block_first, block_last;
+    unsigned mask;
+    size_t i = 0;
+    int bit;
+
+    if (m == 1) {
+        return memchr(hay, needle[0], n);
+    }
+    if (n < m) {
+        return NULL;
+    }
+
+    for (; i + m - 1 + 16 <= n; i += 16) {
+        block_first = _mm_loadu_si128((const __m128i *)(hay + i));
+        block_last = _mm_loadu_si128((const __m128i *)(hay + i + m - 1));
+        mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first),
+                                               _mm_cmpeq_epi8(block_last, last)));
+        while (mask != 0) {
+            bit = __builtin_ctz(mask);
+            if (memcmp(hay + i + bit + 1, needle + 1, m - 2) == 0) {
+                return hay + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+
+    // Fewer than 16 candidate positions left
+    found = memmem(hay + i, n - i, needle, m);
+    return found;
+}
+#else
+static const char *find(const char *hay, size_t n, const char *needle, size_t m) {
+    return memmem(hay, n, needle, m);
+}
+#endif
+
+/**
+* Count the lines of @param data containing the needle of @param finder.
+* @param binary is set when @param data matches and has a NUL byte.
+*/
+static uint64_t count_lines(const struct finder *finder, const char *data, size_t len,
+                            bool *binary) {
+    const char *pos = data, *end = data + len, *match, *eol;
+    uint64_t lines = 0;
+
+    while (pos < end &&
+           (match = find(pos, end - pos, finder->needle, finder->needle_len)) != NULL) {
+        lines++;
+        // Further matches on the same line do not count
+        eol = memchr(match + finder->needle_len, '\n', end - match - finder->needle_len);
+        if (eol == NULL) {
+            break;
+        }
+        pos = eol + 1;
+    }
+    *binary = lines > 0 && memchr(data, '\0', len) != NULL;
+    return *binary ? 0 : lines;
+}
+
+static void search_file(struct worker *worker, const char *path) {
+    struct stat st;
+    const char *data;
+    void *map = NULL;
+    ssize_t n;
+    size_t len = 0;
+    uint64_t lines;
+    bool binary;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC | O_NOCTTY)) == -1) {
+        fprintf(stderr, "finder: %s: %s\n", path, strerror(errno));
+        return;
+    }
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return;
+    }
+
+    if (st.st_size > READ_BUFFER_SIZE) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "finder: %s: %s\n", path, strerror(errno));
+            close(fd);
+            return;
+        }
+        (void)madvise(map, st.st_size, MADV_SEQUENTIAL);
+        data = map;
+        len = st.st_size;
+    } else {
+        // Read until EOF, the size may have changed since fstat()
+        while (len < READ_BUFFER_SIZE &&
+               (n = read(fd, worker->buffer + len, READ_BUFFER_SIZE - len)) != 0) {
+            if (n == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                fprintf(stderr, "finder: %s: %s\n", path, strerror(errno));
+                close(fd);
+                return;
+            }
+            len += n;
+        }
+        data = worker->buffer;
+    }
+    close(fd);
+
+    lines = count_lines(worker->finder, data, len, &binary);
+    if (lines > 0 || binary) {
+        worker->files++;
+        worker->lines += lines;
+    }
+
+    if (map != NULL) {
+        munmap(map, st.st_size);
+    }
+}
+
+/**************************************************************
+ * Work queue
+ * ************************************************************/
+static struct work *work_create(enum work_type type, const char *dir, const char *name) {
+    size_t dir_len = strlen(dir), name_len = name ? strlen(name) : 0;
+    struct work *work = malloc(sizeof(struct work) + dir_len + name_len + 2);
+
+    if (work == NULL) {
+        return NULL;
+    }
+    work->type = type;
+    memcpy(work->path, dir, dir_len);
+    if (name != NULL) {
+        if (dir_len == 0 || dir[dir_len - 1] != '/') {
+            work->path[dir_len++] = '/';
+        }
+        memcpy(work->path + dir_len, name, name_len);
+    }
+    work->path[dir_len + name_len] = '\0';
+    return work;
+}
+
+/**
+* Queue the subdirectories and regular files of @param path, all at once.
+*/
+static void list_dir(struct finder *finder, const char *path) {
+    struct work *head = NULL, *tail = NULL, *work;
+    struct dirent *entry;
+    struct stat st;
+    enum work_type type;
+    DIR *dir;
+
+    if ((dir = opendir(path)) == NULL) {
+        fprintf(stderr, "finder: %s: %s\n", path, strerror(errno));
+        return;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        if (entry->d_type == DT_UNKNOWN) {
+            // Some filesystems leave the type to stat
+            if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+                continue;
+            }
+            entry->d_type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_LNK;
+        }
+        if (entry->d_type == DT_DIR) {
+            type = WORK_DIR;
+        } else if (entry->d_type == DT_REG) {
+            type = WORK_FILE;
+        } else {
+            continue;   // links, devices, fifos and sockets are skipped like grep -r
+        }
+
+        if ((work = work_create(type, path, entry->d_name)) == NULL) {
+            fprintf(stderr, "finder: out of memory\n");
+            break;
+        }
+        work->next = NULL;
+        if (tail == NULL) {
+            head = work;
+        } else {
+            tail->next = work;
+        }
+        tail = work;
+    }
+    closedir(dir);
+
+    if (head != NULL) {
+        pthread_mutex_lock(&finder->mutex);
+        tail->next = finder->queue;
+        finder->queue = head;
+        pthread_cond_broadcast(&finder->cond);
+        pthread_mutex_unlock(&finder->mutex);
+    }
+}
+
+/**
+* Queue a candidate file of the index, before the workers start.
+*/
+static void queue_candidate(const char *rel_path, size_t len, void *ctx) {
+    struct finder *finder = ctx;
+    struct work *work;
+
+    (void)len;
+    if ((work = work_create(WORK_FILE, finder->dir, rel_path)) == NULL) {
+        finder->queue_failed = true;
+        return;
+    }
+    work->next = finder->queue;
+    finder->queue = work;
+}
+
+static void *worker_thread(void *arg) {
+    struct worker *worker = arg;
+    struct finder *finder = worker->finder;
+    struct work *work;
+
+    for (;;) {
+        pthread_mutex_lock(&finder->mutex);
+        while (finder->queue == NULL && finder->busy > 0) {
+            pthread_cond_wait(&finder->cond, &finder->mutex);
+        }
+        if (finder->queue == NULL) {
+            // Nothing queued and nobody left who could queue more
+            pthread_mutex_unlock(&finder->mutex);
+            break;
+        }
+        work = finder->queue;
+        finder->queue = work->next;
+        finder->busy++;
+        pthread_mutex_unlock(&finder->mutex);
+
+        if (work->type == WORK_DIR) {
+            list_dir(finder, work->path);
+        } else {
+            search_file(worker, work->path);
+        }
+        free(work);
+
+        pthread_mutex_lock(&finder->mutex);
+        if (--finder->busy == 0 && finder->queue == NULL) {
+            pthread_cond_broadcast(&finder->cond);
+        }
+        pthread_mutex_unlock(&finder->mutex);
+    }
+
+    pthread_mutex_lock(&finder->mutex);
+    finder->files += worker->files;
+    finder->lines += worker->lines;
+    pthread_mutex_unlock(&finder->mutex);
+    return NULL;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [-j threads] [-S] <dir> <string>\n"
+        "  -j threads  worker threads, default one per online cpu\n"
+        "  -S          scan the tree even if finder-indexd keeps an index of it\n",
+        prog);
+}
+
+/**************************************************************
+ * ************************************************************/
+int main( int argc, char *argv[] ) {
+    struct finder finder;
+    struct worker *workers;
+    struct work *work;
+    struct stat st;
+    long num_threads = 0;
+    bool scan = false;
+    int opt, i, started;
+
+    while ((opt = getopt(argc, argv, "j:Sh")) != -1) {
+        switch (opt) {
+            case 'j':
+                num_threads = atol(optarg);
+                break;
+            case 'S':
+                scan = true;
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (optind + 2 != argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (argv[optind + 1][0] == '\0') {
+        printf("No search string specified.\n");
+        return 1;
+    }
+    if (stat(argv[optind], &st) != 0 || !S_ISDIR(st.st_mode)) {
+        printf("No valid directory specified\n");
+        return 1;
+    }
+
+    if (num_threads <= 0) {
+        num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (num_threads < 1) {
+        num_threads = 1;
+    } else if (num_threads > MAX_THREADS) {
+        num_threads = MAX_THREADS;
+    }
+
+    memset(&finder, 0, sizeof(finder));
+    finder.dir = argv[optind];
+    finder.needle = argv[optind + 1];
+    finder.needle_len = strlen(finder.needle);
+    pthread_mutex_init(&finder.mutex, NULL);
+    pthread_cond_init(&finder.cond, NULL);
+
+    // Search only the candidates of a current index, the whole tree otherwise
+    if (scan || finder_index_query(finder.dir, finder.needle, queue_candidate, &finder) < 0 ||
+        finder.queue_failed) {
+        while ((work = finder.queue) != NULL) {
+            finder.queue = work->next;
+            free(work);
+        }
+        if ((finder.queue = work_create(WORK_DIR, finder.dir, NULL)) == NULL) {
+            return 1;
+        }
+        finder.queue->next = NULL;
+    }
+
+    workers = calloc(num_threads, sizeof(struct worker));
+    if (workers == NULL) {
+        return 1;
+    }
+    for (started = 0; started < num_threads; started++) {
+        workers[started].finder = &finder;
+        if ((workers[started].buffer = malloc(READ_BUFFER_SIZE)) == NULL ||
+            pthread_create(&workers[started].thread, NULL, worker_thread, &workers[started]) != 0) {
+            free(workers[started].buffer);
+            break;
+        }
+    }
+    if (started == 0) {
+        fprintf(stderr, "finder: failed to start a worker thread\n");
+        return 1;
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+        free(workers[i].buffer);
+    }
+    free(workers);
+
+    printf("The number of files are %llu and the number of matching lines are %llu\n",
+           (unsigned long long)finder.files, (unsigned long long)finder.lines);
+
+    pthread_mutex_destroy(&finder.mutex);
+    pthread_cond_destroy(&finder.cond);
+    return 0;
+}
@@ -15,6 +15,21 @@ if [ ! -d "$1" ]; then
     exit 1
 fi
 
+# Count with the native finder in a single pass when it is installed next to
+# this script or on the PATH.  It searches for a fixed string, so patterns
+# using regular expression characters are still left to grep.
+case "$2" in
+    *[][.*^$\\]*)
+        ;;
+    *)
+        for finder in "$(dirname "$0")/finder" "$(command -v finder)"; do
+            if [ -n "$finder" ] && [ -x "$finder" ] && [ ! -d "$finder" ]; then
+                exec "$finder" "$1" "$2"
+            fi
+        done
+        ;;
+esac
+
 numLines=$(grep -r $2 $1 | wc -l)
 numFiles=$(grep -rl $2 $1 | wc -l)
 
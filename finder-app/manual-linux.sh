@@ -100,7 +100,7 @@ make CROSS_COMPILE=${CROSS_COMPILE} all
 
 # TODO: Copy the finder related scripts and executables to the /home directory
 # on the target rootfs
-cp writer finder.sh finder-test.sh autorun-qemu.sh start-qemu-app.sh start-qemu-terminal.sh ${OUTDIR}/rootfs/home/
+cp writer finder finder-indexd finder.sh finder-test.sh autorun-qemu.sh start-qemu-app.sh start-qemu-terminal.sh ${OUTDIR}/rootfs/home/
 mkdir ${OUTDIR}/rootfs/conf
 cp ./conf/assignment.txt ${OUTDIR}/rootfs/conf/
 mkdir ${OUTDIR}/rootfs/home/conf
@@ -1,15 +1,379 @@
+#define _GNU_SOURCE    // getdelim
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
 #include <syslog.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/types.h>
 
 // DEFINES
+#define DEFAULT_THREADS 4
+#define MAX_THREADS     64
 
 // TYPES
+struct manifest_entry {
+    char *path;
+    char *content;
+    size_t content_len;
+};
+
+struct batch {
+    struct manifest_entry *entries;
+    size_t count;
+    atomic_size_t next;         // next entry to write
+    atomic_size_t failed;
+    bool sync;                  // fsync every file
+};
 
 // File Private Vars
 
 // File Private Functions Prototypes
+static void usage(const char *prog);
+
+/**************************************************************
+ * Create the directories leading to @param path, like mkdir -p
+ * on its dirname.
+ * ************************************************************/
+static int make_parents(const char *path) {
+    char *dir = strdup(path);
+    char *slash;
+    int rc = 0;
+
+    if (dir == NULL) {
+        return -1;
+    }
+    // Each component is created in turn, another thread may have made it first
+    for (slash = strchr(dir + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+            rc = -1;
+            break;
+        }
+        *slash = '/';
+    }
+    free(dir);
+    return rc;
+}
+
+/**************************************************************
+ * Write @param len bytes of @param content to @param path,
+ * replacing it, and fsync it when @param sync is set.
+ * ************************************************************/
+static int write_file(const char *path, const char *content, size_t len, bool sync) {
+    ssize_t n;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd == -1 && errno == ENOENT) {
+        if (make_parents(path) != 0) {
+            return -1;
+        }
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+    if (fd == -1) {
+        return -1;
+    }
+
+    while (len > 0) {
+        n = write(fd, content, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            close(fd);
+            return -1;
+        }
+        content += n;
+        len -= n;
+    }
+
+    if (sync && fsync(fd) != 0) {
+        close(fd);
+        return -1;
+    }
+    return close(fd);
+}
+
+/**************************************************************
+ * fsync the directory @param path so the entries created in it
+ * are durable.
+ * ************************************************************/
+static int sync_dir(const char *path) {
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int rc;
+
+    if (fd == -1) {
+        return -1;
+    }
+    rc = fsync(fd);
+    close(fd);
+    return rc;
+}
+
+/**************************************************************
+ * Decode the backslash escapes \n, \t and \\ of @param s in place.
+ * @return the decoded length.
+ * ************************************************************/
+static size_t unescape(char *s) {
+    char *in = s, *out = s;
+
+    while (*in != '\0') {
+        if (in[0] == '\\' && in[1] != '\0') {
+            switch (in[1]) {
+                case 'n':
+                    *out++ = '\n';
+                    break;
+                case 't':
+                    *out++ = '\t';
+                    break;
+                default:
+                    *out++ = in[1];
+                    break;
+            }
+            in += 2;
+        } else {
+            *out++ = *in++;
+        }
+    }
+    *out = '\0';
+    return out - s;
+}
+
+/**************************************************************
+ * Read the manifest from @param fp.  Entries are lines of the
+ * form path<TAB>content, with \n, \t and \\ escapes in the
+ * content, or with @param nul_separated alternating NUL
+ * terminated paths and contents taken verbatim.
+ * @return 0 on success, -1 on a malformed manifest.
+ * ************************************************************/
+static int read_manifest(FILE *fp, bool nul_separated, struct batch *batch) {
+    struct manifest_entry *entries = NULL, *grown;
+    size_t count = 0, capacity = 0, line_cap = 0, lineno = 0;
+    char *line = NULL, *tab, *path = NULL;
+    ssize_t len;
+    int rc = 0;
+
+    while ((len = getdelim(&line, &line_cap, nul_separated ? '\0' : '\n', fp)) != -1) {
+        lineno++;
+        if (!nul_separated) {
+            if (len > 0 && line[len - 1] == '\n') {
+                line[--len] = '\0';
+            }
+            if (len == 0) {
+                continue;
+            }
+        }
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            if ((grown = realloc(entries, capacity * sizeof(struct manifest_entry))) == NULL) {
+                rc = -1;
+                break;
+            }
+            entries = grown;
+        }
+
+        if (nul_separated) {
+            // Paths and contents alternate
+            if (path == NULL) {
+                path = strdup(line);
+                continue;
+            }
+            entries[count].path = path;
+            entries[count].content = malloc(len);
+            if (entries[count].content == NULL) {
+                rc = -1;
+                break;
+            }
+            // getdelim() counts the NUL delimiter, except on the last record
+            entries[count].content_len = (len > 0 && line[len - 1] == '\0') ? len - 1 : len;
+            memcpy(entries[count].content, line, entries[count].content_len);
+            path = NULL;
+        } else {
+            if ((tab = strchr(line, '\t')) == NULL) {
+                syslog(LOG_ERR, "Manifest line %zu has no tab between path and content", lineno);
+                rc = -1;
+                break;
+            }
+            *tab = '\0';
+            entries[count].path = strdup(line);
+            entries[count].content = strdup(tab + 1);
+            if (entries[count].path == NULL || entries[count].content == NULL) {
+                rc = -1;
+                break;
+            }
+            entries[count].content_len = unescape(entries[count].content);
+        }
+        count++;
+    }
+    if (path != NULL) {
+        syslog(LOG_ERR, "Manifest ends with path %s without content", path);
+        free(path);
+        rc = -1;
+    }
+    free(line);
+
+    batch->entries = entries;
+    batch->count = count;
+    return rc;
+}
+
+static void *batch_thread(void *arg) {
+    struct batch *batch = arg;
+    struct manifest_entry *entry;
+    size_t i;
+
+    while ((i = atomic_fetch_add(&batch->next, 1)) < batch->count) {
+        entry = &batch->entries[i];
+        if (write_file(entry->path, entry->content, entry->content_len, batch->sync) != 0) {
+            syslog(LOG_ERR, "Error writing file %s: %s", entry->path, strerror(errno));
+            atomic_fetch_add(&batch->failed, 1);
+        }
+    }
+    return NULL;
+}
+
+static int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/**************************************************************
+ * Append a copy of @param dir to the array @param dirs.
+ * ************************************************************/
+static int add_dir(char ***dirs, size_t *count, size_t *capacity, const char *dir) {
+    char **grown;
+
+    if (*count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        if ((grown = realloc(*dirs, *capacity * sizeof(char *))) == NULL) {
+            return -1;
+        }
+        *dirs = grown;
+    }
+    if (((*dirs)[*count] = strdup(dir)) == NULL) {
+        return -1;
+    }
+    (*count)++;
+    return 0;
+}
+
+/**************************************************************
+ * fsync every directory holding one of the files of @param batch,
+ * and the directories above them which may have been created.
+ * ************************************************************/
+static int sync_parents(struct batch *batch) {
+    char **dirs = NULL, *dir, *slash;
+    size_t count = 0, capacity = 0, i;
+    int rc = 0;
+
+    for (i = 0; i < batch->count && rc == 0; i++) {
+        if ((dir = strdup(batch->entries[i].path)) == NULL) {
+            rc = -1;
+            break;
+        }
+        if (strchr(dir, '/') == NULL) {
+            rc = add_dir(&dirs, &count, &capacity, ".");
+        }
+        // Every ancestor of the file
+        while (rc == 0 && (slash = strrchr(dir, '/')) != NULL) {
+            *slash = '\0';
+            rc = add_dir(&dirs, &count, &capacity, slash == dir ? "/" : dir);
+        }
+        free(dir);
+    }
+
+    qsort(dirs, count, sizeof(char *), compare_strings);
+    for (i = 0; i < count; i++) {
+        if ((i == 0 || strcmp(dirs[i], dirs[i - 1]) != 0) && sync_dir(dirs[i]) != 0) {
+            syslog(LOG_ERR, "Error syncing directory %s: %s", dirs[i], strerror(errno));
+            rc = -1;
+        }
+    }
+    for (i = 0; i < count; i++) {
+        free(dirs[i]);
+    }
+    free(dirs);
+    return rc;
+}
+
+/**************************************************************
+ * Write every file of the manifest @param manifest ("-" for stdin)
+ * from @param num_threads threads.
+ * ************************************************************/
+static int run_batch(const char *manifest, bool nul_separated, int num_threads, bool sync) {
+    struct batch batch;
+    pthread_t threads[MAX_THREADS];
+    FILE *fp;
+    size_t i;
+    int started, rc = 0;
+
+    memset(&batch, 0, sizeof(batch));
+    batch.sync = sync;
+
+    fp = strcmp(manifest, "-") == 0 ? stdin : fopen(manifest, "r");
+    if (fp == NULL) {
+        syslog(LOG_ERR, "Error opening manifest %s: %s", manifest, strerror(errno));
+        return 1;
+    }
+    if (read_manifest(fp, nul_separated, &batch) != 0) {
+        rc = 1;
+        goto cleanup;
+    }
+
+    if ((size_t)num_threads > batch.count) {
+        num_threads = batch.count > 0 ? (int)batch.count : 1;
+    }
+    for (started = 0; started < num_threads; started++) {
+        if (pthread_create(&threads[started], NULL, batch_thread, &batch) != 0) {
+            break;
+        }
+    }
+    if (started == 0) {
+        // Write from this thread instead
+        batch_thread(&batch);
+    }
+    for (i = 0; i < (size_t)started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    if (atomic_load(&batch.failed) != 0) {
+        rc = 1;
+    }
+    if (sync && sync_parents(&batch) != 0) {
+        rc = 1;
+    }
+    syslog(LOG_DEBUG, "Wrote %zu of %zu files from %s", batch.count - atomic_load(&batch.failed),
+           batch.count, manifest);
+
+cleanup:
+    for (i = 0; i < batch.count; i++) {
+        free(batch.entries[i].path);
+        free(batch.entries[i].content);
+    }
+    free(batch.entries);
+    if (fp != stdin) {
+        fclose(fp);
+    }
+    return rc;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [-s] <file> <string>\n"
+        "       %s [-s] [-0] [-j threads] -m <manifest>\n"
+        "  -m manifest  write every file listed in manifest, - for stdin.  Each line\n"
+        "               is a path, a tab and the content, with \\n, \\t and \\\\\n"
+        "               escapes.  Parent directories are created\n"
+        "  -0           the manifest alternates NUL terminated paths and contents\n"
+        "  -j threads   threads writing the manifest files (default %d)\n"
+        "  -s           fsync the files, and with -m their directories, before exiting\n",
+        prog, prog, DEFAULT_THREADS);
+}
 
 /**************************************************************
  * ************************************************************/
@@ -17,17 +381,54 @@ int main( int argc, char *argv[] ) {
     FILE *fp;
     char *fileName;
     char *stringToWrite;
+    const char *manifest = NULL;
+    bool nul_separated = false, sync = false;
+    int num_threads = DEFAULT_THREADS;
+    int opt, rc;
 
     openlog("writer", LOG_CONS, LOG_USER);
 
-    if( argc != 3) {
+    // Stop at the first operand, the string to write may start with a dash
+    while ((opt = getopt(argc, argv, "+m:0j:sh")) != -1) {
+        switch (opt) {
+            case 'm':
+                manifest = optarg;
+                break;
+            case '0':
+                nul_separated = true;
+                break;
+            case 'j':
+                num_threads = atoi(optarg);
+                if (num_threads < 1) {
+                    num_threads = 1;
+                } else if (num_threads > MAX_THREADS) {
+                    num_threads = MAX_THREADS;
+                }
+                break;
+            case 's':
+                sync = true;
+                break;
+            default:
+                usage(argv[0]);
+                closelog();
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (manifest != NULL) {
+        rc = run_batch(manifest, nul_separated, num_threads, sync);
+        closelog();
+        return rc;
+    }
+
+    if( argc - optind != 2) {
         syslog(LOG_ERR, "Incorrect number of arguments. Should include file to write and string to write to file.");
         closelog();
         return 1;
     }
 
-    fileName = argv[1];
-    stringToWrite = argv[2];
+    fileName = argv[optind];
+    stringToWrite = argv[optind + 1];
 
     // Attempt to open the specified file with overwriting.
     fp = fopen(fileName, "w+");
@@ -47,8 +448,15 @@ int main( int argc, char *argv[] ) {
 
     syslog(LOG_DEBUG, "Writing %s to %s", stringToWrite, fileName);
 
+    if (sync && (fflush(fp) == EOF || fsync(fileno(fp)) != 0)) {
+        syslog(LOG_ERR, "Failed to sync file %s: %s", fileName, strerror(errno));
+        fclose(fp);
+        closelog();
+        return 1;
+    }
+
     fclose(fp);
     closelog();
-    
+
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,253 @@
+/*
+ * aesdsocket-commit.c
+ *
+ * Group-commit appender.  Instead of every connection taking file_mutex for
+ * its own append, connections queue their completed packet and block while a
+ * single committer thread drains the queue: every batch is appended with one
+ * write callback (one writev() on the storage) and, depending on the
+ * durability policy, one fdatasync().  The waiting connections are completed
+ * together once their batch is done and then build their reply as usual.
+ *
+ * The queue is a multi-producer lock-free ring, and every connection parks on
+ * a futex in its own request, so queueing and completing a packet take no
+ * lock and the committer only wakes the connections of its batch.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include "aesdsocket-commit.h"
+#include "aesdsocket-logger.h"
+#include "../examples/threading/lf-ring.h"
+
+// Defines
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+#define COMMIT_MAX_BATCH    IOV_MAX
+#define COMMIT_QUEUE_SIZE   (2 * COMMIT_MAX_BATCH)
+
+// Types
+enum commit_state {
+    REQUEST_QUEUED,
+    REQUEST_PARKED,             // its connection sleeps on the state futex
+    REQUEST_DONE,
+};
+
+struct commit_request {
+    const char *buf;
+    size_t len;
+    void *arg;
+    int status;
+    atomic_uint state;
+};
+
+// File Private Vars
+static pthread_t CommitThread;
+static struct lf_ring *Queue;
+static struct commit_config Config;
+static struct commit_ops Ops;
+static void *OpsCtx;
+static bool Running;
+static unsigned long long BatchCount;
+static unsigned long long PacketCount;
+
+/********************************************************************
+*********************************************************************/
+static long long now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/********************************************************************
+How long the committer may wait for queued work, -1 for no limit.  With
+an interval policy and unsynced data the wait is bounded by the next sync
+deadline, 0 when it has passed.
+*********************************************************************/
+static int work_timeout_ms(bool dirty, long long last_sync_ms) {
+    long long wake_ms;
+
+    if (!dirty || Config.durability != COMMIT_SYNC_INTERVAL) {
+        return -1;
+    }
+    wake_ms = last_sync_ms + Config.interval_ms - now_ms();
+    return wake_ms > 0 ? (int)wake_ms : 0;
+}
+
+/********************************************************************
+Hand @param status to the connection of @param req and wake it if it
+sleeps.  req may be gone as soon as its state is REQUEST_DONE.
+*********************************************************************/
+static void complete_request(struct commit_request *req, int status) {
+    atomic_uint *state = &req->state;
+
+    req->status = status;
+    if (atomic_exchange(state, REQUEST_DONE) == REQUEST_PARKED) {
+        (void)syscall(SYS_futex, state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+/*************************************************************************
+ * ***********************************************************************/
+static void* commit_thread(void* thread_param) {
+    struct commit_request *batch[COMMIT_MAX_BATCH];
+    struct iovec iov[COMMIT_MAX_BATCH];
+    void *args[COMMIT_MAX_BATCH];
+    long long last_sync_ms = now_ms();
+    bool dirty = false;
+    bool stopping;
+    int n, i, rc, timeout_ms;
+
+    (void)thread_param;
+
+    while (1) {
+        // Take up to one writev worth of packets, all of them before stopping
+        stopping = lf_ring_closed(Queue);
+        n = (int)lf_ring_dequeue(Queue, (void **)batch, COMMIT_MAX_BATCH);
+        if (n == 0) {
+            if (stopping) {
+                break;
+            }
+            if ((timeout_ms = work_timeout_ms(dirty, last_sync_ms)) != 0) {
+                (void)lf_ring_wait(Queue, timeout_ms);
+                continue;
+            }
+        }
+        for (i = 0; i < n; i++) {
+            iov[i].iov_base = (void *)batch[i]->buf;
+            iov[i].iov_len = batch[i]->len;
+            args[i] = batch[i]->arg;
+        }
+
+        rc = 0;
+        if (n > 0) {
+            rc = Ops.write(iov, args, n, OpsCtx);
+            dirty = true;
+        }
+
+        if (Config.durability == COMMIT_SYNC_BATCH ||
+            (Config.durability == COMMIT_SYNC_INTERVAL && dirty &&
+             now_ms() - last_sync_ms >= Config.interval_ms)) {
+            if (rc == 0 && Ops.sync(OpsCtx) != 0 && Config.durability == COMMIT_SYNC_BATCH) {
+                rc = -1;
+            }
+            last_sync_ms = now_ms();
+            dirty = false;
+        }
+
+        for (i = 0; i < n; i++) {
+            complete_request(batch[i], rc);
+        }
+        if (n > 0) {
+            BatchCount++;
+            PacketCount += n;
+        }
+    }
+
+    if (dirty && Config.durability != COMMIT_SYNC_NONE) {
+        (void)Ops.sync(OpsCtx);
+    }
+
+    return NULL;
+}
+
+/********************************************************************
+See aesdsocket-commit.h
+*********************************************************************/
+int commit_start(const struct commit_config *config, const struct commit_ops *ops, void *ctx) {
+    int rv;
+
+    Config = *config;
+    Ops = *ops;
+    OpsCtx = ctx;
+
+    if ((Queue = lf_ring_create(COMMIT_QUEUE_SIZE, LF_RING_MP)) == NULL) {
+        AESD_LOG(LOG_ERR, "Failed to allocate the commit queue: %s", strerror(errno));
+        return -1;
+    }
+    if ((rv = pthread_create(&CommitThread, NULL, commit_thread, NULL)) != 0) {
+        AESD_LOG(LOG_ERR, "Failed to start committer thread: %s", strerror(rv));
+        lf_ring_destroy(Queue);
+        Queue = NULL;
+        return -1;
+    }
+    Running = true;
+    return 0;
+}
+
+int commit_append(const char *buf, size_t len, void *arg) {
+    struct commit_request req = { .buf = buf, .len = len, .arg = arg, .status = -1 };
+    struct commit_request *reqp = &req;
+    unsigned state = REQUEST_QUEUED;
+
+    if (!Running) {
+        return -1;
+    }
+    atomic_init(&req.state, REQUEST_QUEUED);
+    while (lf_ring_enqueue(Queue, (void *const *)&reqp, 1) == 0) {
+        if (lf_ring_closed(Queue)) {
+            return -1;
+        }
+        // The committer is a whole queue behind
+        (void)lf_ring_wait_room(Queue, 1, -1);
+    }
+
+    // Park until complete_request(), unless it already ran
+    if (atomic_compare_exchange_strong(&req.state, &state, REQUEST_PARKED)) {
+        while ((state = atomic_load(&req.state)) == REQUEST_PARKED) {
+            (void)syscall(SYS_futex, &req.state, FUTEX_WAIT_PRIVATE, REQUEST_PARKED, NULL, NULL, 0);
+        }
+    }
+
+    return req.status;
+}
+
+void commit_stop(void) {
+    if (!Running) {
+        return;
+    }
+
+    // The committer drains what is queued, then exits
+    lf_ring_close(Queue);
+    pthread_join(CommitThread, NULL);
+    lf_ring_destroy(Queue);
+    Queue = NULL;
+    Running = false;
+
+    AESD_LOG(LOG_INFO, "Group commit wrote %llu packets in %llu batches", PacketCount, BatchCount);
+}
+
+int commit_parse_durability(const char *arg, struct commit_config *config) {
+    char *end;
+    long ms;
+
+    if (strcmp(arg, "none") == 0) {
+        config->durability = COMMIT_SYNC_NONE;
+        return 0;
+    }
+    if (strcmp(arg, "batch") == 0) {
+        config->durability = COMMIT_SYNC_BATCH;
+        return 0;
+    }
+
+    ms = strtol(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || ms <= 0 || ms > INT_MAX) {
+        return -1;
+    }
+    config->durability = COMMIT_SYNC_INTERVAL;
+    config->interval_ms = (int)ms;
+    return 0;
+}
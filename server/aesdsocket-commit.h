@@ -0,0 +1,61 @@
+/*
+ * aesdsocket-commit.h
+ *
+ * Group-commit appender for aesdsocket, selected with -g.
+ */
+
+#ifndef AESDSOCKET_COMMIT_H
+#define AESDSOCKET_COMMIT_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+enum commit_durability {
+    COMMIT_SYNC_NONE,       // never sync, leave it to the kernel
+    COMMIT_SYNC_BATCH,      // fdatasync after every batch, before completing it
+    COMMIT_SYNC_INTERVAL,   // complete after the write, sync at most every interval_ms
+};
+
+struct commit_config {
+    enum commit_durability durability;
+    int interval_ms;
+};
+
+/**
+* Storage callbacks run by the committer thread.  write appends @param iovcnt
+* complete packets in one call and returns 0 on success, it may modify @param iov
+* while handling short writes.  @param args holds the arg given to commit_append()
+* with each packet.  sync makes the appended data durable.  Both must take
+* whatever lock protects the storage.
+*/
+struct commit_ops {
+    int (*write)(struct iovec *iov, void **args, int iovcnt, void *ctx);
+    int (*sync)(void *ctx);
+};
+
+/**
+* Start the committer thread.
+* @return 0 on success, -1 on failure.
+*/
+int commit_start(const struct commit_config *config, const struct commit_ops *ops, void *ctx);
+
+/**
+* Queue @param len bytes at @param buf for the next batch and wait until the
+* batch has been written (and synced, with COMMIT_SYNC_BATCH).  @param arg is
+* passed to the write callback along with the packet.
+* @return 0 when committed, -1 when the batch write failed or the committer stopped.
+*/
+int commit_append(const char *buf, size_t len, void *arg);
+
+/**
+* Commit whatever is still queued, then stop and join the committer thread.
+*/
+void commit_stop(void);
+
+/**
+* Parse a durability policy: "none", "batch" or a sync interval in milliseconds.
+* @return 0 on success, -1 if @param arg is not a valid policy.
+*/
+int commit_parse_durability(const char *arg, struct commit_config *config);
+
+#endif /* AESDSOCKET_COMMIT_H */
@@ -0,0 +1,179 @@
+/*
+ * aesdsocket-filestore.c
+ *
+ * Memory mapped data file for the file backend.
+ *
+ * The file is kept mapped and is grown FILESTORE_EXTENT bytes at a time with
+ * fallocate(), so appends are a memcpy() into the mapping and replies are
+ * sent straight from it: no stdio buffering, no per byte reads and no seeking
+ * back and forth between the read and write positions.  Only the logical
+ * length is tracked in memory, the preallocated tail is cut off again when
+ * the store is closed.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "aesdsocket-filestore.h"
+#include "aesdsocket-logger.h"
+
+// Types
+struct filestore {
+    int fd;
+    char *map;
+    size_t length;              // bytes appended
+    size_t capacity;            // bytes allocated and mapped
+    size_t synced;              // bytes already msync'ed
+};
+
+/********************************************************************
+Grow the file and its mapping so it can hold at least @param needed
+bytes.  Returns 0 on success, -1 on failure.
+*********************************************************************/
+static int filestore_reserve(struct filestore *fs, size_t needed) {
+    size_t capacity;
+    char *map;
+    int rc;
+
+    if (needed <= fs->capacity) {
+        return 0;
+    }
+
+    capacity = (needed + FILESTORE_EXTENT - 1) / FILESTORE_EXTENT * FILESTORE_EXTENT;
+
+    // Allocate real blocks up front, so writes through the mapping cannot SIGBUS on ENOSPC
+    rc = fallocate(fs->fd, 0, 0, capacity);
+    if (rc == -1 && (errno == EOPNOTSUPP || errno == ENOSYS)) {
+        rc = ftruncate(fs->fd, capacity);
+    }
+    if (rc == -1) {
+        AESD_LOG(LOG_ERR, "Failed to grow data file to %zu bytes: %s", capacity, strerror(errno));
+        return -1;
+    }
+
+    if (fs->map == NULL) {
+        map = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fs->fd, 0);
+    } else {
+        map = mremap(fs->map, fs->capacity, capacity, MREMAP_MAYMOVE);
+    }
+    if (map == MAP_FAILED) {
+        AESD_LOG(LOG_ERR, "Failed to map data file: %s", strerror(errno));
+        return -1;
+    }
+
+    fs->map = map;
+    fs->capacity = capacity;
+    return 0;
+}
+
+/********************************************************************
+See aesdsocket-filestore.h
+*********************************************************************/
+struct filestore *filestore_open(const char *path, bool keep) {
+    struct filestore *fs;
+    struct stat st;
+
+    if ((fs = calloc(1, sizeof(struct filestore))) == NULL) {
+        return NULL;
+    }
+
+    fs->fd = open(path, O_RDWR | O_CREAT | (keep ? 0 : O_TRUNC) | O_CLOEXEC, 0644);
+    if (fs->fd == -1) {
+        AESD_LOG(LOG_ERR, "Error opening file %s: %s", path, strerror(errno));
+        free(fs);
+        return NULL;
+    }
+
+    // A closed store was cut to its length, so the file size is the length
+    if (keep) {
+        if (fstat(fs->fd, &st) == -1) {
+            AESD_LOG(LOG_ERR, "Error reading file %s: %s", path, strerror(errno));
+            close(fs->fd);
+            free(fs);
+            return NULL;
+        }
+        fs->length = st.st_size;
+        fs->synced = st.st_size;
+    }
+
+    if (filestore_reserve(fs, fs->length > 0 ? fs->length : FILESTORE_EXTENT) != 0) {
+        close(fs->fd);
+        free(fs);
+        return NULL;
+    }
+
+    return fs;
+}
+
+int filestore_appendv(struct filestore *fs, const struct iovec *iov, int iovcnt) {
+    size_t total = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        total += iov[i].iov_len;
+    }
+    if (filestore_reserve(fs, fs->length + total) != 0) {
+        return -1;
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(fs->map + fs->length, iov[i].iov_base, iov[i].iov_len);
+        fs->length += iov[i].iov_len;
+    }
+    return 0;
+}
+
+int filestore_append(struct filestore *fs, const char *buf, size_t len) {
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+
+    return filestore_appendv(fs, &iov, 1);
+}
+
+void filestore_truncate(struct filestore *fs, size_t length) {
+    if (length < fs->length) {
+        fs->length = length;
+    }
+    if (fs->synced > fs->length) {
+        fs->synced = fs->length;
+    }
+}
+
+const char *filestore_data(const struct filestore *fs, size_t *len) {
+    *len = fs->length;
+    return fs->map;
+}
+
+int filestore_sync(struct filestore *fs) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = fs->synced / page * page;
+
+    if (fs->length == fs->synced) {
+        return 0;
+    }
+    if (msync(fs->map + start, fs->length - start, MS_SYNC) == -1) {
+        AESD_LOG(LOG_ERR, "Failed to sync data file: %s", strerror(errno));
+        return -1;
+    }
+    fs->synced = fs->length;
+    return 0;
+}
+
+void filestore_close(struct filestore *fs) {
+    if (fs == NULL) {
+        return;
+    }
+    if (fs->map != NULL) {
+        munmap(fs->map, fs->capacity);
+    }
+    if (ftruncate(fs->fd, fs->length) == -1) {
+        AESD_LOG(LOG_ERR, "Failed to truncate data file: %s", strerror(errno));
+    }
+    close(fs->fd);
+    free(fs);
+}
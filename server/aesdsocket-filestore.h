@@ -0,0 +1,60 @@
+/*
+ * aesdsocket-filestore.h
+ *
+ * Memory mapped data file used by the file backend of aesdsocket.
+ * None of the functions lock, callers serialize them with file_mutex.
+ */
+
+#ifndef AESDSOCKET_FILESTORE_H
+#define AESDSOCKET_FILESTORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+#ifndef FILESTORE_EXTENT
+#define FILESTORE_EXTENT    (1024 * 1024)   // the file grows by this many bytes at a time
+#endif
+
+struct filestore;
+
+/**
+* Create (or truncate) the data file at @param path and map it.  With
+* @param keep set the content of an existing file is kept and appended to.
+* @return the store, or NULL on failure.
+*/
+struct filestore *filestore_open(const char *path, bool keep);
+
+/**
+* Append @param iovcnt buffers, growing the file by whole extents as needed.
+* @return 0 on success, -1 on failure in which case nothing is appended.
+*/
+int filestore_appendv(struct filestore *fs, const struct iovec *iov, int iovcnt);
+
+/**
+* Append @param len bytes at @param buf.
+*/
+int filestore_append(struct filestore *fs, const char *buf, size_t len);
+
+/**
+* Drop whatever was appended past the first @param length bytes.
+*/
+void filestore_truncate(struct filestore *fs, size_t length);
+
+/**
+* @return the mapped content of the store, @param len is set to its length.
+* Valid until the next append.
+*/
+const char *filestore_data(const struct filestore *fs, size_t *len);
+
+/**
+* msync the appended data to the file.
+*/
+int filestore_sync(struct filestore *fs);
+
+/**
+* Cut the preallocated tail off the file, then unmap and close it.
+*/
+void filestore_close(struct filestore *fs);
+
+#endif /* AESDSOCKET_FILESTORE_H */
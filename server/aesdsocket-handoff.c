@@ -0,0 +1,302 @@
+/*
+ * aesdsocket-handoff.c
+ *
+ * Listening socket handoff between an old and a new aesdsocket.
+ *
+ * The exchange on the Unix socket is: the old server sends a uint32_t count
+ * with the listening sockets attached as SCM_RIGHTS, the new server answers
+ * with a single byte once it holds them.  Only then does the old server stop
+ * accepting.  It keeps the connection open until it has drained, so the new
+ * server can wait for the storage the two cannot share (the data file and the
+ * log) by waiting for end of file.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "aesdsocket-handoff.h"
+#include "aesdsocket-logger.h"
+
+// Defines
+#define HANDOFF_ACK     'A'
+#define LISTEN_FDS_START    3   // first fd passed by socket activation
+
+/********************************************************************
+Fill in the address of the Unix socket at path.  Returns -1 if the
+path does not fit.
+*********************************************************************/
+static int handoff_addr(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        AESD_LOG(LOG_ERR, "Handoff path %s is too long", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/********************************************************************
+Wait up to HANDOFF_TIMEOUT_MS for fd to become readable.  Returns 0
+when it is, -1 on timeout or failure.
+*********************************************************************/
+static int handoff_wait(int fd) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    int rc;
+
+    do {
+        rc = poll(&pfd, 1, HANDOFF_TIMEOUT_MS);
+    } while (rc == -1 && errno == EINTR);
+    return rc == 1 ? 0 : -1;
+}
+
+/********************************************************************
+Make a received listening socket fit for the accept loops: non-blocking,
+closed on exec, and really a listening stream socket.
+*********************************************************************/
+static int handoff_adopt(int fd) {
+    int type = 0, listening = 0, flags;
+    socklen_t len = sizeof(int);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == -1 || type != SOCK_STREAM) {
+        return -1;
+    }
+    len = sizeof(int);
+    if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) == -1 || !listening) {
+        return -1;
+    }
+    if ((flags = fcntl(fd, F_GETFL)) == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1 ||
+        fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+/********************************************************************
+See aesdsocket-handoff.h
+*********************************************************************/
+int handoff_inherited(int fds[], int max) {
+    const char *pid = getenv("LISTEN_PID");
+    const char *count = getenv("LISTEN_FDS");
+    int n, i;
+
+    if (pid == NULL || count == NULL || atol(pid) != (long)getpid()) {
+        return 0;
+    }
+    n = atoi(count);
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+
+    if (n <= 0) {
+        return 0;
+    }
+    if (n > max) {
+        AESD_LOG(LOG_ERR, "Passed %i listening sockets, using the first %i", n, max);
+        n = max;
+    }
+    for (i = 0; i < n; i++) {
+        fds[i] = LISTEN_FDS_START + i;
+        if (handoff_adopt(fds[i]) != 0) {
+            AESD_LOG(LOG_ERR, "Passed fd %i is not a listening stream socket", fds[i]);
+            return -1;
+        }
+    }
+    return n;
+}
+
+/********************************************************************
+See aesdsocket-handoff.h
+*********************************************************************/
+int handoff_request(const char *path, int fds[], int max, int *conn) {
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+    } control;
+    struct sockaddr_un addr;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    uint32_t count = 0;
+    char ack = HANDOFF_ACK;
+    int fd, n = 0, i;
+    ssize_t len;
+
+    if (handoff_addr(path, &addr) != 0) {
+        return -1;
+    }
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+        AESD_LOG(LOG_ERR, "Failed to open handoff socket: %s", strerror(errno));
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        // Nobody serves the path, a stale socket is replaced by handoff_listen()
+        if (errno == ENOENT || errno == ECONNREFUSED) {
+            close(fd);
+            return 0;
+        }
+        AESD_LOG(LOG_ERR, "Failed to connect to %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    iov.iov_base = &count;
+    iov.iov_len = sizeof(count);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    if (handoff_wait(fd) != 0) {
+        AESD_LOG(LOG_ERR, "No listening sockets from %s", path);
+        goto fail;
+    }
+    do {
+        len = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (len == -1 && errno == EINTR);
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), n * sizeof(int));
+            break;
+        }
+    }
+    if (len != sizeof(count) || (msg.msg_flags & MSG_CTRUNC) || n == 0 || count != (uint32_t)n ||
+        n > max) {
+        AESD_LOG(LOG_ERR, "Bad handoff from %s", path);
+        goto fail;
+    }
+    for (i = 0; i < n; i++) {
+        if (handoff_adopt(fds[i]) != 0) {
+            AESD_LOG(LOG_ERR, "Handed over fd %i is not a listening stream socket", fds[i]);
+            goto fail;
+        }
+    }
+
+    // From here on the old server stops accepting
+    if (send(fd, &ack, 1, MSG_NOSIGNAL) != 1) {
+        AESD_LOG(LOG_ERR, "Failed to acknowledge the handoff: %s", strerror(errno));
+        goto fail;
+    }
+    *conn = fd;
+    return n;
+
+fail:
+    for (i = 0; i < n && i < max; i++) {
+        close(fds[i]);
+    }
+    close(fd);
+    return -1;
+}
+
+/********************************************************************
+See aesdsocket-handoff.h
+*********************************************************************/
+void handoff_wait_drained(int conn) {
+    char buf[16];
+    ssize_t len;
+
+    do {
+        len = read(conn, buf, sizeof(buf));
+    } while (len > 0 || (len == -1 && errno == EINTR));
+    close(conn);
+}
+
+/********************************************************************
+See aesdsocket-handoff.h
+*********************************************************************/
+int handoff_listen(const char *path) {
+    struct sockaddr_un addr;
+    mode_t mask;
+    int fd, rc;
+
+    if (handoff_addr(path, &addr) != 0) {
+        return -1;
+    }
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+        AESD_LOG(LOG_ERR, "Failed to open handoff socket: %s", strerror(errno));
+        return -1;
+    }
+
+    // Only our own user may connect and take the listening sockets
+    unlink(path);
+    mask = umask(0077);
+    rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if (rc == -1 || listen(fd, 1) == -1) {
+        AESD_LOG(LOG_ERR, "Failed to listen for handoffs at %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/********************************************************************
+See aesdsocket-handoff.h
+*********************************************************************/
+int handoff_serve(int listen_fd, const int fds[], int count) {
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+    } control;
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    uint32_t n = count;
+    char ack = 0;
+    int fd;
+
+    if ((fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC)) == -1) {
+        return -1;
+    }
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == -1 ||
+        (cred.uid != geteuid() && cred.uid != 0)) {
+        AESD_LOG(LOG_ERR, "Refused handoff to another user");
+        goto fail;
+    }
+    if (count <= 0 || count > HANDOFF_MAX_FDS) {
+        goto fail;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    iov.iov_base = &n;
+    iov.iov_len = sizeof(n);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(n)) {
+        AESD_LOG(LOG_ERR, "Failed to hand over the listening sockets: %s", strerror(errno));
+        goto fail;
+    }
+    // Without the acknowledgement the new server failed, keep serving
+    if (handoff_wait(fd) != 0 || recv(fd, &ack, 1, 0) != 1 || ack != HANDOFF_ACK) {
+        AESD_LOG(LOG_ERR, "Handoff not acknowledged, still serving");
+        goto fail;
+    }
+    return fd;
+
+fail:
+    close(fd);
+    return -1;
+}
@@ -0,0 +1,62 @@
+/*
+ * aesdsocket-handoff.h
+ *
+ * Listening sockets taken over from socket activation or from a running
+ * aesdsocket, so it can be restarted without refusing connections.
+ *
+ * A server started with -H path listens for handoff requests on a Unix socket
+ * at path.  A new server started with the same -H path first asks it for its
+ * listening sockets, which are passed with SCM_RIGHTS.  Once the new server
+ * has them the old one stops accepting, serves the connections it already
+ * accepted, and closes the handoff connection when it has closed its storage.
+ * Connections arriving meanwhile wait in the shared accept queue.
+ */
+
+#ifndef AESDSOCKET_HANDOFF_H
+#define AESDSOCKET_HANDOFF_H
+
+#include <stdbool.h>
+
+// Defines
+#define HANDOFF_MAX_FDS     64
+#define HANDOFF_TIMEOUT_MS  5000    // for each step of the exchange
+
+/**
+* Take the listening sockets passed with the systemd socket activation
+* convention: LISTEN_PID set to our pid and LISTEN_FDS sockets from fd 3 on.
+* At most @param max are stored in @param fds.  The variables are unset.
+* @return the number of sockets, 0 when none were passed, -1 if one of them
+* is not a listening stream socket.
+*/
+int handoff_inherited(int fds[], int max);
+
+/**
+* Ask the server listening for handoffs at @param path for its listening
+* sockets.  At most @param max are stored in @param fds.  @param conn is set
+* to the connection to that server, see handoff_wait_drained().
+* @return the number of sockets, 0 when no server listens at @param path, -1
+* on failure.
+*/
+int handoff_request(const char *path, int fds[], int max, int *conn);
+
+/**
+* Wait until the server which handed over its sockets on @param conn has
+* drained and closed its storage, then close @param conn.
+*/
+void handoff_wait_drained(int conn);
+
+/**
+* Listen for handoff requests at @param path, replacing what is left there.
+* @return the listening socket, or -1 on failure.
+*/
+int handoff_listen(const char *path);
+
+/**
+* Serve the handoff request pending on @param listen_fd by passing the
+* @param count listening sockets of @param fds.
+* @return the connection to the new server, to be closed once drained, or -1
+* when the sockets were not taken over and the caller keeps serving them.
+*/
+int handoff_serve(int listen_fd, const int fds[], int count);
+
+#endif /* AESDSOCKET_HANDOFF_H */
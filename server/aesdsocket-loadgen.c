@@ -0,0 +1,681 @@
+/*
+ * aesdsocket-loadgen.c
+ *
+ * Load generator and latency benchmark client for aesdsocket.
+ *
+ * Every request opens a connection, sends one newline terminated packet (or a
+ * AESDCHAR_IOCSEEKTO command), reads the reply until the server closes the
+ * connection and validates it.  Connections run concurrently from one thread
+ * per connection slot.
+ *
+ * Two modes are supported:
+ *  - closed loop (default): every slot issues its next request as soon as the
+ *    previous one completes.
+ *  - open loop (-r rate): requests are scheduled at fixed intervals from the
+ *    start of the run and latency is measured from the *intended* start time,
+ *    so a stalled server is charged for the requests queued behind the stall
+ *    (no coordinated omission).  The time from the actual start is reported
+ *    separately as service time.
+ */
+
+#define _GNU_SOURCE    // memmem
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+// Defines
+#define DEFAULT_HOST        "127.0.0.1"
+#define DEFAULT_PORT        "9000"
+#define DEFAULT_CONNECTIONS 8
+#define DEFAULT_DURATION    10
+#define DEFAULT_TIMEOUT     10
+#define DEFAULT_SEEK_CMD    "0,0"
+#define IOCSEEKTO_CMD       "AESDCHAR_IOCSEEKTO:"
+#define RECV_CHUNK_SIZE     0x10000
+#define NSEC_PER_SEC        1000000000ULL
+#define ERROR_LOG(msg,...) fprintf(stderr, "loadgen ERROR: " msg "\n" , ##__VA_ARGS__)
+
+// Log-linear latency histogram, 32 sub buckets per power of two (~3% error)
+#define HIST_SUB_BITS       5
+#define HIST_SUB_COUNT      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS        ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+// Types
+enum size_dist_type {
+    SIZE_DIST_FIXED,
+    SIZE_DIST_UNIFORM,
+    SIZE_DIST_EXP,
+};
+
+struct size_dist {
+    enum size_dist_type type;
+    size_t min;
+    size_t max;
+    double mean;
+};
+
+struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t bucket[HIST_BUCKETS];
+};
+
+struct loadgen_config {
+    const char *host;
+    const char *port;
+    int connections;
+    double duration_sec;
+    uint64_t total_requests;    // 0 means run for duration_sec
+    double rate;                // requests per second, 0 means closed loop
+    struct size_dist size;
+    double seek_fraction;
+    const char *seek_cmd;
+    int timeout_sec;            // per request send/receive timeout
+    bool validate;
+    bool fastopen;              // TCP_FASTOPEN_CONNECT, data goes out with the SYN
+    bool json;
+};
+
+struct slot_stats {
+    struct histogram latency;
+    struct histogram service;
+    uint64_t requests;
+    uint64_t seeks;
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    uint64_t connect_errors;
+    uint64_t io_errors;
+    uint64_t validate_errors;
+};
+
+struct slot_data {
+    pthread_t thread;
+    int id;
+    uint64_t rng;
+    char *packet;
+    size_t packet_cap;
+    char *reply;
+    size_t reply_cap;
+    struct slot_stats stats;
+};
+
+// File Private Vars
+static struct loadgen_config Config;
+static struct addrinfo *ServerAddr;
+static uint64_t StartNs;
+static uint64_t NextTicket;     // atomically incremented request number
+
+/********************************************************************
+*********************************************************************/
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/********************************************************************
+Sleep until the absolute CLOCK_MONOTONIC time in ns
+*********************************************************************/
+static void sleep_until_ns(uint64_t t) {
+    struct timespec ts;
+
+    ts.tv_sec = t / NSEC_PER_SEC;
+    ts.tv_nsec = t % NSEC_PER_SEC;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+        ;
+    }
+}
+
+/********************************************************************
+xorshift64*, one generator per slot so no locking is needed
+*********************************************************************/
+static uint64_t rng_next(uint64_t *state) {
+    uint64_t x = *state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static double rng_unit(uint64_t *state) {
+    return (rng_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/********************************************************************
+Histogram helpers
+*********************************************************************/
+static int hist_index(uint64_t v) {
+    int msb, shift;
+
+    if (v < HIST_SUB_COUNT) {
+        return (int)v;
+    }
+    msb = 63 - __builtin_clzll(v);
+    shift = msb - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + (int)((v >> shift) & (HIST_SUB_COUNT - 1));
+}
+
+// Highest value that maps into bucket idx
+static uint64_t hist_value(int idx) {
+    int shift;
+
+    if (idx < HIST_SUB_COUNT) {
+        return idx;
+    }
+    shift = (idx >> HIST_SUB_BITS) - 1;
+    return ((((uint64_t)HIST_SUB_COUNT + (idx & (HIST_SUB_COUNT - 1)) + 1)) << shift) - 1;
+}
+
+static void hist_record(struct histogram *h, uint64_t v) {
+    h->bucket[hist_index(v)]++;
+    h->count++;
+    h->sum += v;
+    if (v > h->max) {
+        h->max = v;
+    }
+}
+
+static void hist_merge(struct histogram *dst, const struct histogram *src) {
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        dst->bucket[i] += src->bucket[i];
+    }
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+}
+
+static uint64_t hist_percentile(const struct histogram *h, double pct) {
+    uint64_t target, seen = 0;
+    int i;
+
+    if (h->count == 0) {
+        return 0;
+    }
+    target = (uint64_t)ceil(h->count * pct / 100.0);
+    if (target == 0) {
+        target = 1;
+    }
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->bucket[i];
+        if (seen >= target) {
+            uint64_t v = hist_value(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+/********************************************************************
+Parse a size distribution: fixed:N, uniform:MIN:MAX or exp:MEAN
+*********************************************************************/
+static bool parse_size_dist(const char *arg, struct size_dist *dist) {
+    unsigned long a, b;
+    double mean;
+
+    if (sscanf(arg, "fixed:%lu", &a) == 1 && a > 0) {
+        dist->type = SIZE_DIST_FIXED;
+        dist->min = dist->max = a;
+        return true;
+    }
+    if (sscanf(arg, "uniform:%lu:%lu", &a, &b) == 2 && a > 0 && b >= a) {
+        dist->type = SIZE_DIST_UNIFORM;
+        dist->min = a;
+        dist->max = b;
+        return true;
+    }
+    if (sscanf(arg, "exp:%lf", &mean) == 1 && mean >= 1.0) {
+        dist->type = SIZE_DIST_EXP;
+        dist->mean = mean;
+        dist->min = 1;
+        dist->max = (size_t)(mean * 20);
+        return true;
+    }
+    return false;
+}
+
+static size_t sample_size(struct slot_data *slot) {
+    const struct size_dist *dist = &Config.size;
+    size_t size;
+
+    switch (dist->type) {
+        case SIZE_DIST_UNIFORM:
+            size = dist->min + rng_next(&slot->rng) % (dist->max - dist->min + 1);
+            break;
+        case SIZE_DIST_EXP:
+            size = (size_t)(-log(1.0 - rng_unit(&slot->rng)) * dist->mean) + 1;
+            if (size > dist->max) {
+                size = dist->max;
+            }
+            break;
+        case SIZE_DIST_FIXED:
+        default:
+            size = dist->min;
+            break;
+    }
+    return size;
+}
+
+/********************************************************************
+Fill the slot packet buffer with a newline terminated packet of size
+bytes (including the newline).  Returns the packet length.
+*********************************************************************/
+static size_t build_packet(struct slot_data *slot, uint64_t ticket) {
+    static const char alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    size_t size = sample_size(slot);
+    size_t i, prefix;
+
+    if (size > slot->packet_cap) {
+        char *p = realloc(slot->packet, size);
+        if (p == NULL) {
+            return 0;
+        }
+        slot->packet = p;
+        slot->packet_cap = size;
+    }
+
+    // A unique prefix makes every packet distinguishable in the reply
+    prefix = snprintf(slot->packet, size, "%d-%llu-", slot->id, (unsigned long long)ticket);
+    if (prefix >= size) {
+        prefix = size - 1;
+    }
+    for (i = prefix; i < size - 1; i++) {
+        slot->packet[i] = alphabet[rng_next(&slot->rng) % (sizeof(alphabet) - 1)];
+    }
+    slot->packet[size - 1] = '\n';
+    return size;
+}
+
+/********************************************************************
+Send all content of a buffer
+*********************************************************************/
+static int send_all(int s, const char *buf, size_t len) {
+    size_t total = 0;
+    ssize_t n;
+
+    while (total < len) {
+        n = send(s, buf + total, len - total, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        total += n;
+    }
+    return 0;
+}
+
+/********************************************************************
+Receive until the server closes the connection.  Returns the number of
+bytes received or -1 on error.
+*********************************************************************/
+static ssize_t recv_reply(struct slot_data *slot, int s) {
+    size_t pos = 0;
+    ssize_t n;
+
+    while (1) {
+        if (slot->reply_cap - pos < RECV_CHUNK_SIZE) {
+            char *p = realloc(slot->reply, slot->reply_cap * 2);
+            if (p == NULL) {
+                return -1;
+            }
+            slot->reply = p;
+            slot->reply_cap *= 2;
+        }
+        n = recv(s, slot->reply + pos, slot->reply_cap - pos, 0);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        pos += n;
+    }
+    return pos;
+}
+
+static int connect_server(void) {
+    struct addrinfo *p;
+    struct timeval tv;
+    int s, yes = 1;
+
+    tv.tv_sec = Config.timeout_sec;
+    tv.tv_usec = 0;
+
+    for (p = ServerAddr; p != NULL; p = p->ai_next) {
+        s = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (s == -1) {
+            continue;
+        }
+        if (Config.fastopen) {
+            setsockopt(s, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &yes, sizeof(yes));
+        }
+        if (connect(s, p->ai_addr, p->ai_addrlen) == 0) {
+            setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+            // A server which drops the connection without replying counts as an io error
+            setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+            return s;
+        }
+        close(s);
+    }
+    return -1;
+}
+
+/********************************************************************
+Validate a reply.  A packet reply must contain the packet we just sent,
+every reply must be newline terminated.
+*********************************************************************/
+static bool validate_reply(const char *reply, size_t len, const char *packet, size_t packet_len, bool is_seek) {
+    if (len == 0 || reply[len - 1] != '\n') {
+        return false;
+    }
+    if (is_seek) {
+        return true;
+    }
+    return memmem(reply, len, packet, packet_len) != NULL;
+}
+
+/********************************************************************
+Issue one request from a slot.  Returns true when it got a reply, and
+a valid one unless -V, so failures stay out of the latency histograms.
+*********************************************************************/
+static bool run_request(struct slot_data *slot, uint64_t ticket) {
+    struct slot_stats *st = &slot->stats;
+    bool is_seek = Config.seek_fraction > 0 && rng_unit(&slot->rng) < Config.seek_fraction;
+    size_t len;
+    ssize_t got;
+    int s;
+
+    if (is_seek) {
+        // packet_cap was sized for the seek command at startup
+        len = snprintf(slot->packet, slot->packet_cap, "%s%s\n", IOCSEEKTO_CMD, Config.seek_cmd);
+        st->seeks++;
+    } else {
+        len = build_packet(slot, ticket);
+        if (len == 0) {
+            st->io_errors++;
+            return false;
+        }
+    }
+
+    if ((s = connect_server()) == -1) {
+        st->connect_errors++;
+        return false;
+    }
+
+    if (send_all(s, slot->packet, len) == -1) {
+        st->io_errors++;
+        close(s);
+        return false;
+    }
+    st->bytes_sent += len;
+
+    got = recv_reply(slot, s);
+    close(s);
+    if (got == -1) {
+        st->io_errors++;
+        return false;
+    }
+    st->bytes_received += got;
+
+    if (Config.validate && !validate_reply(slot->reply, got, slot->packet, len, is_seek)) {
+        st->validate_errors++;
+        return false;
+    }
+    return true;
+}
+
+/*************************************************************************
+ * ***********************************************************************/
+static void* slot_thread(void* thread_param) {
+    struct slot_data *slot = (struct slot_data *) thread_param;
+    uint64_t end_ns = StartNs + (uint64_t)(Config.duration_sec * NSEC_PER_SEC);
+    uint64_t ticket, intended, start, done;
+    bool ok;
+
+    while (1) {
+        ticket = __atomic_fetch_add(&NextTicket, 1, __ATOMIC_RELAXED);
+        if (Config.total_requests && ticket >= Config.total_requests) {
+            break;
+        }
+
+        if (Config.rate > 0) {
+            intended = StartNs + (uint64_t)(ticket * (NSEC_PER_SEC / Config.rate));
+            if (!Config.total_requests && intended >= end_ns) {
+                break;
+            }
+            sleep_until_ns(intended);
+            start = now_ns();
+        } else {
+            start = now_ns();
+            if (!Config.total_requests && start >= end_ns) {
+                break;
+            }
+            intended = start;
+        }
+
+        ok = run_request(slot, ticket);
+        done = now_ns();
+
+        // A refused connection or a failed request is fast, not a latency sample
+        slot->stats.requests++;
+        if (ok) {
+            hist_record(&slot->stats.latency, done - intended);
+            hist_record(&slot->stats.service, done - start);
+        }
+    }
+
+    return NULL;
+}
+
+static void print_hist(const char *name, const struct histogram *h) {
+    printf("%-8s (usec): mean %.1f  p50 %.1f  p99 %.1f  p999 %.1f  max %.1f\n", name,
+        h->count ? (double)h->sum / h->count / 1000.0 : 0.0,
+        hist_percentile(h, 50.0) / 1000.0, hist_percentile(h, 99.0) / 1000.0,
+        hist_percentile(h, 99.9) / 1000.0, h->max / 1000.0);
+}
+
+static void print_hist_json(const char *name, const struct histogram *h) {
+    printf("\"%s_us\":{\"mean\":%.1f,\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}", name,
+        h->count ? (double)h->sum / h->count / 1000.0 : 0.0,
+        hist_percentile(h, 50.0) / 1000.0, hist_percentile(h, 99.0) / 1000.0,
+        hist_percentile(h, 99.9) / 1000.0, h->max / 1000.0);
+}
+
+static void report(const struct slot_stats *total, double elapsed) {
+    uint64_t errors = total->connect_errors + total->io_errors + total->validate_errors;
+
+    if (Config.json) {
+        printf("{\"mode\":\"%s\",\"connections\":%d,\"rate\":%.1f,\"elapsed_s\":%.3f,"
+            "\"requests\":%llu,\"seeks\":%llu,\"errors\":{\"connect\":%llu,\"io\":%llu,\"validate\":%llu},"
+            "\"throughput_rps\":%.1f,\"tx_bytes\":%llu,\"rx_bytes\":%llu,",
+            Config.rate > 0 ? "open" : "closed", Config.connections, Config.rate, elapsed,
+            (unsigned long long)total->requests, (unsigned long long)total->seeks,
+            (unsigned long long)total->connect_errors, (unsigned long long)total->io_errors,
+            (unsigned long long)total->validate_errors, total->requests / elapsed,
+            (unsigned long long)total->bytes_sent, (unsigned long long)total->bytes_received);
+        print_hist_json("latency", &total->latency);
+        printf(",");
+        print_hist_json("service", &total->service);
+        printf("}\n");
+        return;
+    }
+
+    printf("mode: %s loop, %d connections", Config.rate > 0 ? "open" : "closed", Config.connections);
+    if (Config.rate > 0) {
+        printf(", target %.1f req/s", Config.rate);
+    }
+    printf("\n");
+    printf("requests: %llu (%llu seeks) in %.3f s, %.1f req/s\n",
+        (unsigned long long)total->requests, (unsigned long long)total->seeks, elapsed,
+        total->requests / elapsed);
+    printf("errors: %llu (connect %llu, io %llu, validate %llu)\n", (unsigned long long)errors,
+        (unsigned long long)total->connect_errors, (unsigned long long)total->io_errors,
+        (unsigned long long)total->validate_errors);
+    printf("transfer: tx %.2f MB/s, rx %.2f MB/s\n", total->bytes_sent / elapsed / 1e6,
+        total->bytes_received / elapsed / 1e6);
+    print_hist("latency", &total->latency);
+    if (Config.rate > 0) {
+        print_hist("service", &total->service);
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -H host      server host (default " DEFAULT_HOST ")\n"
+        "  -p port      server port (default " DEFAULT_PORT ")\n"
+        "  -c conns     concurrent connections (default %d)\n"
+        "  -t seconds   run duration (default %d)\n"
+        "  -n requests  stop after this many requests instead of a duration\n"
+        "  -r rate      open loop at rate requests/s total (default closed loop)\n"
+        "  -s dist      packet size: fixed:N, uniform:MIN:MAX or exp:MEAN (default fixed:64)\n"
+        "  -k fraction  fraction of requests which are seek commands (default 0)\n"
+        "  -K cmd,off   seek command arguments (default " DEFAULT_SEEK_CMD ")\n"
+        "  -T seconds   per request timeout (default %d)\n"
+        "  -F           use TCP fast open (server needs -f)\n"
+        "  -V           do not validate replies\n"
+        "  -j           print results as a single JSON object\n",
+        prog, DEFAULT_CONNECTIONS, DEFAULT_DURATION, DEFAULT_TIMEOUT);
+}
+
+/********************************************************************
+*********************************************************************/
+int main( int argc, char *argv[] ) {
+    struct addrinfo hints;
+    struct slot_data *slots;
+    struct slot_stats total;
+    double elapsed;
+    size_t seek_len;
+    int opt, rv, i;
+
+    Config.host = DEFAULT_HOST;
+    Config.port = DEFAULT_PORT;
+    Config.connections = DEFAULT_CONNECTIONS;
+    Config.duration_sec = DEFAULT_DURATION;
+    Config.size.type = SIZE_DIST_FIXED;
+    Config.size.min = Config.size.max = 64;
+    Config.seek_cmd = DEFAULT_SEEK_CMD;
+    Config.timeout_sec = DEFAULT_TIMEOUT;
+    Config.validate = true;
+
+    while ((opt = getopt(argc, argv, "H:p:c:t:n:r:s:k:K:T:FVjh")) != -1) {
+        switch (opt) {
+            case 'H': Config.host = optarg; break;
+            case 'p': Config.port = optarg; break;
+            case 'c': Config.connections = atoi(optarg); break;
+            case 't': Config.duration_sec = atof(optarg); break;
+            case 'n': Config.total_requests = strtoull(optarg, NULL, 10); break;
+            case 'r': Config.rate = atof(optarg); break;
+            case 's':
+                if (!parse_size_dist(optarg, &Config.size)) {
+                    ERROR_LOG("Invalid size distribution %s", optarg);
+                    return 1;
+                }
+                break;
+            case 'k': Config.seek_fraction = atof(optarg); break;
+            case 'K': Config.seek_cmd = optarg; break;
+            case 'T': Config.timeout_sec = atoi(optarg); break;
+            case 'F': Config.fastopen = true; break;
+            case 'V': Config.validate = false; break;
+            case 'j': Config.json = true; break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (Config.connections <= 0 || Config.duration_sec <= 0 || Config.rate < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((rv = getaddrinfo(Config.host, Config.port, &hints, &ServerAddr)) != 0) {
+        ERROR_LOG("Failed to resolve %s:%s: %s", Config.host, Config.port, gai_strerror(rv));
+        return 1;
+    }
+
+    slots = calloc(Config.connections, sizeof(struct slot_data));
+    if (slots == NULL) {
+        ERROR_LOG("Failed to allocate connection slots.");
+        return 1;
+    }
+
+    // The seek command with -K may be longer than any packet
+    seek_len = strlen(IOCSEEKTO_CMD) + strlen(Config.seek_cmd) + 2;
+    StartNs = now_ns();
+    for (i = 0; i < Config.connections; i++) {
+        slots[i].id = i;
+        slots[i].rng = (StartNs ^ ((uint64_t)(i + 1) * 0x9E3779B97F4A7C15ULL)) | 1;
+        slots[i].packet_cap = Config.size.max + 1;
+        if (slots[i].packet_cap < 256) {
+            slots[i].packet_cap = 256;
+        }
+        if (slots[i].packet_cap < seek_len) {
+            slots[i].packet_cap = seek_len;
+        }
+        slots[i].packet = malloc(slots[i].packet_cap);
+        slots[i].reply_cap = 2 * RECV_CHUNK_SIZE;
+        slots[i].reply = malloc(slots[i].reply_cap);
+        if (slots[i].packet == NULL || slots[i].reply == NULL) {
+            ERROR_LOG("Failed to allocate connection buffers.");
+            return 1;
+        }
+        if (pthread_create(&slots[i].thread, NULL, slot_thread, &slots[i]) != 0) {
+            ERROR_LOG("Failed to start connection thread %d.", i);
+            return 1;
+        }
+    }
+
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < Config.connections; i++) {
+        pthread_join(slots[i].thread, NULL);
+        hist_merge(&total.latency, &slots[i].stats.latency);
+        hist_merge(&total.service, &slots[i].stats.service);
+        total.requests += slots[i].stats.requests;
+        total.seeks += slots[i].stats.seeks;
+        total.bytes_sent += slots[i].stats.bytes_sent;
+        total.bytes_received += slots[i].stats.bytes_received;
+        total.connect_errors += slots[i].stats.connect_errors;
+        total.io_errors += slots[i].stats.io_errors;
+        total.validate_errors += slots[i].stats.validate_errors;
+        free(slots[i].packet);
+        free(slots[i].reply);
+    }
+    elapsed = (now_ns() - StartNs) / 1e9;
+
+    report(&total, elapsed);
+
+    free(slots);
+    freeaddrinfo(ServerAddr);
+
+    return (total.connect_errors + total.io_errors + total.validate_errors) ? 2 : 0;
+}
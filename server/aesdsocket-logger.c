@@ -0,0 +1,378 @@
+/*
+ * aesdsocket-logger.c
+ *
+ * Asynchronous logger.  Each thread gets a single producer, single consumer
+ * ring of LOGGER_RING_SIZE bytes the first time it logs.  Messages are stored
+ * in it as variable length records, so the only shared writes on the logging
+ * path are the head of the thread's own ring and, when it is full, its drop
+ * counter.  Rings are pushed onto a lock-free list which only the flusher
+ * thread walks and unlinks from.  The flusher wakes every LOGGER_FLUSH_MS,
+ * or early when a ring fills past half of it, drains every ring and writes
+ * the records in one batch: one fflush() to the file, or one syslog() call
+ * each from the flusher instead of the request handling threads.  The ring
+ * of an exited thread is freed once drained.
+ *
+ * Records of different threads may be written out of order, each carries the
+ * time it was logged at.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "aesdsocket-logger.h"
+
+// Defines
+#define RING_MASK       (LOGGER_RING_SIZE - 1)
+#define RECORD_ALIGN    8
+#define PAD_LEVEL       -1      // fills the end of the ring when a record does not fit
+
+// Types
+struct logger_record {
+    uint32_t size;              // of the whole record, a multiple of RECORD_ALIGN
+    int32_t level;
+    uint64_t ns;                // CLOCK_REALTIME when it was logged
+    char text[];                // NUL terminated
+};
+
+struct logger_ring {
+    struct logger_ring *next;   // written by the pushing thread, then only by the flusher
+    atomic_uint head;           // written by the owning thread
+    atomic_uint tail;           // written by the flusher
+    atomic_ulong dropped;       // written by the owning thread
+    unsigned long reported;     // drops already counted by the flusher
+    atomic_bool closed;         // the owning thread exited
+    char data[LOGGER_RING_SIZE] __attribute__((aligned(RECORD_ALIGN)));
+};
+
+// File Private Vars
+int LoggerLevel = LOG_INFO;
+static _Atomic(struct logger_ring *) Rings;
+static __thread struct logger_ring *ThreadRing;
+static pthread_key_t RingKey;
+static pthread_once_t RingKeyOnce = PTHREAD_ONCE_INIT;
+static atomic_bool Running;
+static atomic_ulong Dropped;            // messages without a ring to go to
+static unsigned long DroppedReported;   // flusher only
+static atomic_ullong DroppedTotal;      // written by the flusher
+static pthread_t FlushThread;
+static pthread_mutex_t FlushMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t FlushCond = PTHREAD_COND_INITIALIZER;
+static bool StopRequested;
+static atomic_bool FlushNow;            // a ring is filling up
+static FILE *Out;                       // NULL for syslog
+
+static const char *const LevelNames[] = {
+    "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug",
+};
+
+/********************************************************************
+Registered rings
+*********************************************************************/
+static void ring_close(void *arg) {
+    struct logger_ring *ring = arg;
+
+    // Runs on the exiting thread.  The flusher may free the ring from now on,
+    // a later message of this thread makes a new one, closed in turn by the
+    // next round of key destructors.
+    ThreadRing = NULL;
+    atomic_store_explicit(&ring->closed, true, memory_order_release);
+}
+
+static void ring_key_create(void) {
+    pthread_key_create(&RingKey, ring_close);
+}
+
+static struct logger_ring *ring_create(void) {
+    struct logger_ring *ring;
+
+    pthread_once(&RingKeyOnce, ring_key_create);
+    if ((ring = calloc(1, sizeof(struct logger_ring))) == NULL) {
+        return NULL;
+    }
+    if (pthread_setspecific(RingKey, ring) != 0) {
+        free(ring);
+        return NULL;
+    }
+    ring->next = atomic_load_explicit(&Rings, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&Rings, &ring->next, ring,
+                                                  memory_order_release, memory_order_relaxed)) {
+    }
+    ThreadRing = ring;
+    return ring;
+}
+
+/**
+* Remove @param ring, which follows @param prev or is the first ring when
+* @param prev is NULL.  Only the flusher removes rings, other threads only
+* push new ones in front.
+*/
+static void ring_unlink(struct logger_ring *prev, struct logger_ring *ring) {
+    struct logger_ring *expected = ring;
+
+    if (prev == NULL) {
+        if (atomic_compare_exchange_strong_explicit(&Rings, &expected, ring->next,
+                                                    memory_order_acq_rel, memory_order_acquire)) {
+            return;
+        }
+        // Rings were pushed in front of it meanwhile
+        for (prev = expected; prev->next != ring; prev = prev->next) {
+        }
+    }
+    prev->next = ring->next;
+}
+
+/********************************************************************
+Producers
+*********************************************************************/
+void logger_log(int level, const char *fmt, ...) {
+    struct logger_ring *ring;
+    struct logger_record *record;
+    struct timespec ts;
+    char msg[LOGGER_MSG_MAX];
+    unsigned head, tail, offset, pad, size;
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    if (!atomic_load_explicit(&Running, memory_order_acquire)) {
+        vsyslog(level, fmt, ap);
+        va_end(ap);
+        return;
+    }
+    len = vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+    if (len < 0) {
+        return;
+    }
+    if (len >= (int)sizeof(msg)) {
+        len = sizeof(msg) - 1;
+    }
+    // Records are lines, some callers still end their message with one
+    while (len > 0 && msg[len - 1] == '\n') {
+        len--;
+    }
+
+    if ((ring = ThreadRing) == NULL && (ring = ring_create()) == NULL) {
+        atomic_fetch_add_explicit(&Dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    size = (sizeof(struct logger_record) + len + 1 + RECORD_ALIGN - 1) & ~(RECORD_ALIGN - 1);
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    offset = head & RING_MASK;
+    // A record is never split, the rest of the ring is skipped instead
+    pad = LOGGER_RING_SIZE - offset < size ? LOGGER_RING_SIZE - offset : 0;
+    if (head + pad + size - tail > LOGGER_RING_SIZE) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    if (pad != 0) {
+        record = (struct logger_record *)(ring->data + offset);
+        record->size = pad;
+        record->level = PAD_LEVEL;
+        head += pad;
+        offset = 0;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    record = (struct logger_record *)(ring->data + offset);
+    record->size = size;
+    record->level = level;
+    record->ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    memcpy(record->text, msg, len);
+    record->text[len] = '\0';
+    atomic_store_explicit(&ring->head, head + size, memory_order_release);
+
+    // Only the record crossing the half wakes the flusher, the others cost nothing.
+    // Signal under the mutex so the flusher cannot miss it between checking
+    // FlushNow and starting to wait.
+    if (head - tail < LOGGER_RING_SIZE / 2 && head + size - tail >= LOGGER_RING_SIZE / 2 &&
+        !atomic_exchange_explicit(&FlushNow, true, memory_order_relaxed)) {
+        pthread_mutex_lock(&FlushMutex);
+        pthread_cond_signal(&FlushCond);
+        pthread_mutex_unlock(&FlushMutex);
+    }
+}
+
+void logger_set_level(int level) {
+    __atomic_store_n(&LoggerLevel, level, __ATOMIC_RELAXED);
+}
+
+int logger_parse_level(const char *name) {
+    char *end;
+    long level;
+    size_t i;
+
+    for (i = 0; i < sizeof(LevelNames) / sizeof(LevelNames[0]); i++) {
+        if (strcasecmp(name, LevelNames[i]) == 0) {
+            return i;
+        }
+    }
+    level = strtol(name, &end, 10);
+    if (end == name || *end != '\0' || level < LOG_EMERG || level > LOG_DEBUG) {
+        return -1;
+    }
+    return level;
+}
+
+/********************************************************************
+Flusher
+*********************************************************************/
+static void write_record(int level, uint64_t ns, const char *text) {
+    struct tm tm;
+    time_t sec;
+    char stamp[32];
+
+    if (Out == NULL) {
+        syslog(level, "%s", text);
+        return;
+    }
+    sec = ns / 1000000000ULL;
+    localtime_r(&sec, &tm);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+    fprintf(Out, "%s.%06llu %s: %s\n", stamp, (unsigned long long)(ns % 1000000000ULL) / 1000,
+            level >= 0 && level <= LOG_DEBUG ? LevelNames[level] : "?", text);
+}
+
+/**
+* Write and consume every record of every ring, free the rings of exited threads.
+*/
+static void drain(void) {
+    struct logger_ring *ring, *prev = NULL, *next;
+    const struct logger_record *record;
+    struct timespec ts;
+    unsigned head, tail;
+    unsigned long dropped, new_drops = 0;
+    char text[64];
+    bool closed;
+
+    for (ring = atomic_load_explicit(&Rings, memory_order_acquire); ring != NULL; ring = next) {
+        next = ring->next;
+        // Read before head, a closed ring then has no record left after this pass
+        closed = atomic_load_explicit(&ring->closed, memory_order_acquire);
+        tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        while (tail != head) {
+            record = (const struct logger_record *)(ring->data + (tail & RING_MASK));
+            if (record->level != PAD_LEVEL) {
+                write_record(record->level, record->ns, record->text);
+            }
+            tail += record->size;
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+        dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+        new_drops += dropped - ring->reported;
+        ring->reported = dropped;
+
+        if (closed) {
+            ring_unlink(prev, ring);
+            free(ring);
+        } else {
+            prev = ring;
+        }
+    }
+
+    dropped = atomic_load_explicit(&Dropped, memory_order_relaxed);
+    new_drops += dropped - DroppedReported;
+    DroppedReported = dropped;
+    if (new_drops != 0) {
+        atomic_fetch_add_explicit(&DroppedTotal, new_drops, memory_order_relaxed);
+        clock_gettime(CLOCK_REALTIME, &ts);
+        snprintf(text, sizeof(text), "Dropped %lu log messages", new_drops);
+        write_record(LOG_WARNING, (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec, text);
+    }
+    if (Out != NULL) {
+        fflush(Out);
+    }
+}
+
+static void* flush_thread(void* arg) {
+    struct timespec deadline;
+    bool stop = false;
+
+    (void)arg;
+    while (!stop) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += LOGGER_FLUSH_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_lock(&FlushMutex);
+        while (!StopRequested && !atomic_load_explicit(&FlushNow, memory_order_relaxed) &&
+               pthread_cond_timedwait(&FlushCond, &FlushMutex, &deadline) != ETIMEDOUT) {
+        }
+        stop = StopRequested;
+        pthread_mutex_unlock(&FlushMutex);
+        atomic_store_explicit(&FlushNow, false, memory_order_relaxed);
+
+        drain();
+    }
+    return NULL;
+}
+
+/********************************************************************
+See aesdsocket-logger.h
+*********************************************************************/
+int logger_start(const char *path) {
+    pthread_condattr_t attr;
+    int rv;
+
+    if (path != NULL && (Out = fopen(path, "ae")) == NULL) {
+        syslog(LOG_ERR, "Failed to open log file %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&FlushCond, &attr);
+    pthread_condattr_destroy(&attr);
+    StopRequested = false;
+
+    if ((rv = pthread_create(&FlushThread, NULL, flush_thread, NULL)) != 0) {
+        syslog(LOG_ERR, "Failed to start log flusher thread: %s", strerror(rv));
+        if (Out != NULL) {
+            fclose(Out);
+            Out = NULL;
+        }
+        return -1;
+    }
+    atomic_store_explicit(&Running, true, memory_order_release);
+    return 0;
+}
+
+void logger_stop(void) {
+    if (!atomic_load_explicit(&Running, memory_order_acquire)) {
+        return;
+    }
+    // Later messages go straight to syslog
+    atomic_store_explicit(&Running, false, memory_order_release);
+
+    pthread_mutex_lock(&FlushMutex);
+    StopRequested = true;
+    pthread_cond_signal(&FlushCond);
+    pthread_mutex_unlock(&FlushMutex);
+    pthread_join(FlushThread, NULL);
+
+    if (atomic_load_explicit(&DroppedTotal, memory_order_relaxed) != 0) {
+        syslog(LOG_NOTICE, "Dropped %llu log messages in total",
+               (unsigned long long)atomic_load_explicit(&DroppedTotal, memory_order_relaxed));
+    }
+    if (Out != NULL) {
+        fclose(Out);
+        Out = NULL;
+    }
+}
+
+uint64_t logger_dropped(void) {
+    return atomic_load_explicit(&DroppedTotal, memory_order_relaxed);
+}
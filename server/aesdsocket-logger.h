@@ -0,0 +1,81 @@
+/*
+ * aesdsocket-logger.h
+ *
+ * Asynchronous logging for aesdsocket.
+ *
+ * Every thread formats its messages into a ring of its own, which a flusher
+ * thread drains in batches to syslog or to a file.  Logging never blocks: a
+ * message which does not fit in the ring of its thread is counted as dropped
+ * and the count is logged by the flusher.  Messages above the current level
+ * cost a single compare, see AESD_LOG().
+ */
+
+#ifndef AESDSOCKET_LOGGER_H
+#define AESDSOCKET_LOGGER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <syslog.h>
+
+// Defines
+#define LOGGER_RING_SIZE    16384   // bytes of messages per thread, a power of two
+#define LOGGER_MSG_MAX      1024    // longer messages are truncated
+#define LOGGER_FLUSH_MS     50      // how often the flusher drains the rings
+
+// Highest syslog priority logged, LOG_INFO by default
+extern int LoggerLevel;
+
+/**
+* @return true if messages of syslog priority @param level are logged.
+*/
+static inline bool logger_enabled(int level) {
+    return level <= __atomic_load_n(&LoggerLevel, __ATOMIC_RELAXED);
+}
+
+/**
+* Log a message of syslog priority @param level, printf style.
+*/
+#define AESD_LOG(level, msg, ...) \
+    do { \
+        if (logger_enabled(level)) { \
+            logger_log((level), msg, ##__VA_ARGS__); \
+        } \
+    } while (0)
+
+/**
+* Log unconditionally, use AESD_LOG().  Until logger_start() and after
+* logger_stop() messages go straight to syslog.
+*/
+void logger_log(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+* Set the highest syslog priority logged to @param level.  Safe to call from
+* any thread at any time.
+*/
+void logger_set_level(int level);
+
+/**
+* Parse a syslog priority given as a number or a name such as "info".
+* @return the priority, -1 if @param name is not one.
+*/
+int logger_parse_level(const char *name);
+
+/**
+* Start the flusher thread, writing to the file at @param path, or to syslog
+* when NULL.  Call after any fork(), the thread does not survive it.
+* @return 0 on success, -1 on failure.
+*/
+int logger_start(const char *path);
+
+/**
+* Write every message logged so far and stop the flusher thread.
+*/
+void logger_stop(void);
+
+/**
+* @return the number of messages dropped because a ring was full, as counted
+* by the flusher so far.
+*/
+uint64_t logger_dropped(void);
+
+#endif /* AESDSOCKET_LOGGER_H */
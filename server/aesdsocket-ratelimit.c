@@ -0,0 +1,380 @@
+/*
+ * aesdsocket-ratelimit.c
+ *
+ * Sharded per client token buckets.
+ *
+ * A client is keyed by its address as 16 bytes, IPv4 mapped into IPv6.  The
+ * hash is seeded at random so clients cannot pick addresses which all land in
+ * one chain.  Each shard has its own lock, its own fixed pool of clients and
+ * its own counters, so connections of different clients rarely contend.  A
+ * client which has not been seen for a while has full buckets, which is the
+ * same as not being tracked, so forgetting the least recently seen client of
+ * a full shard only loses the state of a client that stopped sending.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/random.h>
+#include "aesdsocket-ratelimit.h"
+
+// Defines
+#define RATELIMIT_BUCKETS   512     // hash chains per shard, a power of two
+#define NO_CLIENT           -1
+
+// Types
+struct ratelimit_client {
+    uint8_t addr[16];
+    int32_t next;               // next client of the hash chain
+    double conn_tokens;
+    double byte_tokens;
+    uint64_t refill_ns;         // when the tokens were last topped up
+    uint64_t shed;              // connections and packets shed
+};
+
+struct ratelimit_shard {
+    pthread_mutex_t lock;
+    int32_t chains[RATELIMIT_BUCKETS];
+    struct ratelimit_client clients[RATELIMIT_SHARD_CLIENTS];
+    int32_t used;
+    struct ratelimit_stats stats;
+};
+
+struct ratelimit {
+    struct ratelimit_config config;
+    uint64_t seed;
+    struct ratelimit_shard shards[RATELIMIT_SHARDS];
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/********************************************************************
+Store the address of addr as 16 bytes in key.  Returns -1 for an
+address family without one, such as a Unix socket.
+*********************************************************************/
+static int client_key(const struct sockaddr *addr, uint8_t key[16]) {
+    if (addr->sa_family == AF_INET6) {
+        memcpy(key, &((const struct sockaddr_in6 *)addr)->sin6_addr, 16);
+        return 0;
+    }
+    if (addr->sa_family == AF_INET) {
+        memset(key, 0, 10);
+        key[10] = key[11] = 0xff;
+        memcpy(key + 12, &((const struct sockaddr_in *)addr)->sin_addr, 4);
+        return 0;
+    }
+    return -1;
+}
+
+static uint64_t client_hash(const struct ratelimit *rl, const uint8_t key[16]) {
+    uint64_t hash = 0xcbf29ce484222325ULL ^ rl->seed;   // FNV-1a
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        hash = (hash ^ key[i]) * 0x100000001b3ULL;
+    }
+    return hash ^ (hash >> 29);
+}
+
+/********************************************************************
+Top the buckets of client up for the time since they were last
+refilled, never above their burst
+*********************************************************************/
+static void client_refill(const struct ratelimit_config *config, struct ratelimit_client *client,
+                          uint64_t now) {
+    double elapsed = (double)(now - client->refill_ns) / 1e9;
+
+    client->conn_tokens += elapsed * config->conn_rate;
+    if (client->conn_tokens > config->conn_burst) {
+        client->conn_tokens = config->conn_burst;
+    }
+    client->byte_tokens += elapsed * config->byte_rate;
+    if (client->byte_tokens > config->byte_burst) {
+        client->byte_tokens = config->byte_burst;
+    }
+    client->refill_ns = now;
+}
+
+/********************************************************************
+Unlink client index victim from the chains of shard
+*********************************************************************/
+static void shard_unlink(struct ratelimit *rl, struct ratelimit_shard *shard, int32_t victim) {
+    uint64_t hash = client_hash(rl, shard->clients[victim].addr);
+    int32_t *link = &shard->chains[hash & (RATELIMIT_BUCKETS - 1)];
+
+    while (*link != NO_CLIENT) {
+        if (*link == victim) {
+            *link = shard->clients[victim].next;
+            return;
+        }
+        link = &shard->clients[*link].next;
+    }
+}
+
+/********************************************************************
+Find the client with key in its locked shard, adding it with full
+buckets when it is not tracked yet.  The buckets are refilled.
+*********************************************************************/
+static struct ratelimit_client *shard_client(struct ratelimit *rl, struct ratelimit_shard *shard,
+                                             const uint8_t key[16], uint64_t hash, uint64_t now) {
+    int32_t *chain = &shard->chains[hash & (RATELIMIT_BUCKETS - 1)];
+    struct ratelimit_client *client;
+    int32_t i, victim;
+
+    for (i = *chain; i != NO_CLIENT; i = shard->clients[i].next) {
+        if (memcmp(shard->clients[i].addr, key, 16) == 0) {
+            client_refill(&rl->config, &shard->clients[i], now);
+            return &shard->clients[i];
+        }
+    }
+
+    if (shard->used < RATELIMIT_SHARD_CLIENTS) {
+        victim = shard->used++;
+    } else {
+        // Forget the client whose buckets were refilled longest ago
+        victim = 0;
+        for (i = 1; i < RATELIMIT_SHARD_CLIENTS; i++) {
+            if (shard->clients[i].refill_ns < shard->clients[victim].refill_ns) {
+                victim = i;
+            }
+        }
+        shard_unlink(rl, shard, victim);
+        shard->stats.evictions++;
+    }
+
+    client = &shard->clients[victim];
+    memcpy(client->addr, key, 16);
+    client->conn_tokens = rl->config.conn_burst;
+    client->byte_tokens = rl->config.byte_burst;
+    client->refill_ns = now;
+    client->shed = 0;
+    client->next = *chain;
+    *chain = victim;
+    return client;
+}
+
+/********************************************************************
+Take cost tokens from a bucket holding at most burst.  Returns false
+when there are not enough.
+*********************************************************************/
+static bool bucket_take(double *tokens, double burst, double cost) {
+    if (*tokens < (cost < burst ? cost : burst)) {
+        return false;
+    }
+    *tokens -= cost;
+    return true;
+}
+
+/********************************************************************
+See aesdsocket-ratelimit.h
+*********************************************************************/
+int ratelimit_parse(const char *spec, double *rate, double *burst) {
+    char *end;
+
+    *rate = strtod(spec, &end);
+    if (end == spec || !(*rate > 0)) {
+        return -1;
+    }
+    if (*end == '\0') {
+        *burst = *rate < 1 ? 1 : *rate;
+        return 0;
+    }
+    if (*end != ':') {
+        return -1;
+    }
+    spec = end + 1;
+    *burst = strtod(spec, &end);
+    if (end == spec || *end != '\0' || !(*burst >= 1)) {
+        return -1;
+    }
+    return 0;
+}
+
+/********************************************************************
+See aesdsocket-ratelimit.h
+*********************************************************************/
+struct ratelimit *ratelimit_create(const struct ratelimit_config *config) {
+    struct ratelimit *rl;
+    int s, i;
+
+    if ((rl = calloc(1, sizeof(*rl))) == NULL) {
+        return NULL;
+    }
+    rl->config = *config;
+    if (getrandom(&rl->seed, sizeof(rl->seed), GRND_NONBLOCK) != sizeof(rl->seed)) {
+        rl->seed = now_ns() ^ ((uint64_t)getpid() << 32);
+    }
+    for (s = 0; s < RATELIMIT_SHARDS; s++) {
+        pthread_mutex_init(&rl->shards[s].lock, NULL);
+        for (i = 0; i < RATELIMIT_BUCKETS; i++) {
+            rl->shards[s].chains[i] = NO_CLIENT;
+        }
+    }
+    return rl;
+}
+
+/********************************************************************
+See aesdsocket-ratelimit.h
+*********************************************************************/
+bool ratelimit_admit_conn(struct ratelimit *rl, const struct sockaddr *addr) {
+    struct ratelimit_shard *shard;
+    struct ratelimit_client *client;
+    uint8_t key[16];
+    uint64_t hash;
+    bool admit;
+
+    if (rl->config.conn_rate <= 0 || client_key(addr, key) != 0) {
+        return true;
+    }
+    hash = client_hash(rl, key);
+    shard = &rl->shards[(hash >> 32) & (RATELIMIT_SHARDS - 1)];
+
+    pthread_mutex_lock(&shard->lock);
+    client = shard_client(rl, shard, key, hash, now_ns());
+    admit = bucket_take(&client->conn_tokens, rl->config.conn_burst, 1);
+    if (admit) {
+        shard->stats.conns_admitted++;
+    } else {
+        shard->stats.conns_shed++;
+        client->shed++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return admit;
+}
+
+/********************************************************************
+See aesdsocket-ratelimit.h
+*********************************************************************/
+bool ratelimit_admit_bytes(struct ratelimit *rl, const struct sockaddr *addr, size_t len) {
+    struct ratelimit_shard *shard;
+    struct ratelimit_client *client;
+    uint8_t key[16];
+    uint64_t hash;
+    bool admit;
+
+    if (rl->config.byte_rate <= 0 || client_key(addr, key) != 0) {
+        return true;
+    }
+    hash = client_hash(rl, key);
+    shard = &rl->shards[(hash >> 32) & (RATELIMIT_SHARDS - 1)];
+
+    pthread_mutex_lock(&shard->lock);
+    client = shard_client(rl, shard, key, hash, now_ns());
+    admit = bucket_take(&client->byte_tokens, rl->config.byte_burst, (double)len);
+    if (admit) {
+        shard->stats.packets_admitted++;
+    } else {
+        shard->stats.packets_shed++;
+        shard->stats.bytes_shed += len;
+        client->shed++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return admit;
+}
+
+/********************************************************************
+See aesdsocket-ratelimit.h
+*********************************************************************/
+void ratelimit_stats(struct ratelimit *rl, struct ratelimit_stats *stats) {
+    struct ratelimit_shard *shard;
+    int s;
+
+    memset(stats, 0, sizeof(*stats));
+    for (s = 0; s < RATELIMIT_SHARDS; s++) {
+        shard = &rl->shards[s];
+        pthread_mutex_lock(&shard->lock);
+        stats->conns_admitted += shard->stats.conns_admitted;
+        stats->conns_shed += shard->stats.conns_shed;
+        stats->packets_admitted += shard->stats.packets_admitted;
+        stats->packets_shed += shard->stats.packets_shed;
+        stats->bytes_shed += shard->stats.bytes_shed;
+        stats->evictions += shard->stats.evictions;
+        stats->clients += shard->used;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+static void format_key(const uint8_t key[16], char *buf, size_t len) {
+    static const uint8_t v4mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+    if (memcmp(key, v4mapped, sizeof(v4mapped)) == 0) {
+        inet_ntop(AF_INET, key + 12, buf, len);
+    } else {
+        inet_ntop(AF_INET6, key, buf, len);
+    }
+}
+
+/********************************************************************
+See aesdsocket-ratelimit.h
+*********************************************************************/
+void ratelimit_report(struct ratelimit *rl, void (*print)(const char *line, void *ctx), void *ctx) {
+    struct ratelimit_client top[RATELIMIT_REPORT_TOP];
+    struct ratelimit_shard *shard;
+    struct ratelimit_stats stats;
+    char line[256], addr[INET6_ADDRSTRLEN];
+    int num_top = 0, s, i, j;
+
+    ratelimit_stats(rl, &stats);
+    snprintf(line, sizeof(line),
+             "ratelimit: connections %llu admitted %llu shed, packets %llu admitted %llu shed "
+             "(%llu bytes), %llu clients tracked, %llu evicted",
+             (unsigned long long)stats.conns_admitted, (unsigned long long)stats.conns_shed,
+             (unsigned long long)stats.packets_admitted, (unsigned long long)stats.packets_shed,
+             (unsigned long long)stats.bytes_shed, (unsigned long long)stats.clients,
+             (unsigned long long)stats.evictions);
+    print(line, ctx);
+
+    // Insertion into a short sorted list, shed most often first
+    for (s = 0; s < RATELIMIT_SHARDS; s++) {
+        shard = &rl->shards[s];
+        pthread_mutex_lock(&shard->lock);
+        for (i = 0; i < shard->used; i++) {
+            if (shard->clients[i].shed == 0 ||
+                (num_top == RATELIMIT_REPORT_TOP && shard->clients[i].shed <= top[num_top - 1].shed)) {
+                continue;
+            }
+            if (num_top < RATELIMIT_REPORT_TOP) {
+                num_top++;
+            }
+            for (j = num_top - 1; j > 0 && top[j - 1].shed < shard->clients[i].shed; j--) {
+                top[j] = top[j - 1];
+            }
+            top[j] = shard->clients[i];
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    for (i = 0; i < num_top; i++) {
+        format_key(top[i].addr, addr, sizeof(addr));
+        snprintf(line, sizeof(line), "ratelimit: %s shed %llu times", addr,
+                 (unsigned long long)top[i].shed);
+        print(line, ctx);
+    }
+}
+
+/********************************************************************
+See aesdsocket-ratelimit.h
+*********************************************************************/
+void ratelimit_destroy(struct ratelimit *rl) {
+    int s;
+
+    if (rl == NULL) {
+        return;
+    }
+    for (s = 0; s < RATELIMIT_SHARDS; s++) {
+        pthread_mutex_destroy(&rl->shards[s].lock);
+    }
+    free(rl);
+}
@@ -0,0 +1,90 @@
+/*
+ * aesdsocket-ratelimit.h
+ *
+ * Per client admission control for aesdsocket, selected with -r and -B.
+ *
+ * Every source address gets two token buckets, one for connections and one
+ * for packet bytes.  A connection or packet which finds its bucket empty is
+ * shed right away instead of waiting for a thread and the storage lock, so
+ * one aggressive client cannot raise the latency of the others.  Clients are
+ * kept in a hash table split in independently locked shards; when a shard is
+ * full the client seen least recently is forgotten.
+ */
+
+#ifndef AESDSOCKET_RATELIMIT_H
+#define AESDSOCKET_RATELIMIT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+// Defines
+#define RATELIMIT_SHARDS        16      // a power of two
+#define RATELIMIT_SHARD_CLIENTS 256     // clients tracked per shard
+#define RATELIMIT_REPORT_TOP    5       // most throttled clients listed by ratelimit_report()
+
+struct ratelimit;
+
+// Limits applied to each client, a rate of 0 disables that bucket
+struct ratelimit_config {
+    double conn_rate;           // connections per second
+    double conn_burst;          // connections allowed at once
+    double byte_rate;           // packet bytes per second
+    double byte_burst;          // packet bytes allowed at once
+};
+
+struct ratelimit_stats {
+    uint64_t conns_admitted;
+    uint64_t conns_shed;
+    uint64_t packets_admitted;
+    uint64_t packets_shed;
+    uint64_t bytes_shed;
+    uint64_t clients;           // clients currently tracked
+    uint64_t evictions;         // clients forgotten to make room
+};
+
+/**
+* Parse a "rate[:burst]" limit in @param spec into @param rate and
+* @param burst.  Without a burst it is one second worth of @param rate.
+* @return 0 on success, -1 if @param spec is not a positive rate.
+*/
+int ratelimit_parse(const char *spec, double *rate, double *burst);
+
+/**
+* Create a limiter applying @param config to every client.
+* @return the limiter, or NULL if out of memory.
+*/
+struct ratelimit *ratelimit_create(const struct ratelimit_config *config);
+
+/**
+* Take a connection token for the client at @param addr.
+* @return true if the connection is admitted, false if it should be shed.
+*/
+bool ratelimit_admit_conn(struct ratelimit *rl, const struct sockaddr *addr);
+
+/**
+* Take @param len byte tokens for a packet of the client at @param addr.  A
+* packet larger than the burst passes when the bucket is full, leaving it in
+* debt.
+* @return true if the packet is admitted, false if it should be shed.
+*/
+bool ratelimit_admit_bytes(struct ratelimit *rl, const struct sockaddr *addr, size_t len);
+
+/**
+* Sum the counters of every shard into @param stats.
+*/
+void ratelimit_stats(struct ratelimit *rl, struct ratelimit_stats *stats);
+
+/**
+* Call @param print with a line of totals, then a line for each of the
+* RATELIMIT_REPORT_TOP clients shed most often.
+*/
+void ratelimit_report(struct ratelimit *rl, void (*print)(const char *line, void *ctx), void *ctx);
+
+/**
+* Free the limiter, NULL is ignored.
+*/
+void ratelimit_destroy(struct ratelimit *rl);
+
+#endif /* AESDSOCKET_RATELIMIT_H */
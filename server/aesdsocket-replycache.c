@@ -0,0 +1,237 @@
+/*
+ * aesdsocket-replycache.c
+ *
+ * Reply image cache.
+ *
+ * Without it every connection reopens the device and reads back every entry
+ * while holding file_mutex, even though the content only ever changes by an
+ * entry appended at the tail and, once the driver is full, one evicted at the
+ * head.  The cache mirrors that: the reply is kept as a singly linked list of
+ * immutable chunks, one per entry, extended on append and trimmed on eviction.
+ *
+ * Every chunk holds a reference on the chunk after it and the cache holds one
+ * on the head.  A snapshot is then just a reference on the head chunk plus the
+ * number of chunks it covers: taking it is O(1), the chunks it covers cannot
+ * change or be freed while it is held, and it is sent after file_mutex has
+ * been released, so concurrent replies share the same memory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include "aesdsocket-replycache.h"
+
+// Defines
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+#define REPLYCACHE_IOV_BATCH    64
+
+// Types
+struct replycache_chunk {
+    atomic_uint refs;
+    struct replycache_chunk *next;  // set once, when the next entry is appended
+    uint64_t seq;
+    size_t len;
+    char data[];
+};
+
+struct replycache {
+    struct replycache_chunk *head;
+    struct replycache_chunk *tail;
+    size_t count;
+    size_t bytes;
+    size_t depth;
+    uint64_t next_seq;          // counts every append, valid or not
+    bool valid;
+};
+
+/********************************************************************
+Drop a reference on chunk c, freeing it and every chunk after it which
+was only kept alive by the chain.
+*********************************************************************/
+static void chunk_release(struct replycache_chunk *c) {
+    struct replycache_chunk *next;
+
+    while (c != NULL && atomic_fetch_sub_explicit(&c->refs, 1, memory_order_acq_rel) == 1) {
+        next = c->next;
+        free(c);
+        c = next;
+    }
+}
+
+static void chunk_ref(struct replycache_chunk *c) {
+    atomic_fetch_add_explicit(&c->refs, 1, memory_order_relaxed);
+}
+
+/********************************************************************
+Remove the oldest entry.
+*********************************************************************/
+static void replycache_trim(struct replycache *cache) {
+    struct replycache_chunk *old = cache->head;
+
+    cache->head = old->next;
+    if (cache->head != NULL) {
+        chunk_ref(cache->head);
+    } else {
+        cache->tail = NULL;
+    }
+    cache->count--;
+    cache->bytes -= old->len;
+    chunk_release(old);
+}
+
+/********************************************************************
+See aesdsocket-replycache.h
+*********************************************************************/
+struct replycache *replycache_create(size_t depth) {
+    struct replycache *cache = calloc(1, sizeof(struct replycache));
+
+    if (cache != NULL) {
+        cache->depth = depth;
+    }
+    return cache;
+}
+
+int replycache_append(struct replycache *cache, const char *buf, size_t len) {
+    struct replycache_chunk *c;
+
+    if (!cache->valid) {
+        cache->next_seq++;
+        return 0;
+    }
+
+    c = malloc(sizeof(struct replycache_chunk) + len);
+    if (c == NULL) {
+        replycache_invalidate(cache);
+        return -1;
+    }
+    // The reference is owned by the previous chunk, or by the cache for the head
+    atomic_init(&c->refs, 1);
+    c->next = NULL;
+    c->seq = cache->next_seq++;
+    c->len = len;
+    memcpy(c->data, buf, len);
+
+    if (cache->tail != NULL) {
+        cache->tail->next = c;
+    } else {
+        cache->head = c;
+    }
+    cache->tail = c;
+    cache->count++;
+    cache->bytes += len;
+
+    if (cache->depth > 0 && cache->count > cache->depth) {
+        replycache_trim(cache);
+    }
+    return 0;
+}
+
+void replycache_invalidate(struct replycache *cache) {
+    chunk_release(cache->head);
+    cache->head = NULL;
+    cache->tail = NULL;
+    cache->count = 0;
+    cache->bytes = 0;
+    cache->valid = false;
+}
+
+bool replycache_valid(const struct replycache *cache) {
+    return cache->valid;
+}
+
+int replycache_rebuild(struct replycache *cache, const char *buf, const size_t *lens, size_t count) {
+    size_t i;
+
+    // The device content ends with the last entry appended, number it back from there
+    replycache_invalidate(cache);
+    cache->next_seq = cache->next_seq >= count ? cache->next_seq - count : 0;
+    cache->valid = true;
+
+    for (i = 0; i < count; i++) {
+        if (replycache_append(cache, buf, lens[i]) != 0) {
+            return -1;
+        }
+        buf += lens[i];
+    }
+    return 0;
+}
+
+int replycache_snapshot(struct replycache *cache, struct replycache_snapshot *snap) {
+    if (!cache->valid) {
+        return -1;
+    }
+    snap->head = cache->head;
+    snap->count = cache->count;
+    snap->bytes = cache->bytes;
+    snap->next_seq = cache->next_seq;
+    if (snap->head != NULL) {
+        chunk_ref(snap->head);
+    }
+    return 0;
+}
+
+void replycache_snapshot_since(struct replycache_snapshot *snap, uint64_t seq) {
+    struct replycache_chunk *old = snap->head;
+    struct replycache_chunk *c = snap->head;
+
+    if (snap->count == 0 || c->seq >= seq) {
+        return;
+    }
+
+    // Walk the snapshot only, chunks past its last one may be changing
+    while (snap->count > 0 && c->seq < seq) {
+        snap->bytes -= c->len;
+        if (--snap->count > 0) {
+            c = c->next;
+        }
+    }
+    if (snap->count > 0) {
+        chunk_ref(c);
+        snap->head = c;
+    } else {
+        snap->head = NULL;
+    }
+    chunk_release(old);
+}
+
+int replycache_foreach(const struct replycache_snapshot *snap,
+                       int (*fn)(struct iovec *iov, int iovcnt, void *ctx), void *ctx) {
+    struct iovec iov[REPLYCACHE_IOV_BATCH < IOV_MAX ? REPLYCACHE_IOV_BATCH : IOV_MAX];
+    const struct replycache_chunk *c = snap->head;
+    size_t left = snap->count;
+    int n, rc;
+
+    while (left > 0) {
+        // Never look past the last chunk of the snapshot, its next may be changing
+        for (n = 0; n < (int)(sizeof iov / sizeof iov[0]) && left > 0; n++, left--) {
+            iov[n].iov_base = (void *)c->data;
+            iov[n].iov_len = c->len;
+            if (left > 1) {
+                c = c->next;
+            }
+        }
+        if ((rc = fn(iov, n, ctx)) != 0) {
+            return rc;
+        }
+    }
+    return 0;
+}
+
+void replycache_release(struct replycache_snapshot *snap) {
+    chunk_release(snap->head);
+    snap->head = NULL;
+    snap->count = 0;
+    snap->bytes = 0;
+}
+
+void replycache_destroy(struct replycache *cache) {
+    if (cache == NULL) {
+        return;
+    }
+    replycache_invalidate(cache);
+    free(cache);
+}
@@ -0,0 +1,91 @@
+/*
+ * aesdsocket-replycache.h
+ *
+ * Reply image cache for the char device backend of aesdsocket, selected with -c.
+ * Appends, trims and snapshots are serialized by the caller with file_mutex,
+ * snapshots can then be sent and released without holding it.
+ */
+
+#ifndef AESDSOCKET_REPLYCACHE_H
+#define AESDSOCKET_REPLYCACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+struct replycache;
+struct replycache_chunk;
+
+// An immutable view of the reply at the time it was taken
+struct replycache_snapshot {
+    struct replycache_chunk *head;
+    size_t count;               // chunks in the reply
+    size_t bytes;               // total reply length
+    uint64_t next_seq;          // sequence number of the entry after the last one
+};
+
+/**
+* Create a cache holding the last @param depth entries, 0 for no limit.
+* @return the cache, or NULL if out of memory.
+*/
+struct replycache *replycache_create(size_t depth);
+
+/**
+* Append one entry of @param len bytes, dropping the oldest entry once
+* there are more than depth.  Does nothing while the cache is invalid.
+* @return 0 on success, -1 if out of memory, which invalidates the cache.
+*/
+int replycache_append(struct replycache *cache, const char *buf, size_t len);
+
+/**
+* Drop every entry and mark the cache invalid until the next rebuild.
+*/
+void replycache_invalidate(struct replycache *cache);
+
+/**
+* @return true if the cache content matches the storage.
+*/
+bool replycache_valid(const struct replycache *cache);
+
+/**
+* Replace the content of the cache with the @param count entries of
+* @param buf, as read back from the storage, and mark it valid.  Entry i is
+* @param lens [i] bytes long, split the way the storage holds them: a write
+* is one entry whatever newlines it contains.
+* @return 0 on success, -1 if out of memory.
+*/
+int replycache_rebuild(struct replycache *cache, const char *buf, const size_t *lens, size_t count);
+
+/**
+* Take a snapshot of the reply.  It holds a reference on the chunks, which
+* stay valid until replycache_release() whatever happens to the cache.
+* @return 0 on success, -1 if the cache is invalid.
+*/
+int replycache_snapshot(struct replycache *cache, struct replycache_snapshot *snap);
+
+/**
+* Drop the entries before sequence number @param seq from @param snap.  Every
+* entry appended gets the next sequence number, starting from 0, including the
+* entries appended while the cache was invalid.
+*/
+void replycache_snapshot_since(struct replycache_snapshot *snap, uint64_t seq);
+
+/**
+* Call @param fn with the chunks of @param snap, up to IOV_MAX at a time.
+* @return 0, or the first non zero value returned by @param fn.
+*/
+int replycache_foreach(const struct replycache_snapshot *snap,
+                       int (*fn)(struct iovec *iov, int iovcnt, void *ctx), void *ctx);
+
+/**
+* Release the references held by @param snap.
+*/
+void replycache_release(struct replycache_snapshot *snap);
+
+/**
+* Free the cache.  Outstanding snapshots stay valid until released.
+*/
+void replycache_destroy(struct replycache *cache);
+
+#endif /* AESDSOCKET_REPLYCACHE_H */
@@ -0,0 +1,582 @@
+/*
+ * aesdsocket-seglog.c
+ *
+ * Persistent segmented log backend.
+ *
+ * The log is a directory of segments, each a pair of files named after the
+ * sequence number of its first record:
+ *
+ *  - <seq>.log holds the packets back to back, exactly as they are replied,
+ *    so a reply is sent straight from a mapping of the file
+ *  - <seq>.idx holds one fixed size seglog_index_entry per record with its
+ *    sequence number, offset, length and the CRC32 of its bytes, the entry
+ *    itself being protected by its own CRC32
+ *
+ * Records are only ever appended to the last (active) segment, the data first
+ * and the index entries after it.  A crash can therefore only leave a torn
+ * tail on the active segment: recovery maps its index, walks back from the
+ * last entry to the first one whose entry and data CRCs check out and
+ * truncates both files there.  Older segments are sealed and trusted, so the
+ * cost of a restart does not depend on the amount of history.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "aesdsocket-seglog.h"
+#include "aesdsocket-logger.h"
+
+// Defines
+#define SEGLOG_MAX_BATCH    64      // index entries written with one pwrite()
+
+// Types
+struct seglog_index_entry {
+    uint64_t seq;
+    uint64_t offset;            // of the record in the segment data file
+    uint32_t length;
+    uint32_t data_crc;          // CRC32 of the record bytes
+    uint32_t reserved;
+    uint32_t entry_crc;         // CRC32 of the fields above
+};
+
+struct seglog_segment {
+    uint64_t base_seq;          // sequence number of the first record
+    uint64_t count;             // number of records, only tracked for the active segment
+    size_t length;              // bytes of record data
+    char *map;                  // read-only mapping of the data file
+    size_t map_len;
+};
+
+struct seglog {
+    char *dir;
+    size_t segment_size;
+    struct seglog_segment *segs;
+    size_t nsegs;
+    size_t cap;
+    int data_fd;                // files of the active segment, segs[nsegs - 1]
+    int idx_fd;
+    uint64_t next_seq;
+};
+
+// File Private Vars
+static uint32_t Crc32Table[256];
+static pthread_once_t Crc32Once = PTHREAD_ONCE_INIT;
+
+/********************************************************************
+CRC32 (IEEE 802.3, reflected polynomial 0xEDB88320)
+*********************************************************************/
+static void crc32_init(void) {
+    uint32_t c;
+    int i, k;
+
+    for (i = 0; i < 256; i++) {
+        c = i;
+        for (k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        Crc32Table[i] = c;
+    }
+}
+
+static uint32_t crc32(const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    uint32_t c = 0xFFFFFFFFu;
+
+    while (len--) {
+        c = Crc32Table[(c ^ *p++) & 0xff] ^ (c >> 8);
+    }
+    return c ^ 0xFFFFFFFFu;
+}
+
+static uint32_t entry_crc(const struct seglog_index_entry *entry) {
+    return crc32(entry, offsetof(struct seglog_index_entry, entry_crc));
+}
+
+/********************************************************************
+*********************************************************************/
+static void segment_path(const struct seglog *log, uint64_t base_seq, const char *ext,
+                         char *path, size_t size) {
+    snprintf(path, size, "%s/%020" PRIu64 ".%s", log->dir, base_seq, ext);
+}
+
+static size_t round_to_page(size_t len) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    return (len + page - 1) / page * page;
+}
+
+/********************************************************************
+Map @param len bytes of segment data file @param fd, replacing any
+previous mapping.  The active segment is mapped segment_size bytes ahead
+so appends rarely need a remap.
+Returns 0 on success, -1 on failure.
+*********************************************************************/
+static int segment_map(struct seglog_segment *seg, int fd, size_t len) {
+    char *map;
+
+    if (len == 0) {
+        len = 1;
+    }
+    len = round_to_page(len);
+    map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        AESD_LOG(LOG_ERR, "Failed to map segment %" PRIu64 ": %s", seg->base_seq, strerror(errno));
+        return -1;
+    }
+    if (seg->map != NULL) {
+        munmap(seg->map, seg->map_len);
+    }
+    seg->map = map;
+    seg->map_len = len;
+    return 0;
+}
+
+static struct seglog_segment *segment_add(struct seglog *log, uint64_t base_seq) {
+    struct seglog_segment *segs;
+
+    if (log->nsegs == log->cap) {
+        log->cap = log->cap ? log->cap * 2 : 16;
+        segs = realloc(log->segs, log->cap * sizeof(struct seglog_segment));
+        if (segs == NULL) {
+            return NULL;
+        }
+        log->segs = segs;
+    }
+    memset(&log->segs[log->nsegs], 0, sizeof(struct seglog_segment));
+    log->segs[log->nsegs].base_seq = base_seq;
+    return &log->segs[log->nsegs++];
+}
+
+/********************************************************************
+Open the files of segment @param seg as the active segment.
+*********************************************************************/
+static int segment_open_active(struct seglog *log, struct seglog_segment *seg) {
+    char path[PATH_MAX];
+
+    segment_path(log, seg->base_seq, "log", path, sizeof path);
+    log->data_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (log->data_fd == -1) {
+        AESD_LOG(LOG_ERR, "Failed to open %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    segment_path(log, seg->base_seq, "idx", path, sizeof path);
+    log->idx_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (log->idx_fd == -1) {
+        AESD_LOG(LOG_ERR, "Failed to open %s: %s", path, strerror(errno));
+        close(log->data_fd);
+        log->data_fd = -1;
+        return -1;
+    }
+
+    return segment_map(seg, log->data_fd,
+                       seg->length > log->segment_size ? seg->length : log->segment_size);
+}
+
+/********************************************************************
+Map a sealed segment, its length is the size of its data file.
+*********************************************************************/
+static int segment_open_sealed(struct seglog *log, struct seglog_segment *seg) {
+    char path[PATH_MAX];
+    struct stat st;
+    int fd, rc = -1;
+
+    segment_path(log, seg->base_seq, "log", path, sizeof path);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+        AESD_LOG(LOG_ERR, "Failed to open %s: %s", path, strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &st) == 0) {
+        seg->length = st.st_size;
+        rc = segment_map(seg, fd, seg->length);
+    }
+    close(fd);
+    return rc;
+}
+
+/********************************************************************
+Recover the active segment: find its last intact record from the tail
+of the index and cut off anything a crash left behind it.
+*********************************************************************/
+static int segment_recover(struct seglog *log, struct seglog_segment *seg) {
+    const struct seglog_index_entry *index = NULL;
+    struct stat data_st, idx_st;
+    uint64_t n, valid = 0;
+    size_t length = 0;
+
+    if (fstat(log->data_fd, &data_st) == -1 || fstat(log->idx_fd, &idx_st) == -1) {
+        return -1;
+    }
+
+    n = idx_st.st_size / sizeof(struct seglog_index_entry);
+    if (n > 0) {
+        index = mmap(NULL, n * sizeof(struct seglog_index_entry), PROT_READ, MAP_SHARED, log->idx_fd, 0);
+        if (index == MAP_FAILED) {
+            AESD_LOG(LOG_ERR, "Failed to map index of segment %" PRIu64 ": %s", seg->base_seq, strerror(errno));
+            return -1;
+        }
+        if ((size_t)data_st.st_size > seg->map_len && segment_map(seg, log->data_fd, data_st.st_size) != 0) {
+            munmap((void *)index, n * sizeof(struct seglog_index_entry));
+            return -1;
+        }
+    }
+
+    for (valid = n; valid > 0; valid--) {
+        const struct seglog_index_entry *e = &index[valid - 1];
+
+        if (e->entry_crc == entry_crc(e) && e->seq == seg->base_seq + valid - 1 &&
+            e->offset + e->length <= (uint64_t)data_st.st_size &&
+            e->data_crc == crc32(seg->map + e->offset, e->length)) {
+            length = e->offset + e->length;
+            break;
+        }
+    }
+
+    if (index != NULL) {
+        munmap((void *)index, n * sizeof(struct seglog_index_entry));
+    }
+
+    if (valid != n || (size_t)data_st.st_size != length ||
+        (uint64_t)idx_st.st_size != valid * sizeof(struct seglog_index_entry)) {
+        AESD_LOG(LOG_WARNING, "Segment %" PRIu64 ": recovered %" PRIu64 " of %" PRIu64 " records, truncating",
+               seg->base_seq, valid, n);
+        if (ftruncate(log->data_fd, length) == -1 ||
+            ftruncate(log->idx_fd, valid * sizeof(struct seglog_index_entry)) == -1) {
+            AESD_LOG(LOG_ERR, "Failed to truncate segment %" PRIu64 ": %s", seg->base_seq, strerror(errno));
+            return -1;
+        }
+    }
+
+    seg->count = valid;
+    seg->length = length;
+    log->next_seq = seg->base_seq + valid;
+    return 0;
+}
+
+static int compare_seq(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/********************************************************************
+Collect the base sequence numbers of every segment in the directory.
+*********************************************************************/
+static int list_segments(const char *dir, uint64_t **seqs, size_t *count) {
+    DIR *d;
+    struct dirent *ent;
+    uint64_t seq, *list = NULL, *tmp;
+    size_t n = 0, cap = 0;
+    char ext[8];
+
+    if ((d = opendir(dir)) == NULL) {
+        AESD_LOG(LOG_ERR, "Failed to open log directory %s: %s", dir, strerror(errno));
+        return -1;
+    }
+    while ((ent = readdir(d)) != NULL) {
+        if (strlen(ent->d_name) != 24 || sscanf(ent->d_name, "%20" SCNu64 ".%3s", &seq, ext) != 2 ||
+            strcmp(ext, "log") != 0) {
+            continue;
+        }
+        if (n == cap) {
+            cap = cap ? cap * 2 : 16;
+            if ((tmp = realloc(list, cap * sizeof(uint64_t))) == NULL) {
+                free(list);
+                closedir(d);
+                return -1;
+            }
+            list = tmp;
+        }
+        list[n++] = seq;
+    }
+    closedir(d);
+
+    qsort(list, n, sizeof(uint64_t), compare_seq);
+    *seqs = list;
+    *count = n;
+    return 0;
+}
+
+/********************************************************************
+See aesdsocket-seglog.h
+*********************************************************************/
+struct seglog *seglog_open(const char *dir, size_t segment_size) {
+    struct seglog *log;
+    struct seglog_segment *seg;
+    uint64_t *seqs = NULL;
+    size_t count = 0, i;
+
+    pthread_once(&Crc32Once, crc32_init);
+
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        AESD_LOG(LOG_ERR, "Failed to create log directory %s: %s", dir, strerror(errno));
+        return NULL;
+    }
+
+    if ((log = calloc(1, sizeof(struct seglog))) == NULL) {
+        return NULL;
+    }
+    log->dir = strdup(dir);
+    log->segment_size = segment_size;
+    log->data_fd = -1;
+    log->idx_fd = -1;
+
+    if (log->dir == NULL || list_segments(dir, &seqs, &count) != 0) {
+        goto exit_fail;
+    }
+
+    for (i = 0; i + 1 < count; i++) {
+        if ((seg = segment_add(log, seqs[i])) == NULL || segment_open_sealed(log, seg) != 0) {
+            goto exit_fail;
+        }
+    }
+
+    if ((seg = segment_add(log, count ? seqs[count - 1] : 0)) == NULL ||
+        segment_open_active(log, seg) != 0 || segment_recover(log, seg) != 0) {
+        goto exit_fail;
+    }
+
+    AESD_LOG(LOG_INFO, "Opened log %s: %zu segment(s), next record %" PRIu64, dir, log->nsegs, log->next_seq);
+    free(seqs);
+    return log;
+
+exit_fail:
+    free(seqs);
+    seglog_close(log);
+    return NULL;
+}
+
+/********************************************************************
+Seal the active segment and start a new one at next_seq.  The sealed
+segment is synced so recovery never has to look at it again.
+*********************************************************************/
+static int seglog_roll(struct seglog *log) {
+    struct seglog_segment *seg;
+
+    if (seglog_sync(log) != 0) {
+        return -1;
+    }
+    close(log->data_fd);
+    close(log->idx_fd);
+    log->data_fd = -1;
+    log->idx_fd = -1;
+
+    if ((seg = segment_add(log, log->next_seq)) == NULL) {
+        return -1;
+    }
+    return segment_open_active(log, seg);
+}
+
+/********************************************************************
+Append iov[0..iovcnt) to the active segment, which must have room.
+*********************************************************************/
+static int seglog_write_batch(struct seglog *log, struct iovec *iov, int iovcnt) {
+    struct seglog_segment *seg = &log->segs[log->nsegs - 1];
+    struct seglog_index_entry entries[SEGLOG_MAX_BATCH];
+    size_t offset = seg->length, total = 0;
+    ssize_t n;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        entries[i].seq = seg->base_seq + seg->count + i;
+        entries[i].offset = offset + total;
+        entries[i].length = iov[i].iov_len;
+        entries[i].data_crc = crc32(iov[i].iov_base, iov[i].iov_len);
+        entries[i].reserved = 0;
+        entries[i].entry_crc = entry_crc(&entries[i]);
+        total += iov[i].iov_len;
+    }
+
+    // Data first, a torn write is then never referenced by the index
+    while (iovcnt > 0) {
+        n = pwritev(log->data_fd, iov, iovcnt, offset);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            goto exit_fail;
+        }
+        offset += n;
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    n = i * sizeof(struct seglog_index_entry);
+    if (pwrite(log->idx_fd, entries, n, seg->count * sizeof(struct seglog_index_entry)) != n) {
+        goto exit_fail;
+    }
+
+    seg->count += i;
+    seg->length += total;
+    log->next_seq += i;
+
+    if (seg->length > seg->map_len) {
+        return segment_map(seg, log->data_fd, seg->length);
+    }
+    return 0;
+
+exit_fail:
+    AESD_LOG(LOG_ERR, "Failed to append to segment %" PRIu64 ": %s", seg->base_seq, strerror(errno));
+    // Leave the segment as recovery would find it
+    (void)ftruncate(log->data_fd, seg->length);
+    (void)ftruncate(log->idx_fd, seg->count * sizeof(struct seglog_index_entry));
+    return -1;
+}
+
+int seglog_appendv(struct seglog *log, struct iovec *iov, int iovcnt) {
+    struct seglog_segment *seg;
+    size_t room;
+    int n;
+
+    while (iovcnt > 0) {
+        seg = &log->segs[log->nsegs - 1];
+        if (seg->count > 0 && seg->length + iov[0].iov_len > log->segment_size) {
+            if (seglog_roll(log) != 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        // Take every record which fits in the segment, at least one
+        room = log->segment_size > seg->length ? log->segment_size - seg->length : 0;
+        for (n = 0; n < iovcnt && n < SEGLOG_MAX_BATCH; n++) {
+            if (n > 0 && iov[n].iov_len > room) {
+                break;
+            }
+            room = iov[n].iov_len > room ? 0 : room - iov[n].iov_len;
+        }
+
+        if (seglog_write_batch(log, iov, n) != 0) {
+            return -1;
+        }
+        iov += n;
+        iovcnt -= n;
+    }
+    return 0;
+}
+
+int seglog_append(struct seglog *log, const char *buf, size_t len) {
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+
+    return seglog_appendv(log, &iov, 1);
+}
+
+int seglog_sync(struct seglog *log) {
+    if (fdatasync(log->data_fd) == -1 || fdatasync(log->idx_fd) == -1) {
+        AESD_LOG(LOG_ERR, "Failed to sync log: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int seglog_foreach_segment(struct seglog *log,
+                           int (*fn)(const char *data, size_t len, void *ctx), void *ctx) {
+    return seglog_foreach_since(log, 0, fn, ctx);
+}
+
+/********************************************************************
+Find the data offset of record @param seq in segment @param i from its
+index entry.  Returns 0 on success, -1 on failure.
+*********************************************************************/
+static int segment_record_offset(struct seglog *log, size_t i, uint64_t seq, size_t *offset) {
+    struct seglog_index_entry entry;
+    char path[PATH_MAX];
+    off_t pos = (seq - log->segs[i].base_seq) * sizeof(struct seglog_index_entry);
+    int fd = log->idx_fd;
+    ssize_t n;
+
+    if (i + 1 < log->nsegs) {
+        segment_path(log, log->segs[i].base_seq, "idx", path, sizeof path);
+        if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+            AESD_LOG(LOG_ERR, "Failed to open %s: %s", path, strerror(errno));
+            return -1;
+        }
+    }
+    n = pread(fd, &entry, sizeof entry, pos);
+    if (fd != log->idx_fd) {
+        close(fd);
+    }
+    if (n != sizeof entry || entry.seq != seq || entry.entry_crc != entry_crc(&entry)) {
+        AESD_LOG(LOG_ERR, "Bad index entry for record %" PRIu64, seq);
+        return -1;
+    }
+    *offset = entry.offset;
+    return 0;
+}
+
+int seglog_foreach_since(struct seglog *log, uint64_t seq,
+                         int (*fn)(const char *data, size_t len, void *ctx), void *ctx) {
+    size_t lo = 0, hi = log->nsegs, mid, i, offset = 0;
+    int rc;
+
+    if (seq >= log->next_seq) {
+        return 0;
+    }
+
+    // Last segment starting at or before seq
+    while (hi - lo > 1) {
+        mid = (lo + hi) / 2;
+        if (log->segs[mid].base_seq <= seq) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    if (seq > log->segs[lo].base_seq && segment_record_offset(log, lo, seq, &offset) != 0) {
+        return -1;
+    }
+
+    for (i = lo; i < log->nsegs; i++, offset = 0) {
+        if (log->segs[i].length <= offset) {
+            continue;
+        }
+        if ((rc = fn(log->segs[i].map + offset, log->segs[i].length - offset, ctx)) != 0) {
+            return rc;
+        }
+    }
+    return 0;
+}
+
+uint64_t seglog_next_seq(const struct seglog *log) {
+    return log->next_seq;
+}
+
+void seglog_close(struct seglog *log) {
+    size_t i;
+
+    if (log == NULL) {
+        return;
+    }
+    for (i = 0; i < log->nsegs; i++) {
+        if (log->segs[i].map != NULL) {
+            munmap(log->segs[i].map, log->segs[i].map_len);
+        }
+    }
+    if (log->data_fd != -1) {
+        close(log->data_fd);
+    }
+    if (log->idx_fd != -1) {
+        close(log->idx_fd);
+    }
+    free(log->segs);
+    free(log->dir);
+    free(log);
+}
@@ -0,0 +1,70 @@
+/*
+ * aesdsocket-seglog.h
+ *
+ * Persistent segmented log backend for aesdsocket, selected with -L.
+ * None of the functions lock, callers serialize them with file_mutex.
+ */
+
+#ifndef AESDSOCKET_SEGLOG_H
+#define AESDSOCKET_SEGLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#ifndef SEGLOG_SEGMENT_SIZE
+#define SEGLOG_SEGMENT_SIZE (64 * 1024 * 1024)  // roll to a new segment after this many bytes
+#endif
+
+struct seglog;
+
+/**
+* Open (creating it if needed) the log in directory @param dir and recover it.
+* Segments are rolled once they hold @param segment_size bytes.
+* @return the log, or NULL on failure.
+*/
+struct seglog *seglog_open(const char *dir, size_t segment_size);
+
+/**
+* Append one record per iovec.  @param iov may be modified.
+* @return 0 on success, -1 on failure, in which case none of the records of the
+* current segment past the last successful append are kept.
+*/
+int seglog_appendv(struct seglog *log, struct iovec *iov, int iovcnt);
+
+/**
+* Append the single record @param buf of @param len bytes.
+*/
+int seglog_append(struct seglog *log, const char *buf, size_t len);
+
+/**
+* fdatasync the data and index of the active segment.
+*/
+int seglog_sync(struct seglog *log);
+
+/**
+* Call @param fn with the contiguous content of every segment, oldest first.
+* The content is served from read-only mappings of the segment files.
+* @return 0, or the first non zero value returned by @param fn.
+*/
+int seglog_foreach_segment(struct seglog *log,
+                           int (*fn)(const char *data, size_t len, void *ctx), void *ctx);
+
+/**
+* Like seglog_foreach_segment() but starting at the record with sequence number
+* @param seq, or at the oldest record when it is older than the log.
+*/
+int seglog_foreach_since(struct seglog *log, uint64_t seq,
+                         int (*fn)(const char *data, size_t len, void *ctx), void *ctx);
+
+/**
+* @return the sequence number the next appended record gets.
+*/
+uint64_t seglog_next_seq(const struct seglog *log);
+
+/**
+* Unmap and close every segment and free @param log.
+*/
+void seglog_close(struct seglog *log);
+
+#endif /* AESDSOCKET_SEGLOG_H */
@@ -1,17 +1,26 @@
 #!/bin/sh
 # Created by Ryan Hamor 1/29/2024
 
+# Unix socket the listening sockets are handed over on at restart
+HANDOFF=/var/run/aesdsocket.sock
+
 case $1 in
     start)
         echo "Starting aesdsocket"
-        start-stop-daemon -S -n aesdsocket --exec /usr/bin/aesdsocket -- -d
+        start-stop-daemon -S -n aesdsocket --exec /usr/bin/aesdsocket -- -d -H $HANDOFF
         ;;
     stop)
         echo "Stopping aesdsocket"
         start-stop-daemon -K -n aesdsocket
         ;;
+    restart)
+        # The new server takes the listening sockets over from the running one,
+        # which exits once its connections are served.  No connection is refused.
+        echo "Restarting aesdsocket"
+        /usr/bin/aesdsocket -d -H $HANDOFF
+        ;;
     *)
-        echo "Usage: $0 {start|stop}"
+        echo "Usage: $0 {start|stop|restart}"
     exit 1
 esac
 
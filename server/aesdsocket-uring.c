@@ -0,0 +1,859 @@
+/*
+ * aesdsocket-uring.c
+ *
+ * io_uring execution backend for aesdsocket.
+ *
+ * The thread backend spends a long chain of syscalls on every request: recv
+ * polling, open, write, a read/send pair per device entry and two closes.  This
+ * backend serves every connection of a listener from one thread and one ring:
+ *
+ *  - accept goes straight into the fixed file table (no fd is ever installed)
+ *  - the packet is received into a per connection registered buffer
+ *  - the device write and the first device read are submitted as one linked
+ *    chain against the device, which is registered once as fixed file 0
+ *  - the reply is sent with MSG_WAITALL, and the rest of a short send (kernels
+ *    before 5.19 may stop early on stream sockets) is sent again from where it
+ *    stopped, the connection is closed once the last byte went out
+ *
+ * Device reads use explicit offsets so a single device fd serves every
+ * connection.  Like the thread backend, the write and all reads of a request
+ * happen under file_mutex, so every reply is a consistent snapshot that ends
+ * with the packet of that request.  Only one connection of a ring is in that
+ * device phase at a time, the others wait in a FIFO.
+ *
+ * liburing is not required, the ring is driven with the raw syscalls.  Direct
+ * (fixed file) accept needs Linux 5.15 or later, on older kernels
+ * aesd_uring_run() returns -1 and the listener falls back to threads.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include "aesdsocket.h"
+#include "aesdsocket-uring.h"
+#include "aesdsocket-logger.h"
+#include "aesdsocket-ratelimit.h"
+
+// Defines
+#define URING_ENTRIES       256
+#define URING_MAX_CONNS     64
+#define URING_BUF_SIZE      0x4000  // registered receive buffer per connection
+#define URING_READ_SIZE     0x4000  // initial reply buffer, grows as needed
+#define URING_DEVICE_FILE   0       // fixed file index of the device
+#define URING_CONN_FILE(slot)   (1 + (slot))
+
+#define USER_DATA(slot, op) (((uint64_t)(slot) << 8) | (op))
+#define USER_DATA_SLOT(ud)  ((int)((ud) >> 8))
+#define USER_DATA_OP(ud)    ((int)((ud) & 0xff))
+
+// Types
+enum uring_op {
+    OP_ACCEPT,
+    OP_RECV,
+    OP_DEV_WRITE,
+    OP_DEV_READ,
+    OP_SEND,
+    OP_CLOSE,
+    OP_CANCEL,
+};
+
+enum conn_state {
+    CONN_FREE,
+    CONN_ACCEPTING,
+    CONN_RECV,
+    CONN_WAIT_DEVICE,
+    CONN_DEVICE,
+    CONN_SEND,
+};
+
+struct uring_conn {
+    enum conn_state state;
+    int slot;
+    char *rxbuf;                // registered buffer, URING_BUF_SIZE + 1 for a null
+    size_t rx_len;
+    char *packet;               // heap copy once a packet spans several receives
+    size_t packet_len;
+    size_t packet_cap;
+    bool write_failed;
+    char *reply;
+    size_t reply_len;
+    size_t reply_cap;
+    size_t sent;                // bytes of the reply sent so far
+    uint64_t read_pos;
+    struct uring_conn *next_waiting;
+    struct sockaddr_storage peer;   // filled in by accept for the rate limiter
+    socklen_t peer_len;
+};
+
+struct uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *ring_ptr;
+    size_t ring_size;
+    size_t sqes_size;
+    unsigned to_submit;
+};
+
+struct uring_server {
+    struct uring ring;
+    int listen_fd;
+    int device_fd;
+    struct prof_lock *file_mutex;
+    struct ratelimit *limiter;
+    size_t max_packet;          // longer packets are closed without a reply
+    char *buffers;
+    struct uring_conn conns[URING_MAX_CONNS];
+    struct uring_conn *device_owner;
+    struct uring_conn *waiting_head;
+    struct uring_conn *waiting_tail;
+    bool accept_armed;
+    int accept_slot;            // connection the armed accept fills in
+    bool accept_cancelled;
+    bool accepted_any;
+    bool unsupported;
+};
+
+/********************************************************************
+Raw io_uring syscalls
+*********************************************************************/
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+                              void *arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/********************************************************************
+Create the ring and map the submission and completion queues
+*********************************************************************/
+static int ring_init(struct uring *ring) {
+    struct io_uring_params p;
+    size_t sq_size, cq_size;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&p, 0, sizeof(p));
+
+    ring->fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    if (ring->fd < 0) {
+        return -1;
+    }
+
+    // Everything below relies on these, all present since Linux 5.11
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG) ||
+        !(p.features & IORING_FEAT_RW_CUR_POS)) {
+        close(ring->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->ring_ptr = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ring->fd, IORING_OFF_SQ_RING);
+    if (ring->ring_ptr == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        munmap(ring->ring_ptr, ring->ring_size);
+        close(ring->fd);
+        return -1;
+    }
+
+    ring->sq_entries = p.sq_entries;
+    ring->sq_head = (unsigned *)((char *)ring->ring_ptr + p.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->ring_ptr + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->ring_ptr + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->ring_ptr + p.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->ring_ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->ring_ptr + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->ring_ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->ring_ptr + p.cq_off.cqes);
+
+    return 0;
+}
+
+static void ring_exit(struct uring *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->ring_ptr, ring->ring_size);
+    close(ring->fd);
+}
+
+/********************************************************************
+Submit queued SQEs and wait for at least min_complete completions or
+RECV_POLL_MS, whichever comes first.
+*********************************************************************/
+static int ring_submit_and_wait(struct uring *ring, unsigned min_complete) {
+    struct __kernel_timespec ts = { .tv_sec = 0, .tv_nsec = RECV_POLL_MS * 1000000L };
+    struct io_uring_getevents_arg arg;
+    int rc;
+
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+
+    rc = sys_io_uring_enter(ring->fd, ring->to_submit, min_complete,
+                            IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if (rc >= 0) {
+        ring->to_submit -= (unsigned)rc < ring->to_submit ? (unsigned)rc : ring->to_submit;
+        return 0;
+    }
+    if (errno == ETIME || errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+        return 0;
+    }
+    return -1;
+}
+
+/********************************************************************
+Get a zeroed SQE, flushing the queue to the kernel when it is full
+*********************************************************************/
+static struct io_uring_sqe *ring_get_sqe(struct uring *ring) {
+    unsigned head, tail = *ring->sq_tail;
+    struct io_uring_sqe *sqe;
+
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    while (tail - head >= ring->sq_entries) {
+        if (sys_io_uring_enter(ring->fd, ring->to_submit, 0, 0, NULL, 0) > 0) {
+            ring->to_submit = 0;
+        }
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    }
+
+    sqe = &ring->sqes[tail & *ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+    return sqe;
+}
+
+/********************************************************************
+Make room for n SQEs so a linked chain is never split across two
+submissions
+*********************************************************************/
+static void ring_reserve(struct uring *ring, unsigned n) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    if (ring->sq_entries - (*ring->sq_tail - head) < n) {
+        if (sys_io_uring_enter(ring->fd, ring->to_submit, 0, 0, NULL, 0) > 0) {
+            ring->to_submit = 0;
+        }
+    }
+}
+
+static void prep_rw(struct io_uring_sqe *sqe, int op, int fd, const void *addr, unsigned len,
+                    uint64_t off, uint64_t user_data) {
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = user_data;
+}
+
+/********************************************************************
+Check the kernel knows every opcode this backend submits
+*********************************************************************/
+static bool ring_probe(struct uring *ring) {
+    static const int needed[] = { IORING_OP_ACCEPT, IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED,
+                                  IORING_OP_WRITE, IORING_OP_READ, IORING_OP_SEND, IORING_OP_CLOSE,
+                                  IORING_OP_ASYNC_CANCEL };
+    struct io_uring_probe *probe;
+    size_t size = sizeof(*probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    bool ok = true;
+    size_t i;
+
+    probe = calloc(1, size);
+    if (probe == NULL) {
+        return false;
+    }
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) < 0) {
+        free(probe);
+        return false;
+    }
+    for (i = 0; i < sizeof(needed) / sizeof(needed[0]); i++) {
+        if (needed[i] > probe->last_op || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED)) {
+            ok = false;
+        }
+    }
+    free(probe);
+    return ok;
+}
+
+/********************************************************************
+Connection helpers
+*********************************************************************/
+static struct uring_conn *conn_alloc(struct uring_server *srv) {
+    int i;
+
+    for (i = 0; i < URING_MAX_CONNS; i++) {
+        if (srv->conns[i].state == CONN_FREE) {
+            return &srv->conns[i];
+        }
+    }
+    return NULL;
+}
+
+static void conn_reset(struct uring_conn *conn) {
+    conn->state = CONN_FREE;
+    conn->rx_len = 0;
+    conn->packet_len = 0;
+    conn->reply_len = 0;
+    conn->sent = 0;
+    conn->read_pos = 0;
+    conn->write_failed = false;
+    conn->next_waiting = NULL;
+}
+
+static void arm_accept(struct uring_server *srv) {
+    struct uring_conn *conn;
+    struct io_uring_sqe *sqe;
+
+    if (srv->accept_armed || ShutdownNow || DrainNow) {
+        return;
+    }
+    // With every slot busy accepting pauses until a connection closes
+    if ((conn = conn_alloc(srv)) == NULL) {
+        return;
+    }
+
+    conn->state = CONN_ACCEPTING;
+    conn->peer_len = sizeof(conn->peer);
+    sqe = ring_get_sqe(&srv->ring);
+    prep_rw(sqe, IORING_OP_ACCEPT, srv->listen_fd, &conn->peer, 0, 0, USER_DATA(conn->slot, OP_ACCEPT));
+    sqe->addr2 = (uint64_t)(uintptr_t)&conn->peer_len;
+    sqe->file_index = URING_CONN_FILE(conn->slot) + 1;  // accept into the fixed file table
+    srv->accept_armed = true;
+    srv->accept_slot = conn->slot;
+}
+
+/********************************************************************
+Stop accepting once the listening socket was handed over, the accept
+completes with -ECANCELED unless a connection beat the cancel
+*********************************************************************/
+static void cancel_accept(struct uring_server *srv) {
+    struct io_uring_sqe *sqe;
+
+    if (!srv->accept_armed || srv->accept_cancelled) {
+        return;
+    }
+    sqe = ring_get_sqe(&srv->ring);
+    prep_rw(sqe, IORING_OP_ASYNC_CANCEL, -1, NULL, 0, 0, USER_DATA(srv->accept_slot, OP_CANCEL));
+    sqe->addr = USER_DATA(srv->accept_slot, OP_ACCEPT);
+    srv->accept_cancelled = true;
+}
+
+/********************************************************************
+Returns true once nothing is in flight: no accept and no connection
+*********************************************************************/
+static bool server_idle(const struct uring_server *srv) {
+    int i;
+
+    if (srv->accept_armed) {
+        return false;
+    }
+    for (i = 0; i < URING_MAX_CONNS; i++) {
+        if (srv->conns[i].state != CONN_FREE) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void arm_recv(struct uring_server *srv, struct uring_conn *conn) {
+    struct io_uring_sqe *sqe = ring_get_sqe(&srv->ring);
+
+    conn->state = CONN_RECV;
+    prep_rw(sqe, IORING_OP_READ_FIXED, URING_CONN_FILE(conn->slot), conn->rxbuf, URING_BUF_SIZE, 0,
+            USER_DATA(conn->slot, OP_RECV));
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->buf_index = conn->slot;
+}
+
+static void arm_close(struct uring_server *srv, struct uring_conn *conn) {
+    struct io_uring_sqe *sqe = ring_get_sqe(&srv->ring);
+
+    prep_rw(sqe, IORING_OP_CLOSE, 0, NULL, 0, 0, USER_DATA(conn->slot, OP_CLOSE));
+    sqe->file_index = URING_CONN_FILE(conn->slot) + 1;
+}
+
+static void arm_send(struct uring_server *srv, struct uring_conn *conn) {
+    struct io_uring_sqe *sqe = ring_get_sqe(&srv->ring);
+
+    prep_rw(sqe, IORING_OP_SEND, URING_CONN_FILE(conn->slot), conn->reply + conn->sent,
+            conn->reply_len - conn->sent, 0, USER_DATA(conn->slot, OP_SEND));
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+}
+
+/********************************************************************
+Make sure the reply buffer has room for another device read, returns
+false when it could not grow
+*********************************************************************/
+static bool reply_reserve(struct uring_conn *conn) {
+    size_t cap;
+    char *p;
+
+    if (conn->reply != NULL && conn->reply_cap - conn->reply_len >= URING_READ_SIZE / 2) {
+        return true;
+    }
+    cap = conn->reply_cap ? conn->reply_cap * 2 : URING_READ_SIZE;
+    if ((p = realloc(conn->reply, cap)) == NULL) {
+        AESD_LOG(LOG_ERR, "Failed to allocate %zu bytes for a reply", cap);
+        return false;
+    }
+    conn->reply = p;
+    conn->reply_cap = cap;
+    return true;
+}
+
+static void device_release(struct uring_server *srv);
+
+static void arm_dev_read(struct uring_server *srv, struct uring_conn *conn, bool linked) {
+    struct io_uring_sqe *sqe;
+
+    // A read with no room would complete with 0 and pass for the end of data.
+    // device_start() reserves room before a linked read, so only a lone one fails here.
+    if (!reply_reserve(conn)) {
+        device_release(srv);
+        arm_close(srv, conn);
+        return;
+    }
+    if (linked) {
+        (&srv->ring.sqes[(*srv->ring.sq_tail - 1) & *srv->ring.sq_mask])->flags |= IOSQE_IO_LINK;
+    }
+    sqe = ring_get_sqe(&srv->ring);
+    prep_rw(sqe, IORING_OP_READ, URING_DEVICE_FILE, conn->reply + conn->reply_len,
+            conn->reply_cap - conn->reply_len, conn->read_pos, USER_DATA(conn->slot, OP_DEV_READ));
+    sqe->flags = IOSQE_FIXED_FILE;
+}
+
+/********************************************************************
+Device phase.  Only one connection owns the device at a time.
+*********************************************************************/
+static void device_start(struct uring_server *srv, struct uring_conn *conn) {
+    const char *packet = conn->packet_len ? conn->packet : conn->rxbuf;
+    size_t len = conn->packet_len ? conn->packet_len : conn->rx_len;
+    struct aesd_seekto seekto;
+    struct aesd_seektime seektime;
+    struct io_uring_sqe *sqe;
+    bool seekto_valid, since_valid;
+    unsigned long long since;
+    off_t pos;
+
+    if (prof_lock_acquire(srv->file_mutex) != 0) {
+        AESD_LOG(LOG_ERR, "Failed to acquire file mutex.");
+        arm_close(srv, conn);
+        return;
+    }
+    srv->device_owner = conn;
+    conn->state = CONN_DEVICE;
+    conn->reply_len = 0;
+    conn->read_pos = 0;
+
+    if (parse_since_cmd(packet, &since, &since_valid)) {
+        // Positions come from the reply cache, which this backend does not keep
+        AESD_LOG(LOG_ERR, "The since command is not supported by the io_uring backend.");
+        device_release(srv);
+        arm_close(srv, conn);
+        return;
+    }
+
+    if (parse_seektime_cmd(packet, &seektime, &seekto_valid)) {
+        if (!seekto_valid || ioctl(srv->device_fd, AESDCHAR_IOCSEEKTIME, &seektime) == -1 ||
+            (pos = lseek(srv->device_fd, 0, SEEK_CUR)) == -1) {
+            AESD_LOG(LOG_ERR, "Failed to seek to the time.");
+            device_release(srv);
+            arm_close(srv, conn);
+            return;
+        }
+        conn->read_pos = pos;
+        arm_dev_read(srv, conn, false);
+        return;
+    }
+
+    if (parse_seekto_cmd(packet, &seekto, &seekto_valid)) {
+        // Rare path: there is no io_uring opcode for a driver ioctl
+        if (!seekto_valid || ioctl(srv->device_fd, AESDCHAR_IOCSEEKTO, &seekto) == -1 ||
+            (pos = lseek(srv->device_fd, 0, SEEK_CUR)) == -1) {
+            AESD_LOG(LOG_ERR, "Failed to seek to the write command and offset.");
+            device_release(srv);
+            arm_close(srv, conn);
+            return;
+        }
+        conn->read_pos = pos;
+        arm_dev_read(srv, conn, false);
+        return;
+    }
+
+    // Room for the first read before the write goes out, the read is linked to it
+    if (!reply_reserve(conn)) {
+        device_release(srv);
+        arm_close(srv, conn);
+        return;
+    }
+    ring_reserve(&srv->ring, 2);
+    sqe = ring_get_sqe(&srv->ring);
+    if (conn->packet_len) {
+        prep_rw(sqe, IORING_OP_WRITE, URING_DEVICE_FILE, packet, len, (uint64_t)-1,
+                USER_DATA(conn->slot, OP_DEV_WRITE));
+    } else {
+        prep_rw(sqe, IORING_OP_WRITE_FIXED, URING_DEVICE_FILE, packet, len, (uint64_t)-1,
+                USER_DATA(conn->slot, OP_DEV_WRITE));
+        sqe->buf_index = conn->slot;
+    }
+    sqe->flags = IOSQE_FIXED_FILE;
+    arm_dev_read(srv, conn, true);
+}
+
+static void device_release(struct uring_server *srv) {
+    struct uring_conn *next = srv->waiting_head;
+
+    srv->device_owner = NULL;
+    (void)prof_lock_release(srv->file_mutex);
+
+    if (next != NULL) {
+        srv->waiting_head = next->next_waiting;
+        if (srv->waiting_head == NULL) {
+            srv->waiting_tail = NULL;
+        }
+        next->next_waiting = NULL;
+        device_start(srv, next);
+    }
+}
+
+static void device_request(struct uring_server *srv, struct uring_conn *conn) {
+    if (srv->device_owner == NULL) {
+        device_start(srv, conn);
+        return;
+    }
+    conn->state = CONN_WAIT_DEVICE;
+    if (srv->waiting_tail) {
+        srv->waiting_tail->next_waiting = conn;
+    } else {
+        srv->waiting_head = conn;
+    }
+    srv->waiting_tail = conn;
+}
+
+/********************************************************************
+Completion handlers
+*********************************************************************/
+static void on_accept(struct uring_server *srv, struct uring_conn *conn, int res) {
+    srv->accept_armed = false;
+
+    if (res < 0) {
+        conn->state = CONN_FREE;
+        if (res == -EINVAL && !srv->accepted_any && !ShutdownNow) {
+            // Kernel without accept into the fixed file table
+            srv->unsupported = true;
+        } else if (res != -EINVAL && res != -ECANCELED) {
+            AESD_LOG(LOG_ERR, "Failed to accept with error %s", strerror(-res));
+        }
+    } else {
+        srv->accepted_any = true;
+        if (srv->limiter != NULL && !ratelimit_admit_conn(srv->limiter, (struct sockaddr *)&conn->peer)) {
+            // Over its connection rate, closed before anything is received
+            arm_close(srv, conn);
+        } else {
+            arm_recv(srv, conn);
+        }
+    }
+    arm_accept(srv);
+}
+
+static void on_recv(struct uring_server *srv, struct uring_conn *conn, int res) {
+    if (res <= 0) {
+        // Peer closed or failed before a complete packet, close without a reply
+        arm_close(srv, conn);
+        return;
+    }
+
+    conn->rx_len = res;
+    conn->rxbuf[res] = 0;
+
+    if (conn->packet_len + res > srv->max_packet) {
+        AESD_LOG(LOG_ERR, "Dropped a packet over the %zu byte limit", srv->max_packet);
+        arm_close(srv, conn);
+        return;
+    }
+
+    // A packet spanning several receives is accumulated on the heap
+    if (conn->packet_len || conn->rxbuf[res - 1] != '\n') {
+        if (conn->packet_len + res + 1 > conn->packet_cap) {
+            size_t cap = (conn->packet_len + res + 1) * 2;
+            if (cap > srv->max_packet + 1) {
+                cap = srv->max_packet + 1;
+            }
+            char *p = realloc(conn->packet, cap);
+            if (p == NULL) {
+                AESD_LOG(LOG_ERR, "Failed to allocate %zu bytes for a packet", cap);
+                arm_close(srv, conn);
+                return;
+            }
+            conn->packet = p;
+            conn->packet_cap = cap;
+        }
+        memcpy(conn->packet + conn->packet_len, conn->rxbuf, res + 1);
+        conn->packet_len += res;
+    }
+
+    if (conn->rxbuf[res - 1] != '\n') {
+        arm_recv(srv, conn);
+        return;
+    }
+
+    // Over the byte rate of its client, closed without a reply
+    if (srv->limiter != NULL && !ratelimit_admit_bytes(srv->limiter, (struct sockaddr *)&conn->peer,
+                                                       conn->packet_len ? conn->packet_len : conn->rx_len)) {
+        arm_close(srv, conn);
+        return;
+    }
+
+    device_request(srv, conn);
+}
+
+static void on_dev_write(struct uring_server *srv, struct uring_conn *conn, int res) {
+    (void)srv;
+    // Errors are handled when the linked read completes with -ECANCELED
+    if (res < 0) {
+        AESD_LOG(LOG_ERR, "Failed to write to the storage device: %s", strerror(-res));
+        conn->write_failed = true;
+    }
+}
+
+static void on_dev_read(struct uring_server *srv, struct uring_conn *conn, int res) {
+    if (res > 0) {
+        conn->reply_len += res;
+        conn->read_pos += res;
+        arm_dev_read(srv, conn, false);
+        return;
+    }
+
+    device_release(srv);
+
+    if (res < 0 || conn->write_failed) {
+        if (!conn->write_failed) {
+            AESD_LOG(LOG_ERR, "Failed to read the storage device: %s", strerror(-res));
+        }
+        arm_close(srv, conn);
+        return;
+    }
+
+    // End of data, send the whole reply then close the connection
+    conn->state = CONN_SEND;
+    if (conn->reply_len == 0) {
+        arm_close(srv, conn);
+        return;
+    }
+    arm_send(srv, conn);
+}
+
+static void on_send(struct uring_server *srv, struct uring_conn *conn, int res) {
+    if (res <= 0) {
+        AESD_LOG(LOG_ERR, "Failed to send %zu bytes to client: %s", conn->reply_len - conn->sent,
+                 res < 0 ? strerror(-res) : "connection closed");
+        arm_close(srv, conn);
+        return;
+    }
+
+    // Like sendAll(), a short send goes on from where it stopped
+    conn->sent += res;
+    if (conn->sent < conn->reply_len) {
+        arm_send(srv, conn);
+        return;
+    }
+    arm_close(srv, conn);
+}
+
+static void on_close(struct uring_server *srv, struct uring_conn *conn, int res) {
+    (void)res;
+    conn_reset(conn);
+    arm_accept(srv);
+}
+
+static void dispatch(struct uring_server *srv, const struct io_uring_cqe *cqe) {
+    int slot = USER_DATA_SLOT(cqe->user_data);
+    struct uring_conn *conn;
+
+    if (slot < 0 || slot >= URING_MAX_CONNS) {
+        return;
+    }
+    conn = &srv->conns[slot];
+
+    switch (USER_DATA_OP(cqe->user_data)) {
+        case OP_ACCEPT:     on_accept(srv, conn, cqe->res); break;
+        case OP_RECV:       on_recv(srv, conn, cqe->res); break;
+        case OP_DEV_WRITE:  on_dev_write(srv, conn, cqe->res); break;
+        case OP_DEV_READ:   on_dev_read(srv, conn, cqe->res); break;
+        case OP_SEND:       on_send(srv, conn, cqe->res); break;
+        case OP_CLOSE:      on_close(srv, conn, cqe->res); break;
+        case OP_CANCEL:     break;  // the accept completes on its own
+        default: break;
+    }
+}
+
+/********************************************************************
+Register the device and receive buffers
+*********************************************************************/
+static int server_register(struct uring_server *srv) {
+    struct iovec iov[URING_MAX_CONNS];
+    int files[1 + URING_MAX_CONNS];
+    int i;
+
+    srv->buffers = mmap(NULL, (size_t)URING_MAX_CONNS * (URING_BUF_SIZE + 1), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (srv->buffers == MAP_FAILED) {
+        srv->buffers = NULL;
+        return -1;
+    }
+
+    for (i = 0; i < URING_MAX_CONNS; i++) {
+        srv->conns[i].slot = i;
+        srv->conns[i].rxbuf = srv->buffers + (size_t)i * (URING_BUF_SIZE + 1);
+        iov[i].iov_base = srv->conns[i].rxbuf;
+        iov[i].iov_len = URING_BUF_SIZE;
+        conn_reset(&srv->conns[i]);
+    }
+    if (sys_io_uring_register(srv->ring.fd, IORING_REGISTER_BUFFERS, iov, URING_MAX_CONNS) < 0) {
+        AESD_LOG(LOG_ERR, "io_uring: failed to register buffers: %s", strerror(errno));
+        return -1;
+    }
+
+    // Slot 0 is the device, the rest are filled in by accept
+    files[URING_DEVICE_FILE] = srv->device_fd;
+    for (i = 0; i < URING_MAX_CONNS; i++) {
+        files[URING_CONN_FILE(i)] = -1;
+    }
+    if (sys_io_uring_register(srv->ring.fd, IORING_REGISTER_FILES, files, 1 + URING_MAX_CONNS) < 0) {
+        AESD_LOG(LOG_ERR, "io_uring: failed to register files: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/*************************************************************************
+ * ***********************************************************************/
+int aesd_uring_run(int listen_fd, struct prof_lock *file_mutex, struct ratelimit *limiter, size_t max_packet) {
+    struct uring_server *srv;
+    unsigned head, tail;
+    int flags = 0, rc = -1, i;
+
+    srv = calloc(1, sizeof(*srv));
+    if (srv == NULL) {
+        return -1;
+    }
+    srv->listen_fd = listen_fd;
+    srv->file_mutex = file_mutex;
+    srv->limiter = limiter;
+    srv->max_packet = max_packet;
+    srv->device_fd = -1;
+
+    if (ring_init(&srv->ring) == -1) {
+        AESD_LOG(LOG_ERR, "io_uring: setup failed: %s", strerror(errno));
+        free(srv);
+        return -1;
+    }
+
+    if (!ring_probe(&srv->ring)) {
+        AESD_LOG(LOG_ERR, "io_uring: kernel lacks a required opcode");
+        goto cleanup;
+    }
+
+    srv->device_fd = open(AESD_DEVICE, O_RDWR);
+    if (srv->device_fd == -1) {
+        AESD_LOG(LOG_ERR, "Error opening device %s: %s", AESD_DEVICE, strerror(errno));
+        goto cleanup;
+    }
+
+    if (server_register(srv) == -1) {
+        goto cleanup;
+    }
+
+    // io_uring arms a poll for a blocking socket instead of returning -EAGAIN
+    flags = fcntl(listen_fd, F_GETFL);
+    fcntl(listen_fd, F_SETFL, flags & ~O_NONBLOCK);
+
+    AESD_LOG(LOG_INFO, "io_uring backend serving listener %i", listen_fd);
+    arm_accept(srv);
+
+    while (!ShutdownNow && !srv->unsupported) {
+        // After a handoff, serve the connections accepted so far and return
+        if (DrainNow) {
+            cancel_accept(srv);
+            if (server_idle(srv)) {
+                break;
+            }
+        }
+        if (ring_submit_and_wait(&srv->ring, 1) == -1) {
+            AESD_LOG(LOG_ERR, "io_uring: enter failed: %s", strerror(errno));
+            break;
+        }
+
+        head = *srv->ring.cq_head;
+        tail = __atomic_load_n(srv->ring.cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            dispatch(srv, &srv->ring.cqes[head & *srv->ring.cq_mask]);
+            head++;
+        }
+        __atomic_store_n(srv->ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    if (srv->unsupported) {
+        AESD_LOG(LOG_ERR, "io_uring: kernel lacks accept into fixed files");
+        fcntl(listen_fd, F_SETFL, flags);
+    } else {
+        rc = 0;
+    }
+
+cleanup:
+    // Closing the ring cancels whatever is still in flight and drops the fixed files
+    if (srv->device_owner != NULL) {
+        (void)prof_lock_release(file_mutex);
+    }
+    ring_exit(&srv->ring);
+    if (srv->device_fd != -1) {
+        close(srv->device_fd);
+    }
+    for (i = 0; i < URING_MAX_CONNS; i++) {
+        free(srv->conns[i].packet);
+        free(srv->conns[i].reply);
+    }
+    if (srv->buffers != NULL) {
+        munmap(srv->buffers, (size_t)URING_MAX_CONNS * (URING_BUF_SIZE + 1));
+    }
+    free(srv);
+    return rc;
+}
@@ -0,0 +1,28 @@
+/*
+ * aesdsocket-uring.h
+ *
+ * io_uring execution backend for aesdsocket, selected with -u.
+ */
+
+#ifndef AESDSOCKET_URING_H
+#define AESDSOCKET_URING_H
+
+#include <stddef.h>
+#include "../examples/threading/prof-lock.h"
+#include "aesdsocket-ratelimit.h"
+
+/**
+* Serve the connections of listening socket @param listen_fd from a single io_uring
+* event loop until ShutdownNow is set, or until DrainNow is set and every connection
+* accepted so far is served.  Accesses to AESD_DEVICE are serialized with
+* @param file_mutex so the thread backend of other listeners can run alongside.
+* Connections and packets over the rates of @param limiter, unless NULL, are
+* closed without a reply, and so are packets over @param max_packet bytes, which
+* bounds the memory a connection holds its packet in.
+* @return 0 after shutdown, or -1 if io_uring (or a feature it needs) is not
+* available.  On -1 no connection has been accepted and the caller should serve
+* @param listen_fd itself.
+*/
+int aesd_uring_run(int listen_fd, struct prof_lock *file_mutex, struct ratelimit *limiter, size_t max_packet);
+
+#endif /* AESDSOCKET_URING_H */
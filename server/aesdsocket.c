@@ -1,3 +1,4 @@
+#define _GNU_SOURCE    // cpu affinity
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -11,53 +12,135 @@
 #include <arpa/inet.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <netinet/tcp.h>
 #include <sys/queue.h>
 #include <stdbool.h>
 #include <pthread.h>
 #include <time.h>
-#include "aesd_ioctl.h"
+#include <sched.h>
+#include "aesdsocket.h"
+#include "aesdsocket-uring.h"
+#include "aesdsocket-commit.h"
+#include "aesdsocket-seglog.h"
+#include "aesdsocket-filestore.h"
+#include "aesdsocket-replycache.h"
+#include "aesdsocket-logger.h"
+#include "aesdsocket-handoff.h"
+#include "aesdsocket-ratelimit.h"
+#include "../examples/threading/prof-lock.h"
+#include "../aesd-char-driver/aesd-circular-buffer.h"   // AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
 
 // Defines
-#define USE_AESD_CHAR_DEVICE 1  // Set to 1 to use the char device and no timestamps, 0 to use file and timestamps
 #define SERVER_PORT     "9000"
-#define BACK_LOG        10
+#define BACK_LOG        10      // Default listen backlog, see -b
 #define TEMP_FILE       "/var/tmp/aesdsocketdata"
-#define AESD_DEVICE     "/dev/aesdchar"
 #define MAX_BUF_SIZE    512
-#define DEBUG_LOG(msg,...) printf("threading: " msg "\n" , ##__VA_ARGS__)
-#define ERROR_LOG(msg,...) printf("threading ERROR: " msg "\n" , ##__VA_ARGS__)
+#define STREAM_THRESHOLD 0x10000    // longer packets are spooled to a file as they arrive
+#define STREAM_CHUNK    0x4000      // receive and copy size while spooling
+#define STREAM_STALL_MS 2000        // a spooling client silent this long is dropped
+#define SPOOL_DIR       "/var/tmp"  // Default spool directory, see -S
+#define SPOOL_NAME      "aesdsocket-spool-XXXXXX"
+#define MAX_PACKET_SIZE 0x1000000   // Default longest packet accepted, see -M
+#define DEBUG_LOG(msg,...) AESD_LOG(LOG_DEBUG, msg, ##__VA_ARGS__)
+#define ERROR_LOG(msg,...) AESD_LOG(LOG_ERR, msg, ##__VA_ARGS__)
 #define TIME_STAMP_SEC 10
 #define AESD_CHAR_DEVICE_READ_SIZE 0x20000
-#define IOCSEEKTO_CMD   "AESDCHAR_IOCSEEKTO:"
 
 // Types
 // SLIST.
 typedef struct slist_data_s slist_data_t;
 struct slist_data_s {
     pthread_t thread;
-    pthread_mutex_t *file_mutex;
+    struct prof_lock *file_mutex;
 #if !defined(USE_AESD_CHAR_DEVICE)
-    FILE *fp;
+    struct filestore *fp;
 #else
     int fp;
 #endif // USE_AESD_CHAR_DEVICE
     int socket;
+    struct sockaddr_storage client;     // address the byte rate is charged to
     bool thread_complete_success;
     SLIST_ENTRY(slist_data_s) entries;
 };
 
+// One accept loop, with its own listening socket and worker list.
+typedef struct listener_data_s listener_data_t;
+struct listener_data_s {
+    pthread_t thread;
+    int socket;
+    int cpu;                    // cpu to pin the listener and its workers to, -1 for none
+    struct prof_lock *file_mutex;
+#if !defined(USE_AESD_CHAR_DEVICE)
+    struct filestore *fp;
+#else
+    int fp;
+#endif // USE_AESD_CHAR_DEVICE
+    SLIST_HEAD(slisthead, slist_data_s) head;
+};
+
+// Runtime options of the listening sockets
+struct server_config {
+    int backlog;
+    int fastopen_qlen;          // TCP_FASTOPEN queue length, 0 for disabled
+    int defer_accept_sec;       // TCP_DEFER_ACCEPT timeout, 0 for disabled
+    bool use_uring;             // serve listeners with the io_uring backend
+    bool group_commit;          // append packets through the committer thread
+    struct commit_config commit;
+    const char *log_dir;        // persistent segmented log directory, NULL for none
+    bool reply_cache;           // serve device replies from the reply image cache
+    bool lock_profiling;        // record file_mutex wait and hold times
+    bool fair_lock;             // hand file_mutex over in arrival order
+    int log_level;              // highest syslog priority logged, see SIGUSR2
+    const char *log_file;       // log to this file instead of syslog
+    const char *handoff_path;   // Unix socket the listening sockets are handed over on
+    struct ratelimit_config ratelimit;  // per client limits, rates of 0 for none
+    const char *spool_dir;      // where packets over STREAM_THRESHOLD are spooled
+    size_t max_packet;          // longest packet accepted, by every backend
+};
+
+// Storage the committer thread appends to
+struct commit_storage {
+    struct prof_lock *file_mutex;
+    struct seglog *log;         // when set, used instead of the file or device
+#if !defined(USE_AESD_CHAR_DEVICE)
+    struct filestore *fp;
+#else
+    int fd;                     // committer's own descriptor of AESD_DEVICE
+#endif // USE_AESD_CHAR_DEVICE
+};
+
 // File Private Vars
-static int ShutdownNow = 0;
+volatile sig_atomic_t ShutdownNow = 0;
+volatile sig_atomic_t DrainNow = 0;
+static volatile sig_atomic_t ReportLocksNow = 0;
+static volatile sig_atomic_t ToggleDebugNow = 0;
+static struct server_config Config = {
+    .backlog = BACK_LOG,
+    .log_level = LOG_INFO,
+    .spool_dir = SPOOL_DIR,
+    .max_packet = MAX_PACKET_SIZE,
+};
+static struct seglog *Log;      // opened with -L, replaces the file or device
+static struct ratelimit *Limiter;   // created with -r or -B
+#if defined(USE_AESD_CHAR_DEVICE)
+static struct replycache *Cache;    // created with -c, mirrors the device content
+#endif // USE_AESD_CHAR_DEVICE
 
 // File private function prototypes
-char * recv_dynamic(int s);
+char * recv_dynamic(int s, size_t limit, size_t max, bool *complete);
 void* threadfunc(void* thread_param);
+#if defined(USE_AESD_CHAR_DEVICE)
+static int reply_cache_refill(void);
+#endif // USE_AESD_CHAR_DEVICE
 
 #if !defined(USE_AESD_CHAR_DEVICE)
 struct timer_thread_data
 {
-    FILE *fp;
-    pthread_mutex_t *file_mutex;
+    struct filestore *fp;
+    struct prof_lock *file_mutex;
 };
 #endif // USE_AESD_CHAR_DEVICE
 
@@ -73,50 +156,94 @@ void *get_in_addr(struct sockaddr *sa) {
 }
 
 /********************************************************************
+Send all content of a buffer.  The socket is non-blocking so wait for
+room in the send buffer whenever it fills up.
 *********************************************************************/
-// Read a line from a file.
-char * read_line( FILE * f ) {
-    int cap = 32, next = 0, c;
-    char * ptrLine = malloc(cap);
-
-    while( 1 ) { 
-        if ( next == cap ) {
-            ptrLine = realloc( ptrLine, cap *= 2 );
-        }
-        c = fgetc( f ); 
-        if ( c == EOF || c == '\n' ) {
-            ptrLine[next++] = 0;
+int sendAll(int s, char *buf, int *len) {
+    int total = 0;        // how many bytes have been sent
+    int bytesleft = *len; // how many we have left to send
+    int n = 0;
+    struct pollfd pfd = { .fd = s, .events = POLLOUT };
+
+    while(total < *len) {
+        n = send(s, buf+total, bytesleft, MSG_NOSIGNAL);
+        if (n == -1) {
+            if ((errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) && !ShutdownNow) {
+                (void)poll(&pfd, 1, RECV_POLL_MS);
+                continue;
+            }
             break;
         }
-        ptrLine[next++] = c;
+        total += n;
+        bytesleft -= n;
+    }
+
+    *len = total;       // return the total number sent
+    return n==-1?-1:0; // return -1 if we encountered a send error.
+}
+
+/********************************************************************
+Parse a seek command, see aesdsocket.h
+*********************************************************************/
+bool parse_seekto_cmd(const char *buf, struct aesd_seekto *seekto, bool *valid) {
+    unsigned int write_cmd, write_cmd_offset;
+
+    if ( strncmp(buf, IOCSEEKTO_CMD, strlen(IOCSEEKTO_CMD)) != 0 ) {
+        return false;
+    }
+
+    // The write_command is the first integer before a comma and the write_cmd_offset the second after the comma
+    *valid = sscanf(buf + strlen(IOCSEEKTO_CMD), "%u,%u", &write_cmd, &write_cmd_offset) == 2;
+    if (*valid) {
+        seekto->write_cmd = write_cmd;
+        seekto->write_cmd_offset = write_cmd_offset;
     }
+    return true;
+}
 
-    // Handle an empty file.
-    if ( c == EOF && next == 1 ) {
-        free( ptrLine );
-        ptrLine = NULL;
+/********************************************************************
+Parse a seek time command, see aesdsocket.h
+*********************************************************************/
+bool parse_seektime_cmd(const char *buf, struct aesd_seektime *seektime, bool *valid) {
+    struct timespec now;
+    long long secs;
+    char end;
+
+    if ( strncmp(buf, IOCSEEKTIME_CMD, strlen(IOCSEEKTIME_CMD)) != 0 ) {
+        return false;
     }
 
-    return ptrLine;
+    // A number and the newline ending the packet, nothing else
+    *valid = sscanf(buf + strlen(IOCSEEKTIME_CMD), "%lld%c", &secs, &end) == 2 && end == '\n';
+    if (*valid) {
+        memset(seektime, 0, sizeof(*seektime));
+        if ( secs < 0 ) {
+            // Relative to now, on the clock the driver stamps entries with
+            clock_gettime(CLOCK_REALTIME, &now);
+            secs += now.tv_sec;
+            seektime->time_ns = secs > 0 ? (uint64_t)secs * 1000000000ULL + now.tv_nsec : 0;
+        } else if ( (unsigned long long)secs > UINT64_MAX / 1000000000ULL ) {
+            seektime->time_ns = UINT64_MAX;
+        } else {
+            seektime->time_ns = (uint64_t)secs * 1000000000ULL;
+        }
+    }
+    return true;
 }
 
 /********************************************************************
-Send all content of a buffer
+Parse a since command, see aesdsocket.h
 *********************************************************************/
-int sendAll(int s, char *buf, int *len) {
-    int total = 0;        // how many bytes have been sent
-    int bytesleft = *len; // how many we have left to send
-    int n;
+bool parse_since_cmd(const char *buf, unsigned long long *pos, bool *valid) {
+    char end;
 
-    while(total < *len) {
-        n = send(s, buf+total, bytesleft, 0);
-        if (n == -1) { break; }
-        total += n;
-        bytesleft -= n;
+    if ( strncmp(buf, SINCE_CMD, strlen(SINCE_CMD)) != 0 ) {
+        return false;
     }
 
-    *len = total;       // return the total number sent
-    return n==-1?-1:0; // return -1 if we encountered a send error.
+    // A number and the newline ending the packet, nothing else
+    *valid = sscanf(buf + strlen(SINCE_CMD), "%llu%c", pos, &end) == 2 && end == '\n';
+    return true;
 }
 
 /********************************************************************
@@ -125,9 +252,18 @@ Signal handler
 void signal_handler(int s) {
     if ( s == SIGINT  || s == SIGTERM) {
         ShutdownNow = 1;
+    } else if ( s == SIGUSR1 ) {
+        ReportLocksNow = 1;
+    } else if ( s == SIGUSR2 ) {
+        ToggleDebugNow = 1;
     }
 }
 
+static void log_report_line(const char *line, void *ctx) {
+    (void)ctx;
+    AESD_LOG(LOG_NOTICE, "%s", line);
+}
+
 #if !defined(USE_AESD_CHAR_DEVICE)
 /**
 * A thread which runs every timer_period_ms milliseconds
@@ -138,13 +274,13 @@ static void timer_thread ( union sigval sigval )
 {
     int mutex_rc, rc;
     struct timer_thread_data *td = (struct timer_thread_data*) sigval.sival_ptr;
-    FILE *fp = td->fp;
+    struct filestore *fp = td->fp;
     struct timespec ts_realtime;
     char timeString[200];
     char timeStamp[300];
     struct tm tm;
 
-    mutex_rc = pthread_mutex_lock(td->file_mutex);
+    mutex_rc = prof_lock_acquire(td->file_mutex);
 
     if (mutex_rc != 0) {
         ERROR_LOG("Failed to acquire file mutex.");
@@ -166,11 +302,15 @@ static void timer_thread ( union sigval sigval )
 
     sprintf(timeStamp, "timestamp:%s\n", timeString);
 
-    if ( fputs(timeStamp, fp) == EOF ) {
+    if ( Log != NULL ) {
+        if ( seglog_append(Log, timeStamp, strlen(timeStamp)) != 0 ) {
+            ERROR_LOG("Failed to write to the log");
+        }
+    } else if ( filestore_append(fp, timeStamp, strlen(timeStamp)) != 0 ) {
         ERROR_LOG("Failed to write to the storage file");
     }
 
-    pthread_mutex_unlock(td->file_mutex);
+    prof_lock_release(td->file_mutex);
 }
 
 /**
@@ -199,7 +339,7 @@ static bool setup_timer( int clock_id,
 {
     bool success = false;
     if ( clock_gettime(clock_id,start_time) != 0 ) {
-        printf("Error %d (%s) getting clock %d time\n",errno,strerror(errno),clock_id);
+        ERROR_LOG("Error %d (%s) getting clock %d time",errno,strerror(errno),clock_id);
     } else {
         struct itimerspec itimerspec;
         memset(&itimerspec, 0, sizeof(struct itimerspec));
@@ -207,7 +347,7 @@ static bool setup_timer( int clock_id,
         itimerspec.it_interval.tv_nsec = 0;
         timespec_add(&itimerspec.it_value,start_time,&itimerspec.it_interval);
         if( timer_settime(timerid, TIMER_ABSTIME, &itimerspec, NULL ) != 0 ) {
-            printf("Error %d (%s) setting timer\n",errno,strerror(errno));
+            ERROR_LOG("Error %d (%s) setting timer",errno,strerror(errno));
             // printf("timer_settime args ")
         } else {
             success = true;
@@ -217,96 +357,165 @@ static bool setup_timer( int clock_id,
 }
 #endif // USE_AESD_CHAR_DEVICE
 
+#if defined(USE_AESD_CHAR_DEVICE)
 /********************************************************************
+writev() every iovec to fd, continuing after short writes.
+Returns 0 on success, -1 on failure.
 *********************************************************************/
-int main( int argc, char *argv[] ) {
-    int listenSockfd, newSockfd;
-    struct addrinfo hints, *serverinfo, *tempP;
-    struct sockaddr_storage clientAddr;
-    socklen_t sockSize;
-    int rv;
-    int yes = 1, run_as_daemon = 0;
-    char s[INET6_ADDRSTRLEN];
-#if !defined(USE_AESD_CHAR_DEVICE)
-    FILE *fp;
-#else
-    int fp;
-#endif // USE_AESD_CHAR_DEVICE
-    struct sigaction new_action;
-    slist_data_t *datap=NULL;
-    pthread_mutex_t file_mutex;
-#if !defined(USE_AESD_CHAR_DEVICE)
-    struct sigevent sev;
-    struct timer_thread_data td;
-    timer_t timerid;
+static int writev_all(int fd, struct iovec *iov, int iovcnt) {
+    ssize_t n;
+
+    while (iovcnt > 0) {
+        n = writev(fd, iov, iovcnt);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
 #endif // USE_AESD_CHAR_DEVICE
 
-    openlog("aesdsocket", LOG_CONS, LOG_USER);
+/********************************************************************
+Committer callbacks, see aesdsocket-commit.h.  A batch is appended with
+one writev() under the file mutex; on the char device the kernel runs the
+driver write once per packet, so each packet still becomes its own entry.
+With the reply cache args holds the snapshot of each packet's connection,
+taken right after its entry so the reply ends with it as it would without
+group commit.
+*********************************************************************/
+static int commit_storage_write(struct iovec *iov, void **args, int iovcnt, void *ctx) {
+    struct commit_storage *storage = (struct commit_storage *) ctx;
+    int rc;
 
-    // Init the linked list that will keep thread info
-    SLIST_HEAD(slisthead, slist_data_s) head;
-    SLIST_INIT(&head);
+    (void)args;
 
-    if ( (rv = pthread_mutex_init(&file_mutex, NULL)) != 0) {
-        syslog(LOG_ERR, "Error failed to init file mutex with code: %i", rv);
+    if (prof_lock_acquire(storage->file_mutex) != 0) {
+        return -1;
     }
-
-    // Check if we should run as a daemon
-    if ( argc >= 2 ) {
-        if (strcmp(argv[1],"-d") == 0) {
-            run_as_daemon = 1;
-            //printf("Going to run as daemon.\n");
+    if (storage->log != NULL) {
+        // Every packet becomes one log record
+        rc = seglog_appendv(storage->log, iov, iovcnt);
+    } else {
+#if !defined(USE_AESD_CHAR_DEVICE)
+        rc = filestore_appendv(storage->fp, iov, iovcnt);
+#else
+        for (int i = 0; Cache != NULL && i < iovcnt; i++) {
+            if (replycache_append(Cache, iov[i].iov_base, iov[i].iov_len) == 0 && args[i] != NULL) {
+                (void)replycache_snapshot(Cache, args[i]);
+            }
+        }
+        rc = writev_all(storage->fd, iov, iovcnt);
+        if (rc != 0 && Cache != NULL) {
+            // Whatever part of the batch the driver took is unknown now
+            replycache_invalidate(Cache);
+            for (int i = 0; i < iovcnt; i++) {
+                if (args[i] != NULL) {
+                    replycache_release(args[i]);
+                }
+            }
         }
+#endif // USE_AESD_CHAR_DEVICE
+    }
+    if (rc != 0) {
+        AESD_LOG(LOG_ERR, "Group commit write failed: %s", strerror(errno));
     }
+    (void)prof_lock_release(storage->file_mutex);
 
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_family = AF_INET;  //IPv4
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_PASSIVE;
+    return rc;
+}
 
-    // Setup signal handling
-    memset(&new_action, 0, sizeof(struct sigaction));
-    new_action.sa_handler = signal_handler;
+static int commit_storage_sync(void *ctx) {
+    struct commit_storage *storage = (struct commit_storage *) ctx;
+    int rc = 0;
 
-    if ( sigaction(SIGTERM, &new_action, NULL) != 0 ) {
-        syslog(LOG_ERR, "Error (%s) registering for SIGTERM", strerror(errno));
+    if (prof_lock_acquire(storage->file_mutex) != 0) {
         return -1;
     }
-
-    if ( sigaction(SIGINT, &new_action, NULL) != 0 ) {
-        syslog(LOG_ERR, "Error (%s) registering for SIGINT", strerror(errno));
-        return -1;
+    if (storage->log != NULL) {
+        rc = seglog_sync(storage->log);
+    } else {
+#if !defined(USE_AESD_CHAR_DEVICE)
+        rc = filestore_sync(storage->fp);
+#endif // USE_AESD_CHAR_DEVICE
+        // The driver keeps its entries in memory, there is nothing to sync
     }
+    (void)prof_lock_release(storage->file_mutex);
 
-    if ( sigaction(SIGALRM, &new_action, NULL) != 0 ) {
-        syslog(LOG_ERR, "Error (%s) registering for SIGALRM", strerror(errno));
-        return -1;
-    }
+    return rc;
+}
+
+/********************************************************************
+Open a socket bound to SERVER_PORT.  When reuseport is set the socket is
+opened with SO_REUSEPORT so several listeners can share the port.
+Returns the socket or -1 on failure.
+*********************************************************************/
+static int open_listen_socket(bool reuseport) {
+    struct addrinfo hints, *serverinfo, *tempP;
+    int listenSockfd = -1;
+    int rv, yes = 1;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_INET;  //IPv4
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
 
     // Get the addrinfo for binding socket
     if ((rv = getaddrinfo(NULL, SERVER_PORT, &hints, &serverinfo)) != 0) {
-        syslog(LOG_ERR, "Failed to getaddrinfo with error %s", gai_strerror(rv));
+        AESD_LOG(LOG_ERR, "Failed to getaddrinfo with error %s", gai_strerror(rv));
         return -1;
     }
 
     // Could me multiple entries in the linked list server info loop through them all and bind first.
     for (tempP = serverinfo; tempP != NULL; tempP = tempP->ai_next) {
-        if ((listenSockfd = socket(tempP->ai_family, tempP->ai_socktype,
+        if ((listenSockfd = socket(tempP->ai_family, tempP->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
             tempP->ai_protocol)) == -1) {
-                syslog(LOG_ERR, "Failed to get socket with error %s", strerror(errno));
+                AESD_LOG(LOG_ERR, "Failed to get socket with error %s", strerror(errno));
                 perror("server: socket");
                 continue;
         }
 
         if (setsockopt(listenSockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
-            syslog(LOG_ERR, "Failed to set socket options with error %s", strerror(errno));
+            AESD_LOG(LOG_ERR, "Failed to set socket options with error %s", strerror(errno));
+            perror("setsockopt");
+            close(listenSockfd);
+            freeaddrinfo(serverinfo);
+            return -1;
+        }
+
+        if (reuseport && setsockopt(listenSockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) {
+            AESD_LOG(LOG_ERR, "Failed to set SO_REUSEPORT with error %s", strerror(errno));
             perror("setsockopt");
+            close(listenSockfd);
+            freeaddrinfo(serverinfo);
             return -1;
         }
 
+        // Both are only hints to the kernel, the server works without them.
+        if (Config.fastopen_qlen > 0 && setsockopt(listenSockfd, IPPROTO_TCP, TCP_FASTOPEN,
+                &Config.fastopen_qlen, sizeof(int)) == -1) {
+            AESD_LOG(LOG_ERR, "Failed to set TCP_FASTOPEN with error %s", strerror(errno));
+        }
+
+        if (Config.defer_accept_sec > 0 && setsockopt(listenSockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                &Config.defer_accept_sec, sizeof(int)) == -1) {
+            AESD_LOG(LOG_ERR, "Failed to set TCP_DEFER_ACCEPT with error %s", strerror(errno));
+        }
+
         if (bind(listenSockfd, tempP->ai_addr, tempP->ai_addrlen) == -1) {
             close(listenSockfd);
-            syslog(LOG_ERR, "Failed to bind socket with error %s", strerror(errno));
+            AESD_LOG(LOG_ERR, "Failed to bind socket with error %s", strerror(errno));
             perror("server: bind");
             continue;
         }
@@ -317,337 +526,1323 @@ int main( int argc, char *argv[] ) {
     freeaddrinfo(serverinfo);  // Now that we have either got bind or not this dynamic linked list is not needed.
 
     if (tempP == NULL) {
-        syslog(LOG_ERR, "Failed to bind");
-        return -1;
-    }
-
-    if (run_as_daemon) {
-        if (fork()) { // This should start a child process and if we get a return then we are parent
-            return 0;
-        }
-    }
-
-    if (listen(listenSockfd, BACK_LOG) == -1) {
-        syslog(LOG_ERR, "Failed to listen with error %s", strerror(errno));
-        perror("listen");
+        AESD_LOG(LOG_ERR, "Failed to bind");
         return -1;
     }
 
-    // Setup temp file to log to cleaning out whatever is there already.
-#if !defined(USE_AESD_CHAR_DEVICE)
-    fp = fopen(TEMP_FILE, "w+");
-    if( fp == NULL) {
-        syslog(LOG_ERR, "Error opening file %s: %s\n", TEMP_FILE, strerror( errno ));
-    }
-#else
-    fp = 0;
-    // fp = open(AESD_DEVICE, O_RDWR);
-    // if( fp == -1) {
-    //     syslog(LOG_ERR, "Error opening device %s: %s\n", AESD_DEVICE, strerror( errno ));
-    // }
-#endif // USE_AESD_CHAR_DEVICE
-
-    syslog(LOG_INFO, "Waiting for connections");
+    return listenSockfd;
+}
 
-#if !defined(USE_AESD_CHAR_DEVICE)
-    /* Configure a 10 second timer */
-    memset(&td, 0, sizeof(struct timer_thread_data));
-    td.file_mutex = &file_mutex;
-    td.fp = fp;
-    memset(&sev, 0, sizeof(struct sigevent));
-    sev.sigev_notify = SIGEV_THREAD;
-    sev.sigev_value.sival_ptr = &td;
-    sev.sigev_notify_function = timer_thread;
+/********************************************************************
+Close a connection which is over its rate with a reset, so the client
+learns right away instead of waiting for a reply.
+*********************************************************************/
+static void shed_connection(int s) {
+    struct linger reset = { .l_onoff = 1, .l_linger = 0 };
 
-    int clock_id = CLOCK_MONOTONIC;
-    struct timespec start_time;
+    (void)setsockopt(s, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+    close(s);
+}
 
-    if ( timer_create(clock_id, &sev, &timerid) != 0 ) {
-        syslog(LOG_ERR, "Failed to create time stamp timer.");
-        ShutdownNow = 1;
-    } else {
-        if (!setup_timer(clock_id, timerid, TIME_STAMP_SEC, &start_time)) {
-            syslog(LOG_ERR, "Failed to create time stamp timer.");
-            ShutdownNow = 1;
+/********************************************************************
+Join and free every worker thread of a listener which has completed, or
+every worker when all is set.
+*********************************************************************/
+static void reap_workers(listener_data_t *listener, bool all) {
+    slist_data_t *datap = SLIST_FIRST(&listener->head);
+    slist_data_t *next;
+
+    while (datap != NULL) {
+        next = SLIST_NEXT(datap, entries);
+        if (all || datap->thread_complete_success) {
+            if ( pthread_join(datap->thread, NULL) != 0 ) {
+                AESD_LOG(LOG_ERR, "Failed to join thread with error.");
+            }
+            SLIST_REMOVE(&listener->head, datap, slist_data_s, entries);
+            free(datap);
         }
+        datap = next;
     }
-#endif // USE_AESD_CHAR_DEVICE
-
-    while(!ShutdownNow) {
-        // Accept incoming connections
-        sockSize = sizeof clientAddr;
-        newSockfd = accept(listenSockfd, (struct sockaddr *)&clientAddr, &sockSize);
-        if (newSockfd == -1) {
-            //perror("accept");
-            continue;
-        }
-
-        inet_ntop(clientAddr.ss_family, get_in_addr((struct sockaddr *)&clientAddr), s, sizeof s);
-        //printf("Accepted connection from %s\n",s);
-        syslog(LOG_INFO, "Accepted connection from %s", s);
-
-        datap = malloc(sizeof(slist_data_t));
-        datap->file_mutex = &file_mutex;
-        datap->fp = fp;
-        datap->socket = newSockfd;
-        datap->thread_complete_success = false;
+}
 
-        SLIST_INSERT_HEAD(&head, datap, entries);
+/********************************************************************
+Accept loop of one listening socket.  Each accepted connection is served
+by its own worker thread, pinned to the listener CPU when one is set.
+The listening socket is non-blocking: every wakeup drains the whole
+backlog with accept4() before finished workers are reaped.
+*********************************************************************/
+static void* listener_thread(void* thread_param) {
+    listener_data_t *listener = (listener_data_t *) thread_param;
+    struct sockaddr_storage clientAddr;
+    socklen_t sockSize;
+    pthread_attr_t attr;
+    slist_data_t *datap;
+    struct pollfd pfd = { .fd = listener->socket, .events = POLLIN };
+    char s[INET6_ADDRSTRLEN];
+    int newSockfd, rv;
 
-        rv = pthread_create(&datap->thread, NULL, threadfunc, (void *)datap);
-        if (rv != 0) {
-            syslog(LOG_ERR, "Failed to start thread.");
-            ShutdownNow = 1;
-            continue;
-        }
+    pthread_attr_init(&attr);
+    if (listener->cpu >= 0) {
+        cpu_set_t cpuset;
 
-        SLIST_FOREACH(datap, &head, entries) {
-            if (datap->thread_complete_success) {
-                if ( pthread_join(datap->thread, NULL) != 0 ) {
-                    syslog(LOG_ERR, "Failed to join thread with error.");
-                }
-                SLIST_REMOVE(&head, datap, slist_data_s, entries);
-                free(datap);
-            }
+        CPU_ZERO(&cpuset);
+        CPU_SET(listener->cpu, &cpuset);
+        if ( (rv = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset)) != 0 ) {
+            AESD_LOG(LOG_ERR, "Failed to pin listener to cpu %i: %s", listener->cpu, strerror(rv));
         }
+        pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpuset);
     }
 
-    // Handle shutdown
-    if (ShutdownNow) {
-        syslog(LOG_INFO, "Caught signal, exiting");
-        //printf("Caught signal, exiting\n");
-        if (listenSockfd) {shutdown(listenSockfd, SHUT_RDWR);}
-        if (newSockfd) {shutdown(newSockfd, SHUT_RDWR);}
-        remove(TEMP_FILE);
-        pthread_mutex_destroy(&file_mutex);
-#if !defined(USE_AESD_CHAR_DEVICE)
-        timer_delete(timerid);
-        if (fp) {fclose(fp);};
+    if (Config.use_uring) {
+#if defined(USE_AESD_CHAR_DEVICE)
+        if (aesd_uring_run(listener->socket, listener->file_mutex, Limiter, Config.max_packet) == 0) {
+            pthread_attr_destroy(&attr);
+            return NULL;
+        }
+        AESD_LOG(LOG_ERR, "io_uring backend unavailable, falling back to worker threads");
 #else
-        if (fp) {close(fp);};
+        AESD_LOG(LOG_ERR, "io_uring backend needs the char device, using worker threads");
 #endif // USE_AESD_CHAR_DEVICE
-
-        closelog();
-        return 0;
     }
 
-    return 0;
-}
-
-/********************************************************************
-Recieve every bit of data
-*********************************************************************/
-char * recv_dynamic(int s) {
-    int size_recv = 0, pos = 0;
-    char chunk[MAX_BUF_SIZE];
-    char *p = malloc(MAX_BUF_SIZE);
-
-    // Make socket no blocking
-    fcntl(s, F_SETFL, O_NONBLOCK);
-
-    while(1) {
-        // Check shutdown
-        if (ShutdownNow) {
-            free(p);
-            return NULL;
+    while(!ShutdownNow && !DrainNow) {
+        // Wait for connections, shutdown() of the socket at exit wakes us with POLLHUP.
+        // A handed over socket is not shut down, DrainNow is checked every RECV_POLL_MS.
+        if (poll(&pfd, 1, RECV_POLL_MS) <= 0) {
+            reap_workers(listener, false);
+            continue;
+        }
+        if (pfd.revents & (POLLHUP | POLLERR | POLLNVAL)) {
+            break;
         }
 
-        // recv up to the buffer size
-        memset(chunk, 0, MAX_BUF_SIZE);
+        // Accept every pending connection
+        while (!ShutdownNow && !DrainNow) {
+            sockSize = sizeof clientAddr;
+            newSockfd = accept4(listener->socket, (struct sockaddr *)&clientAddr, &sockSize,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (newSockfd == -1) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    AESD_LOG(LOG_ERR, "Failed to accept with error %s", strerror(errno));
+                }
+                break;
+            }
 
-        if ( (size_recv = recv(s, &chunk, MAX_BUF_SIZE, 0)) == -1 ) {
-            if (errno == EWOULDBLOCK || errno == EAGAIN) {
-                usleep(1000000); // No data backoff for 1msec
+            // Shed a client over its connection rate before it costs a thread
+            if (Limiter != NULL && !ratelimit_admit_conn(Limiter, (struct sockaddr *)&clientAddr)) {
+                shed_connection(newSockfd);
                 continue;
             }
-            else {
-                //Another error occured
-                syslog(LOG_ERR, "Recv error %s\n", strerror( errno ));
-                free(p);
-                return NULL;
+
+            // Skip formatting the address when LOG_INFO is not logged (-q)
+            if (logger_enabled(LOG_INFO)) {
+                inet_ntop(clientAddr.ss_family, get_in_addr((struct sockaddr *)&clientAddr), s, sizeof s);
+                //printf("Accepted connection from %s\n",s);
+                AESD_LOG(LOG_INFO, "Accepted connection from %s", s);
             }
-        }
 
-        if (size_recv > 0) {
-            // printf("Recieved this much data %d\n", size_recv);
-            memcpy(&p[pos], &chunk, size_recv);
-            // printf("The character at end is %d\n", p[(pos + size_recv)-1]);
-            // check if last character is newline then jump out
-            if ( p[pos + size_recv - 1] == '\n' ) {
-                p[pos + size_recv] = 0; //Null terminate the string.
-                break;
+            datap = malloc(sizeof(slist_data_t));
+            if (datap == NULL) {
+                AESD_LOG(LOG_ERR, "Failed to allocate connection data.");
+                close(newSockfd);
+                continue;
+            }
+            datap->file_mutex = listener->file_mutex;
+            datap->fp = listener->fp;
+            datap->socket = newSockfd;
+            datap->client = clientAddr;
+            datap->thread_complete_success = false;
+
+            rv = pthread_create(&datap->thread, &attr, threadfunc, (void *)datap);
+            if (rv != 0) {
+                // Usually out of threads for now: drop this client, keep serving the others
+                AESD_LOG(LOG_ERR, "Failed to start thread: %s", strerror(rv));
+                close(newSockfd);
+                free(datap);
+                reap_workers(listener, false);
+                continue;
             }
-            // else reallocate another chunk and recv more
-            pos = pos + size_recv;
-            // printf("Current recv pos: %d\n", pos);
-            // printf("Reallocating %d\n", pos + (2 *MAX_BUF_SIZE));
-            p = realloc(p, pos + (2 *MAX_BUF_SIZE));
+
+            SLIST_INSERT_HEAD(&listener->head, datap, entries);
         }
+
+        reap_workers(listener, false);
     }
 
-    return p;
+    reap_workers(listener, true);
+    pthread_attr_destroy(&attr);
+    return NULL;
 }
 
-/*************************************************************************
- * ***********************************************************************/
-void* threadfunc(void* thread_param) {
-    slist_data_t* thread_func_args = (slist_data_t *) thread_param;
-    int mutex_rc, numBytes;
-    int socket = thread_func_args->socket;
-    char *recvBuffer, *line;
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [-d] [-q] [-u] [-l listeners] [-a] [-b backlog] [-f qlen] [-D seconds]\n"
+        "          [-g] [-s none|batch|ms] [-L dir] [-c] [-p] [-F] [-V level] [-O file]\n"
+        "          [-H path] [-r rate[:burst]] [-B rate[:burst]] [-S dir] [-M bytes]\n"
+        "  -d            run as a daemon\n"
+        "  -q            do not log every accepted connection, same as -V notice\n"
+        "  -u            serve connections with io_uring instead of a thread per\n"
+        "                connection, falls back to threads when unavailable\n"
+        "  -l listeners  number of SO_REUSEPORT listeners each with their own accept\n"
+        "                loop, 0 for one per online cpu (default 1, no SO_REUSEPORT)\n"
+        "  -a            pin each listener and its workers to a cpu\n"
+        "  -b backlog    listen backlog (default %d)\n"
+        "  -f qlen       enable TCP_FASTOPEN with a queue of qlen pending connections\n"
+        "  -D seconds    enable TCP_DEFER_ACCEPT, wake the listener only once data arrives\n"
+        "  -g            group commit: append the packets of concurrent connections\n"
+        "                in batches from a single committer thread\n"
+        "  -s policy     group commit durability, none (default), batch to fdatasync\n"
+        "                every batch before replying, or a sync interval in ms\n"
+        "  -L dir        keep the packets in a persistent segmented log in dir\n"
+        "                instead of the %s\n"
+        "  -c            keep the char device reply in a cache shared by every\n"
+        "                connection, not used with -u or -L\n"
+        "  -p            profile the storage lock, its wait and hold time histograms\n"
+        "                are logged on SIGUSR1 and at exit, like the -r and -B counters\n"
+        "  -F            grant the storage lock in arrival order\n"
+        "  -V level      highest syslog priority logged, a name such as debug or a\n"
+        "                number (default info), SIGUSR2 toggles it with debug\n"
+        "  -O file       append the log to file instead of syslog\n"
+        "  -H path       hot restart: take the listening sockets over from the server\n"
+        "                started with the same -H path, which then serves the\n"
+        "                connections it accepted and exits, and hand them over in turn\n"
+        "                to the next server started so\n"
+        "  -r rate       admit at most rate connections per second from each client\n"
+        "                address, burst at once (default rate), others are reset\n"
+        "  -B rate       admit at most rate packet bytes per second from each client\n"
+        "                address, burst at once (default rate), others are reset\n"
+        "  -S dir        spool packets longer than %d bytes to dir until they are\n"
+        "                complete (default %s), best on a disk rather than a tmpfs\n"
+        "  -M bytes      longest packet accepted (default %d), longer ones are\n"
+        "                dropped; bounds the spool files and the memory of -g, -L\n"
+        "                and -u connections, which receive packets whole\n",
+        prog, BACK_LOG,
 #if !defined(USE_AESD_CHAR_DEVICE)
-    FILE *fp = thread_func_args->fp;
-    long fileWritePos;
-    char newline = '\n';
+        "data file, which is cleared at every start"
 #else
-    int fp = thread_func_args->fp;
+        "char device"
 #endif // USE_AESD_CHAR_DEVICE
+        , STREAM_THRESHOLD, SPOOL_DIR, MAX_PACKET_SIZE);
+}
 
+/********************************************************************
+*********************************************************************/
+int main( int argc, char *argv[] ) {
+    int rv, opt, i;
+    int run_as_daemon = 0;
+    int num_listeners = 1;
+    bool pin_cpus = false;
+    long num_cpus;
+    unsigned long long max_packet;
+    char *end;
+#if !defined(USE_AESD_CHAR_DEVICE)
+    struct filestore *fp;
+#else
+    int fp;
+#endif // USE_AESD_CHAR_DEVICE
+    struct sigaction new_action;
+    sigset_t block_mask, orig_mask;
+    struct commit_storage storage;
+    struct commit_ops storage_ops = {
+        .write = commit_storage_write,
+        .sync = commit_storage_sync,
+    };
+    listener_data_t *listeners;
+    struct prof_lock file_mutex;
+    int listen_fds[HANDOFF_MAX_FDS];
+    int num_passed, handoff_fd = -1, handoff_conn = -1;
+    bool handed_over = false, exclusive_storage;
+    struct pollfd pfd;
+#if !defined(USE_AESD_CHAR_DEVICE)
+    struct sigevent sev;
+    struct timer_thread_data td;
+    timer_t timerid;
+#endif // USE_AESD_CHAR_DEVICE
 
-    // Recv data
-    if (( recvBuffer = recv_dynamic(socket) ) == NULL) {
-        ERROR_LOG("Got NULL when trying to recv.");
-        thread_func_args->thread_complete_success = true;
-        pthread_exit(NULL);
+    openlog("aesdsocket", LOG_CONS, LOG_USER);
+
+    while ((opt = getopt(argc, argv, "dqul:ab:f:D:gs:L:cpFV:O:H:r:B:S:M:h")) != -1) {
+        switch (opt) {
+            case 'd':
+                // Check if we should run as a daemon
+                run_as_daemon = 1;
+                break;
+            case 'l':
+                num_listeners = atoi(optarg);
+                break;
+            case 'a':
+                pin_cpus = true;
+                break;
+            case 'u':
+                Config.use_uring = true;
+                break;
+            case 'q':
+                Config.log_level = LOG_NOTICE;
+                break;
+            case 'V':
+                if ((Config.log_level = logger_parse_level(optarg)) == -1) {
+                    fprintf(stderr, "Invalid log level %s\n", optarg);
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'O':
+                Config.log_file = optarg;
+                break;
+            case 'H':
+                Config.handoff_path = optarg;
+                break;
+            case 'r':
+                if (ratelimit_parse(optarg, &Config.ratelimit.conn_rate, &Config.ratelimit.conn_burst) != 0) {
+                    fprintf(stderr, "Invalid connection rate %s\n", optarg);
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'B':
+                if (ratelimit_parse(optarg, &Config.ratelimit.byte_rate, &Config.ratelimit.byte_burst) != 0) {
+                    fprintf(stderr, "Invalid byte rate %s\n", optarg);
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'S':
+                Config.spool_dir = optarg;
+                break;
+            case 'M':
+                if ((max_packet = strtoull(optarg, &end, 0)) == 0 || *end != '\0' || max_packet > SIZE_MAX / 2) {
+                    fprintf(stderr, "Invalid packet size %s\n", optarg);
+                    usage(argv[0]);
+                    return -1;
+                }
+                Config.max_packet = max_packet;
+                break;
+            case 'b':
+                Config.backlog = atoi(optarg);
+                break;
+            case 'f':
+                Config.fastopen_qlen = atoi(optarg);
+                break;
+            case 'D':
+                Config.defer_accept_sec = atoi(optarg);
+                break;
+            case 'g':
+                Config.group_commit = true;
+                break;
+            case 'L':
+                Config.log_dir = optarg;
+                break;
+            case 'c':
+                Config.reply_cache = true;
+                break;
+            case 'p':
+                Config.lock_profiling = true;
+                break;
+            case 'F':
+                Config.fair_lock = true;
+                break;
+            case 's':
+                if (commit_parse_durability(optarg, &Config.commit) != 0) {
+                    fprintf(stderr, "Invalid durability policy %s\n", optarg);
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : -1;
+        }
     }
 
-    // Lock file and manipulate
-    mutex_rc = pthread_mutex_lock(thread_func_args->file_mutex);
+    if ( (rv = prof_lock_init(&file_mutex, "file_mutex",
+                              Config.fair_lock ? PROF_LOCK_FAIR : 0)) != 0) {
+        AESD_LOG(LOG_ERR, "Error failed to init file mutex with code: %i", rv);
+        return -1;
+    }
+    prof_lock_profiling(Config.lock_profiling);
+    logger_set_level(Config.log_level);
 
-    if (mutex_rc != 0) {
-        ERROR_LOG("Failed to acquire file mutex.");
-        free(recvBuffer);
-        thread_func_args->thread_complete_success = true;
-        pthread_exit(NULL);
+    num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_cpus < 1) {
+        num_cpus = 1;
     }
+    if (num_listeners <= 0) {
+        num_listeners = num_cpus;
+    }
+
+    // Setup signal handling
+    memset(&new_action, 0, sizeof(struct sigaction));
+    new_action.sa_handler = signal_handler;
 
+    if ( sigaction(SIGTERM, &new_action, NULL) != 0 ) {
+        AESD_LOG(LOG_ERR, "Error (%s) registering for SIGTERM", strerror(errno));
+        return -1;
+    }
+
+    if ( sigaction(SIGINT, &new_action, NULL) != 0 ) {
+        AESD_LOG(LOG_ERR, "Error (%s) registering for SIGINT", strerror(errno));
+        return -1;
+    }
+
+    if ( sigaction(SIGALRM, &new_action, NULL) != 0 ) {
+        AESD_LOG(LOG_ERR, "Error (%s) registering for SIGALRM", strerror(errno));
+        return -1;
+    }
+
+    if ( sigaction(SIGUSR1, &new_action, NULL) != 0 ) {
+        AESD_LOG(LOG_ERR, "Error (%s) registering for SIGUSR1", strerror(errno));
+        return -1;
+    }
+
+    if ( sigaction(SIGUSR2, &new_action, NULL) != 0 ) {
+        AESD_LOG(LOG_ERR, "Error (%s) registering for SIGUSR2", strerror(errno));
+        return -1;
+    }
+
+    // Listening sockets from socket activation, or from the server being restarted
+    num_passed = handoff_inherited(listen_fds, HANDOFF_MAX_FDS);
+    if (num_passed == 0 && Config.handoff_path != NULL) {
+        num_passed = handoff_request(Config.handoff_path, listen_fds, HANDOFF_MAX_FDS, &handoff_conn);
+        handed_over = num_passed > 0;
+    }
+    if (num_passed == -1) {
+        return -1;
+    }
+    if (num_passed > 0) {
+        num_listeners = num_passed;
+        AESD_LOG(LOG_INFO, "Took over %i listening socket(s) %s", num_passed,
+                 handed_over ? "from the old server" : "from socket activation");
+    } else if (Config.handoff_path != NULL && num_listeners > HANDOFF_MAX_FDS) {
+        AESD_LOG(LOG_ERR, "At most %i listeners can be handed over", HANDOFF_MAX_FDS);
+        return -1;
+    }
+
+    listeners = calloc(num_listeners, sizeof(listener_data_t));
+    if (listeners == NULL) {
+        AESD_LOG(LOG_ERR, "Failed to allocate %i listeners", num_listeners);
+        return -1;
+    }
+
+    // Bind every listener before forking so bind errors are reported to the caller.
+    for (i = 0; i < num_listeners; i++) {
+        listeners[i].socket = num_passed > 0 ? listen_fds[i] : open_listen_socket(num_listeners > 1);
+        if (listeners[i].socket == -1) {
+            return -1;
+        }
+        listeners[i].cpu = pin_cpus ? (int)(i % num_cpus) : -1;
+        listeners[i].file_mutex = &file_mutex;
+        SLIST_INIT(&listeners[i].head);
+    }
+
+    // The data file, the log and the reply cache cannot be shared with the old
+    // server, wait until it has drained and closed them.  The device can.
 #if !defined(USE_AESD_CHAR_DEVICE)
-    if ( fputs(recvBuffer, fp) == EOF ) {
+    exclusive_storage = true;
 #else
-    fp = open(AESD_DEVICE, O_RDWR);
-    if( fp == -1) {
-        ERROR_LOG("Error opening device %s: %s\n", AESD_DEVICE, strerror( errno ));
-        free(recvBuffer);
-        (void)pthread_mutex_unlock(thread_func_args->file_mutex);
-        thread_func_args->thread_complete_success = true;
-        pthread_exit(NULL);
+    exclusive_storage = Config.log_dir != NULL || Config.reply_cache;
+#endif // USE_AESD_CHAR_DEVICE
+    if (handoff_conn != -1) {
+        if (exclusive_storage) {
+            handoff_wait_drained(handoff_conn);
+        } else {
+            close(handoff_conn);
+        }
+        handoff_conn = -1;
+    }
+    if (Config.handoff_path != NULL) {
+        handoff_fd = handoff_listen(Config.handoff_path);
+        if (handoff_fd == -1) {
+            return -1;
+        }
     }
 
-    // Check if the recvBuffer starts with the string as for the cmd IOCSEEKTO_CMD after that string the write_command is first integer before a comma and the write_cmd_offset is the second after the comma
-    if ( strncmp(recvBuffer, IOCSEEKTO_CMD, strlen(IOCSEEKTO_CMD)) == 0 ) {
-        char *write_command = strtok(recvBuffer + strlen(IOCSEEKTO_CMD), ",");
-        char *write_cmd_offset = strtok(NULL, ",");
-        if ( write_command == NULL || write_cmd_offset == NULL ) {
-            ERROR_LOG("Failed to parse the write command and offset.");
-            free(recvBuffer);
-            (void)pthread_mutex_unlock(thread_func_args->file_mutex);
-            thread_func_args->thread_complete_success = true;
-            pthread_exit(NULL);
+    // Otherwise long packets would only fail once a client sends one
+    if (strlen(Config.spool_dir) + sizeof("/" SPOOL_NAME) > PATH_MAX) {
+        AESD_LOG(LOG_ERR, "Spool directory path too long: %s", Config.spool_dir);
+        return -1;
+    }
+    if (access(Config.spool_dir, W_OK | X_OK) == -1) {
+        AESD_LOG(LOG_ERR, "Cannot spool packets to %s: %s", Config.spool_dir, strerror(errno));
+        return -1;
+    }
+
+    // Recover the log before forking too, so a broken log stops the start
+    if (Config.log_dir != NULL) {
+        Log = seglog_open(Config.log_dir, SEGLOG_SEGMENT_SIZE);
+        if (Log == NULL) {
+            AESD_LOG(LOG_ERR, "Failed to open log %s", Config.log_dir);
+            return -1;
+        }
+        if (Config.use_uring) {
+            AESD_LOG(LOG_ERR, "io_uring backend serves the char device only, using worker threads");
+            Config.use_uring = false;
         }
+    }
 
-        // Convert the write_command and write_cmd_offset to integers
-        int write_command_int = atoi(write_command);
-        int write_cmd_offset_int = atoi(write_cmd_offset);
+    if (run_as_daemon) {
+        if (fork()) { // This should start a child process and if we get a return then we are parent
+            return 0;
+        }
+    }
 
-        // Create aesd_seekto struct to pass to the device
-        struct aesd_seekto seekto;
-        seekto.write_cmd = write_command_int;
-        seekto.write_cmd_offset = write_cmd_offset_int;
+    // The flusher thread would not survive the fork
+    if (logger_start(Config.log_file) != 0) {
+        return -1;
+    }
+    atexit(logger_stop);    // so the errors of the early returns below are written
 
-        // Using ioctl to seek to the write command and offset
-        if ( ioctl(fp, AESDCHAR_IOCSEEKTO, &seekto) == -1 ) {
-            ERROR_LOG("Failed to seek to the write command and offset.");
-            free(recvBuffer);
-            (void)pthread_mutex_unlock(thread_func_args->file_mutex);
-            thread_func_args->thread_complete_success = true;
-            pthread_exit(NULL);
+    for (i = 0; i < num_listeners; i++) {
+        if (listen(listeners[i].socket, Config.backlog) == -1) {
+            AESD_LOG(LOG_ERR, "Failed to listen with error %s", strerror(errno));
+            perror("listen");
+            return -1;
         }
+    }
 
-        //free the recvBuffer
-        free(recvBuffer);
+    // Setup temp file to log to cleaning out whatever is there already, unless restarted.
+#if !defined(USE_AESD_CHAR_DEVICE)
+    fp = Log != NULL ? NULL : filestore_open(TEMP_FILE, handed_over);
+    if( fp == NULL && Log == NULL) {
+        AESD_LOG(LOG_ERR, "Error opening file %s\n", TEMP_FILE);
+    }
+#else
+    fp = 0;
+    // fp = open(AESD_DEVICE, O_RDWR);
+    // if( fp == -1) {
+    //     syslog(LOG_ERR, "Error opening device %s: %s\n", AESD_DEVICE, strerror( errno ));
+    // }
+#endif // USE_AESD_CHAR_DEVICE
+
+#if defined(USE_AESD_CHAR_DEVICE)
+    // The io_uring backend and the log do not go through the cache
+    if (Config.reply_cache && !Config.use_uring && Log == NULL) {
+        if ((Cache = replycache_create(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)) == NULL) {
+            AESD_LOG(LOG_ERR, "Failed to create the reply cache");
+        } else if (reply_cache_refill() != 0) {
+            AESD_LOG(LOG_ERR, "Failed to read %s, the reply cache starts invalid", AESD_DEVICE);
+        }
+    }
+#endif // USE_AESD_CHAR_DEVICE
+
+    if (Config.ratelimit.conn_rate > 0 || Config.ratelimit.byte_rate > 0) {
+        if ((Limiter = ratelimit_create(&Config.ratelimit)) == NULL) {
+            AESD_LOG(LOG_ERR, "Failed to create the rate limiter, admitting every client");
+        }
+    }
+
+    if (Config.group_commit) {
+        storage.file_mutex = &file_mutex;
+        storage.log = Log;
+#if !defined(USE_AESD_CHAR_DEVICE)
+        storage.fp = fp;
+        if (fp == NULL && Log == NULL) {
+#else
+        storage.fd = Log != NULL ? -1 : open(AESD_DEVICE, O_WRONLY | O_CLOEXEC);
+        if (storage.fd == -1 && Log == NULL) {
+            AESD_LOG(LOG_ERR, "Error opening device %s: %s\n", AESD_DEVICE, strerror( errno ));
+#endif // USE_AESD_CHAR_DEVICE
+            Config.group_commit = false;
+        } else if (commit_start(&Config.commit, &storage_ops, &storage) != 0) {
+            Config.group_commit = false;
+#if defined(USE_AESD_CHAR_DEVICE)
+            if (storage.fd != -1) {
+                close(storage.fd);
+            }
+#endif // USE_AESD_CHAR_DEVICE
+        }
+        if (!Config.group_commit) {
+            AESD_LOG(LOG_ERR, "Group commit unavailable, appending from each connection");
+        }
+    }
+
+    AESD_LOG(LOG_INFO, "Waiting for connections on %i listener(s)", num_listeners);
+
+#if !defined(USE_AESD_CHAR_DEVICE)
+    /* Configure a 10 second timer */
+    memset(&td, 0, sizeof(struct timer_thread_data));
+    td.file_mutex = &file_mutex;
+    td.fp = fp;
+    memset(&sev, 0, sizeof(struct sigevent));
+    sev.sigev_notify = SIGEV_THREAD;
+    sev.sigev_value.sival_ptr = &td;
+    sev.sigev_notify_function = timer_thread;
+
+    int clock_id = CLOCK_MONOTONIC;
+    struct timespec start_time;
+
+    if ( timer_create(clock_id, &sev, &timerid) != 0 ) {
+        AESD_LOG(LOG_ERR, "Failed to create time stamp timer.");
+        ShutdownNow = 1;
     } else {
+        if (!setup_timer(clock_id, timerid, TIME_STAMP_SEC, &start_time)) {
+            AESD_LOG(LOG_ERR, "Failed to create time stamp timer.");
+            ShutdownNow = 1;
+        }
+    }
+#endif // USE_AESD_CHAR_DEVICE
 
-        // Write the recvBuffer to the device as this was not a seek command
-        if ( write(fp, recvBuffer, strlen(recvBuffer)) == -1 ) {
-    #endif // USE_AESD_CHAR_DEVICE
-            ERROR_LOG("Failed to write to the storage device.");
-            free(recvBuffer);
-            (void)pthread_mutex_unlock(thread_func_args->file_mutex);
-            thread_func_args->thread_complete_success = true;
-            pthread_exit(NULL);
-        } else {
-            free(recvBuffer);
+    // Only the main thread handles SIGINT/SIGTERM/SIGUSR1/SIGUSR2, the listener and worker threads
+    // inherit a mask blocking them.  Listeners are woken by shutting down their socket.
+    sigemptyset(&block_mask);
+    sigaddset(&block_mask, SIGINT);
+    sigaddset(&block_mask, SIGTERM);
+    sigaddset(&block_mask, SIGUSR1);
+    sigaddset(&block_mask, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &block_mask, &orig_mask);
+
+    for (i = 0; i < num_listeners; i++) {
+        listeners[i].fp = fp;
+        rv = pthread_create(&listeners[i].thread, NULL, listener_thread, (void *)&listeners[i]);
+        if (rv != 0) {
+            AESD_LOG(LOG_ERR, "Failed to start listener thread.");
+            ShutdownNow = 1;
+            num_listeners = i;
+            break;
+        }
+    }
+
+    // Listening sockets handed over on request
+    for (i = 0; i < num_listeners; i++) {
+        listen_fds[i] = listeners[i].socket;
+    }
+    pfd.fd = handoff_fd;
+    pfd.events = POLLIN;
+
+    while (!ShutdownNow && !DrainNow) {
+        if (handoff_fd == -1) {
+            sigsuspend(&orig_mask);
+        } else if (ppoll(&pfd, 1, NULL, &orig_mask) == 1 &&
+                   (handoff_conn = handoff_serve(handoff_fd, listen_fds, num_listeners)) != -1) {
+            DrainNow = 1;
+        }
+        if (ReportLocksNow) {
+            ReportLocksNow = 0;
+            prof_lock_report(log_report_line, NULL);
+            if (Limiter != NULL) {
+                ratelimit_report(Limiter, log_report_line, NULL);
+            }
+        }
+        if (ToggleDebugNow) {
+            ToggleDebugNow = 0;
+            logger_set_level(logger_enabled(LOG_DEBUG) ? Config.log_level : LOG_DEBUG);
+            AESD_LOG(LOG_NOTICE, "Logging up to %s", logger_enabled(LOG_DEBUG) ? "debug" : "the -V level");
         }
     }
 
+    // Handle shutdown
+    if (DrainNow) {
+        AESD_LOG(LOG_NOTICE, "Listening sockets handed over, exiting once drained");
+    } else {
+        AESD_LOG(LOG_INFO, "Caught signal, exiting");
+    }
+    //printf("Caught signal, exiting\n");
+    if (handoff_fd != -1) {
+        close(handoff_fd);
+        // The new server listens there now
+        if (!DrainNow) {
+            unlink(Config.handoff_path);
+        }
+    }
+    for (i = 0; i < num_listeners; i++) {
+        // The new server accepts on the handed over sockets, leave them open
+        if (!DrainNow) {
+            shutdown(listeners[i].socket, SHUT_RDWR);
+        }
+        if ( pthread_join(listeners[i].thread, NULL) != 0 ) {
+            AESD_LOG(LOG_ERR, "Failed to join listener thread.");
+        }
+        close(listeners[i].socket);
+    }
+    free(listeners);
 #if !defined(USE_AESD_CHAR_DEVICE)
-    // Need to reply with full content what we have in file storage.
-    fileWritePos = ftell(fp);
-    rewind(fp);
-
-    while ( (line = read_line( fp )) ) {
-        numBytes = strlen(line);
-
-        if ( numBytes != 0) {
-            if ( (sendAll(socket, line, &numBytes) == -1) ) {
-                ERROR_LOG("Failed to send %i bytes to client!", numBytes);
-                free(line);
-                (void)pthread_mutex_unlock(thread_func_args->file_mutex);
-                thread_func_args->thread_complete_success = true;
-                pthread_exit(NULL);
-            } else {
-                free(line);
+    // Stop the timestamps before the storage they are written to goes away
+    timer_delete(timerid);
+    prof_lock_acquire(&file_mutex);
+    prof_lock_release(&file_mutex);
+#endif // USE_AESD_CHAR_DEVICE
+    if (Config.group_commit) {
+        commit_stop();
+#if defined(USE_AESD_CHAR_DEVICE)
+        if (storage.fd != -1) {
+            close(storage.fd);
+        }
+#endif // USE_AESD_CHAR_DEVICE
+    }
+#if defined(USE_AESD_CHAR_DEVICE)
+    replycache_destroy(Cache);
+#endif // USE_AESD_CHAR_DEVICE
+    if (Log != NULL) {
+        seglog_close(Log);
+    } else if (!DrainNow) {
+        remove(TEMP_FILE);
+    }
+    if (Config.lock_profiling) {
+        prof_lock_report(log_report_line, NULL);
+    }
+    if (Limiter != NULL) {
+        ratelimit_report(Limiter, log_report_line, NULL);
+        ratelimit_destroy(Limiter);
+    }
+    prof_lock_destroy(&file_mutex);
+    logger_stop();
+#if !defined(USE_AESD_CHAR_DEVICE)
+    if (fp) {filestore_close(fp);};
+#else
+    if (fp) {close(fp);};
+#endif // USE_AESD_CHAR_DEVICE
+    // The new server waits for this to open the storage
+    if (handoff_conn != -1) {
+        close(handoff_conn);
+    }
+
+    closelog();
+    return 0;
+}
+
+/********************************************************************
+Recieve every bit of data, up to the first recv ending with a newline.
+The buffer doubles as needed so long packets are not copied over and
+over.  With a limit other than 0, stop once at least limit bytes are
+received and clear complete when the packet goes on.  A packet over max
+bytes is dropped, so the buffer never grows past max + 1.
+*********************************************************************/
+char * recv_dynamic(int s, size_t limit, size_t max, bool *complete) {
+    size_t pos = 0, cap = MAX_BUF_SIZE, grow;
+    ssize_t size_recv;
+    char *p = malloc(cap + 1);    // room for the terminating null
+    char *grown;
+    struct pollfd pfd = { .fd = s, .events = POLLIN };
+
+    // The socket is non-blocking (accept4 SOCK_NONBLOCK)
+    *complete = false;
+    if (p == NULL) {
+        return NULL;
+    }
+
+    while(1) {
+        // Check shutdown
+        if (ShutdownNow) {
+            free(p);
+            return NULL;
+        }
+
+        // recv straight into the packet, up to the room left
+        if ( (size_recv = recv(s, p + pos, cap - pos, 0)) == -1 ) {
+            if (errno == EWOULDBLOCK || errno == EAGAIN || errno == EINTR) {
+                // Wait for data, waking up periodically to check for shutdown
+                (void)poll(&pfd, 1, RECV_POLL_MS);
+                continue;
+            }
+            else {
+                //Another error occured
+                AESD_LOG(LOG_ERR, "Recv error %s\n", strerror( errno ));
+                free(p);
+                return NULL;
+            }
+        }
+
+        if (size_recv == 0) {
+            // Peer closed the connection before sending a complete packet
+            free(p);
+            return NULL;
+        }
+
+        pos += size_recv;
+        if ( pos > max ) {
+            ERROR_LOG("Dropped a packet over the %zu byte limit", max);
+            free(p);
+            return NULL;
+        }
+        p[pos] = 0; //Null terminate the string.
+        // check if last character is newline then jump out
+        if ( p[pos - 1] == '\n' ) {
+            *complete = true;
+            break;
+        }
+        if ( limit != 0 && pos >= limit ) {
+            break;
+        }
+        if ( pos == cap ) {
+            // Room for one byte past max, enough to tell the packet is over it
+            grow = cap * 2 > max + 1 ? max + 1 : cap * 2;
+            if ( (grown = realloc(p, grow + 1)) == NULL ) {
+                AESD_LOG(LOG_ERR, "Failed to grow the receive buffer to %zu bytes", grow);
+                free(p);
+                return NULL;
             }
+            p = grown;
+            cap = grow;
+        }
+    }
 
-            // Handle the need for new line
-            numBytes = 1;
-            if ( (sendAll(socket, &newline, &numBytes) == -1) ) {
-                ERROR_LOG("Failed to send file to client!");
-                (void)pthread_mutex_unlock(thread_func_args->file_mutex);
-                thread_func_args->thread_complete_success = true;
-                pthread_exit(NULL);
+    return p;
+}
+
+/********************************************************************
+Receive a packet longer than STREAM_THRESHOLD into an unlinked spool
+file in the -S directory.  The first len bytes at buf were already
+received, the rest is received STREAM_CHUNK bytes at a time until a recv
+ends with a newline, so memory stays bounded whatever the packet length,
+and the file stops at the -M packet size.  The file mutex is not held
+meanwhile, a slow client only delays itself.  The client is dropped when
+it fails, stalls for STREAM_STALL_MS, goes over its byte rate or over
+the packet size.  Returns the spool descriptor with the packet length in
+size, or -1 on failure.
+*********************************************************************/
+static int spool_packet(slist_data_t *conn, const char *buf, size_t len, off_t *size) {
+    char path[PATH_MAX];
+    struct pollfd pfd = { .fd = conn->socket, .events = POLLIN };
+    char chunk[STREAM_CHUNK];
+    ssize_t size_recv, written;
+    size_t done;
+    int stalled_ms;
+    int spool;
+
+    // main() checked the directory fits
+    snprintf(path, sizeof(path), "%s/" SPOOL_NAME, Config.spool_dir);
+    if ( (spool = mkostemp(path, O_CLOEXEC)) == -1 ) {
+        ERROR_LOG("Failed to create a spool file in %s: %s", Config.spool_dir, strerror(errno));
+        return -1;
+    }
+    unlink(path);
+
+    *size = 0;
+    while (1) {
+        if ( (size_t)*size + len > Config.max_packet ) {
+            ERROR_LOG("Dropped a spooled packet over the %zu byte limit", Config.max_packet);
+            goto exit_close;
+        }
+        for (done = 0; done < len; done += written) {
+            if ( (written = write(spool, buf + done, len - done)) == -1 ) {
+                ERROR_LOG("Failed to write to the spool file: %s", strerror(errno));
+                goto exit_close;
             }
-        } else {
-            free(line);
         }
+        *size += len;
+        if ( buf[len - 1] == '\n' ) {
+            return spool;
+        }
+
+        for (stalled_ms = 0; ; ) {
+            size_recv = recv(conn->socket, chunk, sizeof(chunk), 0);
+            if ( size_recv > 0 ) {
+                break;
+            }
+            if ( size_recv == 0 || (errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR) ||
+                 ShutdownNow || stalled_ms >= STREAM_STALL_MS ) {
+                ERROR_LOG("Dropped a spooled packet after %s", size_recv == 0 ? "the peer closed" :
+                          stalled_ms >= STREAM_STALL_MS ? "a stall" : "a recv error");
+                goto exit_close;
+            }
+            if ( poll(&pfd, 1, RECV_POLL_MS) == 0 ) {
+                stalled_ms += RECV_POLL_MS;
+            }
+        }
+        if ( Limiter != NULL && !ratelimit_admit_bytes(Limiter, (struct sockaddr *)&conn->client,
+                                                       size_recv) ) {
+            DEBUG_LOG("Shed a spooled packet over the byte rate");
+            goto exit_close;
+        }
+        buf = chunk;
+        len = size_recv;
     }
+
+exit_close:
+    close(spool);
+    return -1;
+}
+
+/********************************************************************
+Append the size bytes of a packet spooled by spool_packet().  Called
+with the file mutex held, which keeps the packets of other connections
+from interleaving with this one; only local reads happen meanwhile.
+What was appended is discarded on failure.  Returns 0 on success, -1 on
+failure.
+*********************************************************************/
+#if !defined(USE_AESD_CHAR_DEVICE)
+static int store_spool(struct filestore *fp, int spool, off_t size) {
+    size_t start;
+#else
+static int store_spool(int fp, int spool, off_t size) {
+    ssize_t written;
+    size_t done;
+#endif // USE_AESD_CHAR_DEVICE
+    char chunk[STREAM_CHUNK];
+    ssize_t numBytes;
+    off_t pos;
+
+#if !defined(USE_AESD_CHAR_DEVICE)
+    (void)filestore_data(fp, &start);
+#endif // USE_AESD_CHAR_DEVICE
+    for (pos = 0; pos < size; pos += numBytes) {
+        if ( (numBytes = pread(spool, chunk, sizeof(chunk), pos)) <= 0 ) {
+            ERROR_LOG("Failed to read the spool file: %s", numBytes == 0 ? "it is short" : strerror(errno));
+            goto exit_discard;
+        }
+#if !defined(USE_AESD_CHAR_DEVICE)
+        if ( filestore_append(fp, chunk, numBytes) != 0 ) {
+            goto exit_discard;
+        }
 #else
+        // The driver keeps a write without a newline until the rest arrives
+        for (done = 0; done < (size_t)numBytes; done += written) {
+            if ( (written = write(fp, chunk + done, numBytes - done)) == -1 ) {
+                ERROR_LOG("Failed to write to the storage device: %s", strerror(errno));
+                goto exit_discard;
+            }
+        }
+#endif // USE_AESD_CHAR_DEVICE
+    }
+    return 0;
+
+exit_discard:
+#if !defined(USE_AESD_CHAR_DEVICE)
+    filestore_truncate(fp, start);
+#else
+    if ( ioctl(fp, AESDCHAR_IOCDISCARD) == -1 ) {
+        ERROR_LOG("Failed to discard the partial packet: %s", strerror(errno));
+    }
+#endif // USE_AESD_CHAR_DEVICE
+    return -1;
+}
+
+/********************************************************************
+Send len bytes of a mapped store to the socket pointed to by ctx, also
+used as the seglog_foreach_segment() callback.
+*********************************************************************/
+static int send_mapping(const char *data, size_t len, void *ctx) {
+    int socket = *(int *) ctx;
+    int numBytes;
+
+    while (len > 0) {
+        numBytes = len > INT_MAX ? INT_MAX : (int)len;
+        if ( sendAll(socket, (char *)data, &numBytes) == -1 ) {
+            ERROR_LOG("Failed to send %i bytes to client!", numBytes);
+            return -1;
+        }
+        data += numBytes;
+        len -= numBytes;
+    }
+    return 0;
+}
+
+/********************************************************************
+Send the POS_REPLY line starting the reply to a since command.
+*********************************************************************/
+static int send_pos_line(int socket, unsigned long long pos) {
+    char line[sizeof(POS_REPLY) + 24];
+    int numBytes;
+
+    numBytes = snprintf(line, sizeof line, POS_REPLY "%llu\n", pos);
+    return sendAll(socket, line, &numBytes);
+}
+
+#if !defined(USE_AESD_CHAR_DEVICE)
+/********************************************************************
+Reply to a since command with the storage file content after byte offset
+since, called with the file mutex held.
+*********************************************************************/
+static int send_file_since(struct filestore *fp, unsigned long long since, int socket) {
+    const char *data;
+    size_t len;
+
+    data = filestore_data(fp, &len);
+    if (since > len) {
+        since = len;
+    }
+    if (send_pos_line(socket, len) != 0) {
+        return -1;
+    }
+    return send_mapping(data + since, len - since, &socket);
+}
+
+/********************************************************************
+Reply with the full content of the storage file, called with the file
+mutex held.  Returns 0 on success, -1 if sending failed.
+*********************************************************************/
+static int send_file_reply(struct filestore *fp, int socket) {
+    const char *data;
+    size_t len;
+
+    data = filestore_data(fp, &len);
+    return send_mapping(data, len, &socket);
+}
+#else
+/********************************************************************
+Reply with everything read from the device at fd, called with the file
+mutex held.  Returns 0 on success, -1 on failure.
+*********************************************************************/
+static int send_device_reply(int fd, int socket) {
+    char *line;
+    int numBytes, rc = 0;
+
     // Allocate memory for the line variable to read from fp and handle errors
     line = malloc(AESD_CHAR_DEVICE_READ_SIZE);
 
     if ( line == NULL ) {
         ERROR_LOG("Failed to allocate memory for reading from storage device.");
-        (void)pthread_mutex_unlock(thread_func_args->file_mutex);
-        thread_func_args->thread_complete_success = true;
-        pthread_exit(NULL);
+        return -1;
+    }
+
+    while ( (numBytes = read(fd, line, AESD_CHAR_DEVICE_READ_SIZE)) > 0 ) {
+        if ( (sendAll(socket, line, &numBytes) == -1) ) {
+            ERROR_LOG("Failed to send %i bytes to client!", numBytes);
+            rc = -1;
+            break;
+        }
+    }
+
+    free(line);
+    return rc;
+}
+
+/********************************************************************
+replycache_foreach() callback sending the chunks to the socket pointed
+to by ctx with sendmsg(), waiting for room like sendAll().
+*********************************************************************/
+static int send_iov(struct iovec *iov, int iovcnt, void *ctx) {
+    int socket = *(int *) ctx;
+    struct pollfd pfd = { .fd = socket, .events = POLLOUT };
+    struct msghdr msg;
+    ssize_t n;
+
+    while (iovcnt > 0) {
+        memset(&msg, 0, sizeof msg);
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        n = sendmsg(socket, &msg, MSG_NOSIGNAL);
+        if (n == -1) {
+            if ((errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) && !ShutdownNow) {
+                (void)poll(&pfd, 1, RECV_POLL_MS);
+                continue;
+            }
+            ERROR_LOG("Failed to send reply to client!");
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/********************************************************************
+Read the device back into the reply cache.  The entry boundaries come
+from seeking to each write command, an entry may hold several newlines.
+Called with the file mutex held, or before any connection is served.
+Returns 0 on success, -1 on failure, leaving the cache invalid.
+*********************************************************************/
+static int reply_cache_refill(void) {
+    off_t starts[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 1];
+    size_t lens[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    struct aesd_seekto seekto = { 0 };
+    char *buf, *tmp;
+    size_t len = 0, cap = AESD_CHAR_DEVICE_READ_SIZE, count, i;
+    ssize_t n = -1;
+    int fd, rc = -1;
+
+    if ((fd = open(AESD_DEVICE, O_RDONLY | O_CLOEXEC)) == -1) {
+        return -1;
+    }
+    if ((buf = malloc(cap)) == NULL) {
+        close(fd);
+        return -1;
     }
 
-    while ( (numBytes = read(fp, line, AESD_CHAR_DEVICE_READ_SIZE)) ) {
-        if ( numBytes != 0) {
-            if ( (sendAll(socket, line, &numBytes) == -1) ) {
-                ERROR_LOG("Failed to send %i bytes to client!", numBytes);
-                free(line);
-                (void)pthread_mutex_unlock(thread_func_args->file_mutex);
-                thread_func_args->thread_complete_success = true;
-                pthread_exit(NULL);
+    // The driver refuses to seek past its last write command
+    for (count = 0; count < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; count++) {
+        seekto.write_cmd = count;
+        if (ioctl(fd, AESDCHAR_IOCSEEKTO, &seekto) == -1) {
+            if (errno != EINVAL) {
+                goto exit_free;
             }
+            break;
         }
+        if ((starts[count] = lseek(fd, 0, SEEK_CUR)) == -1) {
+            goto exit_free;
+        }
+    }
+    if (lseek(fd, 0, SEEK_SET) == -1) {
+        goto exit_free;
     }
 
-    if (line) {
-        free(line);
+    while ((n = read(fd, buf + len, cap - len)) > 0) {
+        len += n;
+        if (len == cap) {
+            if ((tmp = realloc(buf, cap * 2)) == NULL) {
+                n = -1;
+                break;
+            }
+            buf = tmp;
+            cap *= 2;
+        }
+    }
+    if (n == 0 && (count == 0 || (size_t)starts[count - 1] <= len)) {
+        starts[count] = len;
+        for (i = 0; i < count; i++) {
+            lens[i] = starts[i + 1] - starts[i];
+        }
+        rc = replycache_rebuild(Cache, buf, lens, count);
     }
 
+exit_free:
+    free(buf);
+    close(fd);
+    return rc;
+}
+
+/********************************************************************
+Take a snapshot of the reply cache, refilling it first when it has been
+invalidated.  Called with the file mutex held.
+Returns 0 on success, -1 if the reply has to be read from the device.
+*********************************************************************/
+static int reply_cache_snapshot(struct replycache_snapshot *snap) {
+    if (!replycache_valid(Cache) && reply_cache_refill() != 0) {
+        return -1;
+    }
+    return replycache_snapshot(Cache, snap);
+}
 #endif // USE_AESD_CHAR_DEVICE
 
+/*************************************************************************
+ * ***********************************************************************/
+void* threadfunc(void* thread_param) {
+    slist_data_t* thread_func_args = (slist_data_t *) thread_param;
+    int mutex_rc;
+    int socket = thread_func_args->socket;
+    char *recvBuffer;
+    bool complete;
+    int spool = -1;
+    off_t spool_size = 0;
+    unsigned long long since;
+    bool since_valid, is_since;
 #if !defined(USE_AESD_CHAR_DEVICE)
-    fseek(fp, fileWritePos, SEEK_SET);  // To position we were last writing at.
+    struct filestore *fp = thread_func_args->fp;
+#else
+    int fp = -1;
+    struct aesd_seekto seekto;
+    struct aesd_seektime seektime;
+    bool seekto_valid;
+    bool is_seek, is_seektime;
+    struct replycache_snapshot snap = { 0 };
+    bool have_snap = false;
+#endif // USE_AESD_CHAR_DEVICE
+
+    // Recv data, long packets are spooled unless the log or the committer needs them whole
+    if (( recvBuffer = recv_dynamic(socket, (Log == NULL && !Config.group_commit) ? STREAM_THRESHOLD : 0,
+                                    Config.max_packet, &complete) ) == NULL) {
+        ERROR_LOG("Got NULL when trying to recv.");
+        goto exit_close_socket;
+    }
+
+    // Shed a packet over the byte rate of its client before it waits for the storage
+    if ( Limiter != NULL && !ratelimit_admit_bytes(Limiter, (struct sockaddr *)&thread_func_args->client,
+                                                   strlen(recvBuffer)) ) {
+        DEBUG_LOG("Shed a packet of %zu bytes over the byte rate", strlen(recvBuffer));
+        free(recvBuffer);
+        shed_connection(socket);
+        goto exit_complete;
+    }
+
+    // Check if the recvBuffer is a SINCE_CMD, which only reads
+    is_since = parse_since_cmd(recvBuffer, &since, &since_valid);
+    if ( is_since && !since_valid ) {
+        ERROR_LOG("Failed to parse the since position.");
+        goto exit_free;
+    }
+
+#if defined(USE_AESD_CHAR_DEVICE)
+    // Check if the recvBuffer is a IOCSEEKTO_CMD or IOCSEEKTIME_CMD rather than data to write
+    is_seektime = parse_seektime_cmd(recvBuffer, &seektime, &seekto_valid);
+    if ( is_seektime && !seekto_valid ) {
+        ERROR_LOG("Failed to parse the seek time.");
+        goto exit_free;
+    }
+    is_seek = is_seektime || parse_seekto_cmd(recvBuffer, &seekto, &seekto_valid);
+    if ( is_seek && !seekto_valid ) {
+        ERROR_LOG("Failed to parse the write command and offset.");
+        goto exit_free;
+    }
+    if ( is_seek && Log != NULL ) {
+        ERROR_LOG("Seek commands are not supported by the log backend.");
+        goto exit_free;
+    }
+
+#endif // USE_AESD_CHAR_DEVICE
+
+    // Receive the rest of a long packet before waiting for the storage
+#if defined(USE_AESD_CHAR_DEVICE)
+    if ( !complete && !is_seek ) {
 #else
-    close(fp);
+    if ( !complete ) {
 #endif // USE_AESD_CHAR_DEVICE
+        if ( (spool = spool_packet(thread_func_args, recvBuffer, strlen(recvBuffer), &spool_size)) == -1 ) {
+            goto exit_free;
+        }
+    }
+
+#if defined(USE_AESD_CHAR_DEVICE)
+    if ( Config.group_commit && !is_seek && !is_since ) {
+#else
+    if ( Config.group_commit && !is_since ) {
+#endif // USE_AESD_CHAR_DEVICE
+        // Appended by the committer together with the packets of other connections
+#if defined(USE_AESD_CHAR_DEVICE)
+        if ( commit_append(recvBuffer, strlen(recvBuffer), Cache != NULL ? &snap : NULL) != 0 ) {
+#else
+        if ( commit_append(recvBuffer, strlen(recvBuffer), NULL) != 0 ) {
+#endif // USE_AESD_CHAR_DEVICE
+            ERROR_LOG("Failed to write to the storage device.");
+            goto exit_free;
+        }
+    }
+
+#if defined(USE_AESD_CHAR_DEVICE)
+    if ( snap.head != NULL ) {
+        // The committer already took the reply, no need for the mutex
+        have_snap = true;
+        goto exit_send_snapshot;
+    }
+#endif // USE_AESD_CHAR_DEVICE
+
+    // Lock file and manipulate
+    mutex_rc = prof_lock_acquire(thread_func_args->file_mutex);
+
+    if (mutex_rc != 0) {
+        ERROR_LOG("Failed to acquire file mutex.");
+        goto exit_free;
+    }
+
+    if ( is_since ) {
+        if ( Log != NULL ) {
+            if ( send_pos_line(socket, seglog_next_seq(Log)) == 0 ) {
+                (void)seglog_foreach_since(Log, since, send_mapping, &socket);
+            }
+        } else {
+#if !defined(USE_AESD_CHAR_DEVICE)
+            (void)send_file_since(fp, since, socket);
+#else
+            if ( Cache != NULL && reply_cache_snapshot(&snap) == 0 ) {
+                // Sent once the mutex is released, after the position line
+                replycache_snapshot_since(&snap, since);
+                have_snap = true;
+            } else {
+                ERROR_LOG("The since command needs the reply cache (-c) with the char device.");
+            }
+#endif // USE_AESD_CHAR_DEVICE
+        }
+        goto exit_unlock;
+    }
+
+    if ( Log != NULL ) {
+        if ( !Config.group_commit && seglog_append(Log, recvBuffer, strlen(recvBuffer)) != 0 ) {
+            ERROR_LOG("Failed to write to the log.");
+            goto exit_unlock;
+        }
+
+        // Reply with the whole history, straight from the segment mappings
+        (void)seglog_foreach_segment(Log, send_mapping, &socket);
+        goto exit_unlock;
+    }
+
+#if !defined(USE_AESD_CHAR_DEVICE)
+    if ( !complete ) {
+        if ( store_spool(fp, spool, spool_size) != 0 ) {
+            goto exit_unlock;
+        }
+    } else if ( !Config.group_commit && filestore_append(fp, recvBuffer, strlen(recvBuffer)) != 0 ) {
+        ERROR_LOG("Failed to write to the storage file.");
+        goto exit_unlock;
+    }
+
+    // Need to reply with full content what we have in file storage.
+    (void)send_file_reply(fp, socket);
+#else
+    // With group commit and the reply cache a packet never needs the device here
+    if ( is_seek || !Config.group_commit || Cache == NULL ) {
+        fp = open(AESD_DEVICE, O_RDWR);
+        if( fp == -1) {
+            ERROR_LOG("Error opening device %s: %s\n", AESD_DEVICE, strerror( errno ));
+            goto exit_unlock;
+        }
+    }
+
+    if ( is_seek ) {
+        // Using ioctl to seek to the write command and offset, or to the first write command at or after the time
+        if ( (is_seektime ? ioctl(fp, AESDCHAR_IOCSEEKTIME, &seektime) : ioctl(fp, AESDCHAR_IOCSEEKTO, &seekto)) == -1 ) {
+            ERROR_LOG("Failed to seek to the write command and offset.");
+            goto exit_unlock;
+        }
+        // The seek reply comes from the device, take the chance to resync the cache
+        if ( Cache != NULL ) {
+            replycache_invalidate(Cache);
+        }
+    } else if ( !complete ) {
+        if ( store_spool(fp, spool, spool_size) != 0 ) {
+            goto exit_unlock;
+        }
+        // Never held whole, the cache is refilled from the device
+        if ( Cache != NULL ) {
+            replycache_invalidate(Cache);
+        }
+    } else if ( !Config.group_commit ) {
+        // Write the recvBuffer to the device as this was not a seek command
+        if ( write(fp, recvBuffer, strlen(recvBuffer)) == -1 ) {
+            ERROR_LOG("Failed to write to the storage device.");
+            goto exit_unlock;
+        }
+        if ( Cache != NULL ) {
+            (void)replycache_append(Cache, recvBuffer, strlen(recvBuffer));
+        }
+    }
+
+    if ( Cache != NULL && !is_seek && reply_cache_snapshot(&snap) == 0 ) {
+        // Sent once the mutex is released
+        have_snap = true;
+        goto exit_unlock;
+    }
+
+    if ( fp == -1 && (fp = open(AESD_DEVICE, O_RDONLY)) == -1 ) {
+        ERROR_LOG("Error opening device %s: %s\n", AESD_DEVICE, strerror( errno ));
+        goto exit_unlock;
+    }
+    (void)send_device_reply(fp, socket);
+#endif // USE_AESD_CHAR_DEVICE
+
+exit_unlock:
+#if defined(USE_AESD_CHAR_DEVICE)
+    if (fp != -1) {
+        close(fp);
+    }
+#endif // USE_AESD_CHAR_DEVICE
+    (void)prof_lock_release(thread_func_args->file_mutex);
+#if defined(USE_AESD_CHAR_DEVICE)
+exit_send_snapshot:
+    if ( have_snap ) {
+        if ( !is_since || send_pos_line(socket, snap.next_seq) == 0 ) {
+            (void)replycache_foreach(&snap, send_iov, &socket);
+        }
+        replycache_release(&snap);
+    }
+#endif // USE_AESD_CHAR_DEVICE
+exit_free:
+    if ( spool != -1 ) {
+        close(spool);
+    }
+    free(recvBuffer);
+exit_close_socket:
     close(socket);
     DEBUG_LOG("Closed connection from %i", socket);
-    (void)pthread_mutex_unlock(thread_func_args->file_mutex);
+exit_complete:
     thread_func_args->thread_complete_success = true;
-    pthread_exit(NULL);
+    return NULL;
 }
\ No newline at end of file
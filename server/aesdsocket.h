@@ -0,0 +1,57 @@
+/*
+ * aesdsocket.h
+ *
+ * Definitions shared between the aesdsocket server and its backends.
+ */
+
+#ifndef AESDSOCKET_H
+#define AESDSOCKET_H
+
+#include <stdbool.h>
+#include <signal.h>
+#include "aesd_ioctl.h"
+
+// Defines
+#define USE_AESD_CHAR_DEVICE 1  // Set to 1 to use the char device and no timestamps, 0 to use file and timestamps
+#define AESD_DEVICE     "/dev/aesdchar"
+#define IOCSEEKTO_CMD   "AESDCHAR_IOCSEEKTO:"
+#define IOCSEEKTIME_CMD "AESDCHAR_IOCSEEKTIME:"     // followed by a time in seconds
+#define SINCE_CMD       "AESDCHAR_SINCE:"   // followed by the last position the client got
+#define POS_REPLY       "AESDCHAR_POS:"     // first line of a SINCE_CMD reply, the new position
+#define RECV_POLL_MS    100     // How often a waiting recv checks for shutdown
+
+// Set from the signal handler when the server should exit
+extern volatile sig_atomic_t ShutdownNow;
+
+// Set once the listening sockets were handed to a new server (-H): the
+// listeners stop accepting and return after their connections are served
+extern volatile sig_atomic_t DrainNow;
+
+/**
+* Parse a "AESDCHAR_IOCSEEKTO:X,Y" command in @param buf into @param seekto.
+* @return false if @param buf is not a seek command, true otherwise.  When the
+* command is malformed @param valid is set to false.
+*/
+bool parse_seekto_cmd(const char *buf, struct aesd_seekto *seekto, bool *valid);
+
+/**
+* Parse a "AESDCHAR_IOCSEEKTIME:T" command in @param buf into @param seektime.
+* T is a time in seconds since the epoch, or -N for N seconds ago.  The reply
+* is the data written at or after that time.
+* @return false if @param buf is not a seek time command, true otherwise.  When
+* the command is malformed @param valid is set to false.
+*/
+bool parse_seektime_cmd(const char *buf, struct aesd_seektime *seektime, bool *valid);
+
+/**
+* Parse a "AESDCHAR_SINCE:N" command in @param buf into @param pos.  N is a
+* position from an earlier "AESDCHAR_POS:N" reply line, 0 for everything.  The
+* reply to the command is that line with the current position followed by the
+* data stored after position N only.  Positions are opaque to clients: a record
+* number with the log (-L) and the char device (-c), a byte offset in the file.
+* @return false if @param buf is not a since command, true otherwise.  When the
+* command is malformed @param valid is set to false.
+*/
+bool parse_since_cmd(const char *buf, unsigned long long *pos, bool *valid);
+
+#endif /* AESDSOCKET_H */
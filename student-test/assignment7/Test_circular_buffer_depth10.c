@@ -0,0 +1,38 @@
+#include "unity.h"
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+#include "circular-buffer-checks.h"
+
+/**
+* The circular buffer at its default depth, as built into TESTED_SOURCE.
+* Test_circular_buffer_depth64.c and Test_circular_buffer_depth255.c run the
+* same checks on buffers built with other depths.
+*/
+void test_circular_buffer_depth10_empty()
+{
+    check_empty();
+}
+
+void test_circular_buffer_depth10_fill()
+{
+    check_fill();
+}
+
+void test_circular_buffer_depth10_overwrite_oldest()
+{
+    check_overwrite_oldest();
+}
+
+void test_circular_buffer_depth10_counter_wraparound()
+{
+    check_counter_wraparound();
+}
+
+void test_circular_buffer_depth10_find_for_time()
+{
+    check_find_for_time();
+}
+
+void test_circular_buffer_depth10_find_for_time_wrapped()
+{
+    check_find_for_time_wrapped();
+}
@@ -0,0 +1,43 @@
+#include "unity.h"
+
+/**
+* The circular buffer built with a depth of 64.  TESTED_SOURCE already links
+* aesd-circular-buffer.c at the default depth, so this copy gets names of its own.
+*/
+#define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 64
+#define aesd_circular_buffer_find_entry_offset_for_fpos depth64_find_entry_offset_for_fpos
+#define aesd_circular_buffer_add_entry depth64_add_entry
+#define aesd_circular_buffer_find_entry_for_time depth64_find_entry_for_time
+#define aesd_circular_buffer_init depth64_init
+#include "../../aesd-char-driver/aesd-circular-buffer.c"
+#include "circular-buffer-checks.h"
+
+void test_circular_buffer_depth64_empty()
+{
+    check_empty();
+}
+
+void test_circular_buffer_depth64_fill()
+{
+    check_fill();
+}
+
+void test_circular_buffer_depth64_overwrite_oldest()
+{
+    check_overwrite_oldest();
+}
+
+void test_circular_buffer_depth64_counter_wraparound()
+{
+    check_counter_wraparound();
+}
+
+void test_circular_buffer_depth64_find_for_time()
+{
+    check_find_for_time();
+}
+
+void test_circular_buffer_depth64_find_for_time_wrapped()
+{
+    check_find_for_time_wrapped();
+}
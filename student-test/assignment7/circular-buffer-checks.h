@@ -0,0 +1,216 @@
+/*
+ * circular-buffer-checks.h
+ *
+ * Checks of the aesd circular buffer shared by the Test_circular_buffer_depth*.c
+ * files.  Each of them includes this after aesd-circular-buffer.h, built with
+ * its own AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, and runs every check.
+ */
+
+#ifndef CIRCULAR_BUFFER_CHECKS_H
+#define CIRCULAR_BUFFER_CHECKS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#define DEPTH           AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+#define CHECK_ENTRIES   (3 * DEPTH)     // entries written by the longest check
+#define CHECK_ENTRY_MAX 8
+#define CHECK_TIME_BASE 1000            // timestamp of entry 0, so earlier times exist
+#define CHECK_TIME_STEP 10
+
+// Entry i is 1 to 5 copies of a letter and a newline, so entries differ in size.
+// Timestamps go up every third entry, so most of them are shared with a neighbour.
+static char CheckData[CHECK_ENTRIES][CHECK_ENTRY_MAX];
+
+static struct aesd_buffer_entry check_entry(int i)
+{
+    struct aesd_buffer_entry entry;
+    size_t len = i % 5 + 1;
+
+    memset(CheckData[i], 'a' + i % 26, len);
+    CheckData[i][len] = '\n';
+    entry.buffptr = CheckData[i];
+    entry.size = len + 1;
+    entry.timestamp_ns = CHECK_TIME_BASE + (uint64_t)(i / 3) * CHECK_TIME_STEP;
+    return entry;
+}
+
+/**
+ * Check every offset of @param buffer, which holds entries @param first to
+ * @param first + @param count - 1 of check_entry(), oldest first.
+ */
+static void check_contents(struct aesd_circular_buffer *buffer, int first, int count)
+{
+    struct aesd_buffer_entry *entry;
+    size_t offset, entry_offset = 0, char_offset = 0;
+    uint8_t index;
+    int i, seen = 0;
+    char msg[64];
+
+    for (i = first; i < first + count; i++) {
+        for (offset = 0; offset < check_entry(i).size; offset++, char_offset++) {
+            snprintf(msg, sizeof(msg), "entry %d offset %zu", i, offset);
+            entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, char_offset, &entry_offset);
+            TEST_ASSERT_NOT_NULL_MESSAGE(entry, msg);
+            TEST_ASSERT_EQUAL_PTR_MESSAGE(CheckData[i], entry->buffptr, msg);
+            TEST_ASSERT_EQUAL_UINT32_MESSAGE(offset, entry_offset, msg);
+        }
+    }
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_find_entry_offset_for_fpos(buffer, char_offset, &entry_offset),
+                             "An offset past the last entry must not be found");
+
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, buffer, index) {
+        TEST_ASSERT_EQUAL_PTR_MESSAGE(CheckData[first + seen], entry->buffptr, "FOREACH goes oldest first");
+        seen++;
+    }
+    TEST_ASSERT_EQUAL_INT_MESSAGE(count, seen, "FOREACH visits every entry once");
+}
+
+/**
+ * Add entries @param first to @param first + @param count - 1 of check_entry()
+ * to @param buffer holding @param held entries, checking what each add evicts.
+ */
+static void check_add(struct aesd_circular_buffer *buffer, int first, int count, int held)
+{
+    struct aesd_buffer_entry entry;
+    const char *evicted;
+    int i;
+
+    for (i = first; i < first + count; i++) {
+        entry = check_entry(i);
+        evicted = aesd_circular_buffer_add_entry(buffer, &entry);
+        if (held < DEPTH) {
+            TEST_ASSERT_NULL_MESSAGE(evicted, "Nothing is evicted before the buffer is full");
+            held++;
+        } else {
+            TEST_ASSERT_EQUAL_PTR_MESSAGE(CheckData[i - DEPTH], evicted, "A full buffer evicts its oldest entry");
+        }
+    }
+}
+
+static void check_empty(void)
+{
+    struct aesd_circular_buffer buffer;
+    size_t entry_offset;
+
+    aesd_circular_buffer_init(&buffer);
+    TEST_ASSERT_NULL(aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 0, &entry_offset));
+    check_contents(&buffer, 0, 0);
+}
+
+static void check_fill(void)
+{
+    struct aesd_circular_buffer buffer;
+
+    aesd_circular_buffer_init(&buffer);
+    check_add(&buffer, 0, DEPTH - 1, 0);
+    check_contents(&buffer, 0, DEPTH - 1);
+    check_add(&buffer, DEPTH - 1, 1, DEPTH - 1);
+    check_contents(&buffer, 0, DEPTH);
+}
+
+static void check_overwrite_oldest(void)
+{
+    struct aesd_circular_buffer buffer;
+
+    aesd_circular_buffer_init(&buffer);
+    check_add(&buffer, 0, DEPTH, 0);
+    check_add(&buffer, DEPTH, 1, DEPTH);
+    check_contents(&buffer, 1, DEPTH);
+    // Overwrite the whole buffer, and then some, so the slots wrap more than once
+    check_add(&buffer, DEPTH + 1, 2 * DEPTH - 1, DEPTH);
+    check_contents(&buffer, 2 * DEPTH, DEPTH);
+}
+
+static void check_counter_wraparound(void)
+{
+    struct aesd_circular_buffer buffer;
+
+    // The ring counters run free, start them just short of wrapping around
+    aesd_circular_buffer_init(&buffer);
+    buffer.ring.head = buffer.ring.tail = UINT32_MAX - DEPTH / 2;
+    check_add(&buffer, 0, DEPTH, 0);
+    check_contents(&buffer, 0, DEPTH);
+    check_add(&buffer, DEPTH, DEPTH + 1, DEPTH);
+    check_contents(&buffer, DEPTH + 1, DEPTH);
+    TEST_ASSERT_EQUAL_UINT32(DEPTH, aesd_entry_ring_count(&buffer.ring));
+}
+
+/**
+* Check aesd_circular_buffer_find_entry_for_time() on @param buffer against a
+* linear scan for @param time_ns.
+*/
+static void check_time(struct aesd_circular_buffer *buffer, uint64_t time_ns)
+{
+    struct aesd_buffer_entry *entry, *expected = NULL;
+    size_t expected_offset = 0, char_offset;
+    uint32_t expected_index = 0, found_index;
+    uint8_t index;
+    char msg[64];
+
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, buffer, index) {
+        if (entry->timestamp_ns >= time_ns) {
+            expected = entry;
+            break;
+        }
+        expected_offset += entry->size;
+        expected_index++;
+    }
+
+    snprintf(msg, sizeof(msg), "time %llu", (unsigned long long)time_ns);
+    entry = aesd_circular_buffer_find_entry_for_time(buffer, time_ns, &char_offset, &found_index);
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(expected, entry, msg);
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(expected_offset, char_offset, msg);
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(expected_index, found_index, msg);
+}
+
+/**
+* Check every time from before the oldest entry of @param buffer to after its
+* newest one.
+*/
+static void check_times(struct aesd_circular_buffer *buffer)
+{
+    uint64_t time_ns, last = CHECK_TIME_BASE;
+    struct aesd_buffer_entry *entry;
+    uint8_t index;
+
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, buffer, index) {
+        last = entry->timestamp_ns;
+    }
+    for (time_ns = 0; time_ns <= last + CHECK_TIME_STEP; time_ns++) {
+        check_time(buffer, time_ns);
+    }
+    check_time(buffer, UINT64_MAX);
+}
+
+static void check_find_for_time(void)
+{
+    struct aesd_circular_buffer buffer;
+
+    aesd_circular_buffer_init(&buffer);
+    check_times(&buffer);
+    check_add(&buffer, 0, DEPTH - 1, 0);
+    check_times(&buffer);
+    check_add(&buffer, DEPTH - 1, 1, DEPTH - 1);
+    check_times(&buffer);
+}
+
+static void check_find_for_time_wrapped(void)
+{
+    struct aesd_circular_buffer buffer;
+    int first;
+
+    // A full ring whose slots and counters have both wrapped, with the oldest
+    // entry landing on each of the three entries sharing a timestamp in turn
+    aesd_circular_buffer_init(&buffer);
+    buffer.ring.head = buffer.ring.tail = UINT32_MAX - DEPTH / 2;
+    check_add(&buffer, 0, 2 * DEPTH, 0);
+    for (first = DEPTH; first < DEPTH + 3; first++) {
+        check_times(&buffer);
+        check_add(&buffer, first + DEPTH, 1, DEPTH);
+    }
+    check_contents(&buffer, DEPTH + 3, DEPTH);
+}
+
+#endif /* CIRCULAR_BUFFER_CHECKS_H */